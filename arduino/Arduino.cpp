@@ -23,6 +23,10 @@
 */
 
 #include "Arduino.h"
+#include "Wire.h"
+#include "SPI.h"
+#include "SoftwareSerial.h"
+#include "EEPROM.h"
 #include "commands.h"
 
 #include <stdio.h>
@@ -31,6 +35,195 @@
 #include <time.h>
 #include <string.h>
 #include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#ifdef EMULARD_PROFILE
+#include "Profile.h"
+#endif
+
+
+/*
+  Interrupts (and Wire events, after the pin numbers) are pushed by
+  the server down an event pipe, and signal us with SIGIO. Commands
+  are several writes, so an ISR can't run in the middle of one: if
+  the signal comes in while we are in a shim call it is left pending,
+  and the ISRs run as the call returns. Outside of shim calls they
+  run straight away, like the real thing.
+ */
+
+static const int NUM_INTERRUPT_PINS = 70;
+static const uint8_t INTERRUPT_PINS[] = {2, 3, 21, 20, 19, 18};
+
+static void (*interrupt_handlers[NUM_INTERRUPT_PINS])(void);
+static int num_handlers = 0;
+
+static int event_fd = -1;
+static volatile sig_atomic_t shim_depth = 0;
+static volatile sig_atomic_t interrupts_pending = 0;
+static volatile sig_atomic_t interrupts_enabled = 1;
+
+
+static void run_interrupts() {
+    /* ISRs can't be interrupted themselves */
+    ++shim_depth;
+
+#ifdef EMULARD_PROFILE
+    int profile_depth = profile_begin_interrupts();
+#endif
+
+    while (interrupts_pending) {
+        interrupts_pending = 0;
+
+        uint8_t pins[64];
+        ssize_t count;
+
+        while (0 < (count = ::read(event_fd, pins, sizeof(pins)))) {
+            for (ssize_t i = 0; i < count; ++i) {
+                if (EVENT_WIRE_RECEIVE == pins[i]) {
+                    Wire.receive_event();
+                    continue;
+                }
+
+                if (EVENT_WIRE_REQUEST == pins[i]) {
+                    Wire.request_event();
+                    continue;
+                }
+
+                void (*isr)(void) = pins[i] < NUM_INTERRUPT_PINS ? interrupt_handlers[pins[i]] : NULL;
+
+                if (NULL != isr) {
+                    isr();
+                }
+            }
+        }
+    }
+
+#ifdef EMULARD_PROFILE
+    profile_end_interrupts(profile_depth);
+#endif
+
+    --shim_depth;
+}
+
+
+static void interrupt_signal(int signal_number) {
+    int saved_errno = errno;
+
+    interrupts_pending = 1;
+
+    if (0 == shim_depth && interrupts_enabled) {
+        run_interrupts();
+    }
+
+    errno = saved_errno;
+}
+
+
+/* Start taking events from the event pipe, if the launcher gave us one */
+static void listen_for_events() {
+    if (-1 != event_fd) {
+        return;
+    }
+
+#ifdef EMULARD_DIRECT
+    /* There is no event pipe in a direct build, so ISRs are kept but never run */
+    return;
+#endif
+
+    const char *fd = getenv("EMULARD_EVENT_FD");
+
+    if (NULL == fd) {
+        fprintf(stderr, "No EMULARD_EVENT_FD, interrupts will never happen\n");
+        return;
+    }
+
+    event_fd = atoi(fd);
+
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = interrupt_signal;
+    action.sa_flags = SA_RESTART;
+    sigaction(SIGIO, &action, NULL);
+
+    fcntl(event_fd, F_SETOWN, getpid());
+    fcntl(event_fd, F_SETFL, fcntl(event_fd, F_GETFL) | O_NONBLOCK | O_ASYNC);
+}
+
+
+/* Marks a shim call, so that ISRs wait until it's done */
+class ShimCall {
+ public:
+    ShimCall() {
+        ++shim_depth;
+    }
+
+    ~ShimCall() {
+        if (0 == --shim_depth && interrupts_pending && interrupts_enabled) {
+            run_interrupts();
+        }
+    }
+};
+
+
+/*
+  Public functions start with PROFILED_CALL, which in profiling builds
+  times the call and counts it against the address it was called from.
+  The count is kept inside a shim call so that an ISR can't get at the
+  table halfway through.
+ */
+#ifdef EMULARD_PROFILE
+class ProfiledCall {
+ private:
+    const char *name;
+    void *site;
+    unsigned long long start;
+
+ public:
+    ProfiledCall(const char *name, void *site) {
+        this->name = name;
+        this->site = site;
+        this->start = profile_enter();
+    }
+
+    ~ProfiledCall() {
+        ShimCall call;
+        profile_leave(name, site, start);
+    }
+};
+
+#define PROFILED_CALL ProfiledCall profiled_call(__PRETTY_FUNCTION__, __builtin_return_address(0))
+#else
+#define PROFILED_CALL
+#endif
+
+
+/* Answers from the server, to the commands that get one */
+static char answer_char() {
+    char value = 0;
+    ARDUINO_RECEIVE(value);
+
+    return value;
+}
+
+
+static int answer_int() {
+    int value = 0;
+    ARDUINO_RECEIVE(value);
+
+    return value;
+}
+
+
+static long answer_long() {
+    long value = 0;
+    ARDUINO_RECEIVE(value);
+
+    return value;
+}
 
 
 /*
@@ -38,6 +231,9 @@
  */
 
 void FakeSerial::begin(unsigned long speed) {
+    PROFILED_CALL;
+    ShimCall call;
+
     /* Send the SERIAL_BEGIN command identifier */
     ARDUINO_COMMAND(SERIAL_BEGIN);
 
@@ -48,6 +244,9 @@ void FakeSerial::begin(unsigned long speed) {
 
 
 size_t FakeSerial::write(uint8_t value) {
+    PROFILED_CALL;
+    ShimCall call;
+
     /* SERIAL_WRITE command */
     ARDUINO_COMMAND(SERIAL_WRITE);
 
@@ -60,6 +259,7 @@ size_t FakeSerial::write(uint8_t value) {
 
 
 size_t FakeSerial::write(const char *str) {
+    PROFILED_CALL;
     size_t length = strlen(str);
 
     return this->write((uint8_t *)str, length);
@@ -67,6 +267,7 @@ size_t FakeSerial::write(const char *str) {
 
 
 size_t FakeSerial::write(const uint8_t *buffer, size_t length) {
+    PROFILED_CALL;
     for (int i = 0; i < length; ++i) {
         this->write(buffer[i]);
     }
@@ -76,11 +277,13 @@ size_t FakeSerial::write(const uint8_t *buffer, size_t length) {
 
 
 size_t FakeSerial::print(const char *str) {
+    PROFILED_CALL;
     return this->write(str);
 }
 
 
 size_t FakeSerial::println(const char *str) {
+    PROFILED_CALL;
     size_t sent_bytes = this->print(str);
     sent_bytes += this->println();
 
@@ -89,11 +292,13 @@ size_t FakeSerial::println(const char *str) {
 
 
 size_t FakeSerial::print(char value) {
+    PROFILED_CALL;
     return this->write(value);
 }
 
 
 size_t FakeSerial::println(char value) {
+    PROFILED_CALL;
     size_t sent_bytes = this->print(value);
     sent_bytes += this->println();
 
@@ -102,6 +307,7 @@ size_t FakeSerial::println(char value) {
 
 
 size_t FakeSerial::print(int value, int base) {
+    PROFILED_CALL;
     char buffer[128];
 
     if (base == DEC) {
@@ -116,11 +322,13 @@ size_t FakeSerial::print(int value, int base) {
 
 
 size_t FakeSerial::print(int value) {
+    PROFILED_CALL;
     return this->print(value, DEC);
 }
 
 
 size_t FakeSerial::println(int value, int base) {
+    PROFILED_CALL;
     size_t sent_bytes = this->print(value, base);
     sent_bytes += this->println();
 
@@ -129,11 +337,13 @@ size_t FakeSerial::println(int value, int base) {
 
 
 size_t FakeSerial::println(int value) {
+    PROFILED_CALL;
     return this->println(value, DEC);
 }
 
 
 size_t FakeSerial::print(unsigned int value, int base) {
+    PROFILED_CALL;
     char buffer[128];
 
     if (base == DEC) {
@@ -148,11 +358,13 @@ size_t FakeSerial::print(unsigned int value, int base) {
 
 
 size_t FakeSerial::print(unsigned int value) {
+    PROFILED_CALL;
     return this->print(value, DEC);
 }
 
 
 size_t FakeSerial::println(unsigned int value, int base) {
+    PROFILED_CALL;
     size_t sent_bytes = this->print(value, base);
     sent_bytes += this->println();
 
@@ -161,11 +373,13 @@ size_t FakeSerial::println(unsigned int value, int base) {
 
 
 size_t FakeSerial::println(unsigned int value) {
+    PROFILED_CALL;
     return this->println(value, DEC);
 }
 
 
 size_t FakeSerial::print(long value, int base) {
+    PROFILED_CALL;
     char buffer[128];
 
     if (base == DEC) {
@@ -180,11 +394,13 @@ size_t FakeSerial::print(long value, int base) {
 
 
 size_t FakeSerial::print(long value) {
+    PROFILED_CALL;
     return this->print(value, DEC);
 }
 
 
 size_t FakeSerial::println(long value, int base) {
+    PROFILED_CALL;
     size_t sent_bytes = this->print(value, base);
     sent_bytes += this->println();
 
@@ -193,11 +409,13 @@ size_t FakeSerial::println(long value, int base) {
 
 
 size_t FakeSerial::println(long value) {
+    PROFILED_CALL;
     return this->println(value, DEC);
 }
 
 
 size_t FakeSerial::print(unsigned long value, int base) {
+    PROFILED_CALL;
     char buffer[128];
 
     if (base == DEC) {
@@ -211,11 +429,13 @@ size_t FakeSerial::print(unsigned long value, int base) {
 }
 
 size_t FakeSerial::print(unsigned long value) {
+    PROFILED_CALL;
     return this->print(value, DEC);
 }
 
 
 size_t FakeSerial::println(unsigned long value, int base) {
+    PROFILED_CALL;
     size_t sent_bytes = this->print(value, base);
     sent_bytes += this->println();
 
@@ -224,11 +444,13 @@ size_t FakeSerial::println(unsigned long value, int base) {
 
 
 size_t FakeSerial::println(unsigned long value) {
+    PROFILED_CALL;
     return this->println(value, DEC);
 }
 
 
 size_t FakeSerial::println() {
+    PROFILED_CALL;
     size_t sent_bytes = this->write('\r');
     sent_bytes += this->write('\n');
 
@@ -237,6 +459,9 @@ size_t FakeSerial::println() {
 
 
 int FakeSerial::read() {
+    PROFILED_CALL;
+    ShimCall call;
+
     /* Send the read command */
     ARDUINO_COMMAND(SERIAL_READ);
 
@@ -244,11 +469,14 @@ int FakeSerial::read() {
     ARDUINO_SEND(port_number);
 
     /* Return the result */
-    return receive_int(STDIN_FILENO);
+    return answer_int();
 }
 
 
 int FakeSerial::peek() {
+    PROFILED_CALL;
+    ShimCall call;
+
     /* Send the read command */
     ARDUINO_COMMAND(SERIAL_PEEK);
 
@@ -256,11 +484,14 @@ int FakeSerial::peek() {
     ARDUINO_SEND(port_number);
 
     /* Return the result */
-    return receive_int(STDIN_FILENO);
+    return answer_int();
 }
 
 
 int FakeSerial::available() {
+    PROFILED_CALL;
+    ShimCall call;
+
     /* Send the read command */
     ARDUINO_COMMAND(SERIAL_AVAILABLE);
 
@@ -268,7 +499,147 @@ int FakeSerial::available() {
     ARDUINO_SEND(port_number);
 
     /* Return the result */
-    return receive_int(STDIN_FILENO);
+    return answer_int();
+}
+
+
+size_t FakeSerial::print(const String &str) {
+    PROFILED_CALL;
+    return this->write((const uint8_t *)str.c_str(), str.length());
+}
+
+
+size_t FakeSerial::println(const String &str) {
+    PROFILED_CALL;
+    size_t sent_bytes = this->print(str);
+    sent_bytes += this->println();
+
+    return sent_bytes;
+}
+
+
+/*
+  One SERIAL_READ_BYTES: whatever is waiting, up to `length` bytes,
+  stopping after `terminator` (-1 for none). `found` is set if it got
+  the terminator.
+ */
+size_t FakeSerial::read_chunk(char *buffer, size_t length, int terminator, int *found) {
+    ShimCall call;
+
+    uint8_t request = length > UINT8_MAX ? UINT8_MAX : length;
+
+    uint8_t message[1 + sizeof(port_number) + sizeof(request) + sizeof(terminator)];
+    message[0] = SERIAL_READ_BYTES;
+    memcpy(message + 1, &port_number, sizeof(port_number));
+    memcpy(message + 1 + sizeof(port_number), &request, sizeof(request));
+    memcpy(message + 1 + sizeof(port_number) + sizeof(request), &terminator, sizeof(terminator));
+    ARDUINO_SEND_BYTES(message, sizeof(message));
+
+    uint8_t count = answer_char();
+    ARDUINO_RECEIVE_BYTES(buffer, count);
+
+    *found = count > 0 && -1 != terminator && (uint8_t)buffer[count - 1] == terminator;
+
+    return count;
+}
+
+
+/*
+  Fill `buffer` until it's full, the terminator comes, or nothing has
+  arrived for the timeout. The wait counts the 1ms delays between
+  empty polls rather than watching millis(), which without virtual
+  time is the sketch's CPU time and stands still while it sleeps.
+ */
+size_t FakeSerial::read_timed(char *buffer, size_t length, int terminator, int *found) {
+    size_t total = 0;
+    unsigned long waited = 0;
+
+    *found = 0;
+
+    while (total < length && !*found) {
+        size_t count = this->read_chunk(buffer + total, length - total, terminator, found);
+        total += count;
+
+        if (count) {
+            waited = 0;
+        }
+        else if (waited++ < timeout) {
+            delay(1);
+        }
+        else {
+            break;
+        }
+    }
+
+    return total;
+}
+
+
+void FakeSerial::setTimeout(unsigned long timeout) {
+    this->timeout = timeout;
+}
+
+
+size_t FakeSerial::readBytes(char *buffer, size_t length) {
+    PROFILED_CALL;
+    int found;
+
+    return this->read_timed(buffer, length, -1, &found);
+}
+
+
+size_t FakeSerial::readBytes(uint8_t *buffer, size_t length) {
+    PROFILED_CALL;
+    return this->readBytes((char *)buffer, length);
+}
+
+
+/* The terminator is taken, but not stored or counted */
+size_t FakeSerial::readBytesUntil(char terminator, char *buffer, size_t length) {
+    PROFILED_CALL;
+    int found;
+    size_t count = this->read_timed(buffer, length, (uint8_t)terminator, &found);
+
+    return found ? count - 1 : count;
+}
+
+
+size_t FakeSerial::readBytesUntil(char terminator, uint8_t *buffer, size_t length) {
+    PROFILED_CALL;
+    return this->readBytesUntil(terminator, (char *)buffer, length);
+}
+
+
+String FakeSerial::readString() {
+    PROFILED_CALL;
+    String str;
+    char chunk[UINT8_MAX];
+    int found;
+    size_t count;
+
+    /* A short chunk means it timed out */
+    do {
+        count = this->read_timed(chunk, sizeof(chunk), -1, &found);
+        str.concat(chunk, count);
+    } while (count == sizeof(chunk));
+
+    return str;
+}
+
+
+String FakeSerial::readStringUntil(char terminator) {
+    PROFILED_CALL;
+    String str;
+    char chunk[UINT8_MAX];
+    int found = 0;
+    size_t count;
+
+    do {
+        count = this->read_timed(chunk, sizeof(chunk), (uint8_t)terminator, &found);
+        str.concat(chunk, found ? count - 1 : count);
+    } while (count == sizeof(chunk) && !found);
+
+    return str;
 }
 
 
@@ -277,6 +648,9 @@ int FakeSerial::available() {
  */
 
 void pinMode(uint8_t pin, uint8_t mode) {
+    PROFILED_CALL;
+    ShimCall call;
+
     /* Send PIN_MODE command identifier */
     ARDUINO_COMMAND(PIN_MODE);
 
@@ -287,6 +661,9 @@ void pinMode(uint8_t pin, uint8_t mode) {
 
 
 int digitalRead(uint8_t pin) {
+    PROFILED_CALL;
+    ShimCall call;
+
     /* Send DIGITAL_READ command */
     ARDUINO_COMMAND(DIGITAL_READ);
 
@@ -294,11 +671,14 @@ int digitalRead(uint8_t pin) {
     ARDUINO_SEND(pin);
 
     /* Receive the integer result */
-    return receive_int(STDIN_FILENO);
+    return answer_int();
 }
 
 
 void digitalWrite(uint8_t pin, uint8_t value) {
+    PROFILED_CALL;
+    ShimCall call;
+
     /* Send DIGITAL_WRITE command */
     ARDUINO_COMMAND(DIGITAL_WRITE);
 
@@ -308,7 +688,46 @@ void digitalWrite(uint8_t pin, uint8_t value) {
 }
 
 
+/* Ports are numbered from A, so port I's number is skipped */
+PortRegister PINA(REGISTER_PIN, 0), DDRA(REGISTER_DDR, 0), PORTA(REGISTER_PORT, 0);
+PortRegister PINB(REGISTER_PIN, 1), DDRB(REGISTER_DDR, 1), PORTB(REGISTER_PORT, 1);
+PortRegister PINC(REGISTER_PIN, 2), DDRC(REGISTER_DDR, 2), PORTC(REGISTER_PORT, 2);
+PortRegister PIND(REGISTER_PIN, 3), DDRD(REGISTER_DDR, 3), PORTD(REGISTER_PORT, 3);
+PortRegister PINE(REGISTER_PIN, 4), DDRE(REGISTER_DDR, 4), PORTE(REGISTER_PORT, 4);
+PortRegister PINF(REGISTER_PIN, 5), DDRF(REGISTER_DDR, 5), PORTF(REGISTER_PORT, 5);
+PortRegister PING(REGISTER_PIN, 6), DDRG(REGISTER_DDR, 6), PORTG(REGISTER_PORT, 6);
+PortRegister PINH(REGISTER_PIN, 7), DDRH(REGISTER_DDR, 7), PORTH(REGISTER_PORT, 7);
+PortRegister PINJ(REGISTER_PIN, 9), DDRJ(REGISTER_DDR, 9), PORTJ(REGISTER_PORT, 9);
+PortRegister PINK(REGISTER_PIN, 10), DDRK(REGISTER_DDR, 10), PORTK(REGISTER_PORT, 10);
+PortRegister PINL(REGISTER_PIN, 11), DDRL(REGISTER_DDR, 11), PORTL(REGISTER_PORT, 11);
+
+
+PortRegister::operator uint8_t() const {
+    PROFILED_CALL;
+    ShimCall call;
+
+    /* Send REGISTER_READ with the register and port */
+    uint8_t message[] = {REGISTER_READ, reg, port};
+    ARDUINO_SEND_BYTES(message, sizeof(message));
+
+    return answer_int();
+}
+
+
+void PortRegister::update(uint8_t and_mask, uint8_t xor_mask) {
+    PROFILED_CALL;
+    ShimCall call;
+
+    /* REGISTER_WRITE goes in one piece */
+    uint8_t message[] = {REGISTER_WRITE, reg, port, and_mask, xor_mask};
+    ARDUINO_SEND_BYTES(message, sizeof(message));
+}
+
+
 int analogRead(uint8_t pin) {
+    PROFILED_CALL;
+    ShimCall call;
+
     /* Send ANALOG_READ command */
     ARDUINO_COMMAND(ANALOG_READ);
 
@@ -316,11 +735,14 @@ int analogRead(uint8_t pin) {
     ARDUINO_SEND(pin);
 
     /* Receive integer result */
-    return receive_int(STDIN_FILENO);
+    return answer_int();
 }
 
 
 void analogWrite(uint8_t pin, int value) {
+    PROFILED_CALL;
+    ShimCall call;
+
     /* Send ANALOG_WRITE command */
     ARDUINO_COMMAND(ANALOG_WRITE);
 
@@ -330,6 +752,31 @@ void analogWrite(uint8_t pin, int value) {
 }
 
 
+/*
+  Runs can be seeded with EMULARD_SEED so that a batch of simulations
+  is reproducible. The Arduino's name (argv[0] when arduino_net starts
+  it) is mixed in so that the Arduinos don't all make the same choices.
+ */
+static int seed_from_environment() {
+    const char *seed = getenv("EMULARD_SEED");
+
+    if (NULL == seed) {
+        return 0;
+    }
+
+    unsigned int value = strtoul(seed, NULL, 10);
+
+    for (const char *c = program_invocation_short_name; *c; ++c) {
+        value = value * 31 + *c;
+    }
+
+    srand(value);
+    return 1;
+}
+
+static int seeded_from_environment = seed_from_environment();
+
+
 void randomSeed(unsigned int seed) {
     srand(seed);
 }
@@ -345,16 +792,772 @@ long random(long min, long max) {
 }
 
 
+/*
+  Headless runs set EMULARD_VIRTUAL_TIME, and then time is kept by the
+  server: delays don't sleep, they just move this Arduino's clock
+  forward, and micros() asks the server what time it is.
+ */
+static int virtual_time() {
+#ifdef EMULARD_DIRECT
+    /* The server is in the same process, and its clock is the only one */
+    return 1;
+#else
+    static int enabled = -1;
+
+    if (-1 == enabled) {
+        enabled = NULL != getenv("EMULARD_VIRTUAL_TIME");
+    }
+
+    return enabled;
+#endif
+}
+
+
+/* Sleep for real, carrying on after any interrupts */
+static void real_delay(unsigned long microseconds) {
+    struct timespec remaining;
+    remaining.tv_sec = microseconds / 1000000;
+    remaining.tv_nsec = (microseconds % 1000000) * 1000;
+
+    while (-1 == nanosleep(&remaining, &remaining) && EINTR == errno) {
+    }
+}
+
+
+/*
+  A virtual delay doesn't wait for anything, so with ISRs attached the
+  sketch would run on ahead of the interrupts the rest of the network
+  hasn't sent it yet. Instead it waits on a SYNC, which the server
+  answers once everyone has caught up to this Arduino's clock, and the
+  ISRs for whatever is in the event pipe by then run before it carries
+  on. Call it inside a shim call, which runs them as it returns.
+ */
+static void sync_interrupts() {
+    if (-1 == event_fd || 0 == num_handlers) {
+        return;
+    }
+
+    /* Send SYNC, and wait for the network to catch up */
+    ARDUINO_COMMAND(SYNC);
+    answer_char();
+
+    /* The events are in the pipe, even if their SIGIO hasn't come in yet */
+    interrupts_pending = 1;
+}
+
+
+static void virtual_delay(unsigned long microseconds) {
+    ShimCall call;
+
+    /* Send DELAY command with the length of the delay */
+    ARDUINO_COMMAND(DELAY);
+    ARDUINO_SEND(microseconds);
+
+    sync_interrupts();
+}
+
+
 void delay(unsigned long milliseconds) {
-    usleep(milliseconds * 1000);
+    PROFILED_CALL;
+    if (virtual_time()) {
+        virtual_delay(milliseconds * 1000);
+        return;
+    }
+
+    real_delay(milliseconds * 1000);
+}
+
+
+void delayMicroseconds(unsigned int microseconds) {
+    PROFILED_CALL;
+    if (virtual_time()) {
+        virtual_delay(microseconds);
+        return;
+    }
+
+    real_delay(microseconds);
 }
 
 
 unsigned long micros() {
+    PROFILED_CALL;
+    if (virtual_time()) {
+        ShimCall call;
+
+        /* Send MICROS command, and receive the time */
+        ARDUINO_COMMAND(MICROS);
+
+        return answer_long();
+    }
+
     return clock() * 1000000 / CLOCKS_PER_SEC;
 }
 
 
 unsigned long millis() {
+    PROFILED_CALL;
     return micros() / 1000;
 }
+
+
+void attachInterrupt(uint8_t interrupt, void (*isr)(void), int mode) {
+    PROFILED_CALL;
+    if (interrupt >= sizeof(INTERRUPT_PINS)) {
+        return;
+    }
+
+    listen_for_events();
+
+    ShimCall call;
+    uint8_t pin = INTERRUPT_PINS[interrupt];
+    uint8_t edge = mode;
+
+    num_handlers += (NULL != isr) - (NULL != interrupt_handlers[pin]);
+    interrupt_handlers[pin] = isr;
+
+    /* Send ATTACH_INTERRUPT with the pin and mode */
+    ARDUINO_COMMAND(ATTACH_INTERRUPT);
+    ARDUINO_SEND(pin);
+    ARDUINO_SEND(edge);
+}
+
+
+void detachInterrupt(uint8_t interrupt) {
+    PROFILED_CALL;
+    if (interrupt >= sizeof(INTERRUPT_PINS)) {
+        return;
+    }
+
+    ShimCall call;
+    uint8_t pin = INTERRUPT_PINS[interrupt];
+
+    num_handlers -= NULL != interrupt_handlers[pin];
+    interrupt_handlers[pin] = NULL;
+
+    /* Send DETACH_INTERRUPT with the pin */
+    ARDUINO_COMMAND(DETACH_INTERRUPT);
+    ARDUINO_SEND(pin);
+}
+
+
+void interrupts() {
+    interrupts_enabled = 1;
+
+    if (0 == shim_depth && interrupts_pending) {
+        run_interrupts();
+    }
+}
+
+
+void noInterrupts() {
+    interrupts_enabled = 0;
+}
+
+
+void finish_loop() {
+#ifdef EMULARD_PROFILE
+    {
+        ShimCall call;
+        profile_loop();
+    }
+#endif
+
+    ShimCall call;
+
+    /* Let the server count loops */
+    ARDUINO_COMMAND(LOOP);
+
+    /* Between loops is where a real board would have run any ISRs that came in */
+    if (virtual_time()) {
+        sync_interrupts();
+    }
+}
+
+
+/*
+  Wire (I2C).
+ */
+
+TwoWire Wire;
+
+
+TwoWire::TwoWire() {
+    transmit_address = 0;
+    transmit_length = 0;
+    transmitting = 0;
+
+    response_length = 0;
+    responding = 0;
+
+    receive_length = 0;
+    receive_index = 0;
+
+    receive_handler = NULL;
+    request_handler = NULL;
+}
+
+
+void TwoWire::begin() {
+}
+
+
+void TwoWire::begin(uint8_t address) {
+    PROFILED_CALL;
+    /* Targets hear about transmissions and requests on the event pipe */
+    listen_for_events();
+
+    ShimCall call;
+
+    /* Send WIRE_BEGIN with our address */
+    ARDUINO_COMMAND(WIRE_BEGIN);
+    ARDUINO_SEND(address);
+}
+
+
+void TwoWire::begin(int address) {
+    PROFILED_CALL;
+    this->begin((uint8_t)address);
+}
+
+
+void TwoWire::setClock(uint32_t frequency) {
+}
+
+
+void TwoWire::beginTransmission(uint8_t address) {
+    transmit_address = address;
+    transmit_length = 0;
+    transmitting = 1;
+}
+
+
+void TwoWire::beginTransmission(int address) {
+    this->beginTransmission((uint8_t)address);
+}
+
+
+uint8_t TwoWire::endTransmission() {
+    PROFILED_CALL;
+    return this->endTransmission((uint8_t)1);
+}
+
+
+uint8_t TwoWire::endTransmission(uint8_t stop) {
+    PROFILED_CALL;
+    ShimCall call;
+
+    /* The whole transmission goes over in one write */
+    uint8_t command[3 + BUFFER_LENGTH] = {WIRE_TRANSMIT, transmit_address, transmit_length};
+    memcpy(command + 3, transmit_buffer, transmit_length);
+
+    ARDUINO_SEND_BYTES(command, 3 + transmit_length);
+
+    transmit_length = 0;
+    transmitting = 0;
+
+    /* Receive the status */
+    return answer_char();
+}
+
+
+uint8_t TwoWire::requestFrom(uint8_t address, uint8_t quantity) {
+    PROFILED_CALL;
+    if (quantity > BUFFER_LENGTH) {
+        quantity = BUFFER_LENGTH;
+    }
+
+    ShimCall call;
+
+    uint8_t command[3] = {WIRE_REQUEST, address, quantity};
+    ARDUINO_SEND_BYTES(command, sizeof(command));
+
+    /* Receive the count, and then the bytes */
+    receive_length = answer_char();
+    receive_index = 0;
+
+    ARDUINO_RECEIVE_BYTES(receive_buffer, receive_length);
+
+    return receive_length;
+}
+
+
+uint8_t TwoWire::requestFrom(uint8_t address, uint8_t quantity, uint8_t stop) {
+    PROFILED_CALL;
+    return this->requestFrom(address, quantity);
+}
+
+
+uint8_t TwoWire::requestFrom(int address, int quantity) {
+    PROFILED_CALL;
+    return this->requestFrom((uint8_t)address, (uint8_t)quantity);
+}
+
+
+uint8_t TwoWire::requestFrom(int address, int quantity, int stop) {
+    PROFILED_CALL;
+    return this->requestFrom((uint8_t)address, (uint8_t)quantity);
+}
+
+
+size_t TwoWire::write(uint8_t value) {
+    /* Inside onRequest writes are the response, otherwise the transmission */
+    if (responding) {
+        if (response_length >= BUFFER_LENGTH) {
+            return 0;
+        }
+
+        response_buffer[response_length++] = value;
+        return 1;
+    }
+
+    if (!transmitting || transmit_length >= BUFFER_LENGTH) {
+        return 0;
+    }
+
+    transmit_buffer[transmit_length++] = value;
+    return 1;
+}
+
+
+size_t TwoWire::write(const uint8_t *data, size_t length) {
+    size_t written = 0;
+
+    while (written < length && this->write(data[written])) {
+        ++written;
+    }
+
+    return written;
+}
+
+
+int TwoWire::available() {
+    return receive_length - receive_index;
+}
+
+
+int TwoWire::read() {
+    if (receive_index >= receive_length) {
+        return -1;
+    }
+
+    return receive_buffer[receive_index++];
+}
+
+
+int TwoWire::peek() {
+    if (receive_index >= receive_length) {
+        return -1;
+    }
+
+    return receive_buffer[receive_index];
+}
+
+
+void TwoWire::onReceive(void (*handler)(int)) {
+    receive_handler = handler;
+}
+
+
+void TwoWire::onRequest(void (*handler)(void)) {
+    request_handler = handler;
+}
+
+
+void TwoWire::receive_event() {
+    {
+        ShimCall call;
+
+        /* Fetch the transmission that is waiting for us */
+        ARDUINO_COMMAND(WIRE_TAKE);
+
+        receive_length = answer_char();
+        receive_index = 0;
+
+        ARDUINO_RECEIVE_BYTES(receive_buffer, receive_length);
+    }
+
+    if (NULL != receive_handler) {
+        receive_handler(receive_length);
+    }
+}
+
+
+void TwoWire::request_event() {
+    response_length = 0;
+    responding = 1;
+
+    if (NULL != request_handler) {
+        request_handler();
+    }
+
+    responding = 0;
+
+    /* Always respond, even with nothing, since the controller is waiting on us */
+    ShimCall call;
+
+    uint8_t command[2 + BUFFER_LENGTH] = {WIRE_RESPOND, response_length};
+    memcpy(command + 2, response_buffer, response_length);
+
+    ARDUINO_SEND_BYTES(command, 2 + response_length);
+}
+
+
+/*
+  SPI.
+ */
+
+SPIClass SPI;
+
+
+static uint8_t reverse_bits(uint8_t value) {
+    value = (value & 0xF0) >> 4 | (value & 0x0F) << 4;
+    value = (value & 0xCC) >> 2 | (value & 0x33) << 2;
+    value = (value & 0xAA) >> 1 | (value & 0x55) << 1;
+
+    return value;
+}
+
+
+SPIClass::SPIClass() {
+    bit_order = MSBFIRST;
+}
+
+
+void SPIClass::begin() {
+}
+
+
+void SPIClass::end() {
+}
+
+
+void SPIClass::beginTransaction(SPISettings settings) {
+    bit_order = settings.bit_order;
+}
+
+
+void SPIClass::endTransaction() {
+}
+
+
+void SPIClass::setBitOrder(uint8_t order) {
+    bit_order = order;
+}
+
+
+void SPIClass::setDataMode(uint8_t mode) {
+}
+
+
+void SPIClass::setClockDivider(uint8_t divider) {
+}
+
+
+uint8_t SPIClass::transfer(uint8_t value) {
+    PROFILED_CALL;
+    this->transfer(&value, 1);
+
+    return value;
+}
+
+
+uint16_t SPIClass::transfer16(uint16_t value) {
+    PROFILED_CALL;
+    uint8_t data[2];
+
+    if (MSBFIRST == bit_order) {
+        data[0] = value >> 8;
+        data[1] = value & 0xFF;
+    }
+    else {
+        data[0] = value & 0xFF;
+        data[1] = value >> 8;
+    }
+
+    this->transfer(data, sizeof(data));
+
+    if (MSBFIRST == bit_order) {
+        return data[0] << 8 | data[1];
+    }
+
+    return data[1] << 8 | data[0];
+}
+
+
+void SPIClass::transfer(void *buffer, size_t count) {
+    PROFILED_CALL;
+    uint8_t *data = (uint8_t *)buffer;
+
+    while (count > 0) {
+        uint8_t length = count > UINT8_MAX ? UINT8_MAX : count;
+        uint8_t command[2 + UINT8_MAX] = {SPI_TRANSFER, length};
+
+        for (int k = 0; k < length; ++k) {
+            command[2 + k] = MSBFIRST == bit_order ? data[k] : reverse_bits(data[k]);
+        }
+
+        {
+            ShimCall call;
+
+            /* Send SPI_TRANSFER with the bytes, and the same number come back */
+            ARDUINO_SEND_BYTES(command, 2 + length);
+            ARDUINO_RECEIVE_BYTES(data, length);
+        }
+
+        if (LSBFIRST == bit_order) {
+            for (int k = 0; k < length; ++k) {
+                data[k] = reverse_bits(data[k]);
+            }
+        }
+
+        data += length;
+        count -= length;
+    }
+}
+
+
+/*
+  SoftwareSerial.
+ */
+
+/* Port number until begin() gets a real one from the server */
+static const unsigned int NO_PORT = (unsigned int)-1;
+
+static SoftwareSerial *soft_listening = NULL;
+
+
+SoftwareSerial::SoftwareSerial(uint8_t rx, uint8_t tx, bool inverse_logic) : FakeSerial(NO_PORT) {
+    rx_pin = rx;
+    tx_pin = tx;
+    inverse = inverse_logic;
+    bit_micros = 0;
+}
+
+
+void SoftwareSerial::begin(long speed) {
+    PROFILED_CALL;
+    bit_micros = speed > 0 ? 1000000 / speed : 0;
+
+    /* The line idles at the stop bit's level */
+    pinMode(tx_pin, OUTPUT);
+    digitalWrite(tx_pin, inverse ? LOW : HIGH);
+    pinMode(rx_pin, inverse ? INPUT : INPUT_PULLUP);
+
+    {
+        ShimCall call;
+
+        /* Send SOFT_SERIAL_BEGIN with the pins, and get our port number */
+        ARDUINO_COMMAND(SOFT_SERIAL_BEGIN);
+        ARDUINO_SEND(rx_pin);
+        ARDUINO_SEND(tx_pin);
+
+        int port = answer_int();
+        port_number = -1 == port ? NO_PORT : port;
+    }
+
+    this->listen();
+}
+
+
+void SoftwareSerial::end() {
+    PROFILED_CALL;
+    this->stopListening();
+}
+
+
+bool SoftwareSerial::listen() {
+    PROFILED_CALL;
+    if (this == soft_listening || NO_PORT == port_number) {
+        return false;
+    }
+
+    ShimCall call;
+
+    soft_listening = this;
+
+    /* Send SOFT_SERIAL_LISTEN with our port */
+    ARDUINO_COMMAND(SOFT_SERIAL_LISTEN);
+    ARDUINO_SEND(port_number);
+
+    return true;
+}
+
+
+bool SoftwareSerial::isListening() {
+    return this == soft_listening;
+}
+
+
+bool SoftwareSerial::stopListening() {
+    PROFILED_CALL;
+    if (this != soft_listening) {
+        return false;
+    }
+
+    ShimCall call;
+
+    soft_listening = NULL;
+
+    /* Listening on a port that isn't a SoftwareSerial port stops it */
+    ARDUINO_COMMAND(SOFT_SERIAL_LISTEN);
+    ARDUINO_SEND(NO_PORT);
+
+    return true;
+}
+
+
+bool SoftwareSerial::overflow() {
+    return false;
+}
+
+
+size_t SoftwareSerial::write(uint8_t value) {
+    PROFILED_CALL;
+    uint8_t bits;
+
+    {
+        ShimCall call;
+
+        /* Send SOFT_SERIAL_WRITE, and find out if anything needs the bits */
+        ARDUINO_COMMAND(SOFT_SERIAL_WRITE);
+        ARDUINO_SEND(port_number);
+        ARDUINO_SEND(value);
+
+        bits = answer_char();
+    }
+
+    if (bits) {
+        this->write_bits(value);
+    }
+
+    return 1;
+}
+
+
+/* 8N1, LSB first, the same as the real SoftwareSerial */
+void SoftwareSerial::write_bits(uint8_t value) {
+    uint8_t idle = inverse ? LOW : HIGH;
+
+    digitalWrite(tx_pin, !idle);
+    delayMicroseconds(bit_micros);
+
+    for (int bit = 0; bit < 8; ++bit) {
+        digitalWrite(tx_pin, ((value >> bit) & 1) ^ inverse);
+        delayMicroseconds(bit_micros);
+    }
+
+    digitalWrite(tx_pin, idle);
+    delayMicroseconds(bit_micros);
+}
+
+
+/*
+  EEPROM.
+ */
+
+EEPROMClass EEPROM;
+
+uint8_t *EEPROMClass::cells = NULL;
+uint32_t *EEPROMClass::wear = NULL;
+
+
+/*
+  mmap `size` bytes of a file, or NULL if it can't be done. The
+  network makes the files, but one that is short is grown with `fill`
+  bytes, so cells that were never written read as erased.
+ */
+static void *map_file(const char *path, size_t size, uint8_t fill) {
+    int fd = open(path, O_RDWR | O_CREAT, 0644);
+    struct stat info;
+
+    if (-1 == fd) {
+        return NULL;
+    }
+
+    if (-1 == fstat(fd, &info) || -1 == ftruncate(fd, size)) {
+        close(fd);
+        return NULL;
+    }
+
+    void *memory = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+
+    if (MAP_FAILED == memory) {
+        return NULL;
+    }
+
+    if ((size_t)info.st_size < size) {
+        memset((uint8_t *)memory + info.st_size, fill, size - info.st_size);
+    }
+
+    return memory;
+}
+
+
+void EEPROMClass::map() {
+#ifdef EMULARD_DIRECT
+    /* Kept with the other globals, so every run of a direct build starts from an erased EEPROM */
+    static uint8_t direct_cells[EEPROM_SIZE];
+    static uint32_t direct_wear[EEPROM_SIZE];
+
+    cells = direct_cells;
+    wear = direct_wear;
+    memset(cells, 0xFF, EEPROM_SIZE);
+
+    return;
+#endif
+
+    const char *path = getenv("EMULARD_EEPROM");
+
+    if (NULL != path) {
+        size_t length = strlen(path) + sizeof(EEPROM_WEAR_SUFFIX);
+        char *wear_path = (char *)malloc(length);
+        snprintf(wear_path, length, "%s%s", path, EEPROM_WEAR_SUFFIX);
+
+        cells = (uint8_t *)map_file(path, EEPROM_SIZE, 0xFF);
+        wear = (uint32_t *)map_file(wear_path, EEPROM_SIZE * sizeof(uint32_t), 0);
+
+        free(wear_path);
+
+        if (NULL == cells || NULL == wear) {
+            fprintf(stderr, "Could not map EEPROM \"%s\"\n", path);
+            exit(EXIT_FAILURE);
+        }
+
+        return;
+    }
+
+    /* Nowhere to keep it, so it's a fresh, erased EEPROM every run */
+    cells = (uint8_t *)mmap(NULL, EEPROM_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    wear = (uint32_t *)mmap(NULL, EEPROM_SIZE * sizeof(uint32_t), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+    if (MAP_FAILED == cells || MAP_FAILED == wear) {
+        perror("Could not allocate EEPROM");
+        exit(EXIT_FAILURE);
+    }
+
+    memset(cells, 0xFF, EEPROM_SIZE);
+}
+
+
+EERef::operator uint8_t() const {
+    return EEPROM.read(address);
+}
+
+
+EERef &EERef::operator=(uint8_t value) {
+    EEPROM.write(address, value);
+    return *this;
+}
+
+
+EERef &EERef::operator=(const EERef &ref) {
+    EEPROM.write(address, (uint8_t)ref);
+    return *this;
+}
+
+
+EERef &EERef::update(uint8_t value) {
+    EEPROM.update(address, value);
+    return *this;
+}
@@ -29,18 +29,25 @@
 #include <stddef.h>
 #include <stdlib.h>
 
+#include "WString.h"
 
 class FakeSerial {
  private:
+    size_t read_chunk(char *buffer, size_t length, int terminator, int *found);
+    size_t read_timed(char *buffer, size_t length, int terminator, int *found);
+ protected:
     unsigned int port_number;
+    unsigned long timeout;  /* Milliseconds, for the readBytes and readString family */
  public:
     FakeSerial(unsigned int port_number) {
         this->port_number = port_number;
+        this->timeout = 1000;
     }
 
     void begin(unsigned long speed);
 
-    size_t write(uint8_t value);
+    /* Virtual so that SoftwareSerial's writes go its own way */
+    virtual size_t write(uint8_t value);
     size_t write(const char *str);
     size_t write(const uint8_t *buffer, size_t length);
 
@@ -69,11 +76,26 @@ class FakeSerial {
     size_t println(unsigned long value, int base);
     size_t println(unsigned long value);
 
+    size_t print(const String &str);
+    size_t println(const String &str);
+
     size_t println();
 
     int read();
     int peek();
     int available();
+
+    /*
+      These read as much as is there in one go, and wait out the
+      timeout only when they run dry.
+     */
+    void setTimeout(unsigned long timeout);
+    size_t readBytes(char *buffer, size_t length);
+    size_t readBytes(uint8_t *buffer, size_t length);
+    size_t readBytesUntil(char terminator, char *buffer, size_t length);
+    size_t readBytesUntil(char terminator, uint8_t *buffer, size_t length);
+    String readString();
+    String readStringUntil(char terminator);
 };
 
 static FakeSerial Serial(0), Serial1(1), Serial2(2), Serial3(3);
@@ -86,11 +108,24 @@ static const int LOW = 0;
 static const int HEX = 16;
 static const int DEC = 10;
 
+/* Bit orders */
+static const uint8_t LSBFIRST = 0;
+static const uint8_t MSBFIRST = 1;
+
 /* Values for pin modes */
 static const uint8_t INPUT = 0;
 static const uint8_t OUTPUT = 1;
 static const uint8_t INPUT_PULLUP = 2;
 
+/* Modes for interrupts */
+static const int CHANGE = 1;
+static const int FALLING = 2;
+static const int RISING = 3;
+
+/* External interrupts on the Mega are on pins 2, 3, 21, 20, 19, and 18 */
+#define NOT_AN_INTERRUPT -1
+#define digitalPinToInterrupt(p) ((p) == 2 ? 0 : (p) == 3 ? 1 : ((p) >= 18 && (p) <= 21) ? 23 - (p) : NOT_AN_INTERRUPT)
+
 /* Arduino types */
 typedef uint8_t byte;
 
@@ -101,6 +136,79 @@ void pinMode(uint8_t pin, uint8_t mode);
 int digitalRead(uint8_t pin);
 void digitalWrite(uint8_t pin, uint8_t value);
 
+/*
+  The AVR's port registers, for code that works on eight pins at
+  once. Writes are one command each, compound assignments included:
+  the server does the read-modify-write. Reading a register asks the
+  server for it.
+ */
+class PortRegister {
+ private:
+    uint8_t reg;
+    uint8_t port;
+
+    void update(uint8_t and_mask, uint8_t xor_mask);
+ public:
+    PortRegister(uint8_t reg, uint8_t port) {
+        this->reg = reg;
+        this->port = port;
+    }
+
+    operator uint8_t() const;
+
+    PortRegister &operator=(uint8_t value) {
+        this->update(0, value);
+        return *this;
+    }
+
+    PortRegister &operator=(const PortRegister &other) {
+        this->update(0, (uint8_t)other);
+        return *this;
+    }
+
+    PortRegister &operator|=(uint8_t mask) {
+        this->update(~mask, mask);
+        return *this;
+    }
+
+    PortRegister &operator&=(uint8_t mask) {
+        this->update(mask, 0);
+        return *this;
+    }
+
+    PortRegister &operator^=(uint8_t mask) {
+        this->update(0xFF, mask);
+        return *this;
+    }
+};
+
+extern PortRegister PINA, DDRA, PORTA;
+extern PortRegister PINB, DDRB, PORTB;
+extern PortRegister PINC, DDRC, PORTC;
+extern PortRegister PIND, DDRD, PORTD;
+extern PortRegister PINE, DDRE, PORTE;
+extern PortRegister PINF, DDRF, PORTF;
+extern PortRegister PING, DDRG, PORTG;
+extern PortRegister PINH, DDRH, PORTH;
+extern PortRegister PINJ, DDRJ, PORTJ;
+extern PortRegister PINK, DDRK, PORTK;
+extern PortRegister PINL, DDRL, PORTL;
+
+/* Bit numbers within the ports, and _BV to make masks of them */
+#define _BV(bit) (1 << (bit))
+
+enum { PA0, PA1, PA2, PA3, PA4, PA5, PA6, PA7 };
+enum { PB0, PB1, PB2, PB3, PB4, PB5, PB6, PB7 };
+enum { PC0, PC1, PC2, PC3, PC4, PC5, PC6, PC7 };
+enum { PD0, PD1, PD2, PD3, PD4, PD5, PD6, PD7 };
+enum { PE0, PE1, PE2, PE3, PE4, PE5, PE6, PE7 };
+enum { PF0, PF1, PF2, PF3, PF4, PF5, PF6, PF7 };
+enum { PG0, PG1, PG2, PG3, PG4, PG5, PG6, PG7 };
+enum { PH0, PH1, PH2, PH3, PH4, PH5, PH6, PH7 };
+enum { PJ0, PJ1, PJ2, PJ3, PJ4, PJ5, PJ6, PJ7 };
+enum { PK0, PK1, PK2, PK3, PK4, PK5, PK6, PK7 };
+enum { PL0, PL1, PL2, PL3, PL4, PL5, PL6, PL7 };
+
 /* Analog read and write functions */
 int analogRead(uint8_t pin);
 void analogWrite(uint8_t pin, int value);
@@ -110,9 +218,19 @@ void randomSeed(unsigned int seed);
 long random(long max);
 long random(long min, long max);
 
+/* Interrupt functions */
+void attachInterrupt(uint8_t interrupt, void (*isr)(void), int mode);
+void detachInterrupt(uint8_t interrupt);
+void interrupts();
+void noInterrupts();
+
 /* Timing functions */
 void delay(unsigned long milliseconds);
+void delayMicroseconds(unsigned int microseconds);
 unsigned long micros();
 unsigned long millis();
 
+/* The runtime calls this after every loop(), so the server can count them */
+void finish_loop();
+
 #endif
@@ -0,0 +1,122 @@
+/* Copyright (C) 2013 Calvin Beck
+
+  Permission is hereby granted, free of charge, to any person
+  obtaining a copy of this software and associated documentation files
+  (the "Software"), to deal in the Software without restriction,
+  including without limitation the rights to use, copy, modify, merge,
+  publish, distribute, sublicense, and/or sell copies of the Software,
+  and to permit persons to whom the Software is furnished to do so,
+  subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be
+  included in all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+  EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+  MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+  NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+  BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+  ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+  CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+  SOFTWARE.
+
+*/
+
+#ifndef EEPROM_H
+#define EEPROM_H
+
+#include "Arduino.h"
+
+/* Last EEPROM address, as avr/io.h has it for the Mega's 4K */
+#define E2END 0xFFF
+
+
+/* EEPROM[address], which reads and writes like a byte */
+class EERef {
+ private:
+    int address;
+ public:
+    EERef(int address) {
+        this->address = address;
+    }
+
+    operator uint8_t() const;
+    EERef &operator=(uint8_t value);
+    EERef &operator=(const EERef &ref);
+    EERef &update(uint8_t value);
+};
+
+
+/*
+  EEPROM. The cells are a file mmap'd into the sketch, so reads and
+  writes are plain memory accesses that never go to the server. The
+  network names the file in EMULARD_EEPROM, and it outlives the run.
+  Without one the EEPROM starts erased and is gone when the sketch
+  exits.
+
+  Every write that reaches a cell is counted, in a second file next
+  to the first, so that the network can report on wear.
+ */
+class EEPROMClass {
+ private:
+    static uint8_t *cells;
+    static uint32_t *wear;
+
+    static void map();
+ public:
+    uint8_t read(int address) {
+        if (NULL == cells) {
+            map();
+        }
+
+        return cells[address & E2END];
+    }
+
+    void write(int address, uint8_t value) {
+        if (NULL == cells) {
+            map();
+        }
+
+        cells[address & E2END] = value;
+        ++wear[address & E2END];
+    }
+
+    void update(int address, uint8_t value) {
+        if (this->read(address) != value) {
+            this->write(address, value);
+        }
+    }
+
+    EERef operator[](int address) {
+        return EERef(address);
+    }
+
+    uint16_t length() {
+        return E2END + 1;
+    }
+
+    template <typename T> T &get(int address, T &value) {
+        uint8_t *bytes = (uint8_t *)&value;
+
+        for (size_t i = 0; i < sizeof(T); ++i) {
+            bytes[i] = this->read(address + i);
+        }
+
+        return value;
+    }
+
+    /* Like the real thing, only the bytes that changed are written */
+    template <typename T> const T &put(int address, const T &value) {
+        const uint8_t *bytes = (const uint8_t *)&value;
+
+        for (size_t i = 0; i < sizeof(T); ++i) {
+            this->update(address + i, bytes[i]);
+        }
+
+        return value;
+    }
+};
+
+extern EEPROMClass EEPROM;
+
+#endif
@@ -0,0 +1,476 @@
+/* Copyright (C) 2013 Calvin Beck
+
+  Permission is hereby granted, free of charge, to any person
+  obtaining a copy of this software and associated documentation files
+  (the "Software"), to deal in the Software without restriction,
+  including without limitation the rights to use, copy, modify, merge,
+  publish, distribute, sublicense, and/or sell copies of the Software,
+  and to permit persons to whom the Software is furnished to do so,
+  subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be
+  included in all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+  EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+  MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+  NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+  BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+  ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+  CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+  SOFTWARE.
+
+*/
+
+#include "Profile.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <signal.h>
+#include <link.h>
+#include <elf.h>
+#include <cxxabi.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+
+/* Call sites are kept in an open addressing table, keyed by site and call */
+typedef struct ProfileSite {
+    void *site;
+    const char *name;
+    unsigned long long calls;
+    unsigned long long total_nanoseconds;
+    unsigned long long max_nanoseconds;
+} ProfileSite;
+
+static const size_t MAX_SITES = 4096;
+static ProfileSite sites[MAX_SITES];
+static size_t num_sites = 0;
+static unsigned long long dropped_calls = 0;
+
+static volatile sig_atomic_t profile_depth = 0;
+static volatile sig_atomic_t interrupt_depth = 0;
+
+/* loop() iterations are timed from the end of one to the end of the next */
+static unsigned long long loops = 0;
+static unsigned long long last_loop = 0;
+static unsigned long long loop_nanoseconds = 0;
+static unsigned long long max_loop_nanoseconds = 0;
+
+/*
+  The report is written when the launcher stops us with SIGTERM, or at
+  exit, and every second along the way in case we're killed outright.
+ */
+static const unsigned long long WRITE_INTERVAL = 1000000000ULL;
+static unsigned long long profile_start = 0;
+static unsigned long long last_written = 0;
+static volatile sig_atomic_t writing = 0;
+static int write_failed = 0;
+
+static void write_profile();
+
+
+static void write_and_exit(int signal_number) {
+    /* One that's halfway out is left for the last complete one */
+    if (!writing) {
+        write_profile();
+    }
+
+    _exit(EXIT_SUCCESS);
+}
+
+
+/*
+  The server side of single_main is linked with us too, so nothing is
+  set up until the first call: only the sketch's process gets a report.
+ */
+static void start_profile() {
+    if (0 != profile_start) {
+        return;
+    }
+
+    profile_start = profile_clock();
+    last_written = profile_start;
+
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = write_and_exit;
+    sigaction(SIGTERM, &action, NULL);
+
+    atexit(write_profile);
+}
+
+
+unsigned long long profile_clock() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    return (unsigned long long)now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+
+static void write_now_and_then(unsigned long long now) {
+    if (0 == interrupt_depth && now - last_written >= WRITE_INTERVAL) {
+        last_written = now;
+        write_profile();
+    }
+}
+
+
+unsigned long long profile_enter() {
+    start_profile();
+
+    return 0 == profile_depth++ ? profile_clock() : 0;
+}
+
+
+void profile_leave(const char *name, void *site, unsigned long long start) {
+    if (0 != --profile_depth) {
+        return;
+    }
+
+    unsigned long long now = profile_clock();
+    unsigned long long nanoseconds = now - start;
+
+    size_t slot = ((uintptr_t)site >> 2) * 2654435761u % MAX_SITES;
+
+    while (NULL != sites[slot].site && (sites[slot].site != site || sites[slot].name != name)) {
+        slot = (slot + 1) % MAX_SITES;
+    }
+
+    if (NULL == sites[slot].site) {
+        /* Keep the table from filling up, so that probes stay short */
+        if (num_sites >= MAX_SITES / 4 * 3) {
+            ++dropped_calls;
+            return;
+        }
+
+        sites[slot].site = site;
+        sites[slot].name = name;
+        ++num_sites;
+    }
+
+    ProfileSite *entry = &sites[slot];
+    ++entry->calls;
+    entry->total_nanoseconds += nanoseconds;
+
+    if (nanoseconds > entry->max_nanoseconds) {
+        entry->max_nanoseconds = nanoseconds;
+    }
+
+    write_now_and_then(now);
+}
+
+
+int profile_begin_interrupts() {
+    int depth = profile_depth;
+
+    ++interrupt_depth;
+    profile_depth = 0;
+
+    return depth;
+}
+
+
+void profile_end_interrupts(int depth) {
+    profile_depth = depth;
+    --interrupt_depth;
+}
+
+
+void profile_loop() {
+    start_profile();
+
+    unsigned long long now = profile_clock();
+
+    if (loops > 0) {
+        unsigned long long nanoseconds = now - last_loop;
+        loop_nanoseconds += nanoseconds;
+
+        if (nanoseconds > max_loop_nanoseconds) {
+            max_loop_nanoseconds = nanoseconds;
+        }
+    }
+
+    ++loops;
+    last_loop = now;
+
+    write_now_and_then(now);
+}
+
+
+/*
+  Symbols for the report come from the executable's own symbol table,
+  so that the sketch's functions get names without -rdynamic.
+ */
+
+typedef struct Symbol {
+    uintptr_t address;
+    size_t size;
+    const char *name;
+} Symbol;
+
+static Symbol *symbols = NULL;
+static size_t num_symbols = 0;
+static int symbols_loaded = 0;
+
+
+static void load_symbols() {
+    symbols_loaded = 1;
+
+    int fd = open("/proc/self/exe", O_RDONLY);
+
+    if (-1 == fd) {
+        return;
+    }
+
+    struct stat info;
+
+    if (-1 == fstat(fd, &info) || (size_t)info.st_size < sizeof(ElfW(Ehdr))) {
+        close(fd);
+        return;
+    }
+
+    /* Left mapped, the names point into it */
+    uint8_t *image = (uint8_t *)mmap(NULL, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+
+    if (MAP_FAILED == image) {
+        return;
+    }
+
+    ElfW(Ehdr) *header = (ElfW(Ehdr) *)image;
+
+    if (0 != memcmp(header->e_ident, ELFMAG, SELFMAG) || header->e_shoff + header->e_shnum * sizeof(ElfW(Shdr)) > (size_t)info.st_size) {
+        return;
+    }
+
+    ElfW(Shdr) *sections = (ElfW(Shdr) *)(image + header->e_shoff);
+
+    /* The full symbol table if it wasn't stripped, otherwise the dynamic one */
+    ElfW(Shdr) *table = NULL;
+
+    for (size_t i = 0; i < header->e_shnum; ++i) {
+        if (SHT_SYMTAB == sections[i].sh_type || (NULL == table && SHT_DYNSYM == sections[i].sh_type)) {
+            table = &sections[i];
+        }
+    }
+
+    if (NULL == table || table->sh_link >= header->e_shnum) {
+        return;
+    }
+
+    ElfW(Sym) *entries = (ElfW(Sym) *)(image + table->sh_offset);
+    size_t num_entries = table->sh_size / sizeof(ElfW(Sym));
+    const char *names = (const char *)(image + sections[table->sh_link].sh_offset);
+
+    symbols = (Symbol *)malloc(num_entries * sizeof(Symbol));
+
+    if (NULL == symbols) {
+        return;
+    }
+
+    for (size_t i = 0; i < num_entries; ++i) {
+        if (STT_FUNC == ELF64_ST_TYPE(entries[i].st_info) && 0 != entries[i].st_value) {
+            symbols[num_symbols].address = entries[i].st_value;
+            symbols[num_symbols].size = entries[i].st_size;
+            symbols[num_symbols].name = names + entries[i].st_name;
+            ++num_symbols;
+        }
+    }
+}
+
+
+/* Which loaded object an address is in, and where that was loaded */
+typedef struct Module {
+    uintptr_t address;
+    uintptr_t base;
+    const char *path;
+} Module;
+
+
+static int find_module(struct dl_phdr_info *info, size_t size, void *data) {
+    Module *module = (Module *)data;
+
+    for (int i = 0; i < info->dlpi_phnum; ++i) {
+        const ElfW(Phdr) *segment = &info->dlpi_phdr[i];
+        uintptr_t start = info->dlpi_addr + segment->p_vaddr;
+
+        if (PT_LOAD == segment->p_type && module->address >= start && module->address < start + segment->p_memsz) {
+            module->base = info->dlpi_addr;
+            module->path = info->dlpi_name;
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+
+/*
+  "function+0x1c (file+0x11c9)", where the offset in the file is what
+  addr2line -f -e <file> wants. The site is the return address, so we
+  go back a byte to land on the call itself.
+ */
+static void describe_site(void *site, char *buffer, size_t length) {
+    Module module;
+    module.address = (uintptr_t)site - 1;
+    module.base = 0;
+    module.path = NULL;
+
+    if (!dl_iterate_phdr(find_module, &module)) {
+        snprintf(buffer, length, "%p", site);
+        return;
+    }
+
+    uintptr_t offset = module.address - module.base;
+
+    /* The executable comes first, with an empty name */
+    char executable[256];
+    const char *path = module.path;
+
+    if ('\0' == path[0]) {
+        ssize_t count = readlink("/proc/self/exe", executable, sizeof(executable) - 1);
+        executable[count > 0 ? count : 0] = '\0';
+        path = executable;
+    }
+
+    const char *file = strrchr(path, '/');
+    file = NULL == file ? path : file + 1;
+
+    const Symbol *symbol = NULL;
+
+    if (path == executable) {
+        if (!symbols_loaded) {
+            load_symbols();
+        }
+
+        for (size_t i = 0; i < num_symbols && NULL == symbol; ++i) {
+            if (offset >= symbols[i].address && offset < symbols[i].address + symbols[i].size) {
+                symbol = &symbols[i];
+            }
+        }
+    }
+
+    if (NULL == symbol) {
+        snprintf(buffer, length, "%s+0x%lx", file, (unsigned long)offset);
+        return;
+    }
+
+    int status;
+    char *demangled = abi::__cxa_demangle(symbol->name, NULL, NULL, &status);
+
+    snprintf(buffer, length, "%s+0x%lx (%s+0x%lx)", NULL != demangled ? demangled : symbol->name,
+             (unsigned long)(offset - symbol->address), file, (unsigned long)offset);
+
+    free(demangled);
+}
+
+
+static int by_total_time(const void *a, const void *b) {
+    const ProfileSite *site_a = *(const ProfileSite **)a;
+    const ProfileSite *site_b = *(const ProfileSite **)b;
+
+    if (site_a->total_nanoseconds == site_b->total_nanoseconds) {
+        return 0;
+    }
+
+    return site_a->total_nanoseconds > site_b->total_nanoseconds ? -1 : 1;
+}
+
+
+static void print_profile(FILE *report) {
+    double seconds = (profile_clock() - profile_start) / 1e9;
+
+    fprintf(report, "Profile of %s, %.3f s\n\n", program_invocation_short_name, seconds);
+
+    if (loops > 1) {
+        double loop_seconds = loop_nanoseconds / 1e9;
+
+        fprintf(report, "loop(): %llu iterations, %.1f per second, %.3f ms average, %.3f ms longest\n\n",
+                loops, (loops - 1) / loop_seconds, loop_seconds * 1000 / (loops - 1), max_loop_nanoseconds / 1e6);
+    }
+    else {
+        fprintf(report, "loop(): %llu iterations\n\n", loops);
+    }
+
+    ProfileSite **sorted = (ProfileSite **)malloc((num_sites + 1) * sizeof(ProfileSite *));
+
+    if (NULL == sorted) {
+        return;
+    }
+
+    size_t count = 0;
+
+    for (size_t i = 0; i < MAX_SITES; ++i) {
+        if (NULL != sites[i].site) {
+            sorted[count++] = &sites[i];
+        }
+    }
+
+    qsort(sorted, count, sizeof(ProfileSite *), by_total_time);
+
+    fprintf(report, "%12s %12s %10s %10s  %s\n", "calls", "total ms", "mean us", "max us", "call");
+
+    for (size_t i = 0; i < count; ++i) {
+        ProfileSite *entry = sorted[i];
+        char site[512];
+
+        describe_site(entry->site, site, sizeof(site));
+
+        fprintf(report, "%12llu %12.3f %10.2f %10.2f  %s\n", entry->calls, entry->total_nanoseconds / 1e6,
+                entry->total_nanoseconds / 1e3 / entry->calls, entry->max_nanoseconds / 1e3, entry->name);
+        fprintf(report, "%49sfrom %s\n", "", site);
+    }
+
+    if (dropped_calls) {
+        fprintf(report, "\n%llu calls from sites that didn't fit in the table\n", dropped_calls);
+    }
+
+    free(sorted);
+}
+
+
+/* Written next to the old report and renamed over it, so it's never half there */
+static void write_profile() {
+    if (write_failed) {
+        return;
+    }
+
+    const char *directory = getenv("EMULARD_PROFILE_DIR");
+
+    if (NULL == directory) {
+        directory = ".";
+    }
+
+    char path[4096];
+    char temporary[4096];
+    snprintf(path, sizeof(path), "%s/%s.profile", directory, program_invocation_short_name);
+    snprintf(temporary, sizeof(temporary), "%s.tmp", path);
+
+    writing = 1;
+
+    FILE *report = fopen(temporary, "w");
+
+    if (NULL == report) {
+        fprintf(stderr, "Could not write profile \"%s\": %s\n", temporary, strerror(errno));
+        write_failed = 1;
+        writing = 0;
+        return;
+    }
+
+    print_profile(report);
+    fclose(report);
+    writing = 0;
+
+    if (-1 == rename(temporary, path)) {
+        fprintf(stderr, "Could not write profile \"%s\": %s\n", path, strerror(errno));
+        write_failed = 1;
+    }
+}
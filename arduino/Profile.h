@@ -0,0 +1,60 @@
+/* Copyright (C) 2013 Calvin Beck
+
+  Permission is hereby granted, free of charge, to any person
+  obtaining a copy of this software and associated documentation files
+  (the "Software"), to deal in the Software without restriction,
+  including without limitation the rights to use, copy, modify, merge,
+  publish, distribute, sublicense, and/or sell copies of the Software,
+  and to permit persons to whom the Software is furnished to do so,
+  subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be
+  included in all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+  EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+  MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+  NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+  BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+  ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+  CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+  SOFTWARE.
+
+*/
+
+
+#ifndef PROFILE_H
+#define PROFILE_H
+
+
+/*
+  Profiling builds of the library (libemulard_profile.a, compiled with
+  EMULARD_PROFILE) count every shim call by the address it was called
+  from, and time it, so blocking round trips to the server show up as
+  the time they take. Only the outermost call is counted: print()
+  going on to write() is one print(). loop() iterations are timed as
+  well, and <name>.profile is written to EMULARD_PROFILE_DIR (or the
+  current directory) with the results.
+ */
+
+/* Nanoseconds on the monotonic clock */
+unsigned long long profile_clock();
+
+/* Start a shim call, giving its start time if it's the outermost */
+unsigned long long profile_enter();
+
+/* Finish a shim call that was called from `site` */
+void profile_leave(const char *name, void *site, unsigned long long start);
+
+/*
+  ISRs are counted on their own rather than as part of the call they
+  land in. Give profile_end_interrupts() what profile_begin_interrupts()
+  gave you.
+ */
+int profile_begin_interrupts();
+void profile_end_interrupts(int depth);
+
+/* Count a loop() iteration */
+void profile_loop();
+
+#endif
@@ -0,0 +1,95 @@
+/* Copyright (C) 2013 Calvin Beck
+
+  Permission is hereby granted, free of charge, to any person
+  obtaining a copy of this software and associated documentation files
+  (the "Software"), to deal in the Software without restriction,
+  including without limitation the rights to use, copy, modify, merge,
+  publish, distribute, sublicense, and/or sell copies of the Software,
+  and to permit persons to whom the Software is furnished to do so,
+  subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be
+  included in all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+  EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+  MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+  NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+  BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+  ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+  CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+  SOFTWARE.
+
+*/
+
+#ifndef SPI_H
+#define SPI_H
+
+#include "Arduino.h"
+
+/* Data modes, only kept for compatibility */
+static const uint8_t SPI_MODE0 = 0x00;
+static const uint8_t SPI_MODE1 = 0x04;
+static const uint8_t SPI_MODE2 = 0x08;
+static const uint8_t SPI_MODE3 = 0x0C;
+
+/* Clock dividers, only kept for compatibility */
+static const uint8_t SPI_CLOCK_DIV2 = 0x04;
+static const uint8_t SPI_CLOCK_DIV4 = 0x00;
+static const uint8_t SPI_CLOCK_DIV8 = 0x05;
+static const uint8_t SPI_CLOCK_DIV16 = 0x01;
+static const uint8_t SPI_CLOCK_DIV32 = 0x06;
+static const uint8_t SPI_CLOCK_DIV64 = 0x02;
+static const uint8_t SPI_CLOCK_DIV128 = 0x03;
+
+
+class SPISettings {
+ public:
+    uint32_t clock;
+    uint8_t bit_order;
+    uint8_t data_mode;
+
+    SPISettings() {
+        this->clock = 4000000;
+        this->bit_order = MSBFIRST;
+        this->data_mode = SPI_MODE0;
+    }
+
+    SPISettings(uint32_t clock, uint8_t bit_order, uint8_t data_mode) {
+        this->clock = clock;
+        this->bit_order = bit_order;
+        this->data_mode = data_mode;
+    }
+};
+
+
+/*
+  SPI. Each transfer goes to the server as one command, and it shifts
+  the bytes through whichever device is selected by one of this
+  Arduino's pins being driven LOW. Devices see bytes MSB first, so
+  with LSBFIRST the bits are reversed on the way through.
+ */
+class SPIClass {
+ private:
+    uint8_t bit_order;
+ public:
+    SPIClass();
+
+    void begin();
+    void end();
+
+    void beginTransaction(SPISettings settings);
+    void endTransaction();
+
+    void setBitOrder(uint8_t order);
+    void setDataMode(uint8_t mode);
+    void setClockDivider(uint8_t divider);
+
+    uint8_t transfer(uint8_t value);
+    uint16_t transfer16(uint16_t value);
+    void transfer(void *buffer, size_t count);
+};
+
+extern SPIClass SPI;
+
+#endif
@@ -0,0 +1,69 @@
+/* Copyright (C) 2013 Calvin Beck
+
+  Permission is hereby granted, free of charge, to any person
+  obtaining a copy of this software and associated documentation files
+  (the "Software"), to deal in the Software without restriction,
+  including without limitation the rights to use, copy, modify, merge,
+  publish, distribute, sublicense, and/or sell copies of the Software,
+  and to permit persons to whom the Software is furnished to do so,
+  subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be
+  included in all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+  EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+  MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+  NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+  BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+  ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+  CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+  SOFTWARE.
+
+*/
+
+#ifndef SOFTWARE_SERIAL_H
+#define SOFTWARE_SERIAL_H
+
+#include "Arduino.h"
+
+
+/*
+  SoftwareSerial, on any pair of pins. The pins behave as they do on
+  the real thing (TX idles HIGH, RX is pulled up), so the port can be
+  wired to anything with 'p' connections. Between two SoftwareSerial
+  ports the server passes whole bytes, and the bits are only sent on
+  the TX pin, timed with delayMicroseconds, when a plain input is
+  listening to it too.
+
+  Reads come from a serial port of its own on the server, so
+  everything but write() is FakeSerial's.
+ */
+class SoftwareSerial : public FakeSerial {
+ private:
+    uint8_t rx_pin;
+    uint8_t tx_pin;
+    int inverse;
+    unsigned long bit_micros;
+
+    void write_bits(uint8_t value);
+ public:
+    SoftwareSerial(uint8_t rx, uint8_t tx, bool inverse_logic = false);
+
+    void begin(long speed);
+    void end();
+
+    bool listen();
+    bool isListening();
+    bool stopListening();
+    bool overflow();
+
+    size_t write(uint8_t value);
+    using FakeSerial::write;
+
+    operator bool() {
+        return true;
+    }
+};
+
+#endif
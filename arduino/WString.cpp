@@ -0,0 +1,905 @@
+/* Copyright (C) 2013 Calvin Beck
+
+  Permission is hereby granted, free of charge, to any person
+  obtaining a copy of this software and associated documentation files
+  (the "Software"), to deal in the Software without restriction,
+  including without limitation the rights to use, copy, modify, merge,
+  publish, distribute, sublicense, and/or sell copies of the Software,
+  and to permit persons to whom the Software is furnished to do so,
+  subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be
+  included in all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+  EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+  MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+  NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+  BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+  ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+  CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+  SOFTWARE.
+
+*/
+
+#include "WString.h"
+#include "commands.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+
+/*
+  The String heap.
+
+  A first-fit heap in one fixed arena, much like avr-libc's malloc:
+  every block has a header with its size, free blocks next to each
+  other are always merged, and a block that is freed or grown in place
+  is merged with its neighbours. The arena is small enough that
+  walking it is cheap, so the figures in `stats` are kept exact.
+ */
+
+/* The Mega's SRAM, and the most the 16 bit block sizes can cover */
+static const size_t DEFAULT_HEAP = 8192;
+static const size_t MAX_HEAP = 65532;
+
+typedef struct HeapBlock {
+    uint16_t size;  /* Of the whole block, header and all */
+    uint16_t free;
+} HeapBlock;
+
+static uint8_t *heap = NULL;
+static size_t heap_size = 0;
+
+/* Shared with the launcher through EMULARD_HEAP_FD if it gave us one */
+static HeapStats local_stats;
+static HeapStats *stats = &local_stats;
+
+
+static void heap_init() {
+    const char *size = getenv("EMULARD_HEAP");
+    heap_size = NULL != size ? strtoul(size, NULL, 0) : DEFAULT_HEAP;
+
+    if (heap_size > MAX_HEAP) {
+        heap_size = MAX_HEAP;
+    }
+    else if (heap_size < 2 * sizeof(HeapBlock)) {
+        heap_size = 2 * sizeof(HeapBlock);
+    }
+
+    heap_size &= ~(size_t)3;
+
+#ifdef EMULARD_DIRECT
+    /* With the other globals, so it goes back to how it was along with the Strings using it */
+    static uint8_t arena[MAX_HEAP];
+    heap = arena;
+#else
+    heap = (uint8_t *)malloc(heap_size);
+#endif
+
+    if (NULL == heap) {
+        perror("Could not allocate the String heap");
+        exit(EXIT_FAILURE);
+    }
+
+    HeapBlock *first = (HeapBlock *)heap;
+    first->size = heap_size;
+    first->free = 1;
+
+    const char *fd = getenv("EMULARD_HEAP_FD");
+
+    if (NULL != fd) {
+        void *shared = mmap(NULL, sizeof(HeapStats), PROT_READ | PROT_WRITE, MAP_SHARED, atoi(fd), 0);
+
+        if (MAP_FAILED != shared) {
+            stats = (HeapStats *)shared;
+        }
+
+        close(atoi(fd));
+    }
+
+    memset(stats, 0, sizeof(*stats));
+    stats->size = heap_size;
+    stats->free_blocks = 1;
+    stats->largest_free = heap_size - sizeof(HeapBlock);
+}
+
+
+static HeapBlock *next_block(HeapBlock *block) {
+    return (HeapBlock *)((uint8_t *)block + block->size);
+}
+
+
+static int in_heap(HeapBlock *block) {
+    return (uint8_t *)block < heap + heap_size;
+}
+
+
+/* Size of the block for `size` bytes, kept to 4 byte multiples */
+static size_t block_size(size_t size) {
+    return (size + sizeof(HeapBlock) + 3) & ~(size_t)3;
+}
+
+
+/* Give anything past the first `size` bytes of a block back as a free block */
+static void split_block(HeapBlock *block, size_t size) {
+    if (block->size - size < 2 * sizeof(HeapBlock)) {
+        return;
+    }
+
+    HeapBlock *rest = (HeapBlock *)((uint8_t *)block + size);
+    rest->size = block->size - size;
+    rest->free = 1;
+
+    block->size = size;
+
+    /* Whatever came after the block might have been free too */
+    HeapBlock *after = next_block(rest);
+
+    if (in_heap(after) && after->free) {
+        rest->size += after->size;
+    }
+}
+
+
+/* Merge free neighbours, and count up the free space */
+static void heap_update() {
+    uint32_t free_blocks = 0;
+    uint32_t largest_free = 0;
+
+    for (HeapBlock *block = (HeapBlock *)heap; in_heap(block); block = next_block(block)) {
+        if (!block->free) {
+            continue;
+        }
+
+        for (HeapBlock *after = next_block(block); in_heap(after) && after->free; after = next_block(block)) {
+            block->size += after->size;
+        }
+
+        ++free_blocks;
+
+        if (block->size - sizeof(HeapBlock) > largest_free) {
+            largest_free = block->size - sizeof(HeapBlock);
+        }
+    }
+
+    stats->free_blocks = free_blocks;
+    stats->largest_free = largest_free;
+
+    if (stats->used > stats->peak) {
+        stats->peak = stats->used;
+    }
+}
+
+
+static void *heap_alloc(size_t size) {
+    if (NULL == heap) {
+        heap_init();
+    }
+
+    size_t needed = block_size(size);
+
+    for (HeapBlock *block = (HeapBlock *)heap; in_heap(block); block = next_block(block)) {
+        if (!block->free || block->size < needed) {
+            continue;
+        }
+
+        split_block(block, needed);
+        block->free = 0;
+
+        stats->used += block->size;
+        heap_update();
+
+        return block + 1;
+    }
+
+    ++stats->failures;
+    return NULL;
+}
+
+
+static void heap_free(void *memory) {
+    if (NULL == memory) {
+        return;
+    }
+
+    HeapBlock *block = (HeapBlock *)memory - 1;
+
+    block->free = 1;
+    stats->used -= block->size;
+
+    heap_update();
+}
+
+
+/* Grows in place when the next block is free, and moves otherwise */
+static void *heap_realloc(void *memory, size_t size) {
+    if (NULL == memory) {
+        return heap_alloc(size);
+    }
+
+    HeapBlock *block = (HeapBlock *)memory - 1;
+    size_t needed = block_size(size);
+
+    if (block->size >= needed) {
+        return memory;
+    }
+
+    HeapBlock *after = next_block(block);
+
+    if (in_heap(after) && after->free && block->size + after->size >= needed) {
+        stats->used -= block->size;
+
+        block->size += after->size;
+        split_block(block, needed);
+
+        stats->used += block->size;
+        heap_update();
+
+        return memory;
+    }
+
+    void *moved = heap_alloc(size);
+
+    if (NULL == moved) {
+        return NULL;
+    }
+
+    memcpy(moved, memory, block->size - sizeof(HeapBlock));
+    heap_free(memory);
+
+    return moved;
+}
+
+
+void stringHeapStats(StringHeapStats *heap_stats) {
+    if (NULL == heap) {
+        heap_init();
+    }
+
+    heap_stats->size = stats->size;
+    heap_stats->used = stats->used;
+    heap_stats->peak = stats->peak;
+    heap_stats->free_blocks = stats->free_blocks;
+    heap_stats->largest_free = stats->largest_free;
+    heap_stats->failures = stats->failures;
+}
+
+
+/*
+  String.
+ */
+
+void String::init() {
+    buffer = inline_buffer;
+    capacity = INLINE_CAPACITY;
+    len = 0;
+    inline_buffer[0] = '\0';
+}
+
+
+void String::release() {
+    if (buffer != inline_buffer) {
+        heap_free(buffer);
+    }
+
+    this->init();
+}
+
+
+unsigned char String::reserve(unsigned int size) {
+    if (size <= capacity) {
+        return 1;
+    }
+
+    /* At least double, so a String built up bit by bit isn't moved every time */
+    unsigned int grown = capacity * 2 > size ? capacity * 2 : size;
+    char *memory = NULL;
+
+    if (buffer == inline_buffer) {
+        memory = (char *)heap_alloc(grown + 1);
+
+        if (NULL == memory && grown > size) {
+            grown = size;
+            memory = (char *)heap_alloc(grown + 1);
+        }
+
+        if (NULL != memory) {
+            memcpy(memory, buffer, len + 1);
+        }
+    }
+    else {
+        memory = (char *)heap_realloc(buffer, grown + 1);
+
+        if (NULL == memory && grown > size) {
+            grown = size;
+            memory = (char *)heap_realloc(buffer, grown + 1);
+        }
+    }
+
+    if (NULL == memory) {
+        return 0;
+    }
+
+    buffer = memory;
+    capacity = grown;
+
+    return 1;
+}
+
+
+String &String::copy(const char *str, unsigned int length) {
+    if (!this->reserve(length)) {
+        return *this;
+    }
+
+    memmove(buffer, str, length);
+    buffer[length] = '\0';
+    len = length;
+
+    return *this;
+}
+
+
+void String::set_unsigned(unsigned long value, int base) {
+    char digits[8 * sizeof(value) + 1];
+    char *start = digits + sizeof(digits) - 1;
+
+    if (base < 2 || base > 36) {
+        base = 10;
+    }
+
+    *start = '\0';
+
+    do {
+        int digit = value % base;
+        *--start = digit < 10 ? '0' + digit : 'a' + digit - 10;
+        value /= base;
+    } while (value);
+
+    this->copy(start, digits + sizeof(digits) - 1 - start);
+}
+
+
+/* Only base 10 gets a sign, like itoa */
+void String::set_number(long value, int base) {
+    if (10 != base || value >= 0) {
+        this->set_unsigned(value, base);
+        return;
+    }
+
+    this->set_unsigned(-(unsigned long)value, base);
+
+    if (this->reserve(len + 1)) {
+        memmove(buffer + 1, buffer, len + 1);
+        buffer[0] = '-';
+        ++len;
+    }
+}
+
+
+void String::set_decimal(double value, unsigned char decimals) {
+    char digits[64];
+    int length = snprintf(digits, sizeof(digits), "%.*f", decimals, value);
+
+    if (length >= (int)sizeof(digits)) {
+        length = sizeof(digits) - 1;
+    }
+
+    this->copy(digits, length);
+}
+
+
+String::String(const char *str) {
+    this->init();
+
+    if (NULL != str) {
+        this->copy(str, strlen(str));
+    }
+}
+
+
+String::String(const String &str) {
+    this->init();
+    this->copy(str.buffer, str.len);
+}
+
+
+String::String(char c) {
+    this->init();
+    this->copy(&c, 1);
+}
+
+
+String::String(unsigned char value, unsigned char base) {
+    this->init();
+    this->set_unsigned(value, base);
+}
+
+
+String::String(int value, unsigned char base) {
+    this->init();
+    this->set_number(value, base);
+}
+
+
+String::String(unsigned int value, unsigned char base) {
+    this->init();
+    this->set_unsigned(value, base);
+}
+
+
+String::String(long value, unsigned char base) {
+    this->init();
+    this->set_number(value, base);
+}
+
+
+String::String(unsigned long value, unsigned char base) {
+    this->init();
+    this->set_unsigned(value, base);
+}
+
+
+String::String(float value, unsigned char decimals) {
+    this->init();
+    this->set_decimal(value, decimals);
+}
+
+
+String::String(double value, unsigned char decimals) {
+    this->init();
+    this->set_decimal(value, decimals);
+}
+
+
+#if __cplusplus >= 201103L
+String::String(String &&str) {
+    this->init();
+    *this = static_cast<String &&>(str);
+}
+
+
+String &String::operator=(String &&str) {
+    if (this == &str) {
+        return *this;
+    }
+
+    if (str.buffer == str.inline_buffer) {
+        return this->copy(str.buffer, str.len);
+    }
+
+    /* Take its heap buffer, and leave it empty */
+    this->release();
+
+    buffer = str.buffer;
+    capacity = str.capacity;
+    len = str.len;
+
+    str.init();
+
+    return *this;
+}
+#endif
+
+
+String::~String() {
+    this->release();
+}
+
+
+String &String::operator=(const String &str) {
+    if (this == &str) {
+        return *this;
+    }
+
+    return this->copy(str.buffer, str.len);
+}
+
+
+String &String::operator=(const char *str) {
+    if (NULL == str) {
+        return this->copy("", 0);
+    }
+
+    return this->copy(str, strlen(str));
+}
+
+
+unsigned char String::concat(const char *str, unsigned int length) {
+    if (NULL == str) {
+        return 0;
+    }
+
+    /* Appending part of ourselves has to survive the buffer moving */
+    size_t offset = str - buffer;
+    int own = str >= buffer && str <= buffer + len;
+
+    if (!this->reserve(len + length)) {
+        return 0;
+    }
+
+    if (own) {
+        str = buffer + offset;
+    }
+
+    memmove(buffer + len, str, length);
+    len += length;
+    buffer[len] = '\0';
+
+    return 1;
+}
+
+
+unsigned char String::concat(const String &str) {
+    return this->concat(str.buffer, str.len);
+}
+
+
+unsigned char String::concat(const char *str) {
+    return NULL == str ? 0 : this->concat(str, strlen(str));
+}
+
+
+unsigned char String::concat(char c) {
+    return this->concat(&c, 1);
+}
+
+
+unsigned char String::concat(unsigned char value) {
+    return this->concat(String(value));
+}
+
+
+unsigned char String::concat(int value) {
+    return this->concat(String(value));
+}
+
+
+unsigned char String::concat(unsigned int value) {
+    return this->concat(String(value));
+}
+
+
+unsigned char String::concat(long value) {
+    return this->concat(String(value));
+}
+
+
+unsigned char String::concat(unsigned long value) {
+    return this->concat(String(value));
+}
+
+
+unsigned char String::concat(float value) {
+    return this->concat(String(value));
+}
+
+
+unsigned char String::concat(double value) {
+    return this->concat(String(value));
+}
+
+
+int String::compareTo(const String &str) const {
+    return strcmp(buffer, str.buffer);
+}
+
+
+unsigned char String::equals(const String &str) const {
+    return len == str.len && 0 == strcmp(buffer, str.buffer);
+}
+
+
+unsigned char String::equals(const char *str) const {
+    return 0 == strcmp(buffer, NULL == str ? "" : str);
+}
+
+
+unsigned char String::equalsIgnoreCase(const String &str) const {
+    if (len != str.len) {
+        return 0;
+    }
+
+    for (unsigned int i = 0; i < len; ++i) {
+        if (tolower((unsigned char)buffer[i]) != tolower((unsigned char)str.buffer[i])) {
+            return 0;
+        }
+    }
+
+    return 1;
+}
+
+
+unsigned char String::startsWith(const String &prefix) const {
+    return this->startsWith(prefix, 0);
+}
+
+
+unsigned char String::startsWith(const String &prefix, unsigned int offset) const {
+    if (offset > len || prefix.len > len - offset) {
+        return 0;
+    }
+
+    return 0 == strncmp(buffer + offset, prefix.buffer, prefix.len);
+}
+
+
+unsigned char String::endsWith(const String &suffix) const {
+    if (suffix.len > len) {
+        return 0;
+    }
+
+    return 0 == strcmp(buffer + len - suffix.len, suffix.buffer);
+}
+
+
+char String::charAt(unsigned int index) const {
+    return index < len ? buffer[index] : 0;
+}
+
+
+void String::setCharAt(unsigned int index, char c) {
+    if (index < len) {
+        buffer[index] = c;
+    }
+}
+
+
+char String::operator[](unsigned int index) const {
+    return this->charAt(index);
+}
+
+
+/* Out of range, like the real thing, this gives something harmless to write to */
+char &String::operator[](unsigned int index) {
+    static char dummy;
+
+    if (index >= len) {
+        dummy = 0;
+        return dummy;
+    }
+
+    return buffer[index];
+}
+
+
+void String::getBytes(unsigned char *bytes, unsigned int size, unsigned int index) const {
+    if (NULL == bytes || 0 == size) {
+        return;
+    }
+
+    if (index >= len) {
+        bytes[0] = '\0';
+        return;
+    }
+
+    unsigned int count = len - index < size - 1 ? len - index : size - 1;
+
+    memcpy(bytes, buffer + index, count);
+    bytes[count] = '\0';
+}
+
+
+void String::toCharArray(char *chars, unsigned int size, unsigned int index) const {
+    this->getBytes((unsigned char *)chars, size, index);
+}
+
+
+int String::indexOf(char c) const {
+    return this->indexOf(c, 0);
+}
+
+
+int String::indexOf(char c, unsigned int from) const {
+    if (from >= len) {
+        return -1;
+    }
+
+    const char *found = (const char *)memchr(buffer + from, c, len - from);
+
+    return NULL == found ? -1 : found - buffer;
+}
+
+
+int String::indexOf(const String &str) const {
+    return this->indexOf(str, 0);
+}
+
+
+int String::indexOf(const String &str, unsigned int from) const {
+    if (from >= len) {
+        return -1;
+    }
+
+    const char *found = strstr(buffer + from, str.buffer);
+
+    return NULL == found ? -1 : found - buffer;
+}
+
+
+int String::lastIndexOf(char c) const {
+    return this->lastIndexOf(c, len - 1);
+}
+
+
+int String::lastIndexOf(char c, unsigned int from) const {
+    if (from >= len) {
+        return -1;
+    }
+
+    for (int i = from; i >= 0; --i) {
+        if (c == buffer[i]) {
+            return i;
+        }
+    }
+
+    return -1;
+}
+
+
+int String::lastIndexOf(const String &str) const {
+    return this->lastIndexOf(str, len - str.len);
+}
+
+
+int String::lastIndexOf(const String &str, unsigned int from) const {
+    if (0 == str.len || str.len > len) {
+        return -1;
+    }
+
+    if (from > len - str.len) {
+        from = len - str.len;
+    }
+
+    for (int i = from; i >= 0; --i) {
+        if (0 == strncmp(buffer + i, str.buffer, str.len)) {
+            return i;
+        }
+    }
+
+    return -1;
+}
+
+
+String String::substring(unsigned int from) const {
+    return this->substring(from, len);
+}
+
+
+String String::substring(unsigned int from, unsigned int to) const {
+    String part;
+
+    if (from > to) {
+        unsigned int swap = from;
+        from = to;
+        to = swap;
+    }
+
+    if (from >= len) {
+        return part;
+    }
+
+    if (to > len) {
+        to = len;
+    }
+
+    part.copy(buffer + from, to - from);
+
+    return part;
+}
+
+
+void String::replace(char find, char replacement) {
+    for (unsigned int i = 0; i < len; ++i) {
+        if (find == buffer[i]) {
+            buffer[i] = replacement;
+        }
+    }
+}
+
+
+/* In place, after making room for the longer result if it needs it */
+void String::replace(const String &find, const String &replacement) {
+    if (0 == find.len) {
+        return;
+    }
+
+    if (this == &find || this == &replacement) {
+        String find_copy(find);
+        String replacement_copy(replacement);
+
+        this->replace(find_copy, replacement_copy);
+        return;
+    }
+
+    unsigned int count = 0;
+
+    for (const char *found = strstr(buffer, find.buffer); NULL != found; found = strstr(found + find.len, find.buffer)) {
+        ++count;
+    }
+
+    if (0 == count || !this->reserve(len - count * find.len + count * replacement.len)) {
+        return;
+    }
+
+    for (char *found = strstr(buffer, find.buffer); NULL != found; found = strstr(found + replacement.len, find.buffer)) {
+        memmove(found + replacement.len, found + find.len, buffer + len - (found + find.len) + 1);
+        memcpy(found, replacement.buffer, replacement.len);
+
+        len = len - find.len + replacement.len;
+    }
+}
+
+
+void String::remove(unsigned int index) {
+    if (index < len) {
+        this->remove(index, len - index);
+    }
+}
+
+
+void String::remove(unsigned int index, unsigned int count) {
+    if (index >= len) {
+        return;
+    }
+
+    if (count > len - index) {
+        count = len - index;
+    }
+
+    memmove(buffer + index, buffer + index + count, len - index - count + 1);
+    len -= count;
+}
+
+
+void String::toLowerCase() {
+    for (unsigned int i = 0; i < len; ++i) {
+        buffer[i] = tolower((unsigned char)buffer[i]);
+    }
+}
+
+
+void String::toUpperCase() {
+    for (unsigned int i = 0; i < len; ++i) {
+        buffer[i] = toupper((unsigned char)buffer[i]);
+    }
+}
+
+
+void String::trim() {
+    unsigned int start = 0;
+
+    while (start < len && isspace((unsigned char)buffer[start])) {
+        ++start;
+    }
+
+    unsigned int end = len;
+
+    while (end > start && isspace((unsigned char)buffer[end - 1])) {
+        --end;
+    }
+
+    len = end - start;
+    memmove(buffer, buffer + start, len);
+    buffer[len] = '\0';
+}
+
+
+long String::toInt() const {
+    return atol(buffer);
+}
+
+
+float String::toFloat() const {
+    return atof(buffer);
+}
+
+
+double String::toDouble() const {
+    return atof(buffer);
+}
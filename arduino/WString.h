@@ -0,0 +1,206 @@
+/* Copyright (C) 2013 Calvin Beck
+
+  Permission is hereby granted, free of charge, to any person
+  obtaining a copy of this software and associated documentation files
+  (the "Software"), to deal in the Software without restriction,
+  including without limitation the rights to use, copy, modify, merge,
+  publish, distribute, sublicense, and/or sell copies of the Software,
+  and to permit persons to whom the Software is furnished to do so,
+  subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be
+  included in all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+  EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+  MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+  NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+  BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+  ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+  CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+  SOFTWARE.
+
+*/
+
+#ifndef WSTRING_H
+#define WSTRING_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+
+/*
+  The heap Strings come from. It's a fixed arena the size of the
+  Mega's 8K of SRAM (or EMULARD_HEAP bytes), so a sketch that would
+  run out of memory on the board runs out here too, and a String that
+  can't get the memory it wants is left as it was. stringHeapStats()
+  gives the sketch the figures the launcher reports at the end of a
+  run.
+ */
+typedef struct StringHeapStats {
+    size_t size;          /* Bytes in the arena */
+    size_t used;          /* Allocated, headers and all */
+    size_t peak;          /* Most that has ever been used */
+    size_t free_blocks;   /* Pieces the free space is in */
+    size_t largest_free;  /* Biggest allocation that would fit */
+    size_t failures;      /* Allocations that didn't */
+} StringHeapStats;
+
+void stringHeapStats(StringHeapStats *stats);
+
+
+/*
+  Arduino's String. Short strings live inside the String itself, and
+  only longer ones go to the heap, which a String's buffer grows in by
+  at least doubling so that += isn't a reallocation every time.
+ */
+class String {
+ private:
+    static const unsigned int INLINE_CAPACITY = 15;
+
+    char *buffer;
+    unsigned int capacity;  /* Not counting the '\0' */
+    unsigned int len;
+    char inline_buffer[INLINE_CAPACITY + 1];
+
+    void init();
+    void release();
+    String &copy(const char *str, unsigned int length);
+    void set_number(long value, int base);
+    void set_unsigned(unsigned long value, int base);
+    void set_decimal(double value, unsigned char decimals);
+ public:
+    String(const char *str = "");
+    String(const String &str);
+    explicit String(char c);
+    explicit String(unsigned char value, unsigned char base = 10);
+    explicit String(int value, unsigned char base = 10);
+    explicit String(unsigned int value, unsigned char base = 10);
+    explicit String(long value, unsigned char base = 10);
+    explicit String(unsigned long value, unsigned char base = 10);
+    explicit String(float value, unsigned char decimals = 2);
+    explicit String(double value, unsigned char decimals = 2);
+#if __cplusplus >= 201103L
+    String(String &&str);
+    String &operator=(String &&str);
+#endif
+    ~String();
+
+    /* Returns 0 if the memory isn't there, and the String is unchanged */
+    unsigned char reserve(unsigned int size);
+
+    unsigned int length() const {
+        return len;
+    }
+
+    String &operator=(const String &str);
+    String &operator=(const char *str);
+
+    unsigned char concat(const String &str);
+    unsigned char concat(const char *str);
+    unsigned char concat(const char *str, unsigned int length);
+    unsigned char concat(char c);
+    unsigned char concat(unsigned char value);
+    unsigned char concat(int value);
+    unsigned char concat(unsigned int value);
+    unsigned char concat(long value);
+    unsigned char concat(unsigned long value);
+    unsigned char concat(float value);
+    unsigned char concat(double value);
+
+    template <typename T> String &operator+=(const T &value) {
+        this->concat(value);
+        return *this;
+    }
+
+    int compareTo(const String &str) const;
+    unsigned char equals(const String &str) const;
+    unsigned char equals(const char *str) const;
+    unsigned char equalsIgnoreCase(const String &str) const;
+    unsigned char startsWith(const String &prefix) const;
+    unsigned char startsWith(const String &prefix, unsigned int offset) const;
+    unsigned char endsWith(const String &suffix) const;
+
+    unsigned char operator==(const String &str) const {
+        return this->equals(str);
+    }
+
+    unsigned char operator==(const char *str) const {
+        return this->equals(str);
+    }
+
+    unsigned char operator!=(const String &str) const {
+        return !this->equals(str);
+    }
+
+    unsigned char operator!=(const char *str) const {
+        return !this->equals(str);
+    }
+
+    unsigned char operator<(const String &str) const {
+        return this->compareTo(str) < 0;
+    }
+
+    unsigned char operator>(const String &str) const {
+        return this->compareTo(str) > 0;
+    }
+
+    unsigned char operator<=(const String &str) const {
+        return this->compareTo(str) <= 0;
+    }
+
+    unsigned char operator>=(const String &str) const {
+        return this->compareTo(str) >= 0;
+    }
+
+    char charAt(unsigned int index) const;
+    void setCharAt(unsigned int index, char c);
+    char operator[](unsigned int index) const;
+    char &operator[](unsigned int index);
+
+    void getBytes(unsigned char *buffer, unsigned int size, unsigned int index = 0) const;
+    void toCharArray(char *buffer, unsigned int size, unsigned int index = 0) const;
+
+    const char *c_str() const {
+        return buffer;
+    }
+
+    int indexOf(char c) const;
+    int indexOf(char c, unsigned int from) const;
+    int indexOf(const String &str) const;
+    int indexOf(const String &str, unsigned int from) const;
+    int lastIndexOf(char c) const;
+    int lastIndexOf(char c, unsigned int from) const;
+    int lastIndexOf(const String &str) const;
+    int lastIndexOf(const String &str, unsigned int from) const;
+
+    String substring(unsigned int from) const;
+    String substring(unsigned int from, unsigned int to) const;
+
+    void replace(char find, char replacement);
+    void replace(const String &find, const String &replacement);
+    void remove(unsigned int index);
+    void remove(unsigned int index, unsigned int count);
+    void toLowerCase();
+    void toUpperCase();
+    void trim();
+
+    long toInt() const;
+    float toFloat() const;
+    double toDouble() const;
+};
+
+
+/* Sums build on the left hand String, so a + b + c is one growing buffer */
+template <typename T> String operator+(String lhs, const T &rhs) {
+    lhs.concat(rhs);
+    return lhs;
+}
+
+inline String operator+(const char *lhs, const String &rhs) {
+    String sum(lhs);
+    sum.concat(rhs);
+    return sum;
+}
+
+#endif
@@ -0,0 +1,93 @@
+/* Copyright (C) 2013 Calvin Beck
+
+  Permission is hereby granted, free of charge, to any person
+  obtaining a copy of this software and associated documentation files
+  (the "Software"), to deal in the Software without restriction,
+  including without limitation the rights to use, copy, modify, merge,
+  publish, distribute, sublicense, and/or sell copies of the Software,
+  and to permit persons to whom the Software is furnished to do so,
+  subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be
+  included in all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+  EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+  MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+  NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+  BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+  ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+  CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+  SOFTWARE.
+
+*/
+
+#ifndef WIRE_H
+#define WIRE_H
+
+#include "Arduino.h"
+
+/* Bytes in a transmission or request, the same as the real Wire */
+#define BUFFER_LENGTH 32
+
+
+/*
+  Wire (I2C). Transmissions and requests go to the server whole, one
+  command each, and it hands them to whatever is at the address on
+  this Arduino's bus: a device model, or another Arduino that called
+  begin(address), whose onReceive and onRequest handlers run like
+  interrupts.
+ */
+class TwoWire {
+ private:
+    uint8_t transmit_address;
+    uint8_t transmit_buffer[BUFFER_LENGTH];
+    uint8_t transmit_length;
+    int transmitting;
+
+    uint8_t response_buffer[BUFFER_LENGTH];
+    uint8_t response_length;
+    int responding;
+
+    uint8_t receive_buffer[BUFFER_LENGTH];
+    uint8_t receive_length;
+    uint8_t receive_index;
+
+    void (*receive_handler)(int);
+    void (*request_handler)(void);
+ public:
+    TwoWire();
+
+    void begin();
+    void begin(uint8_t address);
+    void begin(int address);
+    void setClock(uint32_t frequency);
+
+    void beginTransmission(uint8_t address);
+    void beginTransmission(int address);
+    uint8_t endTransmission();
+    uint8_t endTransmission(uint8_t stop);
+
+    uint8_t requestFrom(uint8_t address, uint8_t quantity);
+    uint8_t requestFrom(uint8_t address, uint8_t quantity, uint8_t stop);
+    uint8_t requestFrom(int address, int quantity);
+    uint8_t requestFrom(int address, int quantity, int stop);
+
+    size_t write(uint8_t value);
+    size_t write(const uint8_t *data, size_t length);
+
+    int available();
+    int read();
+    int peek();
+
+    void onReceive(void (*handler)(int));
+    void onRequest(void (*handler)(void));
+
+    /* Events from the server, for when this Arduino is a target */
+    void receive_event();
+    void request_event();
+};
+
+extern TwoWire Wire;
+
+#endif
@@ -0,0 +1,46 @@
+/* Copyright (C) 2013 Calvin Beck
+
+  Permission is hereby granted, free of charge, to any person
+  obtaining a copy of this software and associated documentation files
+  (the "Software"), to deal in the Software without restriction,
+  including without limitation the rights to use, copy, modify, merge,
+  publish, distribute, sublicense, and/or sell copies of the Software,
+  and to permit persons to whom the Software is furnished to do so,
+  subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be
+  included in all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+  EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+  MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+  NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+  BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+  ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+  CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+  SOFTWARE.
+
+*/
+
+#ifndef BENCH_H
+#define BENCH_H
+
+/*
+  Workload sizes shared by the benchmark sketches and emulard_bench,
+  which needs them to turn run times into rates.
+ */
+
+/* Commands each read / write sketch sends per loop() */
+#define BENCH_COMMANDS_PER_LOOP 1000
+
+/* Bytes sent over the serial link, and how the receiver acknowledges
+   them. The sender never has more than BENCH_SERIAL_WINDOW bytes
+   outstanding, so the 64 byte serial buffers never drop anything. */
+#define BENCH_SERIAL_BYTES 20000
+#define BENCH_SERIAL_WINDOW 32
+#define BENCH_SERIAL_ACK 16
+
+/* Pin a sketch sets HIGH once it is done */
+#define BENCH_DONE_PIN 13
+
+#endif
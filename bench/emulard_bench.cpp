@@ -0,0 +1,741 @@
+/* Copyright (C) 2013 Calvin Beck
+
+  Permission is hereby granted, free of charge, to any person
+  obtaining a copy of this software and associated documentation files
+  (the "Software"), to deal in the Software without restriction,
+  including without limitation the rights to use, copy, modify, merge,
+  publish, distribute, sublicense, and/or sell copies of the Software,
+  and to permit persons to whom the Software is furnished to do so,
+  subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be
+  included in all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+  EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+  MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+  NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+  BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+  ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+  CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+  SOFTWARE.
+
+*/
+
+/*
+  Benchmarks for emulard.
+
+  Measures the protocol and the network server from the outside, by
+  running the benchmark sketches (headless, with virtual time) and
+  timing them, and measures the network data structures from the
+  inside, by parsing generated .ard files and propagating pins on
+  them directly. Results go out as JSON so that runs can be compared.
+
+  Times for whole runs are medians over a number of repeats, with the
+  time it takes to start and stop the same number of idle Arduinos
+  taken off, so what is left is the work itself.
+ */
+
+#include "bench.h"
+#include "../networking/network_parse.h"
+#include "../networking/network_image.h"
+#include "../networking/network_nets.h"
+#include "../networking/network_wheel.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+
+/* Loops the read and write sketches run for */
+#define BENCH_LOOPS 200
+
+/* Node counts for launch and fire and forget runs */
+static const size_t LAUNCH_NODES[] = {1, 2, 4, 8, 16, 32, 64};
+static const size_t WRITE_NODES[] = {1, 2, 4, 8};
+
+/* Network sizes for parsing and pin propagation */
+static const size_t NETWORK_NODES[] = {1000, 10000, 100000};
+static const size_t NETWORK_DEGREES[] = {2, 8, 32};
+
+/* Pin changes are timed for up to this many, or this long */
+#define PROPAGATIONS 1000000
+#define PROPAGATION_SECONDS 1.0
+
+/* Events in flight on the timing wheel, each up to WHEEL_SPREAD microseconds off */
+static const size_t WHEEL_PENDING[] = {1000, 100000, 1000000};
+#define WHEEL_SPREAD 10000
+#define WHEEL_EVENTS 4000000
+
+/*
+  Plain .ard files look every Arduino up by name, which is quadratic,
+  so skip parsing networks where that would take minutes.
+ */
+#define PARSE_LIMIT 1e9
+
+/* Any run that takes longer than this is broken */
+#define RUN_TIMEOUT 120
+
+#define NUM_ELEMENTS(array) (sizeof(array) / sizeof(array[0]))
+
+
+typedef struct BenchOptions {
+    const char *net_program;
+    const char *sketch_dir;
+    const char *work_dir;
+    int repeats;
+} BenchOptions;
+
+
+/* Results are written as they come in */
+static FILE *report = NULL;
+static int num_results = 0;
+
+
+static double now()
+{
+    struct timespec time;
+    clock_gettime(CLOCK_MONOTONIC, &time);
+
+    return time.tv_sec + time.tv_nsec / 1e9;
+}
+
+
+static void usage(char *program_name)
+{
+    fprintf(stderr, "Usage: %s [-n <arduino_net>] [-s <sketch directory>] [-w <work directory>] [-r <repeats>] [-o <results>.json]\n", program_name);
+}
+
+
+static void write_result(const char *name, size_t nodes, size_t edges, double value, const char *unit)
+{
+    fprintf(report, "%s\n    {\"name\": \"%s\", \"nodes\": %lu, \"edges\": %lu, \"value\": %.6g, \"unit\": \"%s\"}",
+            num_results ? "," : "", name, (unsigned long)nodes, (unsigned long)edges, value, unit);
+    fflush(report);
+
+    fprintf(stderr, "%-24s nodes=%-7lu edges=%-8lu %12.6g %s\n", name, (unsigned long)nodes, (unsigned long)edges, value, unit);
+
+    ++num_results;
+}
+
+
+/* Absolute path of one of the benchmark sketches (caller frees) */
+static char *sketch_path(BenchOptions *options, const char *sketch)
+{
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/%s", options->sketch_dir, sketch);
+
+    char *absolute = realpath(path, NULL);
+
+    if (NULL == absolute) {
+        fprintf(stderr, "Could not find sketch \"%s\"\n", path);
+        exit(EXIT_FAILURE);
+    }
+
+    return absolute;
+}
+
+
+/* Path of a scratch file in the work directory (caller frees) */
+static char *work_path(BenchOptions *options, const char *name)
+{
+    size_t length = strlen(options->work_dir) + strlen(name) + 2;
+    char *path = (char *)malloc(length);
+
+    snprintf(path, length, "%s/%s", options->work_dir, name);
+    return path;
+}
+
+
+/*
+  Run a program to completion with its output thrown away, and return
+  how long it took, or a negative number if it failed or hung.
+ */
+static double time_program(char **argv)
+{
+    sigset_t child_set;
+    sigemptyset(&child_set);
+    sigaddset(&child_set, SIGCHLD);
+
+    double start = now();
+    pid_t pid = fork();
+
+    if (-1 == pid) {
+        perror("Could not fork");
+        exit(EXIT_FAILURE);
+    }
+
+    if (0 == pid) {
+        /* Own process group, so a hung run goes down with its Arduinos */
+        setpgid(0, 0);
+        sigprocmask(SIG_UNBLOCK, &child_set, NULL);
+
+        int null = open("/dev/null", O_WRONLY);
+        dup2(null, STDOUT_FILENO);
+        dup2(null, STDERR_FILENO);
+
+        execv(argv[0], argv);
+        _exit(127);
+    }
+
+    setpgid(pid, pid);
+
+    struct timespec timeout = {RUN_TIMEOUT, 0};
+    int status = 0;
+
+    while (0 == waitpid(pid, &status, WNOHANG)) {
+        if (-1 == sigtimedwait(&child_set, NULL, &timeout)) {
+            fprintf(stderr, "%s timed out\n", argv[0]);
+            killpg(pid, SIGKILL);
+            waitpid(pid, NULL, 0);
+
+            return -1;
+        }
+    }
+
+    double elapsed = now() - start;
+
+    /* Anything left over from the run */
+    killpg(pid, SIGKILL);
+
+    if (!WIFEXITED(status) || 0 != WEXITSTATUS(status)) {
+        fprintf(stderr, "%s failed\n", argv[0]);
+        return -1;
+    }
+
+    return elapsed;
+}
+
+
+static int compare_doubles(const void *a, const void *b)
+{
+    double x = *(const double *)a;
+    double y = *(const double *)b;
+
+    return (x > y) - (x < y);
+}
+
+
+/* Median time over the repeats, or a negative number on failure */
+static double median_time(BenchOptions *options, char **argv)
+{
+    double *times = (double *)malloc(sizeof(times[0]) * options->repeats);
+
+    for (int i = 0; i < options->repeats; ++i) {
+        times[i] = time_program(argv);
+
+        if (times[i] < 0) {
+            free(times);
+            return -1;
+        }
+    }
+
+    qsort(times, options->repeats, sizeof(times[0]), compare_doubles);
+    double median = times[options->repeats / 2];
+
+    free(times);
+    return median;
+}
+
+
+/* Time a single headless sketch run for `loops` loops */
+static double time_sketch(BenchOptions *options, const char *sketch, unsigned long loops)
+{
+    char *path = sketch_path(options, sketch);
+    char loop_arg[32];
+
+    snprintf(loop_arg, sizeof(loop_arg), "%lu", loops);
+
+    char *argv[] = {path, (char *)"-H", (char *)"-l", loop_arg, NULL};
+    double time = median_time(options, argv);
+
+    free(path);
+    return time;
+}
+
+
+/* Write out a network of `count` copies of a sketch with no connections */
+static char *write_copies(BenchOptions *options, const char *sketch, size_t count)
+{
+    char name[64];
+    snprintf(name, sizeof(name), "%s_%lu.ard", sketch, (unsigned long)count);
+
+    char *path = work_path(options, name);
+    char *program = sketch_path(options, sketch);
+    FILE *file = fopen(path, "w");
+
+    if (NULL == file) {
+        perror("Could not write network");
+        exit(EXIT_FAILURE);
+    }
+
+    fprintf(file, "g line node:%s %lu\n", program, (unsigned long)count);
+    fclose(file);
+
+    free(program);
+    return path;
+}
+
+
+/* Time a headless arduino_net run with extra arguments */
+static double time_network(BenchOptions *options, const char *network, const char **args, int num_args)
+{
+    char *argv[16];
+    int argc = 0;
+
+    argv[argc++] = (char *)options->net_program;
+    argv[argc++] = (char *)"-H";
+
+    for (int i = 0; i < num_args; ++i) {
+        argv[argc++] = (char *)args[i];
+    }
+
+    argv[argc++] = (char *)network;
+    argv[argc] = NULL;
+
+    return median_time(options, argv);
+}
+
+
+/*
+  Time from starting arduino_net to every Arduino having finished a
+  loop, and everything being shut down again.
+ */
+static void bench_launch(BenchOptions *options, double *launch_times)
+{
+    for (size_t i = 0; i < NUM_ELEMENTS(LAUNCH_NODES); ++i) {
+        char *network = write_copies(options, "bench_idle", LAUNCH_NODES[i]);
+        const char *args[] = {"-l", "1"};
+
+        launch_times[i] = time_network(options, network, args, 2);
+
+        if (launch_times[i] >= 0) {
+            write_result("launch", LAUNCH_NODES[i], 0, launch_times[i] * 1e3, "ms");
+        }
+
+        unlink(network);
+        free(network);
+    }
+}
+
+
+/* Launch time for a network of `nodes` Arduinos */
+static double launch_time(double *launch_times, size_t nodes)
+{
+    for (size_t i = 0; i < NUM_ELEMENTS(LAUNCH_NODES); ++i) {
+        if (LAUNCH_NODES[i] == nodes) {
+            return launch_times[i];
+        }
+    }
+
+    return 0;
+}
+
+
+/* digitalRead waits on a reply from the server every time */
+static void bench_round_trip(BenchOptions *options)
+{
+    double startup = time_sketch(options, "bench_idle", 1);
+    double total = time_sketch(options, "bench_read", BENCH_LOOPS);
+
+    if (startup < 0 || total < 0) {
+        return;
+    }
+
+    double reads = (double)BENCH_LOOPS * BENCH_COMMANDS_PER_LOOP;
+
+    write_result("startup", 1, 0, startup * 1e3, "ms");
+    write_result("digital_read_round_trip", 1, 0, (total - startup) / reads * 1e9, "ns");
+}
+
+
+/* digitalWrite never waits, so this is how fast the server keeps up */
+static void bench_fire_and_forget(BenchOptions *options, double *launch_times)
+{
+    char loop_arg[32];
+    snprintf(loop_arg, sizeof(loop_arg), "%d", BENCH_LOOPS);
+
+    for (size_t i = 0; i < NUM_ELEMENTS(WRITE_NODES); ++i) {
+        size_t nodes = WRITE_NODES[i];
+        char *network = write_copies(options, "bench_write", nodes);
+        const char *args[] = {"-l", loop_arg};
+
+        double total = time_network(options, network, args, 2);
+        double work = total - launch_time(launch_times, nodes);
+
+        if (total >= 0 && work > 0) {
+            double commands = (double)BENCH_LOOPS * BENCH_COMMANDS_PER_LOOP;
+            write_result("fire_and_forget", nodes, 0, commands / work, "commands/s/node");
+        }
+
+        unlink(network);
+        free(network);
+    }
+}
+
+
+/* Pins set per second by digitalWrite, and by PORTA setting eight at once */
+static void bench_port_write(BenchOptions *options)
+{
+    double startup = time_sketch(options, "bench_idle", 1);
+    double single = time_sketch(options, "bench_write", BENCH_LOOPS);
+    double port = time_sketch(options, "bench_port_write", BENCH_LOOPS);
+
+    if (startup < 0 || single < 0 || port < 0) {
+        return;
+    }
+
+    double commands = (double)BENCH_LOOPS * BENCH_COMMANDS_PER_LOOP;
+
+    write_result("digital_write", 1, 0, commands / (single - startup), "pins/s");
+    write_result("port_write", 1, 0, commands * 8 / (port - startup), "pins/s");
+}
+
+
+/* Bytes per second over one serial link, with acknowledgements */
+static void bench_serial(BenchOptions *options, double *launch_times)
+{
+    char *path = work_path(options, "serial.ard");
+    char *send = sketch_path(options, "bench_serial_send");
+    char *receive = sketch_path(options, "bench_serial_receive");
+    FILE *file = fopen(path, "w");
+
+    if (NULL == file) {
+        perror("Could not write network");
+        exit(EXIT_FAILURE);
+    }
+
+    fprintf(file, "d send:%s\nd receive:%s\ns send:0 receive:0\n", send, receive);
+    fclose(file);
+
+    char goal[32];
+    snprintf(goal, sizeof(goal), "receive:%d=1", BENCH_DONE_PIN);
+
+    const char *args[] = {"-p", goal};
+    double total = time_network(options, path, args, 2);
+    double work = total - launch_time(launch_times, 2);
+
+    if (total >= 0 && work > 0) {
+        write_result("serial_throughput", 2, 1, BENCH_SERIAL_BYTES / work, "bytes/s");
+    }
+
+    unlink(path);
+
+    free(receive);
+    free(send);
+    free(path);
+}
+
+
+/* Write a parsed network back out as plain declarations and connections */
+static void write_flat(const char *path, ArduinoNetwork *network)
+{
+    FILE *file = fopen(path, "w");
+
+    if (NULL == file) {
+        perror("Could not write network");
+        exit(EXIT_FAILURE);
+    }
+
+    for (size_t i = 0; i < network->num_arduinos; ++i) {
+        fprintf(file, "d %s:%s\n", network->names[i], network->paths[i]);
+    }
+
+    for (size_t i = 0; i < network->num_pins; ++i) {
+        PinConnection con = network->pins[i];
+
+        fprintf(file, "p %s:%d %s:%d\n", network->names[con.out_index], con.out_pin,
+                network->names[con.in_index], con.in_pin);
+    }
+
+    fclose(file);
+}
+
+
+/* Parse a .ard file, and return how long it took */
+static double time_parse(const char *path, ArduinoNetwork *network)
+{
+    FILE *file = fopen(path, "r");
+
+    if (NULL == file) {
+        perror("Could not read network");
+        exit(EXIT_FAILURE);
+    }
+
+    double start = now();
+    *network = parse_network(file);
+    double elapsed = now() - start;
+
+    fclose(file);
+    return elapsed;
+}
+
+
+/*
+  Average time to settle the net after a random Arduino lets go of,
+  or pulls down, its open-drain pin
+ */
+static double time_propagation(ArduinoNetwork *network)
+{
+    ArduinoMega **arduinos = (ArduinoMega **)malloc(sizeof(arduinos[0]) * network->num_arduinos);
+
+    for (size_t i = 0; i < network->num_arduinos; ++i) {
+        arduinos[i] = new ArduinoMega(-1, -1);
+    }
+
+    TimingWheel wheel;
+    init_wheel(&wheel, 0);
+
+    PinNets nets;
+    init_nets(&nets, network, arduinos, &wheel);
+
+    uint64_t state = 1;
+    double start = now();
+    double elapsed = 0;
+    int count = 0;
+
+    while (count < PROPAGATIONS && elapsed < PROPAGATION_SECONDS) {
+        /* xorshift is plenty for picking nodes */
+        state ^= state << 13;
+        state ^= state >> 7;
+        state ^= state << 17;
+
+        size_t index = state % network->num_arduinos;
+
+        arduinos[index]->pin_modes[BENCH_DONE_PIN] ^= MODE_OUTPUT;
+        arduinos[index]->drive_changed(BENCH_DONE_PIN);
+        update_nets(&nets, arduinos, index, 0);
+
+        if (0 == ++count % 1024) {
+            elapsed = now() - start;
+        }
+    }
+
+    elapsed = now() - start;
+    free_nets(&nets);
+    free_wheel(&wheel);
+
+    for (size_t i = 0; i < network->num_arduinos; ++i) {
+        delete arduinos[i];
+    }
+
+    free(arduinos);
+    return elapsed / count;
+}
+
+
+/*
+  Parse time for generated and plain .ard files, load time for their
+  compiled images, and the cost of propagating a pin change, all as
+  the number of Arduinos and connections grows.
+ */
+static void bench_networks(BenchOptions *options)
+{
+    char *idle = sketch_path(options, "bench_idle");
+    char *generated = work_path(options, "generated.ard");
+    char *flat = work_path(options, "flat.ard");
+    char *image = work_path(options, "flat.ardc");
+
+    for (size_t n = 0; n < NUM_ELEMENTS(NETWORK_NODES); ++n) {
+        for (size_t d = 0; d < NUM_ELEMENTS(NETWORK_DEGREES); ++d) {
+            size_t nodes = NETWORK_NODES[n];
+            FILE *file = fopen(generated, "w");
+
+            if (NULL == file) {
+                perror("Could not write network");
+                exit(EXIT_FAILURE);
+            }
+
+            /* Every edge drives pins both ways, so each node drives DEGREE pins */
+            fprintf(file, "g regular node:%s %lu %lu 1 p %d:2 r %d:2\n", idle,
+                    (unsigned long)nodes, (unsigned long)NETWORK_DEGREES[d], BENCH_DONE_PIN, BENCH_DONE_PIN);
+            fclose(file);
+
+            ArduinoNetwork network;
+            double generate = time_parse(generated, &network);
+            size_t edges = network.num_pins;
+
+            write_result("ard_generate", nodes, edges, generate * 1e3, "ms");
+
+            write_flat(flat, &network);
+
+            if ((double)nodes * edges <= PARSE_LIMIT) {
+                free_network(&network);
+
+                double parse = time_parse(flat, &network);
+                write_result("ard_parse", nodes, edges, parse * 1e3, "ms");
+            }
+
+            if (0 != write_network_image(image, flat, &network)) {
+                exit(EXIT_FAILURE);
+            }
+
+            free_network(&network);
+
+            uint64_t source_hash = hash_file(flat);
+            double start = now();
+
+            if (0 != load_network_image(image, source_hash, &network)) {
+                fprintf(stderr, "Could not load \"%s\"\n", image);
+                exit(EXIT_FAILURE);
+            }
+
+            write_result("ard_image_load", nodes, edges, (now() - start) * 1e3, "ms");
+
+            double propagation = time_propagation(&network);
+            write_result("pin_propagation", nodes, edges, propagation * 1e9, "ns");
+
+            free_network(&network);
+        }
+    }
+
+    unlink(generated);
+    unlink(flat);
+    unlink(image);
+
+    free(image);
+    free(flat);
+    free(generated);
+    free(idle);
+}
+
+
+/*
+  Time to take the next event off the timing wheel and schedule
+  another, with a steady number of events in flight
+ */
+static void bench_wheel()
+{
+    for (size_t p = 0; p < NUM_ELEMENTS(WHEEL_PENDING); ++p) {
+        TimingWheel wheel;
+        init_wheel(&wheel, 0);
+
+        uint64_t state = 1;
+
+        for (size_t e = 0; e < WHEEL_PENDING[p]; ++e) {
+            state ^= state << 13;
+            state ^= state >> 7;
+            state ^= state << 17;
+
+            schedule_event(&wheel, state % WHEEL_SPREAD, LINK_SERIAL, 0, 0, 0);
+        }
+
+        WheelEvent event;
+        double start = now();
+
+        for (int count = 0; count < WHEEL_EVENTS; ++count) {
+            next_event(&wheel, ULLONG_MAX, &event);
+
+            state ^= state << 13;
+            state ^= state >> 7;
+            state ^= state << 17;
+
+            schedule_event(&wheel, event.time + state % WHEEL_SPREAD, LINK_SERIAL, 0, 0, 0);
+        }
+
+        write_result("wheel_event", 0, WHEEL_PENDING[p], (now() - start) / WHEEL_EVENTS * 1e9, "ns");
+        free_wheel(&wheel);
+    }
+}
+
+
+int main(int argc, char *argv[])
+{
+    BenchOptions options;
+    options.net_program = "../networking/arduino_net";
+    options.sketch_dir = ".";
+    options.work_dir = NULL;
+    options.repeats = 3;
+
+    const char *report_path = NULL;
+    int option;
+
+    while (-1 != (option = getopt(argc, argv, "n:s:w:r:o:"))) {
+        switch (option) {
+        case 'n':
+            options.net_program = optarg;
+            break;
+        case 's':
+            options.sketch_dir = optarg;
+            break;
+        case 'w':
+            options.work_dir = optarg;
+            break;
+        case 'r':
+            options.repeats = atoi(optarg);
+            break;
+        case 'o':
+            report_path = optarg;
+            break;
+        default:
+            usage(argv[0]);
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    if (options.repeats < 1) {
+        usage(argv[0]);
+        exit(EXIT_FAILURE);
+    }
+
+    char work_template[] = "/tmp/emulard_bench.XXXXXX";
+
+    if (NULL == options.work_dir) {
+        options.work_dir = mkdtemp(work_template);
+
+        if (NULL == options.work_dir) {
+            perror("Could not make a work directory");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    report = NULL == report_path ? stdout : fopen(report_path, "w");
+
+    if (NULL == report) {
+        fprintf(stderr, "Could not open \"%s\"\n", report_path);
+        exit(EXIT_FAILURE);
+    }
+
+    /* Timeouts are waited for with sigtimedwait */
+    sigset_t child_set;
+    sigemptyset(&child_set);
+    sigaddset(&child_set, SIGCHLD);
+    sigprocmask(SIG_BLOCK, &child_set, NULL);
+
+    time_t start_time = time(NULL);
+    char date[64];
+    strftime(date, sizeof(date), "%Y-%m-%dT%H:%M:%SZ", gmtime(&start_time));
+
+    fprintf(report, "{\n  \"date\": \"%s\",\n  \"cores\": %ld,\n  \"repeats\": %d,\n  \"results\": [",
+            date, sysconf(_SC_NPROCESSORS_ONLN), options.repeats);
+
+    double launch_times[NUM_ELEMENTS(LAUNCH_NODES)];
+
+    bench_round_trip(&options);
+    bench_launch(&options, launch_times);
+    bench_fire_and_forget(&options, launch_times);
+    bench_port_write(&options);
+    bench_serial(&options, launch_times);
+    bench_networks(&options);
+    bench_wheel();
+
+    fprintf(report, "\n  ]\n}\n");
+
+    if (stdout != report) {
+        fclose(report);
+    }
+
+    /* The scratch networks are gone, so the directory can go too */
+    if (options.work_dir == work_template) {
+        rmdir(work_template);
+    }
+
+    return EXIT_SUCCESS;
+}
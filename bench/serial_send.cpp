@@ -0,0 +1,48 @@
+/* Copyright (C) 2013 Calvin Beck
+
+  Permission is hereby granted, free of charge, to any person
+  obtaining a copy of this software and associated documentation files
+  (the "Software"), to deal in the Software without restriction,
+  including without limitation the rights to use, copy, modify, merge,
+  publish, distribute, sublicense, and/or sell copies of the Software,
+  and to permit persons to whom the Software is furnished to do so,
+  subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be
+  included in all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+  EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+  MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+  NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+  BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+  ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+  CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+  SOFTWARE.
+
+*/
+
+
+#include <Arduino.h>
+#include "bench.h"
+
+/* Sends BENCH_SERIAL_BYTES over Serial, a window at a time */
+
+unsigned long sent = 0;
+unsigned long acknowledged = 0;
+
+void setup() {
+    Serial.begin(115200);
+}
+
+void loop() {
+    while (Serial.available()) {
+        Serial.read();
+        acknowledged += BENCH_SERIAL_ACK;
+    }
+
+    while (sent < BENCH_SERIAL_BYTES && sent - acknowledged < BENCH_SERIAL_WINDOW) {
+        Serial.write((uint8_t)sent);
+        ++sent;
+    }
+}
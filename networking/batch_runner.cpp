@@ -0,0 +1,720 @@
+/* Copyright (C) 2013 Calvin Beck
+
+  Permission is hereby granted, free of charge, to any person
+  obtaining a copy of this software and associated documentation files
+  (the "Software"), to deal in the Software without restriction,
+  including without limitation the rights to use, copy, modify, merge,
+  publish, distribute, sublicense, and/or sell copies of the Software,
+  and to permit persons to whom the Software is furnished to do so,
+  subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be
+  included in all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+  EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+  MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+  NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+  BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+  ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+  CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+  SOFTWARE.
+
+*/
+
+/*
+  Batch runner for sweeps of network simulations.
+
+  Reads a manifest with one run per line, and runs them headless with
+  arduino_net, as many at once as the core budget allows. Each run is
+  killed (along with all of its Arduino processes) if it outlasts its
+  timeout, and the results, output, and resource usage of every run
+  are collected into a single JSON report.
+ */
+
+#include "network_image.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <time.h>
+#include <dirent.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <sys/resource.h>
+#include <sys/prctl.h>
+
+
+/* Most output kept for the report, per run. The log file has all of it. */
+#define REPORT_OUTPUT_LIMIT (64 * 1024)
+
+/* Largest number of arduino_net arguments on a manifest line */
+#define MAX_RUN_ARGS 32
+
+
+typedef enum RunState {
+    RUN_PENDING,
+    RUN_ACTIVE,
+    RUN_DONE
+} RunState;
+
+
+typedef struct BatchRun {
+    char *name;
+    char *network;
+    unsigned long seed;
+    double timeout;  /* Seconds, 0 for none */
+    char *until;     /* Output that ends the run successfully, or NULL */
+
+    char *args[MAX_RUN_ARGS];
+    int num_args;
+
+    size_t cost;  /* Cores this run is expected to keep busy */
+
+    RunState state;
+    pid_t pid;
+    int output_fd;
+    FILE *log;
+
+    char *output;
+    size_t output_length;
+    int output_truncated;
+
+    char *serial_dir;
+
+    double start_time;
+    double end_time;
+
+    int exit_status;
+    int timed_out;
+    int matched;
+    struct rusage usage;
+} BatchRun;
+
+
+static double now()
+{
+    struct timespec time;
+    clock_gettime(CLOCK_MONOTONIC, &time);
+
+    return time.tv_sec + time.tv_nsec / 1e9;
+}
+
+
+static void usage(char *program_name)
+{
+    fprintf(stderr, "Usage: %s [-j <cores>] [-n <arduino_net>] [-o <log directory>] [-r <report>.json] <manifest>\n", program_name);
+}
+
+
+/*
+  Manifest lines look like
+
+    <NAME> <NETWORK> [seed=<N>] [timeout=<SECONDS>] [-- <arduino_net arguments>] [until=<TEXT>]
+
+  where until takes the rest of the line. '#' starts a comment.
+ */
+
+static int parse_manifest_line(char *line, BatchRun *run)
+{
+    memset(run, 0, sizeof(*run));
+    run->output_fd = -1;
+
+    /* until= runs to the end of the line, so cut it off first */
+    char *until = strstr(line, "until=");
+
+    if (NULL != until) {
+        *until = '\0';
+        until += strlen("until=");
+        until[strcspn(until, "\r\n")] = '\0';
+
+        run->until = strdup(until);
+    }
+    else {
+        /* Comments only make sense when there is no until text */
+        line[strcspn(line, "#\r\n")] = '\0';
+    }
+
+    char *save = NULL;
+    char *name = strtok_r(line, " \t", &save);
+
+    if (NULL == name) {
+        free(run->until);
+        return 0;
+    }
+
+    char *network = strtok_r(NULL, " \t", &save);
+
+    if (NULL == network) {
+        fprintf(stderr, "Run \"%s\" has no network\n", name);
+        free(run->until);
+        return -1;
+    }
+
+    run->name = strdup(name);
+    run->network = strdup(network);
+
+    int passthrough = 0;
+    char *token;
+
+    while (NULL != (token = strtok_r(NULL, " \t", &save))) {
+        if (passthrough) {
+            if (run->num_args < MAX_RUN_ARGS) {
+                run->args[run->num_args++] = strdup(token);
+            }
+        }
+        else if (0 == strcmp(token, "--")) {
+            passthrough = 1;
+        }
+        else if (0 == strncmp(token, "seed=", 5)) {
+            run->seed = strtoul(token + 5, NULL, 10);
+        }
+        else if (0 == strncmp(token, "timeout=", 8)) {
+            run->timeout = atof(token + 8);
+        }
+        else {
+            fprintf(stderr, "Unknown option \"%s\" for run \"%s\"\n", token, run->name);
+            return -1;
+        }
+    }
+
+    return 1;
+}
+
+
+/* One core for the server, and one for each Arduino process */
+static size_t run_cost(BatchRun *run, size_t budget)
+{
+    ArduinoNetwork network;
+    size_t cost = 1;
+
+    if (0 == load_network(run->network, &network)) {
+        cost += network.num_arduinos;
+        free_network(&network);
+    }
+
+    /* A run bigger than the whole budget still gets to run, on its own */
+    return cost < budget ? cost : budget;
+}
+
+
+/* Make a directory, and any of its parents that aren't there yet, like mkdir -p */
+static void make_directory(const char *path)
+{
+    char *partial = strdup(path);
+
+    for (char *slash = strchr(partial + 1, '/'); NULL != slash; slash = strchr(slash + 1, '/')) {
+        *slash = '\0';
+        mkdir(partial, 0777);
+        *slash = '/';
+    }
+
+    mkdir(partial, 0777);
+    free(partial);
+}
+
+
+static void start_run(BatchRun *run, const char *net_program, const char *log_dir)
+{
+    int output_pipe[2];
+
+    if (-1 == pipe(output_pipe)) {
+        perror("Could not create output pipe");
+        exit(EXIT_FAILURE);
+    }
+
+    size_t path_length = strlen(log_dir) + strlen(run->name) + 8;
+    char *log_path = (char *)malloc(path_length);
+    snprintf(log_path, path_length, "%s/%s.log", log_dir, run->name);
+
+    /* Each Arduino's Serial output goes in <log_dir>/<name>/ */
+    run->serial_dir = (char *)malloc(path_length);
+    snprintf(run->serial_dir, path_length, "%s/%s", log_dir, run->name);
+    mkdir(run->serial_dir, 0777);
+
+    run->log = fopen(log_path, "w");
+
+    if (NULL == run->log) {
+        fprintf(stderr, "Could not open log \"%s\"\n", log_path);
+    }
+
+    free(log_path);
+
+    run->start_time = now();
+    run->pid = fork();
+
+    if (-1 == run->pid) {
+        perror("Could not fork run");
+        exit(EXIT_FAILURE);
+    }
+
+    if (0 == run->pid) {
+        /* Own process group, so the run and its Arduinos can be killed together */
+        setpgid(0, 0);
+
+        close(output_pipe[0]);
+        dup2(output_pipe[1], STDOUT_FILENO);
+        dup2(output_pipe[1], STDERR_FILENO);
+        close(output_pipe[1]);
+
+        char seed[32];
+        snprintf(seed, sizeof(seed), "%lu", run->seed);
+        setenv("EMULARD_SEED", seed, 1);
+
+        char *argv[MAX_RUN_ARGS + 6];
+        int argc = 0;
+
+        /* Batch runs are always headless */
+        argv[argc++] = (char *)net_program;
+        argv[argc++] = (char *)"-H";
+        argv[argc++] = (char *)"-o";
+        argv[argc++] = run->serial_dir;
+
+        for (int i = 0; i < run->num_args; ++i) {
+            argv[argc++] = run->args[i];
+        }
+
+        argv[argc++] = run->network;
+        argv[argc] = NULL;
+
+        execvp(net_program, argv);
+
+        fprintf(stderr, "Could not run \"%s\"\n", net_program);
+        _exit(127);
+    }
+
+    /* Also set it from here, so there's no window where killpg misses */
+    setpgid(run->pid, run->pid);
+
+    close(output_pipe[1]);
+    run->output_fd = output_pipe[0];
+    run->state = RUN_ACTIVE;
+}
+
+
+static void read_output(BatchRun *run)
+{
+    char buffer[4096];
+    ssize_t bytes_read = read(run->output_fd, buffer, sizeof(buffer));
+
+    if (bytes_read <= 0) {
+        if (-1 == bytes_read && EINTR == errno) {
+            return;
+        }
+
+        close(run->output_fd);
+        run->output_fd = -1;
+        return;
+    }
+
+    if (NULL != run->log) {
+        fwrite(buffer, 1, bytes_read, run->log);
+    }
+
+    /* Keep the start of the output for the report */
+    size_t keep = bytes_read;
+
+    if (run->output_length + keep > REPORT_OUTPUT_LIMIT) {
+        keep = REPORT_OUTPUT_LIMIT - run->output_length;
+        run->output_truncated = 1;
+    }
+
+    size_t old_length = run->output_length;
+
+    if (keep) {
+        run->output = (char *)realloc(run->output, run->output_length + keep + 1);
+        memcpy(run->output + run->output_length, buffer, keep);
+        run->output_length += keep;
+        run->output[run->output_length] = '\0';
+    }
+
+    /* Only search what's new, plus enough before it to catch a split match */
+    if (NULL != run->until && NULL != run->output && !run->matched) {
+        size_t overlap = strlen(run->until);
+        size_t from = old_length > overlap ? old_length - overlap : 0;
+
+        if (NULL != strstr(run->output + from, run->until)) {
+            run->matched = 1;
+        }
+    }
+}
+
+
+/*
+  Reap whatever has exited in the run's process group, adding up its
+  resource usage. The Arduinos are orphaned to us (we are a subreaper)
+  when arduino_net dies, so their time counts too. Returns 1 if the
+  run's arduino_net itself was reaped.
+ */
+static int reap_run(BatchRun *run, int options)
+{
+    int status = 0;
+    int reaped_leader = 0;
+    struct rusage usage;
+    pid_t pid;
+
+    while (0 < (pid = wait4(-run->pid, &status, options, &usage))) {
+        run->usage.ru_utime.tv_sec += usage.ru_utime.tv_sec;
+        run->usage.ru_utime.tv_usec += usage.ru_utime.tv_usec;
+        run->usage.ru_stime.tv_sec += usage.ru_stime.tv_sec;
+        run->usage.ru_stime.tv_usec += usage.ru_stime.tv_usec;
+
+        if (usage.ru_maxrss > run->usage.ru_maxrss) {
+            run->usage.ru_maxrss = usage.ru_maxrss;
+        }
+
+        if (pid == run->pid) {
+            run->exit_status = WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status);
+            reaped_leader = 1;
+        }
+    }
+
+    return reaped_leader;
+}
+
+
+/* Kill everything in the run's process group, and reap all of it */
+static void finish_run(BatchRun *run)
+{
+    killpg(run->pid, SIGKILL);
+
+    while (-1 != run->output_fd) {
+        read_output(run);
+    }
+
+    reap_run(run, 0);
+
+    if (NULL != run->log) {
+        fclose(run->log);
+        run->log = NULL;
+    }
+
+    run->end_time = now();
+    run->state = RUN_DONE;
+}
+
+
+static int run_passed(BatchRun *run)
+{
+    if (NULL != run->until) {
+        return run->matched;
+    }
+
+    return !run->timed_out && 0 == run->exit_status;
+}
+
+
+static void write_json_string(FILE *file, const char *str, size_t length)
+{
+    fputc('"', file);
+
+    for (size_t i = 0; i < length; ++i) {
+        unsigned char c = str[i];
+
+        if ('"' == c || '\\' == c) {
+            fprintf(file, "\\%c", c);
+        }
+        else if ('\n' == c) {
+            fprintf(file, "\\n");
+        }
+        else if (c < 0x20 || c >= 0x7F) {
+            fprintf(file, "\\u%04x", c);
+        }
+        else {
+            fputc(c, file);
+        }
+    }
+
+    fputc('"', file);
+}
+
+
+/* Write each Arduino's Serial output file as a member of a JSON object */
+static void write_serial_outputs(FILE *file, BatchRun *run)
+{
+    DIR *dir = run->serial_dir ? opendir(run->serial_dir) : NULL;
+    int first = 1;
+
+    fprintf(file, "{");
+
+    struct dirent *entry;
+
+    while (NULL != dir && NULL != (entry = readdir(dir))) {
+        size_t name_length = strlen(entry->d_name);
+
+        if (name_length <= 7 || 0 != strcmp(entry->d_name + name_length - 7, ".serial")) {
+            continue;
+        }
+
+        size_t path_length = strlen(run->serial_dir) + name_length + 2;
+        char *path = (char *)malloc(path_length);
+        snprintf(path, path_length, "%s/%s", run->serial_dir, entry->d_name);
+
+        FILE *serial = fopen(path, "rb");
+        free(path);
+
+        if (NULL == serial) {
+            continue;
+        }
+
+        char *contents = (char *)malloc(REPORT_OUTPUT_LIMIT);
+        size_t length = fread(contents, 1, REPORT_OUTPUT_LIMIT, serial);
+        fclose(serial);
+
+        fprintf(file, "%s\n        ", first ? "" : ",");
+        write_json_string(file, entry->d_name, name_length - 7);
+        fprintf(file, ": ");
+        write_json_string(file, contents, length);
+
+        free(contents);
+        first = 0;
+    }
+
+    if (NULL != dir) {
+        closedir(dir);
+    }
+
+    fprintf(file, "%s}", first ? "" : "\n      ");
+}
+
+
+static void write_report(FILE *file, BatchRun *runs, size_t num_runs, double wall_time, size_t budget)
+{
+    size_t passed = 0;
+
+    for (size_t i = 0; i < num_runs; ++i) {
+        passed += run_passed(&runs[i]);
+    }
+
+    fprintf(file, "{\n");
+    fprintf(file, "  \"cores\": %lu,\n", (unsigned long)budget);
+    fprintf(file, "  \"wall_seconds\": %.3f,\n", wall_time);
+    fprintf(file, "  \"passed\": %lu,\n", (unsigned long)passed);
+    fprintf(file, "  \"failed\": %lu,\n", (unsigned long)(num_runs - passed));
+    fprintf(file, "  \"runs\": [\n");
+
+    for (size_t i = 0; i < num_runs; ++i) {
+        BatchRun *run = &runs[i];
+
+        fprintf(file, "    {\n");
+        fprintf(file, "      \"name\": ");
+        write_json_string(file, run->name, strlen(run->name));
+        fprintf(file, ",\n      \"network\": ");
+        write_json_string(file, run->network, strlen(run->network));
+        fprintf(file, ",\n      \"seed\": %lu,\n", run->seed);
+        fprintf(file, "      \"result\": \"%s\",\n", run_passed(run) ? "pass" : "fail");
+        fprintf(file, "      \"timed_out\": %s,\n", run->timed_out ? "true" : "false");
+        fprintf(file, "      \"exit_status\": %d,\n", run->exit_status);
+        fprintf(file, "      \"wall_seconds\": %.3f,\n", run->end_time - run->start_time);
+        fprintf(file, "      \"user_seconds\": %.3f,\n", run->usage.ru_utime.tv_sec + run->usage.ru_utime.tv_usec / 1e6);
+        fprintf(file, "      \"system_seconds\": %.3f,\n", run->usage.ru_stime.tv_sec + run->usage.ru_stime.tv_usec / 1e6);
+        fprintf(file, "      \"max_rss_kb\": %ld,\n", run->usage.ru_maxrss);
+        fprintf(file, "      \"output_truncated\": %s,\n", run->output_truncated ? "true" : "false");
+        fprintf(file, "      \"output\": ");
+        write_json_string(file, run->output ? run->output : "", run->output_length);
+        fprintf(file, ",\n      \"serial\": ");
+        write_serial_outputs(file, run);
+        fprintf(file, "\n    }%s\n", i + 1 < num_runs ? "," : "");
+    }
+
+    fprintf(file, "  ]\n}\n");
+}
+
+
+int main(int argc, char *argv[])
+{
+    long online = sysconf(_SC_NPROCESSORS_ONLN);
+    size_t budget = online > 0 ? online : 1;
+    const char *net_program = "arduino_net";
+    const char *log_dir = ".";
+    const char *report_path = NULL;
+
+    int option;
+
+    while (-1 != (option = getopt(argc, argv, "j:n:o:r:"))) {
+        switch (option) {
+        case 'j':
+            budget = strtoul(optarg, NULL, 10);
+            break;
+        case 'n':
+            net_program = optarg;
+            break;
+        case 'o':
+            log_dir = optarg;
+            break;
+        case 'r':
+            report_path = optarg;
+            break;
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+
+    if (optind + 1 != argc || 0 == budget) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    /* Like arduino_net's -o, the log directory is made if it isn't there */
+    make_directory(log_dir);
+
+    FILE *manifest = fopen(argv[optind], "r");
+
+    if (NULL == manifest) {
+        fprintf(stderr, "No such file: \"%s\"\n", argv[optind]);
+        return 1;
+    }
+
+    /* Read all of the runs */
+    BatchRun *runs = NULL;
+    size_t num_runs = 0;
+
+    char *line = NULL;
+    size_t line_size = 0;
+
+    while (-1 != getline(&line, &line_size, manifest)) {
+        BatchRun run;
+        int status = parse_manifest_line(line, &run);
+
+        if (-1 == status) {
+            return 1;
+        }
+
+        if (1 == status) {
+            run.cost = run_cost(&run, budget);
+
+            runs = (BatchRun *)realloc(runs, sizeof(runs[0]) * (num_runs + 1));
+            runs[num_runs++] = run;
+        }
+    }
+
+    free(line);
+    fclose(manifest);
+
+    /* Arduinos outlive their arduino_net when it is killed, so adopt them */
+    prctl(PR_SET_CHILD_SUBREAPER, 1);
+
+    double batch_start = now();
+    size_t next_run = 0;
+    size_t cores_used = 0;
+    size_t num_done = 0;
+
+    struct pollfd *fds = (struct pollfd *)malloc(sizeof(fds[0]) * (num_runs + 1));
+    size_t *fd_runs = (size_t *)malloc(sizeof(fd_runs[0]) * (num_runs + 1));
+
+    while (num_done < num_runs) {
+        /* Start as many runs as the budget allows, in manifest order */
+        while (next_run < num_runs && cores_used + runs[next_run].cost <= budget) {
+            start_run(&runs[next_run], net_program, log_dir);
+            cores_used += runs[next_run].cost;
+
+            fprintf(stderr, "Started %s\n", runs[next_run].name);
+            ++next_run;
+        }
+
+        /* Wait for output, or until the next timeout */
+        double current = now();
+        int wait_ms = -1;
+        size_t num_fds = 0;
+
+        for (size_t i = 0; i < num_runs; ++i) {
+            BatchRun *run = &runs[i];
+
+            if (RUN_ACTIVE != run->state) {
+                continue;
+            }
+
+            if (run->timeout > 0) {
+                double remaining = run->start_time + run->timeout - current;
+                int remaining_ms = remaining > 0 ? (int)(remaining * 1000) + 1 : 0;
+
+                if (-1 == wait_ms || remaining_ms < wait_ms) {
+                    wait_ms = remaining_ms;
+                }
+            }
+
+            if (-1 != run->output_fd) {
+                fds[num_fds].fd = run->output_fd;
+                fds[num_fds].events = POLLIN;
+                fd_runs[num_fds] = i;
+                ++num_fds;
+            }
+        }
+
+        /* Runs that closed their output without exiting still need checking */
+        if (0 == num_fds && (-1 == wait_ms || wait_ms > 100)) {
+            wait_ms = 100;
+        }
+
+        poll(fds, num_fds, wait_ms);
+
+        for (size_t f = 0; f < num_fds; ++f) {
+            if (fds[f].revents) {
+                read_output(&runs[fd_runs[f]]);
+            }
+        }
+
+        /* Retire runs that exited, matched, or ran out of time */
+        current = now();
+
+        for (size_t i = 0; i < num_runs; ++i) {
+            BatchRun *run = &runs[i];
+
+            if (RUN_DONE == run->state) {
+                /* Arduinos that were still being reparented when the run finished */
+                reap_run(run, WNOHANG);
+            }
+
+            if (RUN_ACTIVE != run->state) {
+                continue;
+            }
+
+            int exited = reap_run(run, WNOHANG);
+
+            if (!exited && !run->matched && run->timeout > 0 && current >= run->start_time + run->timeout) {
+                run->timed_out = 1;
+            }
+
+            if (exited || run->matched || run->timed_out) {
+                finish_run(run);
+
+                cores_used -= run->cost;
+                ++num_done;
+
+                fprintf(stderr, "%s %s (%.2fs)\n", run_passed(run) ? "PASS" : "FAIL", run->name,
+                        run->end_time - run->start_time);
+            }
+        }
+    }
+
+    free(fds);
+    free(fd_runs);
+
+    FILE *report = NULL == report_path ? stdout : fopen(report_path, "w");
+
+    if (NULL == report) {
+        fprintf(stderr, "Could not write report \"%s\"\n", report_path);
+        return 1;
+    }
+
+    write_report(report, runs, num_runs, now() - batch_start, budget);
+
+    if (stdout != report) {
+        fclose(report);
+    }
+
+    size_t failed = 0;
+
+    for (size_t i = 0; i < num_runs; ++i) {
+        failed += !run_passed(&runs[i]);
+    }
+
+    return failed ? 1 : 0;
+}
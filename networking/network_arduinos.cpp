@@ -22,72 +22,258 @@
 
 */
 
-#include <Arduino.h>
-#include <emulard/fakeduino.h>
-
-#include "network_parse.h"
+#include "network_simulator.h"
+#include "network_image.h"
+#include "network_explore.h"
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
-#include <fcntl.h>
-#include <sys/select.h>
-#include <time.h>
+#include <sys/stat.h>
+
+
+void usage(char *program_name)
+{
+    fprintf(stderr, "Usage: %s [<options>] <input file>.ard\n", program_name);
+    fprintf(stderr, "       %s [<options>] <compiled file>.ardc\n", program_name);
+    fprintf(stderr, "       %s compile <input file>.ard [<output file>.ardc]\n", program_name);
+    fprintf(stderr, "\n");
+    fprintf(stderr, "Options:\n");
+    fprintf(stderr, "  -k <reads>               Park Arduinos after <reads> unchanged reads (0 never does)\n");
+    fprintf(stderr, "  -q <commands>            Commands each Arduino may run per round (default %d)\n", SCHEDULER_QUANTUM);
+    fprintf(stderr, "  -a                       Give the server a CPU, and place Arduinos by their connections\n");
+    fprintf(stderr, "\n");
+    fprintf(stderr, "Headless options:\n");
+    fprintf(stderr, "  -H                       No ptys, and time is virtual\n");
+    fprintf(stderr, "  -i <name>=<file>         Stream <name>'s Serial input from <file>\n");
+    fprintf(stderr, "  -o <directory>           Write Serial output to <directory>/<name>.serial\n");
+    fprintf(stderr, "  -W <us>                  Keep Arduinos within <us> of the slowest one (default %d)\n", HEADLESS_HORIZON);
+    fprintf(stderr, "  -L <us>                  Lockstep, every Arduino runs <us> of virtual time per step\n");
+    fprintf(stderr, "  -D <rank>:<servers>      Run part of the network, as server <rank> of <host>:<port>,...\n");
+    fprintf(stderr, "  -t <ms>                  Stop when every Arduino reaches <ms> of virtual time\n");
+    fprintf(stderr, "  -l <loops>               Stop when every Arduino has run loop() <loops> times\n");
+    fprintf(stderr, "  -p <name>:<pin>=<value>  Stop when the pin reaches the value\n");
+    fprintf(stderr, "  -m <name>:<text>         Stop when the text shows up on <name>'s Serial\n");
+    fprintf(stderr, "\n");
+    fprintf(stderr, "Exploring (headless, the goals are what mustn't happen):\n");
+    fprintf(stderr, "  -x <turns>               Try every order the Arduinos can go in, <turns> turns a run\n");
+    fprintf(stderr, "  -R <runs>                Make <runs> runs in random orders instead\n");
+    fprintf(stderr, "  -j <threads>             Make runs on <threads> threads (default 1)\n");
+    fprintf(stderr, "  -S <states>              Stop once the runs have got to <states> states\n");
+    fprintf(stderr, "  -w <file>                Write the schedule of a run that got there to <file>\n");
+    fprintf(stderr, "                           (default <input file>.schedule)\n");
+    fprintf(stderr, "  -r <file>                Run in the order a schedule says, and stop at its end\n");
+}
 
-pid_t launch_arduino(char *name, char *path, int *in_pipe, int *out_pipe)
+
+/* Parse a .ard file once and write it out as an image */
+int compile(char *program_name, char *ard_path, char *output_path)
 {
-    if (-1 == pipe(in_pipe)) {
-        perror("Could not create input pipe");
-        exit(EXIT_FAILURE);
+    FILE *ard_file = fopen(ard_path, "r");
+
+    if (NULL == ard_file) {
+        fprintf(stderr, "No such file: \"%s\"\n", ard_path);
+        usage(program_name);
+
+        return 1;
     }
 
-    if (-1 == pipe(out_pipe)) {
-        perror("Could not create output pipe");
-        exit(EXIT_FAILURE);
+    ArduinoNetwork network = parse_network(ard_file);
+    fclose(ard_file);
+
+    char *path = NULL == output_path ? image_path(ard_path) : strdup(output_path);
+    int status = write_network_image(path, ard_path, &network);
+
+    if (-1 == status) {
+        perror("Could not write image");
+    }
+    else {
+        printf("Compiled %lu Arduinos, %lu pin and %lu serial connections to %s\n",
+               network.num_arduinos, network.num_pins, network.num_serial, path);
     }
 
-    pid_t pid = fork();
+    free(path);
+    free_network(&network);
 
-    if (pid == 0) {
-        /* Child process - run the Arduino stuff */
+    return -1 == status ? 1 : 0;
+}
 
-        /* Need binary mode badly! */
-        freopen(NULL, "wb", stdout);
-        freopen(NULL, "rb", stdin);
 
-        /* Set up the STDIN pipe */
-        close(in_pipe[1]);  /* Close the write end */
+/* Open a file for every "<name>=<file>" serial input option */
+static int open_serial_inputs(ArduinoNetwork *network, char **options, size_t num_options, FILE **serial_inputs)
+{
+    for (size_t i = 0; i < num_options; ++i) {
+        char *file = strchr(options[i], '=');
 
-        /* Set STDIN to the read end */
-        if (-1 == dup2(in_pipe[0], STDIN_FILENO)) {
-            perror("Could not set up input pipe");
-            exit(EXIT_FAILURE);
+        if (NULL == file) {
+            fprintf(stderr, "Bad serial input \"%s\", expected <name>=<file>\n", options[i]);
+            return -1;
         }
 
-        /* Set up the STDOUT pipe */
-        close(out_pipe[0]);  /* Close the read end */
+        *file++ = '\0';
+        int index = arduino_lookup(options[i], network);
 
-        /* Set STDOUT to the write end */
-        if (-1 == dup2(out_pipe[1], STDOUT_FILENO)) {
-            perror("Could not set up output pipe");
-            exit(EXIT_FAILURE);
+        if (-1 == index) {
+            fprintf(stderr, "No Arduino named \"%s\"\n", options[i]);
+            return -1;
         }
 
-        /* Run the Arduino program */
-        char *argv[] = {name, "-c", NULL};
-        execvp(path, argv);
+        serial_inputs[index] = fopen(file, "rb");
 
-        fprintf(stderr, "Invalid Arduino program, \"%s\"\n", path);
-        exit(EXIT_FAILURE);
+        if (NULL == serial_inputs[index]) {
+            fprintf(stderr, "No such file: \"%s\"\n", file);
+            return -1;
+        }
     }
 
-    return pid;
+    return 0;
 }
 
 
-void usage(char *program_name)
+/* Turn "<name>:<pin>=<value>" and "<name>:<text>" options into goals */
+static int add_goals(ArduinoNetwork *network, char **pin_options, size_t num_pin_options,
+                     char **output_options, size_t num_output_options, StopConditions *stop)
 {
-    fprintf(stderr, "Usage: %s <input file>.ard\n", program_name);
+    for (size_t i = 0; i < num_pin_options; ++i) {
+        char *goal = strchr(pin_options[i], ':');
+        int pin;
+        int value;
+
+        if (NULL == goal || 2 != sscanf(goal + 1, "%d=%d", &pin, &value) || pin < 0 || pin >= ArduinoMega::NUM_PINS) {
+            fprintf(stderr, "Bad pin goal \"%s\", expected <name>:<pin>=<value>\n", pin_options[i]);
+            return -1;
+        }
+
+        *goal = '\0';
+        int index = arduino_lookup(pin_options[i], network);
+
+        if (-1 == index) {
+            fprintf(stderr, "No Arduino named \"%s\"\n", pin_options[i]);
+            return -1;
+        }
+
+        stop->add_pin_goal(index, pin, value);
+    }
+
+    for (size_t i = 0; i < num_output_options; ++i) {
+        char *text = strchr(output_options[i], ':');
+
+        if (NULL == text) {
+            fprintf(stderr, "Bad output goal \"%s\", expected <name>:<text>\n", output_options[i]);
+            return -1;
+        }
+
+        *text++ = '\0';
+        int index = arduino_lookup(output_options[i], network);
+
+        if (-1 == index) {
+            fprintf(stderr, "No Arduino named \"%s\"\n", output_options[i]);
+            return -1;
+        }
+
+        stop->add_output_goal(index, text);
+    }
+
+    return 0;
+}
+
+
+/* Give every explored run the limits and goals from the options */
+static void prepare_run(Simulator *simulator, void *data)
+{
+    StopConditions *stop = (StopConditions *)data;
+
+    simulator->stop.max_micros = stop->max_micros;
+    simulator->stop.max_loops = stop->max_loops;
+
+    for (size_t i = 0; i < stop->num_pin_goals; ++i) {
+        simulator->stop.add_pin_goal(stop->pin_goals[i].index, stop->pin_goals[i].pin, stop->pin_goals[i].value);
+    }
+
+    for (size_t i = 0; i < stop->num_output_goals; ++i) {
+        simulator->stop.add_output_goal(stop->output_goals[i].index, stop->output_goals[i].text);
+    }
+}
+
+
+/* Explore the orders the network's Arduinos can go in, and write out the schedule of one that breaks it */
+static int explore_network(Simulator *simulator, char *path, size_t depth, unsigned long runs, int workers,
+                           unsigned long max_states, char *schedule_path)
+{
+    Exploration exploration;
+
+    if (-1 == init_exploration(&exploration, path)) {
+        fprintf(stderr, "No such file: \"%s\"\n", path);
+        return STOP_ERROR;
+    }
+
+    exploration.idle_reads = simulator->idle_reads;
+    exploration.depth = depth;
+    exploration.runs = runs;
+    exploration.workers = workers;
+    exploration.max_states = max_states;
+    exploration.progress = 1;
+    exploration.prepare = prepare_run;
+    exploration.data = &simulator->stop;
+
+    int violated = explore(&exploration);
+
+    printf("Made %lu runs, %llu turns, through %lu states (%lu runs cut short)\n", exploration.runs_made,
+           exploration.turns, exploration.states, exploration.pruned);
+
+    if (exploration.out_of_states && !exploration.violated) {
+        printf("Stopped at %lu states, before the search was done\n", max_states);
+    }
+
+    if (violated) {
+        char *written = NULL == schedule_path ? (char *)malloc(strlen(path) + 16) : schedule_path;
+
+        if (NULL == schedule_path) {
+            sprintf(written, "%s.schedule", path);
+        }
+
+        printf("Broken after %lu turns: %s\n", (unsigned long)exploration.violation.length, exploration.reason);
+
+        if (-1 == write_schedule(written, &exploration.network, &exploration.violation, exploration.reason)) {
+            perror("Could not write the schedule");
+        }
+        else {
+            printf("Schedule written to %s\n", written);
+        }
+
+        if (written != schedule_path) {
+            free(written);
+        }
+    }
+
+    free_exploration(&exploration);
+
+    return violated ? STOP_GOAL : STOP_LIMIT;
+}
+
+
+/* Make a directory, and any of its parents that aren't there yet, like mkdir -p */
+static void make_directory(const char *path)
+{
+    char *partial = strdup(path);
+
+    for (char *slash = strchr(partial + 1, '/'); NULL != slash; slash = strchr(slash + 1, '/')) {
+        *slash = '\0';
+        mkdir(partial, 0777);
+        *slash = '/';
+    }
+
+    mkdir(partial, 0777);
+    free(partial);
+}
+
+
+/* Add an option argument to a growing list of them */
+static void add_option(char ***options, size_t *num_options, char *option)
+{
+    *options = (char **)realloc(*options, sizeof(char *) * (*num_options + 1));
+    (*options)[(*num_options)++] = option;
 }
 
 
@@ -96,173 +282,268 @@ int main(int argc, char *argv[])
     /* Can't have buffered stdout, it ruins stuff! */
     setvbuf(stdout, NULL, _IONBF, 0);
 
-    if (2 != argc) {
+    if (argc > 2 && 0 == strcmp(argv[1], "compile")) {
+        return compile(argv[0], argv[2], argc > 3 ? argv[3] : NULL);
+    }
+
+    /* Headless options -- ones that name Arduinos wait until the network is loaded */
+    int headless = 0;
+    int idle_reads = ArduinoMega::IDLE_READS;
+    int quantum = SCHEDULER_QUANTUM;
+    unsigned long long step = 0;
+    unsigned long long horizon = HEADLESS_HORIZON;
+    int place = 0;
+    char *cluster_spec = NULL;
+    char *output_dir = NULL;
+    StopConditions stop;
+
+    /* Exploring, or replaying what exploring found */
+    size_t depth = 0;
+    unsigned long runs = 0;
+    int workers = 1;
+    unsigned long max_states = 0;
+    char *write_path = NULL;
+    char *replay_path = NULL;
+
+    char **input_options = NULL;
+    size_t num_input_options = 0;
+
+    char **pin_options = NULL;
+    size_t num_pin_options = 0;
+
+    char **output_options = NULL;
+    size_t num_output_options = 0;
+
+    int option;
+
+    while (-1 != (option = getopt(argc, argv, "k:q:aHW:L:D:i:o:t:l:p:m:x:R:j:S:w:r:"))) {
+        switch (option) {
+        case 'k':
+            idle_reads = atoi(optarg);
+            break;
+        case 'q':
+            quantum = atoi(optarg);
+
+            if (quantum < 1) {
+                usage(argv[0]);
+                return STOP_ERROR;
+            }
+
+            break;
+        case 'a':
+            place = 1;
+            break;
+        case 'H':
+            headless = 1;
+            break;
+        case 'W':
+            horizon = strtoull(optarg, NULL, 10);
+            break;
+        case 'L':
+            step = strtoull(optarg, NULL, 10);
+
+            if (0 == step) {
+                usage(argv[0]);
+                return STOP_ERROR;
+            }
+
+            break;
+        case 'D':
+            cluster_spec = optarg;
+            break;
+        case 'i':
+            add_option(&input_options, &num_input_options, optarg);
+            break;
+        case 'o':
+            output_dir = optarg;
+            break;
+        case 't':
+            stop.max_micros = strtoull(optarg, NULL, 10) * 1000;
+            break;
+        case 'l':
+            stop.max_loops = strtoul(optarg, NULL, 10);
+            break;
+        case 'p':
+            add_option(&pin_options, &num_pin_options, optarg);
+            break;
+        case 'm':
+            add_option(&output_options, &num_output_options, optarg);
+            break;
+        case 'x':
+            depth = strtoul(optarg, NULL, 10);
+
+            if (0 == depth) {
+                usage(argv[0]);
+                return STOP_ERROR;
+            }
+
+            break;
+        case 'R':
+            runs = strtoul(optarg, NULL, 10);
+            break;
+        case 'j':
+            workers = atoi(optarg);
+
+            if (workers < 1) {
+                usage(argv[0]);
+                return STOP_ERROR;
+            }
+
+            break;
+        case 'S':
+            max_states = strtoul(optarg, NULL, 10);
+            break;
+        case 'w':
+            write_path = optarg;
+            break;
+        case 'r':
+            replay_path = optarg;
+            break;
+        default:
+            usage(argv[0]);
+            return STOP_ERROR;
+        }
+    }
+
+    if (optind + 1 != argc) {
         fprintf(stderr, "Invalid number of arguments!\n");
         usage(argv[0]);
 
-        return 1;
+        return STOP_ERROR;
     }
 
-    /* Open the network file and check that it is valid */
-    FILE *ard_file = fopen(argv[1], "r");
-
-    if (NULL == ard_file) {
-        fprintf(stderr, "No such file: \"%s\"\n", argv[1]);
+    if (0 != step && !headless) {
+        fprintf(stderr, "Lockstep runs need virtual time (-H)\n");
         usage(argv[0]);
 
-        return 1;
+        return STOP_ERROR;
     }
 
-    ArduinoNetwork network = parse_network(ard_file);
-    print_network(&network);
+    /* Runs in a chosen order are headless, and the order is all theirs */
+    if (0 != depth || NULL != replay_path) {
+        if (0 != step || NULL != cluster_spec || (0 != depth && (num_input_options || NULL != output_dir))) {
+            fprintf(stderr, "Exploring doesn't go with -L, -D, -i or -o, and replaying doesn't go with -L or -D\n");
+            usage(argv[0]);
 
-    int arduino_in[2];  /* Arduino STDIN pipe */
-    int arduino_out[2];  /* Arduino STDOUT pipe */
+            return STOP_ERROR;
+        }
 
-    /* Create an array of all of the Arduinos */
-    ArduinoMega *arduinos[network.num_arduinos];
+        headless = 1;
+    }
 
-    for (int i = 0; i < network.num_arduinos; ++i) {
-        /* Need the name and path for the Arduino process */
-        char *name = network.names[i];
-        char *path = network.paths[i];
+    /* Load the network from the .ard file, or its compiled image */
+    Simulator simulator;
 
-        /* Launch our fake Arduino processes */
-        launch_arduino(name, path, arduino_in, arduino_out);
+    if (-1 == load_simulator(&simulator, argv[optind])) {
+        fprintf(stderr, "No such file: \"%s\"\n", argv[optind]);
+        usage(argv[0]);
 
-        /* Make an entry in the giant arduino array! */
-        arduinos[i] = new ArduinoMega(arduino_in[1], arduino_out[0]);
+        return STOP_ERROR;
     }
 
-    /* Get a pseudo-tty for each Arduino */
-    int tty_masters[network.num_arduinos];
+    ArduinoNetwork *network = &simulator.network;
+    print_network(network);
 
-    for (int i = 0; i < network.num_arduinos; ++i) {
-        int master = posix_openpt(O_RDWR);  /* Create the master pty fd */
+    simulator.headless = headless;
+    simulator.idle_reads = idle_reads;
+    simulator.quantum = quantum;
+    simulator.step = step;
+    simulator.horizon = horizon;
+    simulator.place = place;
+    simulator.stop = stop;
 
-        if (-1 == master) {
-            perror("Could not create pty master");
-            exit(EXIT_FAILURE);
-        }
+    /* Servers in a cluster meet at the end of every step */
+    Cluster cluster;
 
-        /* Set the mode and owner of the slave of our master pty */
-        if (-1 == grantpt(master)) {
-            perror("Could not set mode or ownership of pty");
-            exit(EXIT_FAILURE);
-        }
+    if (NULL != cluster_spec) {
+        if (0 == step || -1 == parse_cluster(&cluster, cluster_spec)) {
+            fprintf(stderr, "Bad cluster \"%s\", expected <rank>:<host>:<port>,... and a lockstep run (-H -L)\n", cluster_spec);
+            usage(argv[0]);
 
-        /* Unlock the slave pty */
-        if (-1 == unlockpt(master)) {
-            perror("Could not get slave pty");
-            exit(EXIT_FAILURE);
+            return STOP_ERROR;
         }
 
-        int flags = fcntl(master, F_GETFL);
-        fcntl(master, F_SETFL, flags | O_NONBLOCK);
+        /* Only this server's share runs here, the rest are ghosts */
+        partition_cluster(&cluster, network);
+        simulator.cluster = &cluster;
 
-        /* Now we want to get the device name for the slave pty */
-        char *slave_name = ptsname(master);
+        size_t owned = 0;
 
-        if (NULL == slave_name) {
-            perror("Could not get name of slave device");
-            exit(EXIT_FAILURE);
+        for (size_t i = 0; i < network->num_arduinos; ++i) {
+            owned += !cluster.remote[i];
         }
 
-        /* Save in the masters array */
-        tty_masters[i] = master;
+        printf("Server %lu of %lu runs %lu Arduinos\n", (unsigned long)cluster.rank,
+               (unsigned long)cluster.num_servers, (unsigned long)owned);
+    }
 
-        char *name = network.names[i];
-        printf("%s on: %s\n", name, slave_name);
+    /* Serial files for headless runs */
+    if (-1 == open_serial_inputs(network, input_options, num_input_options, simulator.serial_inputs)
+        || -1 == add_goals(network, pin_options, num_pin_options, output_options, num_output_options, &simulator.stop)) {
+        return STOP_ERROR;
     }
 
-    fd_set read_set;
-    int max_read = tty_masters[0];
+    /* Like arduino_batch's log directories, it's made if it isn't there */
+    if (NULL != output_dir) {
+        make_directory(output_dir);
+    }
 
-    /* Find the maximum file descriptor */
-    for (int i = 0; i < network.num_arduinos; ++i) {
-        if (max_read < tty_masters[i]) {
-            max_read = tty_masters[i];
+    for (size_t i = 0; NULL != output_dir && i < network->num_arduinos; ++i) {
+        if (NULL != simulator.cluster && simulator.cluster->remote[i]) {
+            continue;
         }
 
-        if (max_read < arduinos[i]->from_arduino) {
-            max_read = arduinos[i]->from_arduino;
+        size_t length = strlen(output_dir) + strlen(network->names[i]) + 16;
+        char *path = (char *)malloc(length);
+
+        snprintf(path, length, "%s/%s.serial", output_dir, network->names[i]);
+        simulator.serial_outputs[i] = fopen(path, "wb");
+
+        if (NULL == simulator.serial_outputs[i]) {
+            fprintf(stderr, "Could not open \"%s\"\n", path);
+            return STOP_ERROR;
         }
+
+        free(path);
     }
 
-    max_read++;
+    if (0 != depth) {
+        int status = explore_network(&simulator, argv[optind], depth, runs, workers, max_states, write_path);
+        free_simulator(&simulator);
 
-    while (1) {
-        /* Set up the read set */
-        FD_ZERO(&read_set);
+        return status;
+    }
 
-        for (int i = 0; i < network.num_arduinos; ++i) {
-            FD_SET(tty_masters[i], &read_set);
-            FD_SET(arduinos[i]->from_arduino, &read_set);
-        }
+    Schedule schedule;
 
-        /* Wait until something happens */
-        select(max_read, &read_set, NULL, NULL, NULL);
+    if (NULL != replay_path && -1 == read_schedule(replay_path, network, &schedule)) {
+        fprintf(stderr, "Could not read the schedule \"%s\"\n", replay_path);
+        return STOP_ERROR;
+    }
 
-        /* TTY to Arduino */
-        for (int i = 0; i < network.num_arduinos; ++i) {
-            if (FD_ISSET(tty_masters[i], &read_set)) {
-                char input;
-                int bytes_read = read(tty_masters[i], &input, sizeof(input));
+    start_simulator(&simulator);
+    int status;
 
-                if (-1 == bytes_read) {
-                    perror("Error reading from serial");
-                    exit(EXIT_FAILURE);
-                }
+    if (NULL != replay_path) {
+        status = replay_schedule(&simulator, &schedule);
 
-                arduinos[i]->serial_in[0]->append(input);
-            }
+        if (-1 == status) {
+            snprintf(simulator.stop.reason, sizeof(simulator.stop.reason), "end of the schedule");
+            status = simulator.status = simulator.stop.limit_status();
         }
 
-        /* Arduino doing something */
-        for (int i = 0; i < network.num_arduinos; ++i) {
-            if (FD_ISSET(arduinos[i]->from_arduino, &read_set)) {
-                arduinos[i]->run();
-
-                /* 4 is the number of ports on a mega */
-                for (int port = 0; port < 4; ++port) {
-                    if (arduinos[i]->serial_out[port]->available()) {
-                        char output = arduinos[i]->serial_out[port]->read();
-
-                        if (port == 0) {
-                            /* Write to pseudo TTY */
-                            write(tty_masters[i], &output, sizeof(output));
-                        }
-
-                        /* Find all serial connections */
-                        for (int j = 0; j < network.num_serial; ++j) {
-                            SerialConnection con = network.serial_ports[j];
-                        
-                            if (con.in_index == i && con.in_port == 0) {
-                                int out = con.out_index;
-
-                                arduinos[out]->serial_in[con.out_port]->append(output);
-                            }
-                            else if (con.out_index == i && con.out_port == 0) {
-                                int in = con.in_index;
-
-                                arduinos[in]->serial_in[con.in_port]->append(output);
-                            }
-                        }
-                    }
-                }
-            }
-        }
+        free_schedule(&schedule);
+    }
+    else {
+        status = run_simulator(&simulator, NULL, NULL);
+    }
 
-        /* Something happened, so we should try to map all of the pins */
-        for (int i = 0; i < network.num_pins; ++i) {
-            PinConnection con = network.pins[i];
-            int pin_value = arduinos[con.out_index]->pins[con.out_pin];
+    finish_simulator(&simulator);
+    free_simulator(&simulator);
 
-            /* Write to the input pin */
-            arduinos[con.in_index]->pins[con.in_pin] = pin_value;
-        }
-    }
+    free(input_options);
+    free(pin_options);
+    free(output_options);
 
-    free_network(&network);
-    return 0;
+    return status;
 }
@@ -0,0 +1,150 @@
+/* Copyright (C) 2013 Calvin Beck
+
+  Permission is hereby granted, free of charge, to any person
+  obtaining a copy of this software and associated documentation files
+  (the "Software"), to deal in the Software without restriction,
+  including without limitation the rights to use, copy, modify, merge,
+  publish, distribute, sublicense, and/or sell copies of the Software,
+  and to permit persons to whom the Software is furnished to do so,
+  subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be
+  included in all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+  EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+  MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+  NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+  BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+  ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+  CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+  SOFTWARE.
+
+*/
+
+#include "network_buses.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+
+
+/* The I2C bus with a given number, made if it doesn't exist yet */
+static I2CBus *i2c_bus(NetworkBuses *buses, uint32_t number)
+{
+    for (size_t k = 0; k < buses->num_i2c; ++k) {
+        if (number == buses->i2c_numbers[k]) {
+            return buses->i2c[k];
+        }
+    }
+
+    buses->i2c_numbers = (uint32_t *)realloc(buses->i2c_numbers, sizeof(buses->i2c_numbers[0]) * (buses->num_i2c + 1));
+    buses->i2c = (I2CBus **)realloc(buses->i2c, sizeof(buses->i2c[0]) * (buses->num_i2c + 1));
+
+    if (NULL == buses->i2c_numbers || NULL == buses->i2c) {
+        perror("Could not allocate I2C bus");
+        exit(EXIT_FAILURE);
+    }
+
+    buses->i2c_numbers[buses->num_i2c] = number;
+    buses->i2c[buses->num_i2c] = new I2CBus();
+
+    return buses->i2c[buses->num_i2c++];
+}
+
+
+static DeviceModel *make_model(ArduinoNetwork *network, size_t d)
+{
+    BusDevice device = network->devices[d];
+
+    if (DEVICE_EEPROM == device.model) {
+        return new EepromModel(device.size);
+    }
+
+    SensorModel *sensor = new SensorModel();
+
+    for (size_t k = 0; k < network->num_registers; ++k) {
+        if (d == network->registers[k].device) {
+            sensor->registers[network->registers[k].reg] = network->registers[k].value;
+        }
+    }
+
+    return sensor;
+}
+
+
+void init_buses(NetworkBuses *buses, ArduinoNetwork *network, ArduinoMega **arduinos)
+{
+    buses->i2c_numbers = NULL;
+    buses->i2c = NULL;
+    buses->num_i2c = 0;
+
+    buses->num_arduinos = network->num_arduinos;
+    buses->spi = (SPIBus **)calloc(network->num_arduinos + 1, sizeof(SPIBus *));
+    buses->models = (DeviceModel **)malloc(sizeof(DeviceModel *) * (network->num_devices + 1));
+    buses->num_models = 0;
+
+    if (NULL == buses->spi || NULL == buses->models) {
+        perror("Could not allocate buses");
+        exit(EXIT_FAILURE);
+    }
+
+    for (size_t k = 0; k < network->num_wires; ++k) {
+        WireConnection wire = network->wires[k];
+
+        if (wire.index < network->num_arduinos) {
+            arduinos[wire.index]->wire_bus = i2c_bus(buses, wire.bus);
+        }
+    }
+
+    for (size_t d = 0; d < network->num_devices; ++d) {
+        BusDevice device = network->devices[d];
+
+        if (device.spi) {
+            if (device.index >= network->num_arduinos || device.address >= ArduinoMega::NUM_PINS) {
+                fprintf(stderr, "Skipping SPI device on a pin that doesn't exist\n");
+                continue;
+            }
+
+            if (NULL == buses->spi[device.index]) {
+                buses->spi[device.index] = new SPIBus();
+                arduinos[device.index]->spi_bus = buses->spi[device.index];
+            }
+
+            buses->models[buses->num_models] = make_model(network, d);
+            buses->spi[device.index]->add(buses->models[buses->num_models++], device.address);
+        }
+        else {
+            I2CBus *bus = i2c_bus(buses, device.bus);
+
+            if (device.address >= I2CBus::NUM_ADDRESSES || NULL != bus->devices[device.address]) {
+                fprintf(stderr, "Skipping I2C device at 0x%02X on bus %u, the address is taken or too big\n",
+                        device.address, device.bus);
+                continue;
+            }
+
+            buses->models[buses->num_models] = make_model(network, d);
+            bus->devices[device.address] = buses->models[buses->num_models++];
+        }
+    }
+}
+
+
+void free_buses(NetworkBuses *buses)
+{
+    for (size_t k = 0; k < buses->num_i2c; ++k) {
+        delete buses->i2c[k];
+    }
+
+    for (size_t i = 0; i < buses->num_arduinos; ++i) {
+        delete buses->spi[i];
+    }
+
+    for (size_t k = 0; k < buses->num_models; ++k) {
+        delete buses->models[k];
+    }
+
+    free(buses->i2c_numbers);
+    free(buses->i2c);
+    free(buses->spi);
+    free(buses->models);
+}
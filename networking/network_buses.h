@@ -0,0 +1,55 @@
+/* Copyright (C) 2013 Calvin Beck
+
+  Permission is hereby granted, free of charge, to any person
+  obtaining a copy of this software and associated documentation files
+  (the "Software"), to deal in the Software without restriction,
+  including without limitation the rights to use, copy, modify, merge,
+  publish, distribute, sublicense, and/or sell copies of the Software,
+  and to permit persons to whom the Software is furnished to do so,
+  subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be
+  included in all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+  EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+  MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+  NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+  BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+  ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+  CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+  SOFTWARE.
+
+*/
+
+#ifndef NETWORK_BUSES_H
+#define NETWORK_BUSES_H
+
+#include "network_parse.h"
+#include <emulard/fakeduino.h>
+
+
+/*
+  The Wire and SPI buses declared for a network, and the device
+  models on them. Each I2C bus number gets one I2CBus shared by the
+  Arduinos on it, and each Arduino with SPI devices gets its own
+  SPIBus.
+ */
+typedef struct NetworkBuses {
+    uint32_t *i2c_numbers;
+    I2CBus **i2c;
+    size_t num_i2c;
+
+    SPIBus **spi;  /* Indexed by Arduino, NULL for Arduinos without SPI devices */
+    size_t num_arduinos;
+
+    DeviceModel **models;
+    size_t num_models;
+} NetworkBuses;
+
+
+/* Build the buses and devices for a network, and hook the Arduinos up to them */
+void init_buses(NetworkBuses *buses, ArduinoNetwork *network, ArduinoMega **arduinos);
+void free_buses(NetworkBuses *buses);
+
+#endif
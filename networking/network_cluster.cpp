@@ -0,0 +1,655 @@
+/* Copyright (C) 2013 Calvin Beck
+
+  Permission is hereby granted, free of charge, to any person
+  obtaining a copy of this software and associated documentation files
+  (the "Software"), to deal in the Software without restriction,
+  including without limitation the rights to use, copy, modify, merge,
+  publish, distribute, sublicense, and/or sell copies of the Software,
+  and to permit persons to whom the Software is furnished to do so,
+  subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be
+  included in all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+  EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+  MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+  NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+  BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+  ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+  CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+  SOFTWARE.
+
+*/
+
+#include "network_cluster.h"
+#include "network_placement.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <sys/socket.h>
+
+
+/* "EMDF", at the start of every frame */
+#define FRAME_MAGIC 0x46444D45
+
+/* How long to keep trying to reach a server that isn't listening yet */
+#define CONNECT_SECONDS 60
+
+
+/* What servers say first, so each knows who the other is and that they agree */
+typedef struct Handshake {
+    uint32_t magic;
+    uint32_t rank;
+    uint32_t num_servers;
+    uint32_t num_arduinos;
+    uint32_t num_pins;
+    uint32_t num_serial;
+} Handshake;
+
+
+int parse_cluster(Cluster *cluster, const char *spec)
+{
+    char *end;
+
+    cluster->rank = strtoul(spec, &end, 10);
+    cluster->num_servers = 0;
+    cluster->addresses = NULL;
+    cluster->peers = NULL;
+    cluster->owners = NULL;
+    cluster->remote = NULL;
+    cluster->terminal_servers = NULL;
+
+    if (end == spec || ':' != *end) {
+        return -1;
+    }
+
+    char *addresses = strdup(end + 1);
+    char *save;
+
+    for (char *address = strtok_r(addresses, ",", &save); NULL != address; address = strtok_r(NULL, ",", &save)) {
+        if (NULL == strrchr(address, ':') || CLUSTER_MAX_SERVERS == cluster->num_servers) {
+            free(addresses);
+            return -1;
+        }
+
+        cluster->addresses = (char **)realloc(cluster->addresses, sizeof(char *) * (cluster->num_servers + 1));
+        cluster->addresses[cluster->num_servers++] = strdup(address);
+    }
+
+    free(addresses);
+
+    if (cluster->rank >= cluster->num_servers) {
+        return -1;
+    }
+
+    cluster->peers = (ClusterPeer *)calloc(cluster->num_servers, sizeof(ClusterPeer));
+
+    for (size_t k = 0; k < cluster->num_servers; ++k) {
+        cluster->peers[k].fd = -1;
+    }
+
+    return 0;
+}
+
+
+void free_cluster(Cluster *cluster)
+{
+    for (size_t k = 0; k < cluster->num_servers; ++k) {
+        if (-1 != cluster->peers[k].fd) {
+            close(cluster->peers[k].fd);
+        }
+
+        free(cluster->peers[k].records);
+        free(cluster->peers[k].input);
+        free(cluster->addresses[k]);
+    }
+
+    free(cluster->addresses);
+    free(cluster->peers);
+    free(cluster->owners);
+    free(cluster->remote);
+    free(cluster->terminal_servers);
+}
+
+
+void partition_cluster(Cluster *cluster, ArduinoNetwork *network)
+{
+    size_t count = network->num_arduinos;
+    size_t *order = connection_order(network);
+
+    cluster->num_arduinos = count;
+    cluster->owners = (size_t *)malloc(sizeof(size_t) * (count + 1));
+    cluster->remote = (uint8_t *)calloc(count + 1, sizeof(uint8_t));
+
+    for (size_t k = 0; k < count; ++k) {
+        size_t i = order[k];
+
+        cluster->owners[i] = k * cluster->num_servers / count;
+        cluster->remote[i] = cluster->owners[i] != cluster->rank;
+    }
+
+    free(order);
+
+    /* Each bus's first Arduino, to spot buses that cross servers */
+    for (size_t k = 0; k < network->num_wires; ++k) {
+        for (size_t j = 0; j < k; ++j) {
+            WireConnection a = network->wires[j];
+            WireConnection b = network->wires[k];
+
+            if (a.bus == b.bus) {
+                if (cluster->owners[a.index] != cluster->owners[b.index]) {
+                    fprintf(stderr, "I2C bus %u is split between servers, Wire won't get across\n", b.bus);
+                }
+
+                break;
+            }
+        }
+    }
+}
+
+
+void plan_boundary(Cluster *cluster, PinNets *nets)
+{
+    uint64_t *net_servers = (uint64_t *)calloc(nets->num_nets + 1, sizeof(uint64_t));
+
+    cluster->terminal_servers = (uint64_t *)calloc(nets->num_terminals + 1, sizeof(uint64_t));
+
+    if (NULL == net_servers || NULL == cluster->terminal_servers) {
+        perror("Could not plan the cluster's boundary");
+        exit(EXIT_FAILURE);
+    }
+
+    for (size_t t = 0; t < nets->num_terminals; ++t) {
+        net_servers[nets->terminals[t].net] |= 1ULL << cluster->owners[nets->terminals[t].index];
+    }
+
+    for (size_t t = 0; t < nets->num_terminals; ++t) {
+        uint64_t servers = net_servers[nets->terminals[t].net];
+
+        for (size_t l = nets->terminals[t].first_link; NETS_END != l; l = nets->links[l].next) {
+            servers |= net_servers[nets->terminals[nets->links[l].to].net];
+        }
+
+        cluster->terminal_servers[t] = servers & ~(1ULL << cluster->rank);
+    }
+
+    free(net_servers);
+}
+
+
+/* Write all of a buffer to a blocking socket */
+static void send_all(int fd, const void *data, size_t length)
+{
+    const uint8_t *bytes = (const uint8_t *)data;
+
+    while (length > 0) {
+        ssize_t sent = write(fd, bytes, length);
+
+        if (-1 == sent) {
+            perror("Could not write to server");
+            exit(EXIT_FAILURE);
+        }
+
+        bytes += sent;
+        length -= sent;
+    }
+}
+
+
+/* Read exactly `length` bytes from a blocking socket */
+static void receive_all(int fd, void *data, size_t length)
+{
+    uint8_t *bytes = (uint8_t *)data;
+
+    while (length > 0) {
+        ssize_t got = read(fd, bytes, length);
+
+        if (got <= 0) {
+            fprintf(stderr, "Lost a server while connecting\n");
+            exit(EXIT_FAILURE);
+        }
+
+        bytes += got;
+        length -= got;
+    }
+}
+
+
+/* Resolve "<host>:<port>", for listening on if `passive` is set */
+static struct addrinfo *resolve(const char *address, int passive)
+{
+    char *host = strdup(address);
+    char *port = strrchr(host, ':');
+    struct addrinfo hints;
+    struct addrinfo *result = NULL;
+
+    *port++ = '\0';
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = passive ? AI_PASSIVE : 0;
+
+    int error = getaddrinfo(passive ? NULL : host, port, &hints, &result);
+
+    if (0 != error) {
+        fprintf(stderr, "Could not resolve \"%s\": %s\n", address, gai_strerror(error));
+        exit(EXIT_FAILURE);
+    }
+
+    free(host);
+    return result;
+}
+
+
+/* Frames are small and every step waits on them, so they go out at once */
+static void tune_socket(int fd)
+{
+    int on = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+}
+
+
+void connect_cluster(Cluster *cluster, ArduinoNetwork *network)
+{
+    Handshake mine = {FRAME_MAGIC, (uint32_t)cluster->rank, (uint32_t)cluster->num_servers,
+                      (uint32_t)network->num_arduinos, (uint32_t)network->num_pins, (uint32_t)network->num_serial};
+
+    /* Listen first, so that the servers after us can connect whenever they get going */
+    struct addrinfo *local = resolve(cluster->addresses[cluster->rank], 1);
+    int listener = socket(local->ai_family, local->ai_socktype, local->ai_protocol);
+    int on = 1;
+
+    setsockopt(listener, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+
+    if (-1 == listener || -1 == bind(listener, local->ai_addr, local->ai_addrlen) || -1 == listen(listener, cluster->num_servers)) {
+        perror("Could not listen for servers");
+        exit(EXIT_FAILURE);
+    }
+
+    freeaddrinfo(local);
+
+    /* Connect to the servers before us... */
+    for (size_t k = 0; k < cluster->rank; ++k) {
+        struct addrinfo *remote = resolve(cluster->addresses[k], 0);
+        int fd = -1;
+
+        for (int attempt = 0; -1 == fd && attempt < 10 * CONNECT_SECONDS; ++attempt) {
+            fd = socket(remote->ai_family, remote->ai_socktype, remote->ai_protocol);
+
+            if (-1 != fd && -1 == connect(fd, remote->ai_addr, remote->ai_addrlen)) {
+                close(fd);
+                fd = -1;
+                usleep(100000);
+            }
+        }
+
+        if (-1 == fd) {
+            fprintf(stderr, "Could not reach server %lu at %s\n", (unsigned long)k, cluster->addresses[k]);
+            exit(EXIT_FAILURE);
+        }
+
+        freeaddrinfo(remote);
+        send_all(fd, &mine, sizeof(mine));
+        cluster->peers[k].fd = fd;
+    }
+
+    /* ...and wait for the ones after us to connect */
+    for (size_t k = cluster->rank + 1; k < cluster->num_servers; ++k) {
+        int fd = accept(listener, NULL, NULL);
+
+        if (-1 == fd) {
+            perror("Could not accept a server");
+            exit(EXIT_FAILURE);
+        }
+
+        Handshake theirs;
+        receive_all(fd, &theirs, sizeof(theirs));
+
+        if (FRAME_MAGIC != theirs.magic || theirs.rank <= cluster->rank || theirs.rank >= cluster->num_servers
+            || -1 != cluster->peers[theirs.rank].fd || theirs.num_servers != mine.num_servers
+            || theirs.num_arduinos != mine.num_arduinos || theirs.num_pins != mine.num_pins
+            || theirs.num_serial != mine.num_serial) {
+            fprintf(stderr, "Server %u isn't running the same network\n", theirs.rank);
+            exit(EXIT_FAILURE);
+        }
+
+        cluster->peers[theirs.rank].fd = fd;
+    }
+
+    close(listener);
+
+    for (size_t k = 0; k < cluster->num_servers; ++k) {
+        if (k != cluster->rank) {
+            tune_socket(cluster->peers[k].fd);
+            fcntl(cluster->peers[k].fd, F_SETFL, fcntl(cluster->peers[k].fd, F_GETFL) | O_NONBLOCK);
+        }
+    }
+}
+
+
+/* Queue a record for a server's next frame */
+static void add_record(ClusterPeer *peer, BoundaryRecord record)
+{
+    if (peer->num_records == peer->records_size) {
+        peer->records_size = peer->records_size ? 2 * peer->records_size : 64;
+        peer->records = (BoundaryRecord *)realloc(peer->records, sizeof(BoundaryRecord) * peer->records_size);
+
+        if (NULL == peer->records) {
+            perror("Could not queue boundary records");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    peer->records[peer->num_records++] = record;
+}
+
+
+/* Queue a record for every server in `servers` */
+static void add_records(Cluster *cluster, uint64_t servers, BoundaryRecord record)
+{
+    for (size_t k = 0; servers; ++k, servers >>= 1) {
+        if (servers & 1) {
+            add_record(&cluster->peers[k], record);
+        }
+    }
+}
+
+
+void hold_boundary(Cluster *cluster, ArduinoMega **arduinos, PinNets *nets)
+{
+    for (size_t i = 0; i < cluster->num_arduinos; ++i) {
+        ArduinoMega *arduino = arduinos[i];
+
+        if (cluster->remote[i]) {
+            continue;
+        }
+
+        for (int k = 0; k < arduino->num_drive_changes; ++k) {
+            uint8_t pin = arduino->drive_changes[k];
+            NetTerminal *terminal = find_terminal(nets, i, pin);
+
+            if (NULL != terminal) {
+                BoundaryRecord record = {(uint32_t)i, arduino->outputs[pin], BOUNDARY_DRIVE, pin, arduino->pin_modes[pin], 0};
+                add_records(cluster, cluster->terminal_servers[terminal - nets->terminals], record);
+            }
+        }
+
+        if (-1 != arduino->soft_pending_port) {
+            uint8_t pin = arduino->soft_tx[arduino->soft_pending_port];
+            NetTerminal *terminal = find_terminal(nets, i, pin);
+            BoundaryRecord record = {(uint32_t)i, arduino->soft_pending_value, BOUNDARY_SOFT, pin, 0, 0};
+
+            add_records(cluster, cluster->terminal_servers[terminal - nets->terminals], record);
+        }
+    }
+}
+
+
+/* Size of the frame at the start of a peer's input, or 0 if its header isn't in yet */
+static size_t frame_size(ClusterPeer *peer)
+{
+    if (peer->input_fill < sizeof(FrameHeader)) {
+        return 0;
+    }
+
+    FrameHeader *header = (FrameHeader *)peer->input;
+
+    if (FRAME_MAGIC != header->magic) {
+        fprintf(stderr, "Garbled frame from a server\n");
+        exit(EXIT_FAILURE);
+    }
+
+    return sizeof(FrameHeader) + header->reason_length + sizeof(BoundaryRecord) * header->num_records;
+}
+
+
+/* Whether a whole frame from this peer has been read */
+static int frame_ready(ClusterPeer *peer)
+{
+    size_t size = frame_size(peer);
+    return 0 != size && peer->input_fill >= size;
+}
+
+
+/*
+  Send every other server its frame, and read one from each of them.
+  Both happen together, so two servers with big frames for each other
+  can't both be stuck writing.
+ */
+static void swap_frames(Cluster *cluster, FrameHeader *header, const char *reason)
+{
+    size_t count = cluster->num_servers;
+    uint8_t **frames = (uint8_t **)calloc(count, sizeof(uint8_t *));
+    size_t *lengths = (size_t *)calloc(count, sizeof(size_t));
+    size_t *sent = (size_t *)calloc(count, sizeof(size_t));
+    struct pollfd *polls = (struct pollfd *)calloc(count, sizeof(struct pollfd));
+
+    for (size_t k = 0; k < count; ++k) {
+        ClusterPeer *peer = &cluster->peers[k];
+
+        if (k == cluster->rank) {
+            continue;
+        }
+
+        header->num_records = peer->num_records;
+        lengths[k] = sizeof(FrameHeader) + header->reason_length + sizeof(BoundaryRecord) * peer->num_records;
+        frames[k] = (uint8_t *)malloc(lengths[k]);
+
+        memcpy(frames[k], header, sizeof(FrameHeader));
+        memcpy(frames[k] + sizeof(FrameHeader), reason, header->reason_length);
+        memcpy(frames[k] + sizeof(FrameHeader) + header->reason_length, peer->records,
+               sizeof(BoundaryRecord) * peer->num_records);
+
+        peer->num_records = 0;
+    }
+
+    while (1) {
+        int waiting = 0;
+
+        for (size_t k = 0; k < count; ++k) {
+            ClusterPeer *peer = &cluster->peers[k];
+
+            polls[k].fd = -1;
+            polls[k].events = 0;
+
+            if (k == cluster->rank) {
+                continue;
+            }
+
+            if (sent[k] < lengths[k]) {
+                polls[k].events |= POLLOUT;
+            }
+
+            if (!frame_ready(peer)) {
+                polls[k].events |= POLLIN;
+            }
+
+            if (0 != polls[k].events) {
+                polls[k].fd = peer->fd;
+                waiting = 1;
+            }
+        }
+
+        if (!waiting) {
+            break;
+        }
+
+        if (-1 == poll(polls, count, -1)) {
+            if (EINTR == errno) {
+                continue;
+            }
+
+            perror("Could not wait on the servers");
+            exit(EXIT_FAILURE);
+        }
+
+        for (size_t k = 0; k < count; ++k) {
+            ClusterPeer *peer = &cluster->peers[k];
+
+            if (k == cluster->rank) {
+                continue;
+            }
+
+            if ((polls[k].events & POLLOUT) && (polls[k].revents & (POLLOUT | POLLERR | POLLHUP))) {
+                ssize_t wrote = write(peer->fd, frames[k] + sent[k], lengths[k] - sent[k]);
+
+                if (-1 == wrote && EAGAIN != errno) {
+                    fprintf(stderr, "Lost server %lu\n", (unsigned long)k);
+                    exit(EXIT_FAILURE);
+                }
+
+                sent[k] += -1 == wrote ? 0 : wrote;
+            }
+
+            if ((polls[k].events & POLLIN) && (polls[k].revents & (POLLIN | POLLERR | POLLHUP))) {
+                size_t wanted = frame_size(peer);
+
+                if (peer->input_size < peer->input_fill + 4096 || peer->input_size < wanted) {
+                    peer->input_size = 2 * (peer->input_size > wanted ? peer->input_size : wanted) + 4096;
+                    peer->input = (uint8_t *)realloc(peer->input, peer->input_size);
+                }
+
+                ssize_t got = read(peer->fd, peer->input + peer->input_fill, peer->input_size - peer->input_fill);
+
+                if (0 == got || (-1 == got && EAGAIN != errno)) {
+                    fprintf(stderr, "Lost server %lu\n", (unsigned long)k);
+                    exit(EXIT_FAILURE);
+                }
+
+                peer->input_fill += -1 == got ? 0 : got;
+            }
+        }
+    }
+
+    for (size_t k = 0; k < count; ++k) {
+        free(frames[k]);
+    }
+
+    free(frames);
+    free(lengths);
+    free(sent);
+    free(polls);
+}
+
+
+/* Play a frame's records into the ghosts, and drop it from the peer's input */
+static void play_frame(ClusterPeer *peer, ArduinoMega **arduinos, PinNets *nets, unsigned long long end)
+{
+    FrameHeader *header = (FrameHeader *)peer->input;
+    BoundaryRecord *records = (BoundaryRecord *)(peer->input + sizeof(FrameHeader) + header->reason_length);
+    size_t size = frame_size(peer);
+
+    /* Drives first, so SoftwareSerial bytes find the nets as they are now */
+    for (size_t r = 0; r < header->num_records; ++r) {
+        BoundaryRecord record = records[r];
+        ArduinoMega *ghost = arduinos[record.index];
+
+        if (BOUNDARY_DRIVE == record.kind) {
+            ghost->pin_modes[record.pin] = record.mode;
+            ghost->outputs[record.pin] = record.value;
+            ghost->drive_changed(record.pin);
+        }
+        else if (BOUNDARY_SERIAL == record.kind) {
+            arduinos[record.index]->serial_in[record.pin]->append(record.value);
+        }
+    }
+
+    for (size_t r = 0; r < header->num_records; ++r) {
+        if (BOUNDARY_DRIVE == records[r].kind) {
+            update_nets(nets, arduinos, records[r].index, end);
+        }
+    }
+
+    for (size_t r = 0; r < header->num_records; ++r) {
+        BoundaryRecord record = records[r];
+
+        if (BOUNDARY_SOFT == record.kind) {
+            relay_soft_serial(nets, arduinos, record.index, record.pin, record.value, end);
+        }
+    }
+
+    memmove(peer->input, peer->input + size, peer->input_fill - size);
+    peer->input_fill -= size;
+}
+
+
+int trade_boundary(Cluster *cluster, ArduinoMega **arduinos, PinNets *nets, unsigned long long end,
+                   StopConditions *stop, int status)
+{
+    /* Whatever the routes left in the ghosts' serial buffers goes to their servers */
+    for (size_t i = 0; i < cluster->num_arduinos; ++i) {
+        if (!cluster->remote[i]) {
+            continue;
+        }
+
+        for (int port = 0; port < ArduinoMega::NUM_SERIAL; ++port) {
+            SerialBuffer *buffer = arduinos[i]->serial_in[port];
+
+            while (buffer->available()) {
+                BoundaryRecord record = {(uint32_t)i, buffer->read(), BOUNDARY_SERIAL, (uint8_t)port, 0, 0};
+                add_record(&cluster->peers[cluster->owners[i]], record);
+            }
+        }
+    }
+
+    FrameHeader header;
+    memset(&header, 0, sizeof(header));
+
+    header.magic = FRAME_MAGIC;
+    header.end = end;
+    header.goal = -1 != status || stop->check_pins(arduinos);
+    header.limit = stop->check_limits(arduinos, cluster->num_arduinos);
+    header.failed = STOP_ERROR == status;
+    header.reason_length = header.goal ? strlen(stop->reason) : 0;
+
+    int goal = header.goal;
+    int limit = header.limit;
+    int failed = header.failed;
+
+    swap_frames(cluster, &header, stop->reason);
+
+    /* In rank order, so every server plays them the same way */
+    for (size_t k = 0; k < cluster->num_servers; ++k) {
+        ClusterPeer *peer = &cluster->peers[k];
+
+        if (k == cluster->rank) {
+            continue;
+        }
+
+        FrameHeader *theirs = (FrameHeader *)peer->input;
+
+        if (theirs->end != end) {
+            fprintf(stderr, "Server %lu is out of step\n", (unsigned long)k);
+            exit(EXIT_FAILURE);
+        }
+
+        if (theirs->goal && !goal) {
+            size_t length = theirs->reason_length < sizeof(stop->reason) - 1 ? theirs->reason_length : sizeof(stop->reason) - 1;
+
+            memcpy(stop->reason, peer->input + sizeof(FrameHeader), length);
+            stop->reason[length] = '\0';
+        }
+
+        goal |= theirs->goal;
+        limit &= theirs->limit;
+        failed |= theirs->failed;
+
+        play_frame(peer, arduinos, nets, end);
+    }
+
+    if (goal) {
+        return failed ? STOP_ERROR : STOP_GOAL;
+    }
+
+    return limit ? stop->limit_status() : -1;
+}
@@ -0,0 +1,159 @@
+/* Copyright (C) 2013 Calvin Beck
+
+  Permission is hereby granted, free of charge, to any person
+  obtaining a copy of this software and associated documentation files
+  (the "Software"), to deal in the Software without restriction,
+  including without limitation the rights to use, copy, modify, merge,
+  publish, distribute, sublicense, and/or sell copies of the Software,
+  and to permit persons to whom the Software is furnished to do so,
+  subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be
+  included in all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+  EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+  MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+  NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+  BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+  ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+  CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+  SOFTWARE.
+
+*/
+
+#ifndef NETWORK_CLUSTER_H
+#define NETWORK_CLUSTER_H
+
+#include "network_parse.h"
+#include "network_nets.h"
+#include <emulard/fakeduino.h>
+#include <emulard/stop_conditions.h>
+
+#include <stdint.h>
+
+
+/*
+  Running one network on several servers.
+
+  Every server loads the whole network, and the Arduinos are split
+  between them in runs of the order connection_order() walks them in,
+  so most connections stay on one server. A server only launches its
+  own Arduinos. The others are ghosts, ArduinoMegas without a process,
+  that stand in for them in its nets and serial routes.
+
+  The servers run in lockstep, and the end of each step is where they
+  meet: each one sends every other one a single frame, holding
+
+  - the drive changes of its pins whose nets (or the nets past their
+    links) the other server has pins on,
+  - the SoftwareSerial bytes written on those pins,
+  - the serial bytes its routes delivered to the other server's
+    Arduinos' ghosts,
+  - and whether it has met a goal or reached the limits,
+
+  and doesn't go on to the next step until it has a frame from every
+  other one. Everything in a frame is played into the ghosts before
+  the step's wake-ups, so the servers agree on every net and stop on
+  the same step. Wire buses aren't carried between servers.
+
+  The servers have to be the same build on the same kind of machine,
+  since frames are sent as they are laid out in memory.
+ */
+
+/* Most servers a cluster can have, so the ones a pin matters to fit in a mask */
+#define CLUSTER_MAX_SERVERS 64
+
+/* Kinds of boundary record */
+#define BOUNDARY_DRIVE 1   /* Arduino `index` has `value` written to pin `pin`, which is in `mode` */
+#define BOUNDARY_SOFT 2    /* Arduino `index` wrote `value` with SoftwareSerial on TX pin `pin` */
+#define BOUNDARY_SERIAL 3  /* `value` arrived for serial port `pin` on Arduino `index` */
+
+typedef struct BoundaryRecord {
+    uint32_t index;
+    int32_t value;
+    uint8_t kind;
+    uint8_t pin;
+    uint8_t mode;
+    uint8_t unused;
+} BoundaryRecord;
+
+
+/* Starts every frame, and is followed by the reason and then the records */
+typedef struct FrameHeader {
+    uint32_t magic;
+    uint32_t num_records;
+    uint64_t end;            /* The step it ends, to be sure the servers are in step */
+    uint8_t goal;
+    uint8_t limit;
+    uint8_t failed;          /* An Arduino died, and stopped the run */
+    uint16_t reason_length;  /* Why the server is stopping, if it met a goal or failed */
+} FrameHeader;
+
+
+typedef struct ClusterPeer {
+    int fd;
+
+    /* Records waiting for the next frame to this server */
+    BoundaryRecord *records;
+    size_t num_records;
+    size_t records_size;
+
+    /* Bytes read from this server, which can run past the frame into the next one */
+    uint8_t *input;
+    size_t input_fill;
+    size_t input_size;
+} ClusterPeer;
+
+
+typedef struct Cluster {
+    size_t rank;
+    size_t num_servers;
+    char **addresses;  /* "<host>:<port>" of every server, by rank */
+    ClusterPeer *peers;
+
+    size_t num_arduinos;
+    size_t *owners;    /* Server each Arduino runs on */
+    uint8_t *remote;   /* Set for the Arduinos other servers run */
+
+    /* Servers that a drive change on each terminal matters to */
+    uint64_t *terminal_servers;
+} Cluster;
+
+
+/*
+  Read "<rank>:<host>:<port>,<host>:<port>,..." -- this server's rank,
+  and then where every server in the cluster listens. Returns -1 if it
+  doesn't make sense.
+ */
+int parse_cluster(Cluster *cluster, const char *spec);
+void free_cluster(Cluster *cluster);
+
+/* Split the Arduinos between the servers */
+void partition_cluster(Cluster *cluster, ArduinoNetwork *network);
+
+/* Work out which servers each terminal's changes go to, once the nets are built */
+void plan_boundary(Cluster *cluster, PinNets *nets);
+
+/*
+  Connect to every other server, which all have to be running the
+  same network. Exits if they can't be reached.
+ */
+void connect_cluster(Cluster *cluster, ArduinoNetwork *network);
+
+/*
+  Take this server's drive changes and SoftwareSerial writes for the
+  step, before finish_step() uses them up.
+ */
+void hold_boundary(Cluster *cluster, ArduinoMega **arduinos, PinNets *nets);
+
+/*
+  Trade frames with the other servers at the end of the step `end`,
+  and play theirs into the ghosts. `status` is STOP_GOAL if one of our
+  output goals was met. Returns the status every server stops with,
+  or -1 to keep going.
+ */
+int trade_boundary(Cluster *cluster, ArduinoMega **arduinos, PinNets *nets, unsigned long long end,
+                   StopConditions *stop, int status);
+
+#endif
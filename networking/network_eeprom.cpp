@@ -0,0 +1,163 @@
+/* Copyright (C) 2013 Calvin Beck
+
+  Permission is hereby granted, free of charge, to any person
+  obtaining a copy of this software and associated documentation files
+  (the "Software"), to deal in the Software without restriction,
+  including without limitation the rights to use, copy, modify, merge,
+  publish, distribute, sublicense, and/or sell copies of the Software,
+  and to permit persons to whom the Software is furnished to do so,
+  subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be
+  included in all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+  EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+  MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+  NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+  BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+  ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+  CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+  SOFTWARE.
+
+*/
+
+#include "network_eeprom.h"
+#include <emulard/protocol/commands.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+
+
+/* Caller frees */
+static char *wear_path(const char *path)
+{
+    size_t length = strlen(path) + sizeof(EEPROM_WEAR_SUFFIX);
+    char *wear = (char *)malloc(length);
+
+    snprintf(wear, length, "%s%s", path, EEPROM_WEAR_SUFFIX);
+
+    return wear;
+}
+
+
+/* Make the wear file the right size, and clear it if `reset` is set */
+static void prepare_wear(const char *path, int reset)
+{
+    char *wear = wear_path(path);
+    int fd = open(wear, O_RDWR | O_CREAT | (reset ? O_TRUNC : 0), 0644);
+
+    if (-1 == fd || -1 == ftruncate(fd, EEPROM_SIZE * sizeof(uint32_t))) {
+        perror("Could not set up EEPROM wear counts");
+        exit(EXIT_FAILURE);
+    }
+
+    close(fd);
+    free(wear);
+}
+
+
+static void prepare_eeprom(const char *path, const char *seed)
+{
+    uint8_t cells[EEPROM_SIZE];
+    size_t length = 0;
+
+    int fd = open(path, O_RDWR | O_CREAT, 0644);
+
+    if (-1 == fd) {
+        perror("Could not open EEPROM");
+        exit(EXIT_FAILURE);
+    }
+
+    if (NULL != seed) {
+        FILE *seed_file = fopen(seed, "rb");
+
+        if (NULL == seed_file) {
+            perror("Could not open EEPROM seed");
+            exit(EXIT_FAILURE);
+        }
+
+        length = fread(cells, 1, sizeof(cells), seed_file);
+        fclose(seed_file);
+    }
+    else {
+        /* Keep what is there already */
+        struct stat info;
+
+        if (-1 == fstat(fd, &info)) {
+            perror("Could not open EEPROM");
+            exit(EXIT_FAILURE);
+        }
+
+        length = (size_t)info.st_size < sizeof(cells) ? info.st_size : sizeof(cells);
+
+        if (length != (size_t)pread(fd, cells, length, 0)) {
+            perror("Could not read EEPROM");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    /* Anything the file didn't have is erased */
+    memset(cells + length, 0xFF, sizeof(cells) - length);
+
+    if (sizeof(cells) != (size_t)pwrite(fd, cells, sizeof(cells), 0) || -1 == ftruncate(fd, sizeof(cells))) {
+        perror("Could not write EEPROM");
+        exit(EXIT_FAILURE);
+    }
+
+    close(fd);
+
+    prepare_wear(path, NULL != seed);
+}
+
+
+void prepare_eeproms(ArduinoNetwork *network, const uint8_t *remote)
+{
+    for (size_t i = 0; i < network->num_arduinos; ++i) {
+        if (NULL != network->eeproms[i] && (NULL == remote || !remote[i])) {
+            prepare_eeprom(network->eeproms[i], network->eeprom_seeds[i]);
+        }
+    }
+}
+
+
+void print_eeprom_wear(ArduinoNetwork *network, const uint8_t *remote)
+{
+    for (size_t i = 0; i < network->num_arduinos; ++i) {
+        if (NULL == network->eeproms[i] || (NULL != remote && remote[i])) {
+            continue;
+        }
+
+        uint32_t wear[EEPROM_SIZE];
+        char *path = wear_path(network->eeproms[i]);
+        FILE *wear_file = fopen(path, "rb");
+
+        free(path);
+
+        if (NULL == wear_file) {
+            continue;
+        }
+
+        size_t count = fread(wear, sizeof(wear[0]), EEPROM_SIZE, wear_file);
+        fclose(wear_file);
+
+        unsigned long long total = 0;
+        size_t worst = 0;
+
+        for (size_t address = 0; address < count; ++address) {
+            total += wear[address];
+
+            if (wear[address] > wear[worst]) {
+                worst = address;
+            }
+        }
+
+        fprintf(stderr, "EEPROM wear for %s: %llu writes, at most %lu to address 0x%03lX\n",
+                network->names[i], total, count ? (unsigned long)wear[worst] : 0UL, (unsigned long)worst);
+    }
+}
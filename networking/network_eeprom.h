@@ -0,0 +1,46 @@
+/* Copyright (C) 2013 Calvin Beck
+
+  Permission is hereby granted, free of charge, to any person
+  obtaining a copy of this software and associated documentation files
+  (the "Software"), to deal in the Software without restriction,
+  including without limitation the rights to use, copy, modify, merge,
+  publish, distribute, sublicense, and/or sell copies of the Software,
+  and to permit persons to whom the Software is furnished to do so,
+  subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be
+  included in all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+  EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+  MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+  NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+  BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+  ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+  CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+  SOFTWARE.
+
+*/
+
+#ifndef NETWORK_EEPROM_H
+#define NETWORK_EEPROM_H
+
+#include "network_parse.h"
+
+
+/*
+  Get the EEPROM files ready for a run. An Arduino with a seed starts
+  from a copy of it, with its wear counts cleared. One without is
+  erased the first time, and keeps whatever it had after that.
+  Arduinos set in `remote` (if it isn't NULL) are left alone, since
+  another server runs them.
+ */
+void prepare_eeproms(ArduinoNetwork *network, const uint8_t *remote);
+
+/*
+  Print how many writes each EEPROM has taken over its life, and how
+  many went to its most worn byte, skipping any set in `remote`.
+ */
+void print_eeprom_wear(ArduinoNetwork *network, const uint8_t *remote);
+
+#endif
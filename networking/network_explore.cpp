@@ -0,0 +1,720 @@
+/* Copyright (C) 2013 Calvin Beck
+
+  Permission is hereby granted, free of charge, to any person
+  obtaining a copy of this software and associated documentation files
+  (the "Software"), to deal in the Software without restriction,
+  including without limitation the rights to use, copy, modify, merge,
+  publish, distribute, sublicense, and/or sell copies of the Software,
+  and to permit persons to whom the Software is furnished to do so,
+  subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be
+  included in all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+  EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+  MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+  NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+  BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+  ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+  CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+  SOFTWARE.
+
+*/
+
+#include "network_explore.h"
+#include "network_image.h"
+#include "network_eeprom.h"
+#include <emulard/protocol/commands.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+
+
+/* Where runs have got to, and in how few turns, by simulator_state() */
+typedef struct SeenStates {
+    uint64_t *hashes;  /* 0 for an empty slot */
+    size_t *turns;
+    size_t size;       /* A power of two, at least twice count */
+    size_t count;
+} SeenStates;
+
+
+/* What the workers share, under `lock` */
+typedef struct Search {
+    Exploration *exploration;
+
+    pthread_mutex_t lock;
+    pthread_cond_t changed;
+
+    /* Depth-first runs still to make, each the schedule it starts with */
+    Schedule *pending;
+    size_t num_pending;
+    size_t pending_size;
+
+    int active;  /* Runs being made, which may leave more */
+    unsigned long next_run;
+    SeenStates seen;
+
+    time_t reported;  /* When progress was last printed */
+} Search;
+
+
+typedef struct Worker {
+    Search *search;
+    pthread_t thread;
+
+    /* This worker's own EEPROM files, and what each starts every run from */
+    char **eeproms;
+    char **seeds;
+} Worker;
+
+
+static void grow_seen(SeenStates *seen)
+{
+    size_t size = 0 == seen->size ? 1024 : seen->size * 2;
+    uint64_t *hashes = (uint64_t *)calloc(size, sizeof(uint64_t));
+    size_t *turns = (size_t *)malloc(sizeof(size_t) * size);
+
+    if (NULL == hashes || NULL == turns) {
+        perror("Could not keep track of the explored states");
+        exit(EXIT_FAILURE);
+    }
+
+    for (size_t i = 0; i < seen->size; ++i) {
+        if (0 == seen->hashes[i]) {
+            continue;
+        }
+
+        size_t slot = seen->hashes[i] & (size - 1);
+
+        while (0 != hashes[slot]) {
+            slot = (slot + 1) & (size - 1);
+        }
+
+        hashes[slot] = seen->hashes[i];
+        turns[slot] = seen->turns[i];
+    }
+
+    free(seen->hashes);
+    free(seen->turns);
+
+    seen->hashes = hashes;
+    seen->turns = turns;
+    seen->size = size;
+}
+
+
+/* A run got to `hash` after `turns` turns. Returns 1 if one had already got there in as few. */
+static int seen_before(SeenStates *seen, uint64_t hash, size_t turns)
+{
+    /* 0 marks an empty slot */
+    hash += 0 == hash;
+
+    if (2 * (seen->count + 1) > seen->size) {
+        grow_seen(seen);
+    }
+
+    size_t slot = hash & (seen->size - 1);
+
+    while (0 != seen->hashes[slot] && hash != seen->hashes[slot]) {
+        slot = (slot + 1) & (seen->size - 1);
+    }
+
+    if (hash == seen->hashes[slot]) {
+        if (seen->turns[slot] <= turns) {
+            return 1;
+        }
+
+        /* Got there sooner this time, so there's further to go from it */
+        seen->turns[slot] = turns;
+        return 0;
+    }
+
+    seen->hashes[slot] = hash;
+    seen->turns[slot] = turns;
+    ++seen->count;
+
+    return 0;
+}
+
+
+/* Leave a run for later that starts with `length` turns of `turns`, and then `next` */
+static void leave_run(Search *search, const uint32_t *turns, size_t length, uint32_t next)
+{
+    if (search->num_pending == search->pending_size) {
+        search->pending_size = 0 == search->pending_size ? 64 : search->pending_size * 2;
+        search->pending = (Schedule *)realloc(search->pending, sizeof(Schedule) * search->pending_size);
+
+        if (NULL == search->pending) {
+            perror("Could not keep the runs still to make");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    Schedule *schedule = &search->pending[search->num_pending++];
+    schedule->turns = (uint32_t *)malloc(sizeof(uint32_t) * (length + 1));
+    schedule->length = length + 1;
+
+    if (NULL == schedule->turns) {
+        perror("Could not keep the runs still to make");
+        exit(EXIT_FAILURE);
+    }
+
+    memcpy(schedule->turns, turns, sizeof(uint32_t) * length);
+    schedule->turns[length] = next;
+}
+
+
+/*
+  Take the next run to make, and the schedule it starts with. Returns
+  0 once there are none left, or the invariant has been broken.
+ */
+static int take_run(Search *search, Schedule *start, unsigned long *run)
+{
+    Exploration *exploration = search->exploration;
+    int taken = 0;
+
+    pthread_mutex_lock(&search->lock);
+
+    while (!exploration->violated) {
+        if (0 != exploration->max_states && search->seen.count >= exploration->max_states) {
+            exploration->out_of_states = 1;
+            break;
+        }
+
+        if (0 != exploration->runs) {
+            if (search->next_run < exploration->runs) {
+                start->turns = NULL;
+                start->length = 0;
+                taken = 1;
+            }
+
+            break;
+        }
+
+        if (0 != search->num_pending) {
+            *start = search->pending[--search->num_pending];
+            taken = 1;
+            break;
+        }
+
+        /* Nothing left, unless a run that's still going leaves some */
+        if (0 == search->active) {
+            break;
+        }
+
+        pthread_cond_wait(&search->changed, &search->lock);
+    }
+
+    if (taken) {
+        *run = search->next_run++;
+        ++search->active;
+    }
+
+    pthread_mutex_unlock(&search->lock);
+
+    return taken;
+}
+
+
+static int is_ready(size_t *ready, size_t count, size_t index)
+{
+    for (size_t k = 0; k < count; ++k) {
+        if (index == ready[k]) {
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+
+/* Whether the run has broken the invariant, with the status its last turn left it with */
+static int broken_invariant(Exploration *exploration, Simulator *simulator, int status)
+{
+    /* An Arduino dying stops the run with an error, but everyone leaving or dying just ends it */
+    if (STOP_ERROR == status) {
+        for (size_t i = 0; i < simulator->network.num_arduinos; ++i) {
+            if (!simulator->arduinos[i]->dead) {
+                return 1;
+            }
+        }
+
+        return 0;
+    }
+
+    if (NULL != exploration->invariant) {
+        return exploration->invariant(simulator, exploration->data);
+    }
+
+    return STOP_GOAL == status && simulator->stop.has_goals();
+}
+
+
+/*
+  Make run number `run`: the turns in `start`, and then depth-first
+  round the ready Arduinos, leaving the other choices for later, or
+  at random.
+ */
+static void make_run(Worker *worker, Schedule *start, unsigned long run)
+{
+    Search *search = worker->search;
+    Exploration *exploration = search->exploration;
+    Simulator simulator;
+
+    if (-1 == load_simulator(&simulator, exploration->path)) {
+        fprintf(stderr, "Could not load \"%s\" again\n", exploration->path);
+        exit(EXIT_FAILURE);
+    }
+
+    ArduinoNetwork *network = &simulator.network;
+
+    simulator.sketch = exploration->sketch;
+    simulator.headless = 1;
+    simulator.quiet = 1;
+    simulator.idle_reads = exploration->idle_reads;
+
+    /* The worker's own EEPROMs, so runs can't see each other's */
+    char **eeproms = network->eeproms;
+    char **seeds = network->eeprom_seeds;
+
+    network->eeproms = worker->eeproms;
+    network->eeprom_seeds = worker->seeds;
+
+    if (NULL != exploration->prepare) {
+        exploration->prepare(&simulator, exploration->data);
+    }
+
+    start_simulator(&simulator);
+
+    size_t *ready = (size_t *)malloc(sizeof(size_t) * (network->num_arduinos + 1));
+    Schedule schedule;
+
+    schedule.turns = (uint32_t *)malloc(sizeof(uint32_t) * (exploration->depth + 1));
+    schedule.length = 0;
+
+    if (NULL == ready || NULL == schedule.turns) {
+        perror("Could not make a run");
+        exit(EXIT_FAILURE);
+    }
+
+    uint64_t random = (run + 1) * 0x9E3779B97F4A7C15ULL;
+    size_t last = network->num_arduinos - 1;
+    int broken = 0;
+    int cut = 0;
+
+    while (schedule.length < exploration->depth) {
+        size_t count = ready_arduinos(&simulator, ready);
+
+        if (0 == count) {
+            break;
+        }
+
+        size_t choice;
+
+        if (schedule.length < start->length) {
+            choice = start->turns[schedule.length];
+
+            if (!is_ready(ready, count, choice)) {
+                fprintf(stderr, "Run %lu didn't go the same way again, does a sketch keep real time?\n", run);
+                break;
+            }
+        }
+        else if (0 != exploration->runs) {
+            random ^= random << 13;
+            random ^= random >> 7;
+            random ^= random << 17;
+
+            choice = ready[random % count];
+        }
+        else {
+            /* Round the ready Arduinos from the last one to go, and the rest later */
+            choice = ready[0];
+
+            for (size_t k = 0; k < count; ++k) {
+                if (ready[k] > last) {
+                    choice = ready[k];
+                    break;
+                }
+            }
+
+            pthread_mutex_lock(&search->lock);
+
+            for (size_t k = 0; k < count; ++k) {
+                if (choice != ready[k]) {
+                    leave_run(search, schedule.turns, schedule.length, ready[k]);
+                }
+            }
+
+            pthread_cond_broadcast(&search->changed);
+            pthread_mutex_unlock(&search->lock);
+        }
+
+        last = choice;
+        schedule.turns[schedule.length++] = choice;
+
+        int status = turn_simulator(&simulator, choice);
+
+        if (broken_invariant(exploration, &simulator, status)) {
+            broken = 1;
+            break;
+        }
+
+        if (-1 != status) {
+            break;
+        }
+
+        /* The turns it started with were made by the run that left it */
+        if (schedule.length >= start->length) {
+            uint64_t state = simulator_state(&simulator);
+
+            pthread_mutex_lock(&search->lock);
+            cut = seen_before(&search->seen, state, schedule.length) && 0 == exploration->runs;
+            pthread_mutex_unlock(&search->lock);
+
+            if (cut) {
+                break;
+            }
+        }
+    }
+
+    pthread_mutex_lock(&search->lock);
+
+    ++exploration->runs_made;
+    exploration->turns += schedule.length;
+    exploration->states = search->seen.count;
+    exploration->pruned += cut;
+
+    if (exploration->progress && time(NULL) > search->reported) {
+        unsigned long left = 0 != exploration->runs ? exploration->runs - search->next_run : search->num_pending;
+
+        search->reported = time(NULL);
+        fprintf(stderr, "%lu runs, %lu states, %lu runs waiting\n", exploration->runs_made,
+                exploration->states, left);
+    }
+
+    if (broken && !exploration->violated) {
+        exploration->violated = 1;
+        exploration->violation = schedule;
+        snprintf(exploration->reason, sizeof(exploration->reason), "%s", simulator.stop.reason);
+
+        schedule.turns = NULL;
+    }
+
+    pthread_mutex_unlock(&search->lock);
+
+    finish_simulator(&simulator);
+
+    network->eeproms = eeproms;
+    network->eeprom_seeds = seeds;
+    free_simulator(&simulator);
+
+    free(ready);
+    free(schedule.turns);
+}
+
+
+static void *explore_worker(void *data)
+{
+    Worker *worker = (Worker *)data;
+    Search *search = worker->search;
+
+    Schedule start;
+    unsigned long run;
+
+    while (take_run(search, &start, &run)) {
+        make_run(worker, &start, run);
+        free_schedule(&start);
+
+        /* Whoever is waiting on more runs may have some now, or be done */
+        pthread_mutex_lock(&search->lock);
+        --search->active;
+        pthread_cond_broadcast(&search->changed);
+        pthread_mutex_unlock(&search->lock);
+    }
+
+    return NULL;
+}
+
+
+int init_exploration(Exploration *exploration, const char *path)
+{
+    if (-1 == load_network(path, &exploration->network)) {
+        return -1;
+    }
+
+    exploration->path = strdup(path);
+
+    exploration->sketch = NULL;
+    exploration->idle_reads = ArduinoMega::IDLE_READS;
+    exploration->depth = 100;
+    exploration->runs = 0;
+    exploration->workers = 1;
+    exploration->max_states = 0;
+    exploration->progress = 0;
+
+    exploration->prepare = NULL;
+    exploration->invariant = NULL;
+    exploration->data = NULL;
+
+    exploration->runs_made = 0;
+    exploration->turns = 0;
+    exploration->states = 0;
+    exploration->pruned = 0;
+    exploration->out_of_states = 0;
+    exploration->violated = 0;
+    exploration->violation.turns = NULL;
+    exploration->violation.length = 0;
+    exploration->reason[0] = '\0';
+
+    return 0;
+}
+
+
+void free_exploration(Exploration *exploration)
+{
+    free_schedule(&exploration->violation);
+    free_network(&exploration->network);
+    free(exploration->path);
+}
+
+
+int explore(Exploration *exploration)
+{
+    ArduinoNetwork *network = &exploration->network;
+    size_t count = network->num_arduinos;
+    int num_workers = exploration->workers < 1 ? 1 : exploration->workers;
+
+    /* Every run's EEPROMs start from these */
+    prepare_eeproms(network, NULL);
+
+    Search search;
+
+    search.exploration = exploration;
+    pthread_mutex_init(&search.lock, NULL);
+    pthread_cond_init(&search.changed, NULL);
+
+    search.pending = NULL;
+    search.num_pending = 0;
+    search.pending_size = 0;
+    search.active = 0;
+    search.next_run = 0;
+
+    search.seen.hashes = NULL;
+    search.seen.turns = NULL;
+    search.seen.size = 0;
+    search.seen.count = 0;
+    search.reported = time(NULL);
+
+    /* Depth-first starts from nothing */
+    if (0 == exploration->runs) {
+        search.pending = (Schedule *)malloc(sizeof(Schedule));
+        search.pending[0].turns = NULL;
+        search.pending[0].length = 0;
+        search.num_pending = 1;
+        search.pending_size = 1;
+    }
+
+    Worker *workers = (Worker *)calloc(num_workers, sizeof(Worker));
+
+    if (NULL == workers) {
+        perror("Could not start the workers");
+        exit(EXIT_FAILURE);
+    }
+
+    for (int w = 0; w < num_workers; ++w) {
+        Worker *worker = &workers[w];
+
+        worker->search = &search;
+        worker->eeproms = (char **)calloc(count + 1, sizeof(char *));
+        worker->seeds = (char **)calloc(count + 1, sizeof(char *));
+
+        for (size_t i = 0; i < count; ++i) {
+            if (NULL == network->eeproms[i]) {
+                continue;
+            }
+
+            size_t length = strlen(network->eeproms[i]) + 32;
+            worker->eeproms[i] = (char *)malloc(length);
+            snprintf(worker->eeproms[i], length, "%s.explore%d", network->eeproms[i], w);
+
+            worker->seeds[i] = NULL != network->eeprom_seeds[i] ? network->eeprom_seeds[i] : network->eeproms[i];
+        }
+
+        if (0 != pthread_create(&worker->thread, NULL, explore_worker, worker)) {
+            perror("Could not start a worker");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    for (int w = 0; w < num_workers; ++w) {
+        Worker *worker = &workers[w];
+
+        pthread_join(worker->thread, NULL);
+
+        /* Its EEPROM files were only ever copies */
+        for (size_t i = 0; i < count; ++i) {
+            if (NULL == worker->eeproms[i]) {
+                continue;
+            }
+
+            size_t length = strlen(worker->eeproms[i]) + sizeof(EEPROM_WEAR_SUFFIX);
+            char *wear = (char *)malloc(length);
+
+            snprintf(wear, length, "%s%s", worker->eeproms[i], EEPROM_WEAR_SUFFIX);
+            unlink(wear);
+            unlink(worker->eeproms[i]);
+
+            free(wear);
+            free(worker->eeproms[i]);
+        }
+
+        free(worker->eeproms);
+        free(worker->seeds);
+    }
+
+    /* Runs left over once the invariant broke */
+    for (size_t k = 0; k < search.num_pending; ++k) {
+        free_schedule(&search.pending[k]);
+    }
+
+    free(search.pending);
+    free(search.seen.hashes);
+    free(search.seen.turns);
+    free(workers);
+
+    pthread_mutex_destroy(&search.lock);
+    pthread_cond_destroy(&search.changed);
+
+    return exploration->violated;
+}
+
+
+int write_schedule(const char *path, ArduinoNetwork *network, Schedule *schedule, const char *reason)
+{
+    FILE *file = fopen(path, "w");
+
+    if (NULL == file) {
+        return -1;
+    }
+
+    if (NULL != reason) {
+        fprintf(file, "# %s\n", reason);
+    }
+
+    /* A stretch of turns the same Arduino takes goes on one line */
+    for (size_t t = 0; t < schedule->length;) {
+        size_t end = t + 1;
+
+        while (end < schedule->length && schedule->turns[end] == schedule->turns[t]) {
+            ++end;
+        }
+
+        fprintf(file, "%s %lu\n", network->names[schedule->turns[t]], (unsigned long)(end - t));
+        t = end;
+    }
+
+    return 0 == fclose(file) ? 0 : -1;
+}
+
+
+int read_schedule(const char *path, ArduinoNetwork *network, Schedule *schedule)
+{
+    FILE *file = fopen(path, "r");
+
+    if (NULL == file) {
+        return -1;
+    }
+
+    schedule->turns = NULL;
+    schedule->length = 0;
+
+    size_t size = 0;
+    char line[256];
+
+    while (NULL != fgets(line, sizeof(line), file)) {
+        char name[256];
+        unsigned long turns;
+
+        if ('#' == line[0] || 1 > sscanf(line, "%255s", name)) {
+            continue;
+        }
+
+        int index = 2 == sscanf(line, "%255s %lu", name, &turns) ? arduino_lookup(name, network) : -1;
+
+        if (-1 == index) {
+            fprintf(stderr, "Bad schedule line \"%s\", expected <name> <turns> for an Arduino in the network\n",
+                    strtok(line, "\n"));
+            fclose(file);
+            free_schedule(schedule);
+
+            return -1;
+        }
+
+        if (schedule->length + turns > size) {
+            size = 2 * (schedule->length + turns);
+            schedule->turns = (uint32_t *)realloc(schedule->turns, sizeof(uint32_t) * size);
+
+            if (NULL == schedule->turns) {
+                perror("Could not read the schedule");
+                exit(EXIT_FAILURE);
+            }
+        }
+
+        for (unsigned long t = 0; t < turns; ++t) {
+            schedule->turns[schedule->length++] = index;
+        }
+    }
+
+    fclose(file);
+
+    return 0;
+}
+
+
+void free_schedule(Schedule *schedule)
+{
+    free(schedule->turns);
+
+    schedule->turns = NULL;
+    schedule->length = 0;
+}
+
+
+int replay_schedule(Simulator *simulator, Schedule *schedule)
+{
+    ArduinoNetwork *network = &simulator->network;
+    size_t *ready = (size_t *)malloc(sizeof(size_t) * (network->num_arduinos + 1));
+
+    if (NULL == ready) {
+        perror("Could not replay the schedule");
+        exit(EXIT_FAILURE);
+    }
+
+    for (size_t t = 0; t < schedule->length && -1 == simulator->status; ++t) {
+        size_t index = schedule->turns[t];
+        size_t count = ready_arduinos(simulator, ready);
+
+        if (-1 != simulator->status) {
+            break;
+        }
+
+        if (!is_ready(ready, count, index)) {
+            snprintf(simulator->stop.reason, sizeof(simulator->stop.reason),
+                     "turn %lu of the schedule is %s's, and it can't go", (unsigned long)t + 1, network->names[index]);
+            simulator->status = STOP_ERROR;
+            break;
+        }
+
+        turn_simulator(simulator, index);
+    }
+
+    free(ready);
+
+    return simulator->status;
+}
@@ -0,0 +1,132 @@
+/* Copyright (C) 2013 Calvin Beck
+
+  Permission is hereby granted, free of charge, to any person
+  obtaining a copy of this software and associated documentation files
+  (the "Software"), to deal in the Software without restriction,
+  including without limitation the rights to use, copy, modify, merge,
+  publish, distribute, sublicense, and/or sell copies of the Software,
+  and to permit persons to whom the Software is furnished to do so,
+  subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be
+  included in all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+  EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+  MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+  NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+  BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+  ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+  CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+  SOFTWARE.
+
+*/
+
+#ifndef NETWORK_EXPLORE_H
+#define NETWORK_EXPLORE_H
+
+#include "network_simulator.h"
+
+#include <stdint.h>
+
+
+/*
+  Exploring the orders Arduinos can go in, for protocols whose bugs
+  only show up when one node gets ahead of another in just the wrong
+  way.
+
+  A run of the network is a schedule: which Arduino takes each turn
+  (see turn_simulator()). The same schedule always makes the same run,
+  so a run is found again by replaying its schedule from the start.
+  Every run is headless, starts from the same EEPROMs, and goes on
+  until it has had `depth` turns, stops, or nobody can go.
+
+  Depth-first, every order is tried: a run goes round the Arduinos
+  that are ready, and each other Arduino it could have picked leaves
+  a run to try later that picks that one instead. Once a run gets
+  somewhere another run already got to in as few turns (by
+  simulator_state()), it stops there, since it would only go the same
+  way. Random runs pick who goes next at random, the same way for the
+  same run number.
+
+  Runs are shared out between worker threads, each with its own
+  Arduinos. The first run to break the invariant stops the search,
+  and its schedule is kept to be written out and replayed.
+ */
+
+/* Which Arduino takes each turn, by index */
+typedef struct Schedule {
+    uint32_t *turns;
+    size_t length;
+} Schedule;
+
+
+typedef struct Exploration {
+    /* Options, set after init_exploration() */
+    void (*sketch)(void);  /* As in the Simulator */
+    int idle_reads;
+    size_t depth;          /* Turns in a run */
+    unsigned long runs;    /* Random runs to make, or 0 to search depth-first */
+    int workers;           /* Threads making runs */
+    unsigned long max_states;  /* Stop once the runs have got to this many states, or 0 for no limit */
+    int progress;          /* Print how far it has got to stderr, every second or so */
+
+    /*
+      Called with each run's simulator after it's loaded, before it
+      starts, to set its goals and limits (may be NULL).
+     */
+    void (*prepare)(Simulator *simulator, void *data);
+
+    /*
+      Called after every turn. Returns non-zero, saying why in
+      simulator->stop.reason, if the network is somewhere it mustn't
+      be. If it's NULL, reaching one of the stop goals is what mustn't
+      happen. Either way an Arduino dying and stopping the run does
+      too.
+     */
+    int (*invariant)(Simulator *simulator, void *data);
+    void *data;
+
+    /* Results */
+    unsigned long runs_made;
+    unsigned long long turns;
+    unsigned long states;   /* Different places the runs got to */
+    unsigned long pruned;   /* Runs stopped where another had been */
+    int out_of_states;      /* Stopped at max_states, with runs still to make */
+    int violated;
+    Schedule violation;
+    char reason[256];
+
+    /* The network, loaded once to check it and get its EEPROMs ready */
+    char *path;
+    ArduinoNetwork network;
+} Exploration;
+
+
+/* Set up an exploration of the network in a .ard file or its image, or return -1 if it can't be loaded */
+int init_exploration(Exploration *exploration, const char *path);
+void free_exploration(Exploration *exploration);
+
+/* Make the runs. Returns 1 if the invariant was broken, otherwise 0. */
+int explore(Exploration *exploration);
+
+/*
+  Schedule files have a line for each stretch of turns one Arduino
+  takes, "<name> <turns>", and '#' comments. `reason` (if it isn't
+  NULL) goes at the top as one. Both return 0, or -1 if the file
+  can't be written or read, or names an Arduino the network hasn't
+  got.
+ */
+int write_schedule(const char *path, ArduinoNetwork *network, Schedule *schedule, const char *reason);
+int read_schedule(const char *path, ArduinoNetwork *network, Schedule *schedule);
+void free_schedule(Schedule *schedule);
+
+/*
+  Run a started, headless simulator's turns as the schedule says.
+  Returns the status to stop with, or -1 if it's still running once
+  the schedule is done. A turn the Arduino isn't ready for stops it
+  with an error.
+ */
+int replay_schedule(Simulator *simulator, Schedule *schedule);
+
+#endif
@@ -0,0 +1,619 @@
+/* Copyright (C) 2013 Calvin Beck
+
+  Permission is hereby granted, free of charge, to any person
+  obtaining a copy of this software and associated documentation files
+  (the "Software"), to deal in the Software without restriction,
+  including without limitation the rights to use, copy, modify, merge,
+  publish, distribute, sublicense, and/or sell copies of the Software,
+  and to permit persons to whom the Software is furnished to do so,
+  subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be
+  included in all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+  EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+  MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+  NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+  BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+  ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+  CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+  SOFTWARE.
+
+*/
+
+#include "network_image.h"
+#include <emulard/fakeduino.h>
+
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+
+static const char IMAGE_MAGIC[8] = "EMULARD";
+
+
+/* Sizes of the elements in each section, indexed by ImageSectionId */
+static const size_t section_sizes[IMAGE_NUM_SECTIONS] = {
+    sizeof(char),
+    sizeof(ImageNode),
+    sizeof(PinConnection),
+    sizeof(SerialConnection),
+    sizeof(size_t),
+    sizeof(size_t),
+    sizeof(size_t),
+    sizeof(SerialRoute),
+    sizeof(NodeSchedule),
+    sizeof(WireConnection),
+    sizeof(BusDevice),
+    sizeof(DeviceRegister),
+    sizeof(AnalogStimulus),
+    sizeof(uint64_t),
+    sizeof(TopologyChange)
+};
+
+
+static uint64_t align_offset(uint64_t offset)
+{
+    return (offset + 7) & ~(uint64_t)7;
+}
+
+
+char *image_path(const char *ard_path)
+{
+    size_t length = strlen(ard_path);
+    char *path = (char *)malloc(length + 6);
+
+    if (length >= 4 && 0 == strcmp(ard_path + length - 4, ".ard")) {
+        snprintf(path, length + 6, "%sc", ard_path);
+    }
+    else {
+        snprintf(path, length + 6, "%s.ardc", ard_path);
+    }
+
+    return path;
+}
+
+
+uint64_t hash_file(const char *path)
+{
+    int fd = open(path, O_RDONLY);
+
+    if (-1 == fd) {
+        return 0;
+    }
+
+    struct stat info;
+
+    if (-1 == fstat(fd, &info)) {
+        close(fd);
+        return 0;
+    }
+
+    uint64_t hash = 0xCBF29CE484222325ULL;
+
+    if (info.st_size > 0) {
+        const uint8_t *contents = (const uint8_t *)mmap(NULL, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+
+        if (MAP_FAILED == contents) {
+            close(fd);
+            return 0;
+        }
+
+        for (off_t i = 0; i < info.st_size; ++i) {
+            hash ^= contents[i];
+            hash *= 0x100000001B3ULL;
+        }
+
+        munmap((void *)contents, info.st_size);
+    }
+
+    close(fd);
+
+    /* 0 means "couldn't hash" */
+    return hash ? hash : 1;
+}
+
+
+/* Returns 1 if the file starts with the image magic */
+static int is_image(const char *path)
+{
+    char magic[sizeof(IMAGE_MAGIC)];
+    FILE *file = fopen(path, "rb");
+
+    if (NULL == file) {
+        return 0;
+    }
+
+    size_t bytes_read = fread(magic, 1, sizeof(magic), file);
+    fclose(file);
+
+    return bytes_read == sizeof(magic) && 0 == memcmp(magic, IMAGE_MAGIC, sizeof(magic));
+}
+
+
+/* Write a section and pad up to the next 8 byte boundary */
+static int write_section(FILE *file, ImageHeader *header, int id, const void *data, uint64_t count)
+{
+    static const char padding[8] = {0};
+    uint64_t size = count * section_sizes[id];
+
+    if (size && 1 != fwrite(data, size, 1, file)) {
+        return -1;
+    }
+
+    uint64_t padded = align_offset(header->sections[id].offset + size);
+    uint64_t pad = padded - (header->sections[id].offset + size);
+
+    if (pad && 1 != fwrite(padding, pad, 1, file)) {
+        return -1;
+    }
+
+    return 0;
+}
+
+
+int write_network_image(const char *path, const char *source_path, ArduinoNetwork *network)
+{
+    ImageHeader header;
+    memset(&header, 0, sizeof(header));
+
+    memcpy(header.magic, IMAGE_MAGIC, sizeof(header.magic));
+    header.version = IMAGE_VERSION;
+    header.word_size = sizeof(size_t);
+    header.source_hash = hash_file(source_path);
+
+    /* Build the string table: source path, then each node's strings */
+    char resolved[PATH_MAX];
+    const char *source = realpath(source_path, resolved) ? resolved : source_path;
+
+    ImageNode *nodes = (ImageNode *)malloc(sizeof(ImageNode) * (network->num_arduinos + 1));
+    uint64_t strings_size = strlen(source) + 1;
+
+    for (size_t i = 0; i < network->num_arduinos; ++i) {
+        nodes[i].name = strings_size;
+        strings_size += strlen(network->names[i]) + 1;
+
+        nodes[i].path = strings_size;
+        strings_size += strlen(network->paths[i]) + 1;
+
+        nodes[i].eeprom = IMAGE_NO_STRING;
+        nodes[i].eeprom_seed = IMAGE_NO_STRING;
+
+        if (NULL != network->eeproms[i]) {
+            nodes[i].eeprom = strings_size;
+            strings_size += strlen(network->eeproms[i]) + 1;
+        }
+
+        if (NULL != network->eeprom_seeds[i]) {
+            nodes[i].eeprom_seed = strings_size;
+            strings_size += strlen(network->eeprom_seeds[i]) + 1;
+        }
+    }
+
+    /* Waveform files, by string table offset */
+    uint64_t *stimulus_paths = (uint64_t *)malloc(sizeof(uint64_t) * (network->num_stimuli + 1));
+
+    for (size_t i = 0; i < network->num_stimuli; ++i) {
+        stimulus_paths[i] = strings_size;
+        strings_size += strlen(network->stimulus_paths[i]) + 1;
+    }
+
+    char *strings = (char *)malloc(strings_size);
+    memcpy(strings, source, strlen(source) + 1);
+
+    for (size_t i = 0; i < network->num_stimuli; ++i) {
+        strcpy(strings + stimulus_paths[i], network->stimulus_paths[i]);
+    }
+
+    for (size_t i = 0; i < network->num_arduinos; ++i) {
+        strcpy(strings + nodes[i].name, network->names[i]);
+        strcpy(strings + nodes[i].path, network->paths[i]);
+
+        if (NULL != network->eeproms[i]) {
+            strcpy(strings + nodes[i].eeprom, network->eeproms[i]);
+        }
+
+        if (NULL != network->eeprom_seeds[i]) {
+            strcpy(strings + nodes[i].eeprom_seed, network->eeprom_seeds[i]);
+        }
+    }
+
+    header.source_path = 0;
+
+    const uint64_t counts[IMAGE_NUM_SECTIONS] = {
+        strings_size,
+        network->num_arduinos,
+        network->num_pins,
+        network->num_serial,
+        network->num_arduinos + 1,
+        network->pin_fanout_start[network->num_arduinos],
+        network->num_arduinos * NETWORK_SERIAL_PORTS + 1,
+        network->num_routes,
+        network->num_arduinos,
+        network->num_wires,
+        network->num_devices,
+        network->num_registers,
+        network->num_stimuli,
+        network->num_stimuli,
+        network->num_changes
+    };
+
+    const void *data[IMAGE_NUM_SECTIONS] = {
+        strings,
+        nodes,
+        network->pins,
+        network->serial_ports,
+        network->pin_fanout_start,
+        network->pin_fanout,
+        network->serial_route_start,
+        network->serial_routes,
+        network->schedule,
+        network->wires,
+        network->devices,
+        network->registers,
+        network->stimuli,
+        stimulus_paths,
+        network->changes
+    };
+
+    uint64_t offset = align_offset(sizeof(header));
+
+    for (int id = 0; id < IMAGE_NUM_SECTIONS; ++id) {
+        header.sections[id].offset = offset;
+        header.sections[id].count = counts[id];
+
+        offset = align_offset(offset + counts[id] * section_sizes[id]);
+    }
+
+    header.image_size = offset;
+
+    /* Write to a temporary file and rename, so readers never see half an image */
+    size_t tmp_length = strlen(path) + 32;
+    char *tmp_path = (char *)malloc(tmp_length);
+    snprintf(tmp_path, tmp_length, "%s.%ld.tmp", path, (long)getpid());
+
+    FILE *file = fopen(tmp_path, "wb");
+    int status = NULL == file ? -1 : 0;
+
+    if (0 == status) {
+        static const char padding[8] = {0};
+        size_t pad = align_offset(sizeof(header)) - sizeof(header);
+
+        if (1 != fwrite(&header, sizeof(header), 1, file) || (pad && 1 != fwrite(padding, pad, 1, file))) {
+            status = -1;
+        }
+    }
+
+    for (int id = 0; 0 == status && id < IMAGE_NUM_SECTIONS; ++id) {
+        status = write_section(file, &header, id, data[id], counts[id]);
+    }
+
+    if (NULL != file && 0 != fclose(file)) {
+        status = -1;
+    }
+
+    if (0 == status && -1 == rename(tmp_path, path)) {
+        status = -1;
+    }
+
+    if (0 != status) {
+        unlink(tmp_path);
+    }
+
+    free(tmp_path);
+    free(strings);
+    free(nodes);
+    free(stimulus_paths);
+
+    return status;
+}
+
+
+/* Whether a pin connection joins pins that exist on Arduinos that do */
+/*
+  Whether every index in a loaded image points somewhere real: the
+  Arduinos, pins, and ports in its connections, and the positions in
+  its fan-out and routing indexes. The server indexes its arrays with
+  them as they are, so an image that fails this is refused.
+ */
+static int image_indexes(ArduinoNetwork *network, const ImageHeader *header)
+{
+    size_t num_nodes = network->num_arduinos;
+    size_t num_slots = num_nodes * NETWORK_SERIAL_PORTS;
+
+    for (size_t i = 0; i < network->num_pins; ++i) {
+        if (!valid_pin_connection(network, network->pins[i])) {
+            return 0;
+        }
+    }
+
+    for (size_t i = 0; i < network->num_serial; ++i) {
+        if (!valid_serial_connection(network, network->serial_ports[i])) {
+            return 0;
+        }
+    }
+
+    /* Each Arduino's fan-out runs on from the last one's, and ends inside pin_fanout */
+    if (num_nodes + 1 != header->sections[IMAGE_PIN_FANOUT_START].count || 0 != network->pin_fanout_start[0]) {
+        return 0;
+    }
+
+    for (size_t i = 0; i < num_nodes; ++i) {
+        if (network->pin_fanout_start[i] > network->pin_fanout_start[i + 1]) {
+            return 0;
+        }
+    }
+
+    if (network->pin_fanout_start[num_nodes] > header->sections[IMAGE_PIN_FANOUT].count) {
+        return 0;
+    }
+
+    for (size_t k = 0; k < network->pin_fanout_start[num_nodes]; ++k) {
+        if (network->pin_fanout[k] >= network->num_pins) {
+            return 0;
+        }
+    }
+
+    if (num_slots + 1 != header->sections[IMAGE_SERIAL_ROUTE_START].count) {
+        return 0;
+    }
+
+    for (size_t slot = 0; slot < num_slots; ++slot) {
+        if (ROUTE_END != network->serial_route_start[slot] && network->serial_route_start[slot] >= network->num_routes) {
+            return 0;
+        }
+    }
+
+    for (size_t k = 0; k < network->num_routes; ++k) {
+        SerialRoute route = network->serial_routes[k];
+
+        if (route.index >= num_nodes || route.port < 0 || route.port >= NETWORK_SERIAL_PORTS
+            || (ROUTE_END != route.next && route.next >= network->num_routes)) {
+            return 0;
+        }
+    }
+
+    for (size_t i = 0; i < network->num_wires; ++i) {
+        if (network->wires[i].index >= num_nodes) {
+            return 0;
+        }
+    }
+
+    for (size_t i = 0; i < network->num_devices; ++i) {
+        BusDevice device = network->devices[i];
+
+        if (device.spi && (device.index >= num_nodes || device.address >= ArduinoMega::NUM_PINS)) {
+            return 0;
+        }
+    }
+
+    for (size_t i = 0; i < network->num_registers; ++i) {
+        if (network->registers[i].device >= network->num_devices) {
+            return 0;
+        }
+    }
+
+    for (size_t i = 0; i < network->num_stimuli; ++i) {
+        if (network->stimuli[i].index >= num_nodes || network->stimuli[i].pin >= ArduinoMega::NUM_PINS) {
+            return 0;
+        }
+    }
+
+    for (size_t i = 0; i < network->num_changes; ++i) {
+        TopologyChange change = network->changes[i];
+
+        if ((CHANGE_PIN == change.kind && !valid_pin_connection(network, change.pin))
+            || (CHANGE_SERIAL == change.kind && !valid_serial_connection(network, change.serial))
+            || (CHANGE_ARDUINO == change.kind && change.index >= num_nodes)
+            || change.kind > CHANGE_ARDUINO) {
+            return 0;
+        }
+    }
+
+    return 1;
+}
+
+
+int load_network_image(const char *path, uint64_t source_hash, ArduinoNetwork *network)
+{
+    int fd = open(path, O_RDONLY);
+
+    if (-1 == fd) {
+        return -1;
+    }
+
+    struct stat info;
+
+    if (-1 == fstat(fd, &info) || (size_t)info.st_size < sizeof(ImageHeader)) {
+        close(fd);
+        return -1;
+    }
+
+    /* Private and writable, so the server can touch things without changing the file */
+    char *image = (char *)mmap(NULL, info.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    close(fd);
+
+    if (MAP_FAILED == image) {
+        return -1;
+    }
+
+    ImageHeader *header = (ImageHeader *)image;
+    int valid = 0 == memcmp(header->magic, IMAGE_MAGIC, sizeof(header->magic))
+        && IMAGE_VERSION == header->version
+        && sizeof(size_t) == header->word_size
+        && (uint64_t)info.st_size == header->image_size
+        && (0 == source_hash || source_hash == header->source_hash);
+
+    for (int id = 0; valid && id < IMAGE_NUM_SECTIONS; ++id) {
+        ImageSection section = header->sections[id];
+
+        valid = 0 == section.offset % 8
+            && section.offset <= header->image_size
+            && section.count <= (header->image_size - section.offset) / section_sizes[id];
+    }
+
+    const char *strings = image + header->sections[IMAGE_STRINGS].offset;
+    uint64_t strings_size = header->sections[IMAGE_STRINGS].count;
+
+    ImageNode *nodes = (ImageNode *)(image + header->sections[IMAGE_NODES].offset);
+    uint64_t num_nodes = header->sections[IMAGE_NODES].count;
+
+    /* Every string has to end inside the string table */
+    valid = valid && strings_size > 0 && '\0' == strings[strings_size - 1];
+
+    for (uint64_t i = 0; valid && i < num_nodes; ++i) {
+        valid = nodes[i].name < strings_size && nodes[i].path < strings_size
+            && (IMAGE_NO_STRING == nodes[i].eeprom || nodes[i].eeprom < strings_size)
+            && (IMAGE_NO_STRING == nodes[i].eeprom_seed || nodes[i].eeprom_seed < strings_size);
+    }
+
+    valid = valid && num_nodes == header->sections[IMAGE_SCHEDULE].count
+        && header->sections[IMAGE_STIMULI].count == header->sections[IMAGE_STIMULUS_PATHS].count;
+
+    const uint64_t *stimulus_paths = (const uint64_t *)(image + header->sections[IMAGE_STIMULUS_PATHS].offset);
+    uint64_t num_stimuli = header->sections[IMAGE_STIMULI].count;
+
+    for (uint64_t i = 0; valid && i < num_stimuli; ++i) {
+        valid = stimulus_paths[i] < strings_size;
+    }
+
+    if (!valid) {
+        munmap(image, info.st_size);
+        return -1;
+    }
+
+    network->num_arduinos = num_nodes;
+    network->name_index = NULL;
+    network->name_index_size = 0;
+    network->num_named = 0;
+    network->names = (char **)malloc(sizeof(char *) * (num_nodes + 1));
+    network->paths = (char **)malloc(sizeof(char *) * (num_nodes + 1));
+    network->eeproms = (char **)malloc(sizeof(char *) * (num_nodes + 1));
+    network->eeprom_seeds = (char **)malloc(sizeof(char *) * (num_nodes + 1));
+
+    for (uint64_t i = 0; i < num_nodes; ++i) {
+        network->names[i] = (char *)strings + nodes[i].name;
+        network->paths[i] = (char *)strings + nodes[i].path;
+        network->eeproms[i] = IMAGE_NO_STRING == nodes[i].eeprom ? NULL : (char *)strings + nodes[i].eeprom;
+        network->eeprom_seeds[i] = IMAGE_NO_STRING == nodes[i].eeprom_seed ? NULL : (char *)strings + nodes[i].eeprom_seed;
+    }
+
+    network->schedule = (NodeSchedule *)(image + header->sections[IMAGE_SCHEDULE].offset);
+
+    network->pins = (PinConnection *)(image + header->sections[IMAGE_PINS].offset);
+    network->num_pins = header->sections[IMAGE_PINS].count;
+
+    network->serial_ports = (SerialConnection *)(image + header->sections[IMAGE_SERIAL].offset);
+    network->num_serial = header->sections[IMAGE_SERIAL].count;
+
+    network->pin_fanout_start = (size_t *)(image + header->sections[IMAGE_PIN_FANOUT_START].offset);
+    network->pin_fanout = (size_t *)(image + header->sections[IMAGE_PIN_FANOUT].offset);
+
+    network->serial_route_start = (size_t *)(image + header->sections[IMAGE_SERIAL_ROUTE_START].offset);
+    network->serial_routes = (SerialRoute *)(image + header->sections[IMAGE_SERIAL_ROUTES].offset);
+    network->num_routes = header->sections[IMAGE_SERIAL_ROUTES].count;
+    network->route_capacity = 0;
+    network->free_routes = ROUTE_END;
+
+    network->wires = (WireConnection *)(image + header->sections[IMAGE_WIRES].offset);
+    network->num_wires = header->sections[IMAGE_WIRES].count;
+
+    network->devices = (BusDevice *)(image + header->sections[IMAGE_DEVICES].offset);
+    network->num_devices = header->sections[IMAGE_DEVICES].count;
+
+    network->registers = (DeviceRegister *)(image + header->sections[IMAGE_REGISTERS].offset);
+    network->num_registers = header->sections[IMAGE_REGISTERS].count;
+
+    network->stimuli = (AnalogStimulus *)(image + header->sections[IMAGE_STIMULI].offset);
+    network->num_stimuli = num_stimuli;
+    network->stimulus_paths = (char **)malloc(sizeof(char *) * (num_stimuli + 1));
+
+    for (uint64_t i = 0; i < num_stimuli; ++i) {
+        network->stimulus_paths[i] = (char *)strings + stimulus_paths[i];
+    }
+
+    network->changes = (TopologyChange *)(image + header->sections[IMAGE_CHANGES].offset);
+    network->num_changes = header->sections[IMAGE_CHANGES].count;
+
+    network->image = image;
+    network->image_size = info.st_size;
+
+    if (!image_indexes(network, header)) {
+        free_network(network);
+        return -1;
+    }
+
+    return 0;
+}
+
+
+/* Parse a .ard file, and refresh the image at image_file if it is given */
+static int parse_source(const char *ard_path, const char *image_file, ArduinoNetwork *network)
+{
+    FILE *ard_file = fopen(ard_path, "r");
+
+    if (NULL == ard_file) {
+        return -1;
+    }
+
+    *network = parse_network(ard_file);
+    fclose(ard_file);
+
+    if (NULL != image_file) {
+        if (-1 == write_network_image(image_file, ard_path, network)) {
+            fprintf(stderr, "Could not rebuild stale image \"%s\"\n", image_file);
+        }
+        else {
+            fprintf(stderr, "Rebuilt stale image \"%s\"\n", image_file);
+        }
+    }
+
+    return 0;
+}
+
+
+int load_network(const char *path, ArduinoNetwork *network)
+{
+    if (is_image(path)) {
+        if (-1 == load_network_image(path, 0, network)) {
+            return -1;
+        }
+
+        /* Check the image against its source, if the source is still around */
+        ImageHeader *header = (ImageHeader *)network->image;
+        const char *strings = (const char *)network->image + header->sections[IMAGE_STRINGS].offset;
+
+        char *source = strdup(strings + header->source_path);
+        uint64_t source_hash = hash_file(source);
+        int status = 0;
+
+        if (source_hash && source_hash != header->source_hash) {
+            free_network(network);
+            status = parse_source(source, path, network);
+        }
+
+        free(source);
+        return status;
+    }
+
+    /* A .ard file -- use its image if there is one and it is up to date */
+    char *image_file = image_path(path);
+    int status = 0;
+
+    if (-1 == access(image_file, F_OK)) {
+        status = parse_source(path, NULL, network);
+    }
+    else if (-1 == load_network_image(image_file, hash_file(path), network)) {
+        status = parse_source(path, image_file, network);
+    }
+
+    free(image_file);
+    return status;
+}
@@ -0,0 +1,131 @@
+/* Copyright (C) 2013 Calvin Beck
+
+  Permission is hereby granted, free of charge, to any person
+  obtaining a copy of this software and associated documentation files
+  (the "Software"), to deal in the Software without restriction,
+  including without limitation the rights to use, copy, modify, merge,
+  publish, distribute, sublicense, and/or sell copies of the Software,
+  and to permit persons to whom the Software is furnished to do so,
+  subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be
+  included in all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+  EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+  MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+  NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+  BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+  ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+  CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+  SOFTWARE.
+
+*/
+
+#ifndef NETWORK_IMAGE_H
+#define NETWORK_IMAGE_H
+
+#include "network_parse.h"
+
+#include <stdint.h>
+
+
+/*
+  Compiled .ard images.
+
+  An image is an ArduinoNetwork laid out flat in a file so that it can
+  be mmap'd and used directly: a header, a string table with the
+  names, paths, EEPROM files, and waveforms, a node table of string
+  table offsets, and then the connection arrays, routing indexes, and
+  timeline exactly as they are in memory. Like the protocol, images
+  assume they are used on the machine that made them.
+
+  The header records a hash of the .ard source, so an image that no
+  longer matches its source is noticed and rebuilt.
+ */
+
+enum ImageSectionId {
+    IMAGE_STRINGS,
+    IMAGE_NODES,
+    IMAGE_PINS,
+    IMAGE_SERIAL,
+    IMAGE_PIN_FANOUT_START,
+    IMAGE_PIN_FANOUT,
+    IMAGE_SERIAL_ROUTE_START,
+    IMAGE_SERIAL_ROUTES,
+    IMAGE_SCHEDULE,
+    IMAGE_WIRES,
+    IMAGE_DEVICES,
+    IMAGE_REGISTERS,
+    IMAGE_STIMULI,
+    IMAGE_STIMULUS_PATHS,
+    IMAGE_CHANGES,
+    IMAGE_NUM_SECTIONS
+};
+
+
+typedef struct ImageSection {
+    uint64_t offset;  /* From the start of the image, 8 byte aligned */
+    uint64_t count;   /* Number of elements, not bytes */
+} ImageSection;
+
+
+typedef struct ImageHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t word_size;
+
+    uint64_t source_hash;
+    uint64_t image_size;
+
+    uint64_t source_path;  /* String table offset of the .ard path */
+
+    ImageSection sections[IMAGE_NUM_SECTIONS];
+} ImageHeader;
+
+
+typedef struct ImageNode {
+    uint64_t name;  /* String table offsets */
+    uint64_t path;
+    uint64_t eeprom;  /* IMAGE_NO_STRING if there isn't one */
+    uint64_t eeprom_seed;
+} ImageNode;
+
+
+/* String table offset for a string that isn't there */
+#define IMAGE_NO_STRING UINT64_MAX
+
+
+/* Bump whenever the layout changes so that old images count as stale */
+#define IMAGE_VERSION 8
+
+
+/* Path of the image that goes with a .ard file (caller frees) */
+char *image_path(const char *ard_path);
+
+/* FNV-1a hash of a file's contents. Returns 0 if it can't be read. */
+uint64_t hash_file(const char *path);
+
+/*
+  Write `network` out as an image for the .ard file at
+  source_path. Returns 0 on success, and -1 on failure.
+ */
+int write_network_image(const char *path, const char *source_path, ArduinoNetwork *network);
+
+/*
+  mmap an image into `network`. Only the string arrays are
+  allocated. If source_hash is nonzero the image must match it.
+
+  Returns 0 on success, and -1 if the image is missing, corrupt, or
+  stale.
+ */
+int load_network_image(const char *path, uint64_t source_hash, ArduinoNetwork *network);
+
+/*
+  Load a network from a .ard file or an image, using (and refreshing)
+  the compiled image for a .ard file when there is one. Returns 0 on
+  success, and -1 if nothing could be loaded.
+ */
+int load_network(const char *path, ArduinoNetwork *network);
+
+#endif
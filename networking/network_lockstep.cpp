@@ -0,0 +1,119 @@
+/* Copyright (C) 2013 Calvin Beck
+
+  Permission is hereby granted, free of charge, to any person
+  obtaining a copy of this software and associated documentation files
+  (the "Software"), to deal in the Software without restriction,
+  including without limitation the rights to use, copy, modify, merge,
+  publish, distribute, sublicense, and/or sell copies of the Software,
+  and to permit persons to whom the Software is furnished to do so,
+  subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be
+  included in all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+  EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+  MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+  NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+  BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+  ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+  CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+  SOFTWARE.
+
+*/
+
+#include "network_lockstep.h"
+#include "network_utilities.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+
+
+void init_lockstep(Lockstep *lockstep, size_t num_arduinos, unsigned long long step)
+{
+    lockstep->num_arduinos = num_arduinos;
+    lockstep->step = step;
+    lockstep->end = 0;
+    lockstep->remote = NULL;
+
+    lockstep->held = (HeldByte **)calloc(num_arduinos + 1, sizeof(HeldByte *));
+    lockstep->num_held = (size_t *)calloc(num_arduinos + 1, sizeof(size_t));
+    lockstep->held_size = (size_t *)calloc(num_arduinos + 1, sizeof(size_t));
+}
+
+
+void free_lockstep(Lockstep *lockstep)
+{
+    for (size_t i = 0; i < lockstep->num_arduinos; ++i) {
+        free(lockstep->held[i]);
+    }
+
+    free(lockstep->held);
+    free(lockstep->num_held);
+    free(lockstep->held_size);
+}
+
+
+unsigned long long start_step(Lockstep *lockstep)
+{
+    lockstep->end += lockstep->step;
+    return lockstep->end;
+}
+
+
+int step_done(Lockstep *lockstep, ArduinoMega **arduinos, size_t index)
+{
+    ArduinoMega *arduino = arduinos[index];
+
+    if (NULL != lockstep->remote && lockstep->remote[index]) {
+        return 1;
+    }
+
+    return arduino->virtual_micros >= lockstep->end || arduino->parked || arduino->dead
+        || -1 != arduino->soft_pending_port || arduino->wire_waiting || arduino->syncing;
+}
+
+
+void hold_serial(Lockstep *lockstep, size_t index, int port, uint8_t value)
+{
+    if (lockstep->num_held[index] == lockstep->held_size[index]) {
+        lockstep->held_size[index] = lockstep->held_size[index] ? 2 * lockstep->held_size[index] : 64;
+        lockstep->held[index] = (HeldByte *)realloc(lockstep->held[index], sizeof(HeldByte) * lockstep->held_size[index]);
+
+        if (NULL == lockstep->held[index]) {
+            perror("Could not hold serial output");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    HeldByte *held = &lockstep->held[index][lockstep->num_held[index]++];
+
+    held->port = port;
+    held->value = value;
+}
+
+
+void finish_step(Lockstep *lockstep, ArduinoNetwork *network, ArduinoMega **arduinos, PinNets *nets,
+                 TimingWheel *wheel, unsigned long long *line_free)
+{
+    unsigned long long end = lockstep->end;
+
+    for (size_t i = 0; i < lockstep->num_arduinos; ++i) {
+        for (size_t k = 0; k < lockstep->num_held[i]; ++k) {
+            HeldByte held = lockstep->held[i][k];
+            route_serial(network, arduinos, i, held.port, held.value, wheel, line_free, end, 0);
+        }
+
+        lockstep->num_held[i] = 0;
+    }
+
+    for (size_t i = 0; i < lockstep->num_arduinos; ++i) {
+        update_nets(nets, arduinos, i, end);
+    }
+
+    for (size_t i = 0; i < lockstep->num_arduinos; ++i) {
+        if (-1 != arduinos[i]->soft_pending_port) {
+            route_soft_serial(nets, arduinos, i, end);
+        }
+    }
+}
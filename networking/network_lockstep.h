@@ -0,0 +1,96 @@
+/* Copyright (C) 2013 Calvin Beck
+
+  Permission is hereby granted, free of charge, to any person
+  obtaining a copy of this software and associated documentation files
+  (the "Software"), to deal in the Software without restriction,
+  including without limitation the rights to use, copy, modify, merge,
+  publish, distribute, sublicense, and/or sell copies of the Software,
+  and to permit persons to whom the Software is furnished to do so,
+  subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be
+  included in all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+  EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+  MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+  NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+  BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+  ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+  CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+  SOFTWARE.
+
+*/
+
+#ifndef NETWORK_LOCKSTEP_H
+#define NETWORK_LOCKSTEP_H
+
+#include "network_parse.h"
+#include "network_nets.h"
+#include "network_wheel.h"
+#include <emulard/fakeduino.h>
+
+#include <stdint.h>
+
+
+/*
+  Lockstep runs, for experiments that have to come out the same every
+  time.
+
+  Time goes by in steps of virtual time. In each step every Arduino
+  runs until its clock reaches the end of the step, against the pins
+  as they were when the step started: nothing one Arduino does reaches
+  another until the step is over. Pin drive changes already wait in
+  each Arduino's queue, serial bytes are held here, and a
+  SoftwareSerial write waits for its answer, so an Arduino that writes
+  one is done with the step. At the barrier they are all passed on in
+  the order of the Arduinos, as of the end of the step, so which
+  process happened to get its commands in first doesn't matter.
+
+  An Arduino is also done with a step when it parks, or while it waits
+  on another Arduino to answer a Wire request -- the answer is the one
+  thing that isn't held back. Ghosts of Arduinos that another server
+  runs (see network_cluster.h) never have anything to do.
+ */
+
+typedef struct HeldByte {
+    uint8_t port;
+    uint8_t value;
+} HeldByte;
+
+
+typedef struct Lockstep {
+    size_t num_arduinos;
+    unsigned long long step;
+    unsigned long long end;  /* When the current step is over */
+    const uint8_t *remote;   /* Set for the ghosts, or NULL */
+
+    /* The serial bytes Arduino i wrote this step are held[i][0] up to held[i][num_held[i]] */
+    HeldByte **held;
+    size_t *num_held;
+    size_t *held_size;
+} Lockstep;
+
+
+/* Set up lockstep for `num_arduinos` Arduinos, `step` microseconds at a time */
+void init_lockstep(Lockstep *lockstep, size_t num_arduinos, unsigned long long step);
+void free_lockstep(Lockstep *lockstep);
+
+/* Start the next step, and return when it ends */
+unsigned long long start_step(Lockstep *lockstep);
+
+/* Whether Arduino `index` has nothing more to do this step */
+int step_done(Lockstep *lockstep, ArduinoMega **arduinos, size_t index);
+
+/* Hold a byte Arduino `index` wrote to serial port `port` until the barrier */
+void hold_serial(Lockstep *lockstep, size_t index, int port, uint8_t value);
+
+/*
+  The barrier: pass on everything the Arduinos did this step, in
+  order -- their serial bytes, then their pin drives, then their
+  SoftwareSerial writes -- all as of the end of the step.
+ */
+void finish_step(Lockstep *lockstep, ArduinoNetwork *network, ArduinoMega **arduinos, PinNets *nets,
+                 TimingWheel *wheel, unsigned long long *line_free);
+
+#endif
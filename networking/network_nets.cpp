@@ -0,0 +1,837 @@
+/* Copyright (C) 2013 Calvin Beck
+
+  Permission is hereby granted, free of charge, to any person
+  obtaining a copy of this software and associated documentation files
+  (the "Software"), to deal in the Software without restriction,
+  including without limitation the rights to use, copy, modify, merge,
+  publish, distribute, sublicense, and/or sell copies of the Software,
+  and to permit persons to whom the Software is furnished to do so,
+  subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be
+  included in all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+  EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+  MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+  NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+  BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+  ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+  CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+  SOFTWARE.
+
+*/
+
+#include "network_nets.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+
+/* Whether a pin connection is between two pins that exist */
+static int wired(PinConnection con)
+{
+    return con.out_pin < ArduinoMega::NUM_PINS && con.in_pin < ArduinoMega::NUM_PINS;
+}
+
+
+/* Make room for one more element at the end of one of the arrays */
+static void *grow(void *array, size_t count, size_t *capacity, size_t size)
+{
+    if (count < *capacity) {
+        return array;
+    }
+
+    *capacity = 2 * *capacity + 16;
+    array = realloc(array, size * *capacity);
+
+    if (NULL == array) {
+        perror("Could not allocate nets");
+        exit(EXIT_FAILURE);
+    }
+
+    return array;
+}
+
+
+/* Arduino `index`'s terminal for `pin`, in a net or not, or NETS_END if it has never had one */
+static size_t lookup_terminal(PinNets *nets, size_t index, uint8_t pin)
+{
+    for (size_t t = nets->first_terminal[index]; NETS_END != t; t = nets->terminals[t].next) {
+        if (nets->terminals[t].pin == pin) {
+            return t;
+        }
+    }
+
+    return NETS_END;
+}
+
+
+NetTerminal *find_terminal(PinNets *nets, size_t index, uint8_t pin)
+{
+    size_t t = lookup_terminal(nets, index, pin);
+
+    if (NETS_END == t || NET_NONE == nets->terminals[t].net) {
+        return NULL;
+    }
+
+    return &nets->terminals[t];
+}
+
+
+static void add_drive(Net *net, uint8_t drive, int value)
+{
+    switch (drive) {
+    case ArduinoMega::DRIVE_LOW:
+        ++net->low_drivers;
+        break;
+    case ArduinoMega::DRIVE_HIGH:
+        ++net->high_drivers;
+        net->high_value = value;
+        net->high_stale = 0;
+        break;
+    case ArduinoMega::DRIVE_PULLUP:
+        ++net->pullups;
+        break;
+    }
+}
+
+
+static void remove_drive(Net *net, uint8_t drive)
+{
+    switch (drive) {
+    case ArduinoMega::DRIVE_LOW:
+        --net->low_drivers;
+        break;
+    case ArduinoMega::DRIVE_HIGH:
+        --net->high_drivers;
+        net->high_stale = 1;
+        break;
+    case ArduinoMega::DRIVE_PULLUP:
+        --net->pullups;
+        break;
+    }
+}
+
+
+/* The value one of net `n`'s remaining HIGH drivers, a pin or a link into one, drives it to */
+static int find_high_value(PinNets *nets, uint32_t n)
+{
+    for (size_t k = nets->nets[n].first_member; NETS_END != k; k = nets->terminals[k].next_member) {
+        NetTerminal *terminal = &nets->terminals[k];
+
+        if (ArduinoMega::DRIVE_HIGH == terminal->drive) {
+            return terminal->value;
+        }
+
+        for (size_t l = terminal->first_in; NETS_END != l; l = nets->links[l].next_in) {
+            if (ArduinoMega::DRIVE_HIGH == nets->links[l].drive) {
+                return nets->links[l].value;
+            }
+        }
+    }
+
+    return nets->nets[n].high_value;
+}
+
+
+/* The level a net gives the pin of one of its terminals */
+static int member_level(Net *net, NetTerminal *terminal)
+{
+    return net->pulled ? ArduinoMega::high_level(terminal->pin) : net->level;
+}
+
+
+/*
+  Work out a net's level from its counts, and pass it on to the pins
+  in the net if it changed (or if `force` is set). Returns 1 if it
+  was passed on.
+ */
+static int resolve_net(PinNets *nets, ArduinoMega **arduinos, size_t n, int force)
+{
+    Net *net = &nets->nets[n];
+    int level = 0;
+    uint8_t pulled = 0;
+
+    if (net->low_drivers && net->high_drivers) {
+        if (!net->reported) {
+            NetTerminal *terminal = &nets->terminals[net->first_member];
+
+            fprintf(stderr, "Contention on the net with %s:%d, reading LOW\n", nets->names[terminal->index], terminal->pin);
+            net->reported = 1;
+        }
+    }
+    else if (net->high_drivers) {
+        if (net->high_stale) {
+            net->high_value = find_high_value(nets, n);
+            net->high_stale = 0;
+        }
+
+        level = net->high_value;
+    }
+    else if (!net->low_drivers && net->pullups) {
+        pulled = 1;
+    }
+
+    if (!force && level == net->level && pulled == net->pulled) {
+        return 0;
+    }
+
+    net->level = level;
+    net->pulled = pulled;
+
+    for (size_t k = net->first_member; NETS_END != k; k = nets->terminals[k].next_member) {
+        NetTerminal *terminal = &nets->terminals[k];
+
+        arduinos[terminal->index]->set_pin(terminal->pin, member_level(net, terminal));
+    }
+
+    return 1;
+}
+
+
+/* A net with nothing in it, reusing one that was given up if there is one */
+static uint32_t new_net(PinNets *nets)
+{
+    size_t n = nets->free_nets;
+
+    if (NETS_END != n) {
+        nets->free_nets = nets->nets[n].first_member;
+    }
+    else {
+        nets->nets = (Net *)grow(nets->nets, nets->num_nets, &nets->max_nets, sizeof(Net));
+        n = nets->num_nets++;
+    }
+
+    memset(&nets->nets[n], 0, sizeof(Net));
+    nets->nets[n].first_member = NETS_END;
+
+    return n;
+}
+
+
+/* Give up net `n`, which has no members left */
+static void drop_net(PinNets *nets, uint32_t n)
+{
+    nets->nets[n].first_member = nets->free_nets;
+    nets->nets[n].size = 0;
+    nets->free_nets = n;
+}
+
+
+static void add_member(PinNets *nets, size_t t, uint32_t n)
+{
+    nets->terminals[t].net = n;
+    nets->terminals[t].next_member = nets->nets[n].first_member;
+    nets->nets[n].first_member = t;
+    ++nets->nets[n].size;
+}
+
+
+/*
+  Arduino `index`'s terminal for `pin`, putting the pin in a net of its
+  own, settled, if it isn't in one yet.
+ */
+static size_t open_terminal(PinNets *nets, ArduinoMega **arduinos, size_t index, uint8_t pin)
+{
+    size_t t = lookup_terminal(nets, index, pin);
+
+    if (NETS_END == t) {
+        nets->terminals = (NetTerminal *)grow(nets->terminals, nets->num_terminals, &nets->max_terminals, sizeof(NetTerminal));
+        t = nets->num_terminals++;
+
+        NetTerminal *terminal = &nets->terminals[t];
+
+        terminal->index = index;
+        terminal->pin = pin;
+        terminal->net = NET_NONE;
+        terminal->next = nets->first_terminal[index];
+        terminal->first_wire = NETS_END;
+        terminal->first_link = NETS_END;
+        terminal->first_in = NETS_END;
+
+        nets->first_terminal[index] = t;
+    }
+
+    NetTerminal *terminal = &nets->terminals[t];
+
+    if (NET_NONE == terminal->net) {
+        ArduinoMega *arduino = arduinos[index];
+        uint32_t n = new_net(nets);
+
+        terminal->drive = arduino->drive(pin);
+        terminal->value = arduino->outputs[pin];
+        arduino->netted[pin] = 1;
+
+        add_member(nets, t, n);
+        add_drive(&nets->nets[n], terminal->drive, terminal->value);
+        resolve_net(nets, arduinos, n, 1);
+    }
+
+    return t;
+}
+
+
+/* Take a terminal out of the nets if nothing connects it any more, so its pin is on its own again */
+static void close_terminal(PinNets *nets, ArduinoMega **arduinos, size_t t)
+{
+    NetTerminal *terminal = &nets->terminals[t];
+
+    if (NETS_END != terminal->first_wire || NETS_END != terminal->first_link || NETS_END != terminal->first_in) {
+        return;
+    }
+
+    /* With no wires it's the only one in its net */
+    drop_net(nets, terminal->net);
+    terminal->net = NET_NONE;
+
+    ArduinoMega *arduino = arduinos[terminal->index];
+
+    arduino->netted[terminal->pin] = 0;
+    arduino->drive_changed(terminal->pin);
+}
+
+
+/* The wire after `w` on terminal `t`'s chain */
+static size_t next_wire(PinNets *nets, size_t w, size_t t)
+{
+    return nets->wires[w].next[nets->wires[w].ends[1] == t];
+}
+
+
+/* The terminal at the other end of wire `w` from `t` */
+static size_t other_end(PinNets *nets, size_t w, size_t t)
+{
+    return nets->wires[w].ends[nets->wires[w].ends[0] == t];
+}
+
+
+/*
+  Move the smaller of two nets' terminals over to the larger, so that
+  they head its chain, and return the net that's left.
+ */
+static uint32_t merge_nets(PinNets *nets, uint32_t a, uint32_t b)
+{
+    if (nets->nets[a].size < nets->nets[b].size) {
+        uint32_t swap = a;
+        a = b;
+        b = swap;
+    }
+
+    Net *into = &nets->nets[a];
+    Net *from = &nets->nets[b];
+    size_t last = NETS_END;
+
+    for (size_t k = from->first_member; NETS_END != k; k = nets->terminals[k].next_member) {
+        nets->terminals[k].net = a;
+        last = k;
+    }
+
+    nets->terminals[last].next_member = into->first_member;
+    into->first_member = from->first_member;
+    into->size += from->size;
+
+    into->low_drivers += from->low_drivers;
+    into->high_drivers += from->high_drivers;
+    into->pullups += from->pullups;
+    into->reported = into->reported && from->reported;
+
+    if (from->high_drivers) {
+        into->high_value = from->high_value;
+        into->high_stale = from->high_stale;
+    }
+
+    drop_net(nets, b);
+
+    return a;
+}
+
+
+/* Wire two pins together, merging their nets and settling the result */
+static void join_pins(PinNets *nets, ArduinoMega **arduinos, PinConnection con)
+{
+    /* A pin wired to itself is nothing more than the pin */
+    if (con.out_index == con.in_index && con.out_pin == con.in_pin) {
+        return;
+    }
+
+    size_t a = open_terminal(nets, arduinos, con.out_index, con.out_pin);
+    size_t b = open_terminal(nets, arduinos, con.in_index, con.in_pin);
+
+    size_t w = nets->free_wires;
+
+    if (NETS_END != w) {
+        nets->free_wires = nets->wires[w].next[0];
+    }
+    else {
+        nets->wires = (NetWire *)grow(nets->wires, nets->num_wires, &nets->max_wires, sizeof(NetWire));
+        w = nets->num_wires++;
+    }
+
+    NetWire *wire = &nets->wires[w];
+
+    wire->ends[0] = a;
+    wire->ends[1] = b;
+    wire->next[0] = nets->terminals[a].first_wire;
+    wire->next[1] = nets->terminals[b].first_wire;
+
+    nets->terminals[a].first_wire = w;
+    nets->terminals[b].first_wire = w;
+
+    uint32_t na = nets->terminals[a].net;
+    uint32_t nb = nets->terminals[b].net;
+
+    if (na == nb) {
+        return;
+    }
+
+    size_t moved = nets->nets[na].size < nets->nets[nb].size ? nets->nets[na].size : nets->nets[nb].size;
+    uint32_t n = merge_nets(nets, na, nb);
+
+    /* If the level holds only the pins that moved over need to hear it */
+    if (resolve_net(nets, arduinos, n, 0)) {
+        return;
+    }
+
+    Net *net = &nets->nets[n];
+
+    for (size_t k = net->first_member; moved > 0; k = nets->terminals[k].next_member, --moved) {
+        NetTerminal *terminal = &nets->terminals[k];
+
+        arduinos[terminal->index]->set_pin(terminal->pin, member_level(net, terminal));
+    }
+}
+
+
+/* Take wire `w` off terminal `t`'s chain */
+static void unlink_wire(PinNets *nets, size_t w, size_t t)
+{
+    size_t *link = &nets->terminals[t].first_wire;
+
+    while (*link != w) {
+        link = &nets->wires[*link].next[nets->wires[*link].ends[1] == t];
+    }
+
+    *link = next_wire(nets, w, t);
+}
+
+
+/*
+  The wire between terminals a and b has been cut. If nothing else
+  joins them a's side of the net becomes a net of its own, and both
+  sides count their drivers again.
+ */
+static void split_net(PinNets *nets, ArduinoMega **arduinos, size_t a, size_t b)
+{
+    uint32_t n = nets->terminals[a].net;
+    uint32_t m = new_net(nets);
+
+    size_t *queue = (size_t *)malloc(sizeof(size_t) * (nets->nets[n].size + 1));
+
+    if (NULL == queue) {
+        perror("Could not split net");
+        exit(EXIT_FAILURE);
+    }
+
+    /* Everything a can still reach over the wires moves to m */
+    size_t head = 0;
+    size_t tail = 0;
+
+    queue[tail++] = a;
+    nets->terminals[a].net = m;
+
+    while (head < tail) {
+        size_t t = queue[head++];
+
+        for (size_t w = nets->terminals[t].first_wire; NETS_END != w; w = next_wire(nets, w, t)) {
+            size_t other = other_end(nets, w, t);
+
+            if (n == nets->terminals[other].net) {
+                nets->terminals[other].net = m;
+                queue[tail++] = other;
+            }
+        }
+    }
+
+    if (m == nets->terminals[b].net) {
+        /* Still joined some other way */
+        for (size_t k = 0; k < tail; ++k) {
+            nets->terminals[queue[k]].net = n;
+        }
+
+        drop_net(nets, m);
+        free(queue);
+
+        return;
+    }
+
+    free(queue);
+
+    Net *net = &nets->nets[n];
+    Net *part = &nets->nets[m];
+    size_t k = net->first_member;
+
+    /* Pins on both sides still have the old level, so that's where each side starts */
+    part->level = net->level;
+    part->pulled = net->pulled;
+    part->reported = net->reported;
+
+    net->first_member = NETS_END;
+    net->size = 0;
+    net->low_drivers = 0;
+    net->high_drivers = 0;
+    net->pullups = 0;
+
+    while (NETS_END != k) {
+        NetTerminal *terminal = &nets->terminals[k];
+        size_t next = terminal->next_member;
+        Net *side = &nets->nets[terminal->net];
+
+        add_member(nets, k, terminal->net);
+        add_drive(side, terminal->drive, terminal->value);
+
+        for (size_t l = terminal->first_in; NETS_END != l; l = nets->links[l].next_in) {
+            add_drive(side, nets->links[l].drive, nets->links[l].value);
+        }
+
+        k = next;
+    }
+
+    resolve_net(nets, arduinos, n, 0);
+    resolve_net(nets, arduinos, m, 0);
+}
+
+
+/* A link for a delayed pin connection, carrying nothing yet */
+static size_t open_link(PinNets *nets, ArduinoMega **arduinos, PinConnection con)
+{
+    size_t from = open_terminal(nets, arduinos, con.out_index, con.out_pin);
+    size_t to = open_terminal(nets, arduinos, con.in_index, con.in_pin);
+
+    nets->links = (NetLink *)grow(nets->links, nets->num_links, &nets->max_links, sizeof(NetLink));
+    size_t l = nets->num_links++;
+
+    NetLink *link = &nets->links[l];
+
+    link->from = from;
+    link->to = to;
+    link->delay = con.delay;
+    link->drive = ArduinoMega::DRIVE_NONE;
+    link->value = 0;
+
+    link->next = nets->terminals[from].first_link;
+    link->next_in = nets->terminals[to].first_in;
+
+    nets->terminals[from].first_link = l;
+    nets->terminals[to].first_in = l;
+
+    return l;
+}
+
+
+void init_nets(PinNets *nets, ArduinoNetwork *network, ArduinoMega **arduinos, TimingWheel *wheel)
+{
+    size_t count = network->num_arduinos;
+
+    nets->names = network->names;
+    nets->wheel = wheel;
+
+    nets->first_terminal = (size_t *)malloc(sizeof(size_t) * (count + 1));
+
+    if (NULL == nets->first_terminal) {
+        perror("Could not allocate nets");
+        exit(EXIT_FAILURE);
+    }
+
+    for (size_t i = 0; i < count; ++i) {
+        nets->first_terminal[i] = NETS_END;
+    }
+
+    nets->terminals = NULL;
+    nets->num_terminals = 0;
+    nets->max_terminals = 0;
+
+    nets->nets = NULL;
+    nets->num_nets = 0;
+    nets->max_nets = 0;
+    nets->free_nets = NETS_END;
+
+    nets->wires = NULL;
+    nets->num_wires = 0;
+    nets->max_wires = 0;
+    nets->free_wires = NETS_END;
+
+    nets->links = NULL;
+    nets->num_links = 0;
+    nets->max_links = 0;
+
+    /* Each connection settles whatever it touches as it goes */
+    for (size_t i = 0; i < network->num_pins; ++i) {
+        PinConnection con = network->pins[i];
+
+        if (!wired(con)) {
+            continue;
+        }
+
+        if (!con.delay) {
+            join_pins(nets, arduinos, con);
+            continue;
+        }
+
+        /* Whatever the pins start out driving is already there */
+        size_t l = open_link(nets, arduinos, con);
+        NetLink *link = &nets->links[l];
+        NetTerminal *from = &nets->terminals[link->from];
+        size_t n = nets->terminals[link->to].net;
+
+        link->drive = from->drive;
+        link->value = from->value;
+        add_drive(&nets->nets[n], link->drive, link->value);
+
+        resolve_net(nets, arduinos, n, 0);
+    }
+}
+
+
+void free_nets(PinNets *nets)
+{
+    free(nets->first_terminal);
+    free(nets->terminals);
+    free(nets->nets);
+    free(nets->wires);
+    free(nets->links);
+}
+
+
+/* Terminal `t` drives `drive` from `now` on: settle its net, and send the change down its links */
+static void set_drive(PinNets *nets, ArduinoMega **arduinos, size_t t, uint8_t drive, int value, unsigned long long now)
+{
+    NetTerminal *terminal = &nets->terminals[t];
+
+    if (drive == terminal->drive && value == terminal->value) {
+        return;
+    }
+
+    Net *net = &nets->nets[terminal->net];
+
+    remove_drive(net, terminal->drive);
+    terminal->drive = drive;
+    terminal->value = value;
+    add_drive(net, drive, value);
+
+    resolve_net(nets, arduinos, terminal->net, 0);
+
+    for (size_t l = terminal->first_link; NETS_END != l; l = nets->links[l].next) {
+        schedule_event(nets->wheel, now + nets->links[l].delay, LINK_PIN, drive, l, value);
+    }
+}
+
+
+void update_nets(PinNets *nets, ArduinoMega **arduinos, size_t index, unsigned long long now)
+{
+    ArduinoMega *arduino = arduinos[index];
+
+    for (int k = 0; k < arduino->num_drive_changes; ++k) {
+        uint8_t pin = arduino->drive_changes[k];
+        NetTerminal *terminal = find_terminal(nets, index, pin);
+
+        arduino->drive_queued[pin] = 0;
+
+        if (NULL != terminal) {
+            set_drive(nets, arduinos, terminal - nets->terminals, arduino->drive(pin), arduino->outputs[pin], now);
+        }
+    }
+
+    arduino->num_drive_changes = 0;
+}
+
+
+/*
+  The SoftwareSerial ports on net `n` (other than the sender's) that
+  are listening on it get `value` if `deliver` is set. Returns 1 if
+  some other pin on it is being watched as well, read by its sketch or
+  with an interrupt attached, and needs the bits.
+ */
+static uint8_t soft_listeners(PinNets *nets, ArduinoMega **arduinos, size_t n, NetTerminal *sender, uint8_t value, int deliver)
+{
+    uint8_t bits = 0;
+
+    for (size_t k = nets->nets[n].first_member; NETS_END != k; k = nets->terminals[k].next_member) {
+        NetTerminal *member = &nets->terminals[k];
+        ArduinoMega *peer = arduinos[member->index];
+
+        if (member == sender) {
+            continue;
+        }
+
+        if (peer->soft_endpoint(member->pin)) {
+            int listening = peer->soft_listening;
+
+            if (deliver && -1 != listening && member->pin == peer->soft_rx[listening]) {
+                peer->serial_in[ArduinoMega::NUM_SERIAL + listening]->append(value);
+            }
+        }
+        else if (peer->pins_read[member->pin] || 0 != peer->interrupt_modes[member->pin]) {
+            bits = 1;
+        }
+    }
+
+    return bits;
+}
+
+
+uint8_t relay_soft_serial(PinNets *nets, ArduinoMega **arduinos, size_t index, uint8_t pin, uint8_t value,
+                          unsigned long long now)
+{
+    /* Only writes on netted pins are left for us, so the terminal is there */
+    NetTerminal *terminal = find_terminal(nets, index, pin);
+
+    uint8_t bits = soft_listeners(nets, arduinos, terminal->net, terminal, value, 1);
+
+    /* Whoever is past a link hears the byte later, but the bits have to be decided now */
+    for (size_t l = terminal->first_link; NETS_END != l; l = nets->links[l].next) {
+        size_t to = nets->links[l].to;
+
+        bits |= soft_listeners(nets, arduinos, nets->terminals[to].net, terminal, value, 0);
+        schedule_event(nets->wheel, now + nets->links[l].delay, LINK_SOFT_SERIAL, 0, l, value);
+    }
+
+    return bits;
+}
+
+
+void route_soft_serial(PinNets *nets, ArduinoMega **arduinos, size_t index, unsigned long long now)
+{
+    ArduinoMega *arduino = arduinos[index];
+    int port = arduino->soft_pending_port;
+
+    arduino->soft_serial_reply(relay_soft_serial(nets, arduinos, index, arduino->soft_tx[port],
+                                                 arduino->soft_pending_value, now));
+}
+
+
+void deliver_link(PinNets *nets, ArduinoMega **arduinos, WheelEvent *event)
+{
+    NetLink *link = &nets->links[event->target];
+
+    /* Cut while this was on its way, so it never gets there */
+    if (NETS_END == link->to) {
+        return;
+    }
+
+    size_t n = nets->terminals[link->to].net;
+
+    if (LINK_SOFT_SERIAL == event->kind) {
+        soft_listeners(nets, arduinos, n, NULL, event->value, 1);
+        return;
+    }
+
+    remove_drive(&nets->nets[n], link->drive);
+    link->drive = event->arg;
+    link->value = event->value;
+    add_drive(&nets->nets[n], link->drive, link->value);
+
+    resolve_net(nets, arduinos, n, 0);
+}
+
+
+int connect_pins(PinNets *nets, ArduinoMega **arduinos, PinConnection con, unsigned long long now)
+{
+    if (!wired(con)) {
+        return -1;
+    }
+
+    if (!con.delay) {
+        join_pins(nets, arduinos, con);
+        return 0;
+    }
+
+    size_t l = open_link(nets, arduinos, con);
+    NetTerminal *from = &nets->terminals[nets->links[l].from];
+
+    schedule_event(nets->wheel, now + con.delay, LINK_PIN, from->drive, l, from->value);
+
+    return 0;
+}
+
+
+int cut_pins(PinNets *nets, ArduinoMega **arduinos, PinConnection con)
+{
+    if (!wired(con)) {
+        return -1;
+    }
+
+    size_t a = lookup_terminal(nets, con.out_index, con.out_pin);
+    size_t b = lookup_terminal(nets, con.in_index, con.in_pin);
+
+    if (NETS_END == a || NETS_END == b || NET_NONE == nets->terminals[a].net || NET_NONE == nets->terminals[b].net) {
+        return -1;
+    }
+
+    if (con.delay) {
+        size_t *link = &nets->terminals[a].first_link;
+
+        while (NETS_END != *link && (nets->links[*link].to != b || nets->links[*link].delay != con.delay)) {
+            link = &nets->links[*link].next;
+        }
+
+        if (NETS_END == *link) {
+            return -1;
+        }
+
+        size_t l = *link;
+        *link = nets->links[l].next;
+
+        for (link = &nets->terminals[b].first_in; *link != l; link = &nets->links[*link].next_in) {
+        }
+
+        *link = nets->links[l].next_in;
+
+        /* Whatever it was carrying stops arriving */
+        size_t n = nets->terminals[b].net;
+
+        remove_drive(&nets->nets[n], nets->links[l].drive);
+        nets->links[l].from = NETS_END;
+        nets->links[l].to = NETS_END;
+
+        resolve_net(nets, arduinos, n, 0);
+    }
+    else {
+        size_t w;
+
+        for (w = nets->terminals[a].first_wire; NETS_END != w; w = next_wire(nets, w, a)) {
+            if (other_end(nets, w, a) == b) {
+                break;
+            }
+        }
+
+        if (NETS_END == w) {
+            return -1;
+        }
+
+        unlink_wire(nets, w, a);
+        unlink_wire(nets, w, b);
+
+        nets->wires[w].next[0] = nets->free_wires;
+        nets->free_wires = w;
+
+        split_net(nets, arduinos, a, b);
+    }
+
+    close_terminal(nets, arduinos, a);
+    close_terminal(nets, arduinos, b);
+
+    return 0;
+}
+
+
+void unplug_pins(PinNets *nets, ArduinoMega **arduinos, size_t index, unsigned long long now)
+{
+    for (size_t t = nets->first_terminal[index]; NETS_END != t; t = nets->terminals[t].next) {
+        if (NET_NONE != nets->terminals[t].net) {
+            set_drive(nets, arduinos, t, ArduinoMega::DRIVE_NONE, 0, now);
+        }
+    }
+}
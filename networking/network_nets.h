@@ -0,0 +1,210 @@
+/* Copyright (C) 2013 Calvin Beck
+
+  Permission is hereby granted, free of charge, to any person
+  obtaining a copy of this software and associated documentation files
+  (the "Software"), to deal in the Software without restriction,
+  including without limitation the rights to use, copy, modify, merge,
+  publish, distribute, sublicense, and/or sell copies of the Software,
+  and to permit persons to whom the Software is furnished to do so,
+  subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be
+  included in all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+  EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+  MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+  NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+  BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+  ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+  CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+  SOFTWARE.
+
+*/
+
+#ifndef NETWORK_NETS_H
+#define NETWORK_NETS_H
+
+#include "network_parse.h"
+#include "network_wheel.h"
+#include <emulard/fakeduino.h>
+
+#include <stdint.h>
+
+
+/*
+  Electrical nets for the pin connections.
+
+  A pin connection is a wire, so every pin joined to another by a
+  chain of connections is on the same net (built up by merging the
+  nets each wire joins, smaller into larger). Each net counts what its
+  pins put on it, and settles on a level:
+
+  - Any pin driving LOW pulls the whole net LOW, so OUTPUT LOW and
+    INPUT make an open-drain, wired-AND bus.
+  - Otherwise a pin driving HIGH makes it HIGH.
+  - Otherwise a pull-up makes it HIGH.
+  - Otherwise the net floats, and reads LOW.
+
+  Pins driving both LOW and HIGH at once are contention. The net
+  reads LOW, and the first time it happens on a net it is reported.
+
+  When a pin's drive changes only its net is looked at: the counts
+  are adjusted and the level worked out again in constant time, and
+  the pins on the net are only visited if the level changes.
+
+  A pin connection with a delay is a link instead of a wire. Its IN
+  pin's net counts the link as one more driver, driving whatever its
+  OUT pin drives, but each change only arrives through the timing
+  wheel after the delay. A link carries its OUT pin's own drive and
+  not its net's level, so links in both directions can't latch each
+  other up.
+
+  Connections can come and go while the network runs, and only the
+  nets they touch change. A new wire merges two nets, moving the
+  smaller one's pins over to the larger. Cutting one looks for another
+  way across its net from one end to the other, and if there isn't one
+  the pins on that end's side become a net of their own, with their
+  counts taken again. A pin with nothing connected to it any more
+  leaves the nets, and is back on its own.
+
+  The terminals, nets, wires, and links are all kept on chains through
+  their arrays, so none of them has to move when something changes.
+  Links that are cut stay where they are, so anything still on its
+  way down one can tell it went nowhere.
+ */
+
+/* End of a chain */
+#define NETS_END SIZE_MAX
+
+/* The net of a terminal that isn't in one any more */
+#define NET_NONE UINT32_MAX
+
+typedef struct NetTerminal {
+    size_t index;  /* Arduino the pin belongs to */
+    uint32_t net;  /* NET_NONE once nothing connects the pin */
+    uint8_t pin;
+    uint8_t drive; /* What the pin puts on the net, one of ArduinoMega's DRIVE_ values */
+    int value;     /* What it drives the net to when it is DRIVE_HIGH */
+
+    size_t next;         /* The Arduino's next terminal */
+    size_t next_member;  /* The next terminal in its net */
+    size_t first_wire;
+    size_t first_link;   /* Links carrying its drive */
+    size_t first_in;     /* Links driving it */
+} NetTerminal;
+
+
+typedef struct Net {
+    uint32_t low_drivers;
+    uint32_t high_drivers;
+    uint32_t pullups;
+    int high_value;  /* Value of the last pin to drive the net HIGH */
+    uint8_t high_stale;  /* A HIGH driver left since, so high_value is found again */
+
+    int level;       /* 0 for LOW, or the driven HIGH value */
+    uint8_t pulled;  /* Pulled up, so each pin reads its own HIGH level */
+    uint8_t reported;
+
+    size_t first_member;  /* Or the next unused net, for one that isn't used */
+    size_t size;
+} Net;
+
+
+/* A wire between two terminals, on both of their chains */
+typedef struct NetWire {
+    size_t ends[2];
+    size_t next[2];  /* The next wire on ends[0]'s chain, and on ends[1]'s */
+} NetWire;
+
+
+typedef struct NetLink {
+    size_t from;     /* Terminal whose drive the link carries, NETS_END once cut */
+    size_t to;       /* Terminal on the net it drives, NETS_END once cut */
+    uint32_t delay;
+    uint8_t drive;   /* What has arrived so far */
+    int value;
+
+    size_t next;     /* The next link out of `from` */
+    size_t next_in;  /* The next link into `to` */
+} NetLink;
+
+
+typedef struct PinNets {
+    char **names;
+    TimingWheel *wheel;
+
+    /* Arduino i's terminals chain from first_terminal[i] */
+    size_t *first_terminal;
+    NetTerminal *terminals;
+    size_t num_terminals;
+    size_t max_terminals;
+
+    Net *nets;
+    size_t num_nets;
+    size_t max_nets;
+    size_t free_nets;
+
+    NetWire *wires;
+    size_t num_wires;
+    size_t max_wires;
+    size_t free_wires;
+
+    NetLink *links;
+    size_t num_links;
+    size_t max_links;
+} PinNets;
+
+
+/*
+  Build the nets for a network, mark the pins in them as netted on
+  each Arduino, and settle every net's level.
+ */
+void init_nets(PinNets *nets, ArduinoNetwork *network, ArduinoMega **arduinos, TimingWheel *wheel);
+void free_nets(PinNets *nets);
+
+/* Arduino `index`'s terminal for `pin`, or NULL if the pin isn't in a net */
+NetTerminal *find_terminal(PinNets *nets, size_t index, uint8_t pin);
+
+/*
+  Settle the nets that Arduino `index`'s queued drive changes touch,
+  and send the changes down any links, as of `now` on the wheel's
+  clock.
+ */
+void update_nets(PinNets *nets, ArduinoMega **arduinos, size_t index, unsigned long long now);
+
+/* A LINK_PIN or LINK_SOFT_SERIAL event arriving */
+void deliver_link(PinNets *nets, ArduinoMega **arduinos, WheelEvent *event);
+
+/*
+  Make a pin connection while the network runs, as of `now`: a wire
+  joins its pins' nets at once, and a link's first level arrives after
+  its delay. Returns -1 if the pins don't exist.
+ */
+int connect_pins(PinNets *nets, ArduinoMega **arduinos, PinConnection con, unsigned long long now);
+
+/* Cut a pin connection made the same way, or return -1 if there isn't one */
+int cut_pins(PinNets *nets, ArduinoMega **arduinos, PinConnection con);
+
+/* Arduino `index` stops driving its pins' nets, as of `now`, because it has gone */
+void unplug_pins(PinNets *nets, ArduinoMega **arduinos, size_t index, unsigned long long now);
+
+/*
+  Pass the byte Arduino `index` wrote to a SoftwareSerial port along
+  to the listening SoftwareSerial ports on its TX pin's net, and
+  answer the write. The bits only have to be sent if something else
+  on the net (a plain input, rather than another SoftwareSerial or a
+  driver) is listening to the pin. Across a link the byte arrives
+  after the link's delay.
+ */
+void route_soft_serial(PinNets *nets, ArduinoMega **arduinos, size_t index, unsigned long long now);
+
+/*
+  The part of route_soft_serial that passes a byte along, for a byte
+  Arduino `index` wrote on TX pin `pin`, without answering the write.
+  Returns 1 if the bits have to be sent.
+ */
+uint8_t relay_soft_serial(PinNets *nets, ArduinoMega **arduinos, size_t index, uint8_t pin, uint8_t value,
+                          unsigned long long now);
+
+#endif
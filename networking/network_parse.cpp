@@ -28,6 +28,8 @@
 #include <string.h>
 #include <stdint.h>
 #include <stdlib.h>
+#include <math.h>
+#include <sys/mman.h>
 
 
 /* Returns 1 for ' ', '\t', or '\n', and 0 otherwise */
@@ -125,12 +127,65 @@ static void skip_aesthetics(FILE *ard_file)
 }
 
 
+/* Like skip_aesthetics, but never moves past the end of the line */
+static void skip_blanks(FILE *ard_file)
+{
+    int character = fgetc(ard_file);
+
+    while (' ' == character || '\t' == character) {
+        character = fgetc(ard_file);
+    }
+
+    /* Put the first non-blank character back (no-op on EOF) */
+    ungetc(character, ard_file);
+}
+
+
+/* Returns -1 if it is not a valid hex digit, ['0'-'9', 'a'-'f', 'A'-'F'] */
+static int char_hex_value(char c)
+{
+    if (c >= 'a' && c <= 'f') {
+        return c - 'a' + 10;
+    }
+
+    if (c >= 'A' && c <= 'F') {
+        return c - 'A' + 10;
+    }
+
+    return char_digit_value(c);
+}
+
+
+/* Parses a decimal integer, or a hex one such as "0x50" */
 static int parse_integer(FILE *ard_file)
 {
     int character = fgetc(ard_file);
     int digit_value = char_digit_value(character);
     int total_value = 0;
 
+    if ('0' == character) {
+        character = fgetc(ard_file);
+
+        if ('x' == character || 'X' == character) {
+            character = fgetc(ard_file);
+            digit_value = char_hex_value(character);
+
+            while (-1 != digit_value) {
+                total_value *= 16;
+                total_value += digit_value;
+
+                character = fgetc(ard_file);
+                digit_value = char_hex_value(character);
+            }
+
+            ungetc(character, ard_file);
+
+            return total_value;
+        }
+
+        digit_value = char_digit_value(character);
+    }
+
     while (-1 != digit_value) {
         total_value *= 10;
         total_value += digit_value;
@@ -139,6 +194,39 @@ static int parse_integer(FILE *ard_file)
         digit_value = char_digit_value(character);
     }
 
+    /* Leave the terminator for whoever is parsing after us */
+    ungetc(character, ard_file);
+
+    return total_value;
+}
+
+
+/* Parses a non-negative decimal such as "0.25" */
+static double parse_decimal(FILE *ard_file)
+{
+    double total_value = parse_integer(ard_file);
+    int character = fgetc(ard_file);
+
+    if ('.' != character) {
+        ungetc(character, ard_file);
+        return total_value;
+    }
+
+    double scale = 0.1;
+
+    character = fgetc(ard_file);
+    int digit_value = char_digit_value(character);
+
+    while (-1 != digit_value) {
+        total_value += digit_value * scale;
+        scale /= 10;
+
+        character = fgetc(ard_file);
+        digit_value = char_digit_value(character);
+    }
+
+    ungetc(character, ard_file);
+
     return total_value;
 }
 
@@ -154,7 +242,7 @@ static char *parse_identifier(FILE *ard_file)
     while (1) {
         int character = fgetc(ard_file);
 
-        if (is_comment(character) || is_whitespace(character) || is_separator(character)) {
+        if (is_comment(character) || is_whitespace(character) || is_separator(character) || EOF == character) {
             if (max_length <= length) {
                 max_length = length + 1;
                 identifier = (char *)realloc(identifier, max_length);
@@ -162,6 +250,11 @@ static char *parse_identifier(FILE *ard_file)
 
             identifier[length] = '\0';
 
+            if (is_comment(character)) {
+                /* Comment belongs to skip_aesthetics, not to us */
+                ungetc(character, ard_file);
+            }
+
             return identifier;
         }
         else {
@@ -177,39 +270,187 @@ static char *parse_identifier(FILE *ard_file)
 }
 
 
-static int parse_declaration(FILE *ard_file, ArduinoNetwork *network)
+/* Allocates memory! Like parse_identifier, but ':' is allowed and the terminator is left */
+static char *parse_path(FILE *ard_file)
 {
-    skip_aesthetics(ard_file);
-    char *name = parse_identifier(ard_file);
+    size_t max_length = 64;
 
-    skip_aesthetics(ard_file);
-    char *path = parse_identifier(ard_file);
+    char *path = (char *)malloc(max_length);
+    size_t length = 0;
+
+    while (1) {
+        int character = fgetc(ard_file);
+
+        if (is_comment(character) || is_whitespace(character) || EOF == character) {
+            ungetc(character, ard_file);
+            path[length] = '\0';
+
+            return path;
+        }
+
+        path[length++] = character;
+
+        if (max_length == length) {
+            max_length *= 2;
+            path = (char *)realloc(path, max_length);
+        }
+    }
+}
 
+
+/* Add an Arduino to the network, which takes the strings */
+static void declare_arduino(ArduinoNetwork *network, char *name, char *path)
+{
     network->names = (char **)realloc(network->names, sizeof(network->names[0]) * (network->num_arduinos + 1));
     network->paths = (char **)realloc(network->paths, sizeof(network->paths[0]) * (network->num_arduinos + 1));
+    network->schedule = (NodeSchedule *)realloc(network->schedule, sizeof(network->schedule[0]) * (network->num_arduinos + 1));
+    network->eeproms = (char **)realloc(network->eeproms, sizeof(network->eeproms[0]) * (network->num_arduinos + 1));
+    network->eeprom_seeds = (char **)realloc(network->eeprom_seeds, sizeof(network->eeprom_seeds[0]) * (network->num_arduinos + 1));
 
     network->names[network->num_arduinos] = name;
     network->paths[network->num_arduinos] = path;
+    network->eeproms[network->num_arduinos] = NULL;
+    network->eeprom_seeds[network->num_arduinos] = NULL;
+    memset(&network->schedule[network->num_arduinos], 0, sizeof(network->schedule[0]));
 
     ++network->num_arduinos;
+}
+
+
+static int parse_declaration(FILE *ard_file, ArduinoNetwork *network)
+{
+    skip_aesthetics(ard_file);
+    char *name = parse_identifier(ard_file);
+
+    skip_aesthetics(ard_file);
+    char *path = parse_identifier(ard_file);
+
+    declare_arduino(network, name, path);
 
     return 0;
 }
 
 
-static int arduino_lookup(const char *name, ArduinoNetwork *network)
+/* The slot `name` has in the name index, or the empty one it would go in */
+static size_t name_slot(ArduinoNetwork *network, const char *name)
 {
-    for (int i = 0; i < network->num_arduinos; ++i) {
-        if (0 == strcmp(name, network->names[i])) {
-            return i;
+    /* FNV-1a */
+    uint64_t hash = 14695981039346656037ULL;
+
+    for (const char *c = name; '\0' != *c; ++c) {
+        hash = (hash ^ (uint8_t)*c) * 1099511628211ULL;
+    }
+
+    size_t mask = network->name_index_size - 1;
+    size_t slot = hash & mask;
+
+    while (-1 != network->name_index[slot] && 0 != strcmp(name, network->names[network->name_index[slot]])) {
+        slot = (slot + 1) & mask;
+    }
+
+    return slot;
+}
+
+
+/* Put the Arduinos declared since the last lookup in the name index, growing it to stay half empty */
+static void index_names(ArduinoNetwork *network)
+{
+    if (2 * network->num_arduinos >= network->name_index_size || network->num_named > network->num_arduinos) {
+        size_t size = 64;
+
+        while (2 * network->num_arduinos >= size) {
+            size *= 2;
+        }
+
+        free(network->name_index);
+        network->name_index = (int *)malloc(sizeof(int) * size);
+
+        if (NULL == network->name_index) {
+            perror("Could not index the Arduinos' names");
+            exit(EXIT_FAILURE);
         }
+
+        memset(network->name_index, 0xFF, sizeof(int) * size);
+        network->name_index_size = size;
+        network->num_named = 0;
     }
 
-    return -1;
+    for (; network->num_named < network->num_arduinos; ++network->num_named) {
+        size_t slot = name_slot(network, network->names[network->num_named]);
+
+        /* The first Arduino with a name keeps it */
+        if (-1 == network->name_index[slot]) {
+            network->name_index[slot] = network->num_named;
+        }
+    }
 }
 
 
-static int parse_pin(FILE *ard_file, ArduinoNetwork *network)
+int arduino_lookup(const char *name, ArduinoNetwork *network)
+{
+    if (network->num_named != network->num_arduinos || NULL == network->name_index) {
+        index_names(network);
+    }
+
+    return network->name_index[name_slot(network, name)];
+}
+
+
+/*
+  The optional timing at the end of a connection: "<N>us" or "<N>ms"
+  of delay for a pin connection, and "<N>baud", or "begin" for the
+  rate the sender's Serial.begin() asks for, for a serial one. Leaves
+  `timing` at 0 if there isn't one, and returns -1 if it's malformed.
+ */
+static int parse_timing(FILE *ard_file, char type, uint32_t *timing)
+{
+    *timing = 0;
+
+    skip_blanks(ard_file);
+    int character = fgetc(ard_file);
+    ungetc(character, ard_file);
+
+    if (-1 == char_digit_value(character) && 'b' != character) {
+        return 0;
+    }
+
+    uint32_t count = -1 == char_digit_value(character) ? 0 : parse_integer(ard_file);
+    char unit[8];
+    size_t length = 0;
+
+    for (character = fgetc(ard_file); character >= 'a' && character <= 'z'; character = fgetc(ard_file)) {
+        if (length < sizeof(unit) - 1) {
+            unit[length++] = character;
+        }
+    }
+
+    ungetc(character, ard_file);
+    unit[length] = '\0';
+
+    if ('s' != type && 0 == strcmp(unit, "us")) {
+        *timing = count;
+    }
+    else if ('s' != type && 0 == strcmp(unit, "ms")) {
+        *timing = count * 1000;
+    }
+    else if ('s' == type && count && 0 == strcmp(unit, "baud")) {
+        *timing = count;
+    }
+    else if ('s' == type && 0 == count && 0 == strcmp(unit, "begin")) {
+        *timing = SERIAL_BAUD_BEGIN;
+    }
+    else {
+        fprintf(stderr, "Bad timing \"%u%s\" for a '%c' connection, expected %s\n", count, unit, type,
+                's' == type ? "<N>baud or begin" : "<N>us or <N>ms");
+        return -1;
+    }
+
+    return 0;
+}
+
+
+/* Read a pin connection's fields, "<NAME>:<PIN> <NAME>:<PIN> [<N>us]" */
+static int read_pin(FILE *ard_file, ArduinoNetwork *network, PinConnection *connection)
 {
     /* Fetch all of the fields */
     skip_aesthetics(ard_file);
@@ -224,30 +465,44 @@ static int parse_pin(FILE *ard_file, ArduinoNetwork *network)
     skip_aesthetics(ard_file);
     int in_pin = parse_integer(ard_file);
 
-    /* Make the new connection */
-    PinConnection connection;
-
-    connection.out_index = arduino_lookup(out_name, network);
-    connection.out_pin = out_pin;
+    /* A pin out of range is kept out of range, rather than wrapping round to a real one */
+    connection->out_index = arduino_lookup(out_name, network);
+    connection->out_pin = out_pin >= 0 && out_pin < NETWORK_PINS ? out_pin : NETWORK_PINS;
 
-    connection.in_index = arduino_lookup(in_name, network);
-    connection.in_pin = in_pin;
+    connection->in_index = arduino_lookup(in_name, network);
+    connection->in_pin = in_pin >= 0 && in_pin < NETWORK_PINS ? in_pin : NETWORK_PINS;
 
     /* Free the names - we don't need to keep them */
     free(out_name);
     free(in_name);
 
+    return parse_timing(ard_file, 'p', &connection->delay);
+}
+
+
+static int parse_pin(FILE *ard_file, ArduinoNetwork *network)
+{
+    PinConnection connection;
+    int status = read_pin(ard_file, network, &connection);
+
+    if (!valid_pin_connection(network, connection)) {
+        fprintf(stderr, "Bad 'p' entry, expected <NAME>:<PIN> <NAME>:<PIN> between declared Arduinos and pins 0 to %d\n",
+                NETWORK_PINS - 1);
+        return -1;
+    }
+
     /* Add the connection to the network */
     network->pins = (PinConnection *)realloc(network->pins, sizeof(network->pins[0]) * (network->num_pins + 1));
     network->pins[network->num_pins] = connection;
 
     ++network->num_pins;
 
-    return 0;
+    return status;
 }
 
 
-static int parse_serial(FILE *ard_file, ArduinoNetwork *network)
+/* Read a serial connection's fields, "<NAME>:<PORT> <NAME>:<PORT> [<N>baud]" */
+static int read_serial(FILE *ard_file, ArduinoNetwork *network, SerialConnection *connection)
 {
     /* Fetch all of the fields */
     skip_aesthetics(ard_file);
@@ -262,128 +517,1543 @@ static int parse_serial(FILE *ard_file, ArduinoNetwork *network)
     skip_aesthetics(ard_file);
     int in_port = parse_integer(ard_file);
 
-    /* Make the new connection */
-    SerialConnection connection;
-
-    connection.out_index = arduino_lookup(out_name, network);
-    connection.out_port = out_port;
+    connection->out_index = arduino_lookup(out_name, network);
+    connection->out_port = out_port;
 
-    connection.in_index = arduino_lookup(in_name, network);
-    connection.in_port = in_port;
+    connection->in_index = arduino_lookup(in_name, network);
+    connection->in_port = in_port;
 
     /* Free the names - we don't need to keep them */
     free(out_name);
     free(in_name);
 
+    return parse_timing(ard_file, 's', &connection->baud);
+}
+
+
+static int parse_serial(FILE *ard_file, ArduinoNetwork *network)
+{
+    SerialConnection connection;
+    int status = read_serial(ard_file, network, &connection);
+
+    if (!valid_serial_connection(network, connection)) {
+        fprintf(stderr, "Bad 's' entry, expected <NAME>:<PORT> <NAME>:<PORT> between declared Arduinos and ports 0 to %d\n",
+                NETWORK_SERIAL_PORTS - 1);
+        return -1;
+    }
+
     /* Add the connection to the network */
     network->serial_ports = (SerialConnection *) realloc(network->serial_ports, sizeof(network->serial_ports[0]) * (network->num_serial + 1));
     network->serial_ports[network->num_serial] = connection;
 
     ++network->num_serial;
 
-    return 0;
+    return status;
 }
 
 
-static int parse_entry(FILE *ard_file, ArduinoNetwork *network)
+/*
+  Topology generators.
+
+  A 'g' entry expands a whole family of Arduinos and the connections
+  between them in one line, instead of writing out every 'd', 'p',
+  and 's' entry. The generator produces a list of directed edges, and
+  each edge is then stamped with the connection templates that follow
+  the generator on the same line.
+ */
+
+typedef struct EdgeList {
+    size_t *from;
+    size_t *to;
+
+    size_t count;
+    size_t capacity;
+} EdgeList;
+
+
+/* A 'p', 'r', or 's' template from the end of a generator line */
+typedef struct ConnectionTemplate {
+    char type;
+
+    int out;
+    int in;
+
+    uint32_t timing;  /* Delay or baud rate, as for the connection */
+} ConnectionTemplate;
+
+
+static void add_edge(EdgeList *edges, size_t from, size_t to)
 {
-    int character = fgetc(ard_file);
+    if (edges->count == edges->capacity) {
+        edges->capacity = edges->capacity ? edges->capacity * 2 : 64;
 
-    switch (character) {
-    case 'd':
-        return parse_declaration(ard_file, network);
-    case 'p':
-        return parse_pin(ard_file, network);
-    case 's':
-        return parse_serial(ard_file, network);
-    default:
-        return -1;
+        edges->from = (size_t *)realloc(edges->from, sizeof(edges->from[0]) * edges->capacity);
+        edges->to = (size_t *)realloc(edges->to, sizeof(edges->to[0]) * edges->capacity);
     }
 
-    return 0;
+    edges->from[edges->count] = from;
+    edges->to[edges->count] = to;
+
+    ++edges->count;
 }
 
 
-ArduinoNetwork parse_network(FILE *ard_file)
+/* Make sure the edge list can take `extra` more edges without reallocating */
+static void reserve_edges(EdgeList *edges, size_t extra)
 {
-    ArduinoNetwork network;
+    if (edges->count + extra <= edges->capacity) {
+        return;
+    }
 
-    /* Initialize the network structure so we can try to fill it */
-    network.names = NULL;
-    network.paths = NULL;
-    network.num_arduinos = 0;
+    edges->capacity = edges->count + extra;
 
-    network.serial_ports = NULL;
-    network.num_serial = 0;
+    edges->from = (size_t *)realloc(edges->from, sizeof(edges->from[0]) * edges->capacity);
+    edges->to = (size_t *)realloc(edges->to, sizeof(edges->to[0]) * edges->capacity);
+}
 
-    network.pins = NULL;
-    network.num_pins = 0;
 
-    /* First let's skip past all of the whitespace / comments */
-    skip_aesthetics(ard_file);
+/*
+  splitmix64 -- tiny, seedable, and gives the same network for the
+  same seed on every machine, which rand() does not.
+ */
+static uint64_t next_random(uint64_t *state)
+{
+    uint64_t z = (*state += 0x9E3779B97F4A7C15ULL);
 
-    /* Check if we ran out of file! */
-    while (!feof(ard_file)) {
-        /* Should be at an entry with identifying character - d, p, or s */
-        parse_entry(ard_file, &network);
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
 
-        /* Now skip ahead to the next entry */
-        skip_aesthetics(ard_file);
-    }
+    return z ^ (z >> 31);
+}
 
-    return network;
+
+/* Uniform double in [0, 1) */
+static double random_unit(uint64_t *state)
+{
+    return (next_random(state) >> 11) * (1.0 / 9007199254740992.0);
 }
 
 
-void free_network(ArduinoNetwork *network)
+static void generate_line(EdgeList *edges, size_t count)
 {
-    /* Free all of the paths and names */
-    for (int i = 0; i < network->num_arduinos; ++i) {
-        free(network->names[i]);
-        free(network->paths[i]);
-    }
+    reserve_edges(edges, count);
 
-    /* Now free the arrays */
-    free(network->names);
-    free(network->paths);
+    for (size_t i = 0; i + 1 < count; ++i) {
+        add_edge(edges, i, i + 1);
+    }
+}
 
-    free(network->serial_ports);
-    free(network->pins);
 
-    network->names = NULL;
-    network->paths = NULL;
-    network->serial_ports = NULL;
-    network->pins = NULL;
+static void generate_ring(EdgeList *edges, size_t count)
+{
+    generate_line(edges, count);
 
-    network->num_arduinos = 0;
-    network->num_serial = 0;
-    network->num_pins = 0;
+    if (count > 1) {
+        add_edge(edges, count - 1, 0);
+    }
 }
 
 
-void print_network(ArduinoNetwork *network)
+/* Node (x, y) has index y * width + x. Edges go right and down. */
+static void generate_grid(EdgeList *edges, size_t width, size_t height, int wrap)
 {
-    printf("%lu Arduinos:\n\n", network->num_arduinos);
+    reserve_edges(edges, 2 * width * height);
 
-    for (int i = 0; i < network->num_arduinos; ++i) {
-        printf("%s - %s\n", network->names[i], network->paths[i]);
+    for (size_t y = 0; y < height; ++y) {
+        for (size_t x = 0; x < width; ++x) {
+            size_t node = y * width + x;
+
+            if (x + 1 < width) {
+                add_edge(edges, node, node + 1);
+            }
+            else if (wrap && width > 2) {
+                add_edge(edges, node, y * width);
+            }
+
+            if (y + 1 < height) {
+                add_edge(edges, node, node + width);
+            }
+            else if (wrap && height > 2) {
+                add_edge(edges, node, x);
+            }
+        }
     }
+}
 
-    printf("\n");
 
-    for (int i = 0; i < network->num_pins; ++i) {
-        PinConnection con = network->pins[i];
-        printf("%s pin %d to %s pin %d\n", network->names[con.out_index], con.out_pin,
-               network->names[con.in_index], con.in_pin);
+/* Node 0 is the hub */
+static void generate_star(EdgeList *edges, size_t count)
+{
+    reserve_edges(edges, count);
+
+    for (size_t i = 1; i < count; ++i) {
+        add_edge(edges, 0, i);
     }
+}
 
-    printf("\n");
 
-    for (int i = 0; i < network->num_serial; ++i) {
-        SerialConnection con = network->serial_ports[i];
-        printf("%s serial %d to %s serial %d\n", network->names[con.out_index], con.out_port,
-               network->names[con.in_index], con.in_port);
+static void generate_complete(EdgeList *edges, size_t count)
+{
+    reserve_edges(edges, count * (count - 1) / 2);
+
+    for (size_t i = 0; i < count; ++i) {
+        for (size_t j = i + 1; j < count; ++j) {
+            add_edge(edges, i, j);
+        }
     }
+}
 
-    printf("\n");
+
+/*
+  Erdos-Renyi G(n, p). Rather than flipping a coin for all n^2 / 2
+  pairs we jump straight to the next edge with a geometric skip
+  (Batagelj and Brandes), so sparse graphs cost O(n + m).
+ */
+static void generate_random(EdgeList *edges, size_t count, double probability, uint64_t seed)
+{
+    if (probability <= 0) {
+        return;
+    }
+
+    if (probability >= 1) {
+        generate_complete(edges, count);
+        return;
+    }
+
+    double log_q = log(1.0 - probability);
+    long long v = 1;
+    long long w = -1;
+
+    while (v < (long long)count) {
+        double r = random_unit(&seed);
+        w += 1 + (long long)floor(log(1.0 - r) / log_q);
+
+        while (w >= v && v < (long long)count) {
+            w -= v;
+            ++v;
+        }
+
+        if (v < (long long)count) {
+            add_edge(edges, w, v);
+        }
+    }
+}
+
+
+/* Open addressing set of undirected edges, for rejecting duplicates */
+static int edge_set_insert(uint64_t *table, size_t mask, size_t a, size_t b)
+{
+    if (a > b) {
+        size_t tmp = a;
+        a = b;
+        b = tmp;
+    }
+
+    /* +1 so that 0 can mean an empty slot */
+    uint64_t key = (((uint64_t)a << 32) | (uint64_t)b) + 1;
+    size_t slot = (key * 0x9E3779B97F4A7C15ULL) >> 20 & mask;
+
+    while (table[slot]) {
+        if (table[slot] == key) {
+            return 0;
+        }
+
+        slot = (slot + 1) & mask;
+    }
+
+    table[slot] = key;
+    return 1;
+}
+
+
+/*
+  Random d-regular graph. Stubs are paired off at random, rejecting
+  self loops and duplicate edges, and starting over in the rare case
+  that the last few stubs can't be paired (Steger and Wormald).
+ */
+static int generate_regular(EdgeList *edges, size_t count, size_t degree, uint64_t seed)
+{
+    size_t num_stubs = count * degree;
+
+    if (degree >= count || num_stubs % 2) {
+        return -1;
+    }
+
+    size_t table_size = 1;
+    while (table_size < num_stubs) {
+        table_size *= 2;
+    }
+
+    size_t *stubs = (size_t *)malloc(sizeof(stubs[0]) * num_stubs);
+    uint64_t *table = (uint64_t *)malloc(sizeof(table[0]) * table_size);
+    size_t first_edge = edges->count;
+
+    reserve_edges(edges, num_stubs / 2);
+
+    for (int attempt = 0; attempt < 100; ++attempt) {
+        for (size_t i = 0; i < num_stubs; ++i) {
+            stubs[i] = i / degree;
+        }
+
+        memset(table, 0, sizeof(table[0]) * table_size);
+        edges->count = first_edge;
+
+        size_t remaining = num_stubs;
+        int failures = 0;
+
+        while (remaining > 0 && failures < 100) {
+            size_t i = next_random(&seed) % remaining;
+            size_t j = next_random(&seed) % remaining;
+            size_t u = stubs[i];
+            size_t v = stubs[j];
+
+            if (i == j || u == v || !edge_set_insert(table, table_size - 1, u, v)) {
+                ++failures;
+                continue;
+            }
+
+            add_edge(edges, u, v);
+            failures = 0;
+
+            /* Remove the two stubs, larger position first */
+            if (i < j) {
+                size_t tmp = i;
+                i = j;
+                j = tmp;
+            }
+
+            stubs[i] = stubs[--remaining];
+            stubs[j] = stubs[--remaining];
+        }
+
+        if (0 == remaining) {
+            free(stubs);
+            free(table);
+            return 0;
+        }
+    }
+
+    free(stubs);
+    free(table);
+
+    edges->count = first_edge;
+    return -1;
+}
+
+
+/* Declare `count` Arduinos named <prefix>0 ... <prefix>N-1 */
+static void declare_generated(ArduinoNetwork *network, const char *prefix, const char *path, size_t count)
+{
+    size_t total = network->num_arduinos + count;
+
+    network->names = (char **)realloc(network->names, sizeof(network->names[0]) * total);
+    network->paths = (char **)realloc(network->paths, sizeof(network->paths[0]) * total);
+    network->schedule = (NodeSchedule *)realloc(network->schedule, sizeof(network->schedule[0]) * total);
+    network->eeproms = (char **)realloc(network->eeproms, sizeof(network->eeproms[0]) * total);
+    network->eeprom_seeds = (char **)realloc(network->eeprom_seeds, sizeof(network->eeprom_seeds[0]) * total);
+
+    memset(&network->schedule[network->num_arduinos], 0, sizeof(network->schedule[0]) * count);
+    memset(&network->eeproms[network->num_arduinos], 0, sizeof(network->eeproms[0]) * count);
+    memset(&network->eeprom_seeds[network->num_arduinos], 0, sizeof(network->eeprom_seeds[0]) * count);
+
+    size_t name_length = strlen(prefix) + 21;
+    size_t path_length = strlen(path) + 1;
+
+    for (size_t i = 0; i < count; ++i) {
+        char *name = (char *)malloc(name_length);
+        char *node_path = (char *)malloc(path_length);
+
+        snprintf(name, name_length, "%s%lu", prefix, (unsigned long)i);
+        memcpy(node_path, path, path_length);
+
+        network->names[network->num_arduinos + i] = name;
+        network->paths[network->num_arduinos + i] = node_path;
+    }
+
+    network->num_arduinos = total;
+}
+
+
+/* Stamp every template onto every edge. `base` is the index of node 0 */
+static void expand_templates(ArduinoNetwork *network, size_t base, EdgeList *edges, ConnectionTemplate *templates, size_t num_templates)
+{
+    size_t pin_templates = 0;
+    size_t serial_templates = 0;
+
+    for (size_t t = 0; t < num_templates; ++t) {
+        if ('s' == templates[t].type) {
+            ++serial_templates;
+        }
+        else {
+            ++pin_templates;
+        }
+    }
+
+    /* Grow each array exactly once */
+    if (pin_templates) {
+        network->pins = (PinConnection *)realloc(network->pins, sizeof(network->pins[0]) * (network->num_pins + edges->count * pin_templates));
+    }
+
+    if (serial_templates) {
+        network->serial_ports = (SerialConnection *)realloc(network->serial_ports, sizeof(network->serial_ports[0]) * (network->num_serial + edges->count * serial_templates));
+    }
+
+    for (size_t e = 0; e < edges->count; ++e) {
+        size_t from = base + edges->from[e];
+        size_t to = base + edges->to[e];
+
+        for (size_t t = 0; t < num_templates; ++t) {
+            ConnectionTemplate tmpl = templates[t];
+
+            if ('s' == tmpl.type) {
+                SerialConnection connection;
+
+                connection.out_index = from;
+                connection.out_port = tmpl.out;
+                connection.in_index = to;
+                connection.in_port = tmpl.in;
+                connection.baud = tmpl.timing;
+
+                network->serial_ports[network->num_serial++] = connection;
+            }
+            else {
+                /* 'r' runs the pin connection against the edge */
+                PinConnection connection;
+
+                connection.out_index = 'r' == tmpl.type ? to : from;
+                connection.out_pin = tmpl.out;
+                connection.in_index = 'r' == tmpl.type ? from : to;
+                connection.in_pin = tmpl.in;
+                connection.delay = tmpl.timing;
+
+                network->pins[network->num_pins++] = connection;
+            }
+        }
+    }
+}
+
+
+static int parse_generator(FILE *ard_file, ArduinoNetwork *network)
+{
+    skip_aesthetics(ard_file);
+    char *kind = parse_identifier(ard_file);
+
+    skip_aesthetics(ard_file);
+    char *prefix = parse_identifier(ard_file);
+
+    skip_aesthetics(ard_file);
+    char *path = parse_identifier(ard_file);
+
+    /* Shape arguments -- which ones we need depends on the kind */
+    size_t count = 0;
+    EdgeList edges = {NULL, NULL, 0, 0};
+    int status = 0;
+
+    skip_blanks(ard_file);
+    size_t first = parse_integer(ard_file);
+
+    if (0 == strcmp(kind, "line")) {
+        count = first;
+        generate_line(&edges, count);
+    }
+    else if (0 == strcmp(kind, "ring")) {
+        count = first;
+        generate_ring(&edges, count);
+    }
+    else if (0 == strcmp(kind, "star")) {
+        count = first;
+        generate_star(&edges, count);
+    }
+    else if (0 == strcmp(kind, "complete")) {
+        count = first;
+        generate_complete(&edges, count);
+    }
+    else if (0 == strcmp(kind, "grid") || 0 == strcmp(kind, "torus")) {
+        skip_blanks(ard_file);
+        size_t height = parse_integer(ard_file);
+
+        count = first * height;
+        generate_grid(&edges, first, height, 0 == strcmp(kind, "torus"));
+    }
+    else if (0 == strcmp(kind, "regular")) {
+        skip_blanks(ard_file);
+        size_t degree = parse_integer(ard_file);
+
+        skip_blanks(ard_file);
+        uint64_t seed = parse_integer(ard_file);
+
+        count = first;
+        status = generate_regular(&edges, count, degree, seed);
+
+        if (-1 == status) {
+            fprintf(stderr, "No %lu-regular graph on %lu Arduinos for \"%s\"\n",
+                    (unsigned long)degree, (unsigned long)count, prefix);
+        }
+    }
+    else if (0 == strcmp(kind, "random")) {
+        skip_blanks(ard_file);
+        double probability = parse_decimal(ard_file);
+
+        skip_blanks(ard_file);
+        uint64_t seed = parse_integer(ard_file);
+
+        count = first;
+        generate_random(&edges, count, probability, seed);
+    }
+    else {
+        fprintf(stderr, "Unknown generator \"%s\"\n", kind);
+        status = -1;
+    }
+
+    if (0 == status && 0 == count) {
+        fprintf(stderr, "Generator \"%s\" for \"%s\" has no Arduinos\n", kind, prefix);
+        status = -1;
+    }
+
+    /* Connection templates run to the end of the line */
+    ConnectionTemplate *templates = NULL;
+    size_t num_templates = 0;
+
+    while (0 == status) {
+        skip_blanks(ard_file);
+        int character = fgetc(ard_file);
+
+        if ('p' != character && 'r' != character && 's' != character) {
+            ungetc(character, ard_file);
+            break;
+        }
+
+        ConnectionTemplate tmpl;
+        tmpl.type = character;
+
+        skip_blanks(ard_file);
+        tmpl.out = parse_integer(ard_file);
+
+        if (!is_separator(fgetc(ard_file))) {
+            fprintf(stderr, "Bad '%c' template for \"%s\", expected <OUT>:<IN>\n", tmpl.type, prefix);
+            status = -1;
+            break;
+        }
+
+        tmpl.in = parse_integer(ard_file);
+
+        if (-1 == parse_timing(ard_file, tmpl.type, &tmpl.timing)) {
+            status = -1;
+            break;
+        }
+
+        templates = (ConnectionTemplate *)realloc(templates, sizeof(templates[0]) * (num_templates + 1));
+        templates[num_templates++] = tmpl;
+    }
+
+    if (0 == status) {
+        size_t base = network->num_arduinos;
+
+        declare_generated(network, prefix, path, count);
+        expand_templates(network, base, &edges, templates, num_templates);
+    }
+    else {
+        /* Don't try to make sense of whatever is left of the line */
+        skip_line(ard_file);
+    }
+
+    free(templates);
+    free(edges.from);
+    free(edges.to);
+
+    free(kind);
+    free(prefix);
+    free(path);
+
+    return status;
+}
+
+
+/* Whether `name` matches `pattern`, which is a prefix if it ends in '*' */
+static int name_matches(const char *pattern, const char *name)
+{
+    size_t length = strlen(pattern);
+
+    if (length > 0 && '*' == pattern[length - 1]) {
+        return 0 == strncmp(pattern, name, length - 1);
+    }
+
+    return 0 == strcmp(pattern, name);
+}
+
+
+/*
+  "e <NAME>:<PATH> [<SEED>]" keeps an Arduino's EEPROM in the file at
+  PATH, which lasts from run to run. With a SEED the EEPROM starts
+  each run as a copy of that file instead. A NAME ending in '*' is a
+  prefix, and then each Arduino's file is PATH with its name on the
+  end.
+ */
+static int parse_eeprom(FILE *ard_file, ArduinoNetwork *network)
+{
+    skip_aesthetics(ard_file);
+    char *name = parse_identifier(ard_file);
+
+    skip_aesthetics(ard_file);
+    char *path = parse_path(ard_file);
+    char *seed = NULL;
+
+    skip_blanks(ard_file);
+    int character = fgetc(ard_file);
+    ungetc(character, ard_file);
+
+    if (!is_newline(character) && !is_comment(character) && EOF != character) {
+        seed = parse_path(ard_file);
+    }
+
+    size_t length = strlen(name);
+    int prefix = length > 0 && '*' == name[length - 1];
+    int found = 0;
+
+    for (size_t i = 0; '\0' != path[0] && i < network->num_arduinos; ++i) {
+        if (!name_matches(name, network->names[i])) {
+            continue;
+        }
+
+        size_t path_length = strlen(path) + (prefix ? strlen(network->names[i]) : 0) + 1;
+        char *node_path = (char *)malloc(path_length);
+        snprintf(node_path, path_length, "%s%s", path, prefix ? network->names[i] : "");
+
+        /* The last entry for an Arduino wins */
+        free(network->eeproms[i]);
+        free(network->eeprom_seeds[i]);
+
+        network->eeproms[i] = node_path;
+        network->eeprom_seeds[i] = NULL == seed ? NULL : strdup(seed);
+
+        found = 1;
+    }
+
+    if (!found) {
+        fprintf(stderr, "Bad 'e' entry for \"%s\", expected <NAME>:<PATH> naming an Arduino\n", name);
+    }
+
+    free(name);
+    free(path);
+    free(seed);
+
+    return found ? 0 : -1;
+}
+
+
+/*
+  "a <NAME>:<PIN> <PATH> [<N>us]" plays the waveform in the file at
+  PATH on an analog pin: uint16_t samples every N microseconds (or
+  <N>ms), or CSV without a period. A NAME ending in '*' is a prefix,
+  and then each Arduino's file is PATH with its name on the end.
+ */
+static int parse_stimulus(FILE *ard_file, ArduinoNetwork *network)
+{
+    skip_aesthetics(ard_file);
+    char *name = parse_identifier(ard_file);
+
+    skip_aesthetics(ard_file);
+    int pin = parse_integer(ard_file);
+
+    skip_aesthetics(ard_file);
+    char *path = parse_path(ard_file);
+
+    uint32_t period;
+
+    if (-1 == parse_timing(ard_file, 'a', &period) || pin < 54 || pin > 69 || '\0' == path[0]) {
+        fprintf(stderr, "Bad 'a' entry for \"%s\", expected <NAME>:<PIN> <PATH> [<N>us] for an analog pin (54 to 69)\n", name);
+        free(name);
+        free(path);
+
+        return -1;
+    }
+
+    size_t length = strlen(name);
+    int prefix = length > 0 && '*' == name[length - 1];
+    int found = 0;
+
+    for (size_t i = 0; i < network->num_arduinos; ++i) {
+        if (!name_matches(name, network->names[i])) {
+            continue;
+        }
+
+        size_t path_length = strlen(path) + (prefix ? strlen(network->names[i]) : 0) + 1;
+        char *node_path = (char *)malloc(path_length);
+        snprintf(node_path, path_length, "%s%s", path, prefix ? network->names[i] : "");
+
+        AnalogStimulus stimulus;
+        stimulus.index = i;
+        stimulus.pin = pin;
+        stimulus.period = period;
+
+        network->stimuli = (AnalogStimulus *)realloc(network->stimuli, sizeof(network->stimuli[0]) * (network->num_stimuli + 1));
+        network->stimulus_paths = (char **)realloc(network->stimulus_paths, sizeof(char *) * (network->num_stimuli + 1));
+
+        network->stimuli[network->num_stimuli] = stimulus;
+        network->stimulus_paths[network->num_stimuli++] = node_path;
+
+        found = 1;
+    }
+
+    if (!found) {
+        fprintf(stderr, "No Arduino matches \"%s\" for 'a'\n", name);
+    }
+
+    free(name);
+    free(path);
+
+    return found ? 0 : -1;
+}
+
+
+/*
+  Scheduling entries, "q <NAME>:<COMMANDS>" for the commands an
+  Arduino gets per round, and "l <NAME>:<RATE>" for a limit in
+  commands per second. A NAME ending in '*' is a prefix, so a whole
+  generated family can be set at once.
+ */
+static int parse_schedule(FILE *ard_file, ArduinoNetwork *network, int type)
+{
+    skip_aesthetics(ard_file);
+    char *name = parse_identifier(ard_file);
+
+    skip_aesthetics(ard_file);
+    uint32_t value = parse_integer(ard_file);
+
+    int found = 0;
+
+    for (size_t i = 0; i < network->num_arduinos; ++i) {
+        if (!name_matches(name, network->names[i])) {
+            continue;
+        }
+
+        if ('q' == type) {
+            network->schedule[i].quantum = value;
+        }
+        else {
+            network->schedule[i].rate = value;
+        }
+
+        found = 1;
+    }
+
+    if (!found) {
+        fprintf(stderr, "No Arduino matches \"%s\" for '%c'\n", name, type);
+    }
+
+    free(name);
+
+    return found ? 0 : -1;
+}
+
+
+/*
+  "f <NAME>:<POLICY>" says what happens when an Arduino's process
+  dies: "halt" stops the run, "dead" carries on without it, and
+  "respawn" starts it again. Like the scheduling entries a NAME ending
+  in '*' is a prefix.
+ */
+static int parse_failure(FILE *ard_file, ArduinoNetwork *network)
+{
+    skip_aesthetics(ard_file);
+    char *name = parse_identifier(ard_file);
+
+    skip_aesthetics(ard_file);
+    char *policy = parse_identifier(ard_file);
+
+    uint32_t failure;
+
+    if (0 == strcmp(policy, "halt")) {
+        failure = FAILURE_HALT;
+    }
+    else if (0 == strcmp(policy, "dead")) {
+        failure = FAILURE_DEAD;
+    }
+    else if (0 == strcmp(policy, "respawn")) {
+        failure = FAILURE_RESPAWN;
+    }
+    else {
+        fprintf(stderr, "Unknown failure policy \"%s\", expected halt, dead, or respawn\n", policy);
+        free(name);
+        free(policy);
+
+        return -1;
+    }
+
+    int found = 0;
+
+    for (size_t i = 0; i < network->num_arduinos; ++i) {
+        if (name_matches(name, network->names[i])) {
+            network->schedule[i].failure = failure;
+            found = 1;
+        }
+    }
+
+    if (!found) {
+        fprintf(stderr, "No Arduino matches \"%s\" for 'f'\n", name);
+    }
+
+    free(name);
+    free(policy);
+
+    return found ? 0 : -1;
+}
+
+
+/*
+  "w <NAME>:<BUS>" puts an Arduino's Wire on an I2C bus. Like the
+  scheduling entries a NAME ending in '*' is a prefix.
+ */
+static int parse_wire(FILE *ard_file, ArduinoNetwork *network)
+{
+    skip_aesthetics(ard_file);
+    char *name = parse_identifier(ard_file);
+
+    skip_aesthetics(ard_file);
+    uint32_t bus = parse_integer(ard_file);
+
+    int found = 0;
+
+    for (size_t i = 0; i < network->num_arduinos; ++i) {
+        if (!name_matches(name, network->names[i])) {
+            continue;
+        }
+
+        WireConnection wire;
+        wire.index = i;
+        wire.bus = bus;
+
+        network->wires = (WireConnection *)realloc(network->wires, sizeof(network->wires[0]) * (network->num_wires + 1));
+        network->wires[network->num_wires++] = wire;
+
+        found = 1;
+    }
+
+    if (!found) {
+        fprintf(stderr, "No Arduino matches \"%s\" for 'w'\n", name);
+    }
+
+    free(name);
+
+    return found ? 0 : -1;
+}
+
+
+/*
+  Device entries, "i <BUS>:<ADDRESS> <MODEL> ..." for an I2C device
+  and "c <NAME>:<PIN> <MODEL> ..." for an SPI device selected by one
+  of an Arduino's pins. The model runs to the end of the line:
+
+  eeprom <BYTES>
+  sensor [<REGISTER>=<VALUE> ...]
+ */
+static int parse_device(FILE *ard_file, ArduinoNetwork *network, int type)
+{
+    BusDevice device;
+    memset(&device, 0, sizeof(device));
+
+    device.spi = 'c' == type;
+
+    skip_aesthetics(ard_file);
+
+    if (device.spi) {
+        char *name = parse_identifier(ard_file);
+        device.index = arduino_lookup(name, network);
+
+        if ((size_t)-1 == device.index) {
+            fprintf(stderr, "No Arduino \"%s\" for 'c'\n", name);
+        }
+
+        free(name);
+    }
+    else {
+        device.bus = parse_integer(ard_file);
+
+        if (!is_separator(fgetc(ard_file))) {
+            fprintf(stderr, "Bad 'i' entry, expected <BUS>:<ADDRESS>\n");
+            skip_line(ard_file);
+            return -1;
+        }
+    }
+
+    device.address = parse_integer(ard_file);
+
+    skip_blanks(ard_file);
+    char *model = parse_identifier(ard_file);
+    int status = 0;
+
+    if (0 == strcmp(model, "eeprom")) {
+        device.model = DEVICE_EEPROM;
+
+        skip_blanks(ard_file);
+        device.size = parse_integer(ard_file);
+
+        if (0 == device.size) {
+            fprintf(stderr, "An eeprom needs a size in bytes\n");
+            status = -1;
+        }
+    }
+    else if (0 == strcmp(model, "sensor")) {
+        device.model = DEVICE_SENSOR;
+
+        /* Registers run to the end of the line, and always start with a digit */
+        while (1) {
+            skip_blanks(ard_file);
+            int character = fgetc(ard_file);
+            ungetc(character, ard_file);
+
+            if (-1 == char_digit_value(character)) {
+                break;
+            }
+
+            DeviceRegister reg;
+            reg.device = network->num_devices;
+            reg.reg = parse_integer(ard_file);
+
+            if ('=' != fgetc(ard_file)) {
+                fprintf(stderr, "Bad sensor register, expected <REGISTER>=<VALUE>\n");
+                skip_line(ard_file);
+                status = -1;
+                break;
+            }
+
+            reg.value = parse_integer(ard_file);
+
+            network->registers = (DeviceRegister *)realloc(network->registers, sizeof(network->registers[0]) * (network->num_registers + 1));
+            network->registers[network->num_registers++] = reg;
+        }
+    }
+    else {
+        fprintf(stderr, "Unknown device model \"%s\"\n", model);
+        status = -1;
+    }
+
+    free(model);
+
+    if ((device.spi && (size_t)-1 == device.index) || -1 == status) {
+        /* Don't leave registers behind for a device that never made it */
+        while (network->num_registers > 0 && network->registers[network->num_registers - 1].device == network->num_devices) {
+            --network->num_registers;
+        }
+
+        return -1;
+    }
+
+    network->devices = (BusDevice *)realloc(network->devices, sizeof(network->devices[0]) * (network->num_devices + 1));
+    network->devices[network->num_devices++] = device;
+
+    return 0;
+}
+
+
+/*
+  "t <TIME> <ENTRY>" changes the network partway through a run, at
+  "<N>us", "<N>ms", or "<N>s" on its clock. ENTRY is a 'p' or 's'
+  entry for a connection made then, or "d <NAME>" to start an Arduino.
+  With a '-' in front ("-p", "-s", or "-d") it cuts the connection, or
+  stops the Arduino, instead.
+ */
+static int parse_change(FILE *ard_file, ArduinoNetwork *network)
+{
+    TopologyChange change;
+    memset(&change, 0, sizeof(change));
+
+    skip_blanks(ard_file);
+    uint64_t count = parse_integer(ard_file);
+    char unit[8];
+    size_t length = 0;
+    int character;
+
+    for (character = fgetc(ard_file); character >= 'a' && character <= 'z'; character = fgetc(ard_file)) {
+        if (length < sizeof(unit) - 1) {
+            unit[length++] = character;
+        }
+    }
+
+    ungetc(character, ard_file);
+    unit[length] = '\0';
+
+    if (0 == strcmp(unit, "us")) {
+        change.time = count;
+    }
+    else if (0 == strcmp(unit, "ms")) {
+        change.time = count * 1000;
+    }
+    else if (0 == strcmp(unit, "s")) {
+        change.time = count * 1000000;
+    }
+    else {
+        fprintf(stderr, "Bad time \"%llu%s\" for a 't' entry, expected <N>us, <N>ms, or <N>s\n", (unsigned long long)count, unit);
+        skip_line(ard_file);
+        return -1;
+    }
+
+    skip_blanks(ard_file);
+    character = fgetc(ard_file);
+
+    if ('-' == character) {
+        change.cut = 1;
+        character = fgetc(ard_file);
+    }
+
+    int status = 0;
+    int valid = 0;
+
+    switch (character) {
+    case 'p':
+        change.kind = CHANGE_PIN;
+        status = read_pin(ard_file, network, &change.pin);
+        valid = valid_pin_connection(network, change.pin);
+        break;
+    case 's':
+        change.kind = CHANGE_SERIAL;
+        status = read_serial(ard_file, network, &change.serial);
+        valid = valid_serial_connection(network, change.serial);
+        break;
+    case 'd': {
+        skip_aesthetics(ard_file);
+        char *name = parse_identifier(ard_file);
+
+        change.kind = CHANGE_ARDUINO;
+        change.index = arduino_lookup(name, network);
+        valid = change.index < network->num_arduinos;
+
+        if (!valid) {
+            fprintf(stderr, "No Arduino \"%s\" for 't'\n", name);
+        }
+
+        free(name);
+        break;
+    }
+    default:
+        fprintf(stderr, "Bad 't' entry, expected <TIME> then a 'p', 's', or 'd' entry, with an optional '-'\n");
+        skip_line(ard_file);
+        return -1;
+    }
+
+    if (-1 == status || !valid) {
+        if (CHANGE_ARDUINO != change.kind) {
+            fprintf(stderr, "Bad connection in a 't' entry at %llu us\n", (unsigned long long)change.time);
+        }
+
+        return -1;
+    }
+
+    network->changes = (TopologyChange *)realloc(network->changes, sizeof(network->changes[0]) * (network->num_changes + 1));
+    network->changes[network->num_changes++] = change;
+
+    return 0;
+}
+
+
+static int parse_entry(FILE *ard_file, ArduinoNetwork *network)
+{
+    int character = fgetc(ard_file);
+
+    switch (character) {
+    case 'd':
+        return parse_declaration(ard_file, network);
+    case 'p':
+        return parse_pin(ard_file, network);
+    case 's':
+        return parse_serial(ard_file, network);
+    case 'g':
+        return parse_generator(ard_file, network);
+    case 'q':
+    case 'l':
+        return parse_schedule(ard_file, network, character);
+    case 'w':
+        return parse_wire(ard_file, network);
+    case 'f':
+        return parse_failure(ard_file, network);
+    case 'a':
+        return parse_stimulus(ard_file, network);
+    case 'e':
+        return parse_eeprom(ard_file, network);
+    case 'i':
+    case 'c':
+        return parse_device(ard_file, network, character);
+    case 't':
+        return parse_change(ard_file, network);
+    default:
+        return -1;
+    }
+
+    return 0;
+}
+
+
+/* A network with nothing in it */
+static ArduinoNetwork empty_network()
+{
+    ArduinoNetwork network;
+
+    network.names = NULL;
+    network.paths = NULL;
+    network.schedule = NULL;
+    network.eeproms = NULL;
+    network.eeprom_seeds = NULL;
+    network.num_arduinos = 0;
+
+    network.name_index = NULL;
+    network.name_index_size = 0;
+    network.num_named = 0;
+
+    network.serial_ports = NULL;
+    network.num_serial = 0;
+
+    network.pins = NULL;
+    network.num_pins = 0;
+
+    network.wires = NULL;
+    network.num_wires = 0;
+    network.devices = NULL;
+    network.num_devices = 0;
+    network.registers = NULL;
+    network.num_registers = 0;
+
+    network.stimuli = NULL;
+    network.stimulus_paths = NULL;
+    network.num_stimuli = 0;
+
+    network.changes = NULL;
+    network.num_changes = 0;
+
+    network.pin_fanout_start = NULL;
+    network.pin_fanout = NULL;
+    network.serial_route_start = NULL;
+    network.serial_routes = NULL;
+    network.num_routes = 0;
+    network.route_capacity = 0;
+    network.free_routes = ROUTE_END;
+
+    network.image = NULL;
+    network.image_size = 0;
+
+    return network;
+}
+
+
+ArduinoNetwork parse_network(FILE *ard_file)
+{
+    ArduinoNetwork network = empty_network();
+
+    /* First let's skip past all of the whitespace / comments */
+    skip_aesthetics(ard_file);
+
+    /* Check if we ran out of file! */
+    while (!feof(ard_file)) {
+        /* Should be at an entry with identifying character - d, p, s, or g */
+        parse_entry(ard_file, &network);
+
+        /* Now skip ahead to the next entry */
+        skip_aesthetics(ard_file);
+    }
+
+    index_network(&network);
+
+    return network;
+}
+
+
+ArduinoNetwork single_network(const char *name, const char *path)
+{
+    ArduinoNetwork network = empty_network();
+
+    declare_arduino(&network, strdup(name), strdup(path));
+    index_network(&network);
+
+    return network;
+}
+
+
+/* Only connections between declared Arduinos and real ports / pins get indexed */
+int valid_pin_connection(ArduinoNetwork *network, PinConnection con)
+{
+    return con.out_index < network->num_arduinos && con.in_index < network->num_arduinos
+        && con.out_pin < NETWORK_PINS && con.in_pin < NETWORK_PINS;
+}
+
+
+int valid_serial_connection(ArduinoNetwork *network, SerialConnection con)
+{
+    return con.out_index < network->num_arduinos && con.in_index < network->num_arduinos
+        && con.out_port >= 0 && con.out_port < NETWORK_SERIAL_PORTS
+        && con.in_port >= 0 && con.in_port < NETWORK_SERIAL_PORTS;
+}
+
+
+void index_network(ArduinoNetwork *network)
+{
+    size_t num_nodes = network->num_arduinos;
+    size_t num_slots = num_nodes * NETWORK_SERIAL_PORTS;
+
+    free(network->pin_fanout_start);
+    free(network->pin_fanout);
+    free(network->serial_route_start);
+    free(network->serial_routes);
+
+    /* Counting sort of the pin connections by the Arduino driving them */
+    network->pin_fanout_start = (size_t *)calloc(num_nodes + 1, sizeof(size_t));
+    network->pin_fanout = (size_t *)malloc(sizeof(size_t) * (network->num_pins + 1));
+
+    for (size_t i = 0; i < network->num_pins; ++i) {
+        if (valid_pin_connection(network, network->pins[i])) {
+            ++network->pin_fanout_start[network->pins[i].out_index + 1];
+        }
+    }
+
+    for (size_t i = 0; i < num_nodes; ++i) {
+        network->pin_fanout_start[i + 1] += network->pin_fanout_start[i];
+    }
+
+    size_t *next = (size_t *)malloc(sizeof(size_t) * (num_slots + 1));
+    memcpy(next, network->pin_fanout_start, sizeof(size_t) * num_nodes);
+
+    for (size_t i = 0; i < network->num_pins; ++i) {
+        PinConnection con = network->pins[i];
+
+        if (valid_pin_connection(network, con)) {
+            network->pin_fanout[next[con.out_index]++] = i;
+        }
+    }
+
+    /* Serial connections are bidirectional, so each one is two routes */
+    network->serial_route_start = (size_t *)calloc(num_slots + 1, sizeof(size_t));
+    network->num_routes = 0;
+
+    for (size_t i = 0; i < network->num_serial; ++i) {
+        SerialConnection con = network->serial_ports[i];
+
+        if (valid_serial_connection(network, con)) {
+            ++network->serial_route_start[con.out_index * NETWORK_SERIAL_PORTS + con.out_port + 1];
+            ++network->serial_route_start[con.in_index * NETWORK_SERIAL_PORTS + con.in_port + 1];
+            network->num_routes += 2;
+        }
+    }
+
+    for (size_t i = 0; i < num_slots; ++i) {
+        network->serial_route_start[i + 1] += network->serial_route_start[i];
+    }
+
+    network->serial_routes = (SerialRoute *)malloc(sizeof(SerialRoute) * (network->num_routes + 1));
+    network->route_capacity = network->num_routes + 1;
+    network->free_routes = ROUTE_END;
+    memcpy(next, network->serial_route_start, sizeof(size_t) * num_slots);
+
+    for (size_t i = 0; i < network->num_serial; ++i) {
+        SerialConnection con = network->serial_ports[i];
+
+        if (valid_serial_connection(network, con)) {
+            SerialRoute forward = {con.in_index, con.in_port, con.baud, ROUTE_END};
+            SerialRoute backward = {con.out_index, con.out_port, con.baud, ROUTE_END};
+
+            network->serial_routes[next[con.out_index * NETWORK_SERIAL_PORTS + con.out_port]++] = forward;
+            network->serial_routes[next[con.in_index * NETWORK_SERIAL_PORTS + con.in_port]++] = backward;
+        }
+    }
+
+    /* Each port's routes are side by side, so chain each to the next and start the empty ports off at the end */
+    for (size_t slot = 0; slot < num_slots; ++slot) {
+        size_t start = network->serial_route_start[slot];
+
+        for (size_t k = start; k + 1 < next[slot]; ++k) {
+            network->serial_routes[k].next = k + 1;
+        }
+
+        if (start == next[slot]) {
+            network->serial_route_start[slot] = ROUTE_END;
+        }
+    }
+
+    free(next);
+}
+
+
+/* A route to put on a port's chain, reusing one that was taken out if there is one */
+static size_t new_route(ArduinoNetwork *network, size_t slot, SerialRoute route)
+{
+    size_t k = network->free_routes;
+
+    if (ROUTE_END != k) {
+        network->free_routes = network->serial_routes[k].next;
+    }
+    else {
+        if (network->num_routes >= network->route_capacity) {
+            size_t capacity = 2 * network->num_routes + 16;
+            SerialRoute *routes = (SerialRoute *)malloc(sizeof(SerialRoute) * capacity);
+
+            if (NULL == routes) {
+                perror("Could not add serial routes");
+                exit(EXIT_FAILURE);
+            }
+
+            /* An image's routes stay where they are, and ours take over from them */
+            memcpy(routes, network->serial_routes, sizeof(SerialRoute) * network->num_routes);
+
+            if (0 != network->route_capacity) {
+                free(network->serial_routes);
+            }
+
+            network->serial_routes = routes;
+            network->route_capacity = capacity;
+        }
+
+        k = network->num_routes++;
+    }
+
+    route.next = network->serial_route_start[slot];
+    network->serial_routes[k] = route;
+    network->serial_route_start[slot] = k;
+
+    return k;
+}
+
+
+/* Take the route from `slot` to port `port` of Arduino `index` with `baud` off its chain, or return -1 */
+static int drop_route(ArduinoNetwork *network, size_t slot, size_t index, int port, uint32_t baud)
+{
+    size_t *link = &network->serial_route_start[slot];
+
+    while (ROUTE_END != *link) {
+        size_t k = *link;
+        SerialRoute *route = &network->serial_routes[k];
+
+        if (route->index == index && route->port == port && route->baud == baud) {
+            *link = route->next;
+            route->next = network->free_routes;
+            network->free_routes = k;
+
+            return 0;
+        }
+
+        link = &route->next;
+    }
+
+    return -1;
+}
+
+
+int add_serial_routes(ArduinoNetwork *network, SerialConnection con, size_t *routes)
+{
+    if (!valid_serial_connection(network, con)) {
+        return -1;
+    }
+
+    SerialRoute forward = {con.in_index, con.in_port, con.baud, ROUTE_END};
+    SerialRoute backward = {con.out_index, con.out_port, con.baud, ROUTE_END};
+
+    routes[0] = new_route(network, con.out_index * NETWORK_SERIAL_PORTS + con.out_port, forward);
+    routes[1] = new_route(network, con.in_index * NETWORK_SERIAL_PORTS + con.in_port, backward);
+
+    return 0;
+}
+
+
+int remove_serial_routes(ArduinoNetwork *network, SerialConnection con)
+{
+    if (!valid_serial_connection(network, con)) {
+        return -1;
+    }
+
+    size_t out_slot = con.out_index * NETWORK_SERIAL_PORTS + con.out_port;
+    size_t in_slot = con.in_index * NETWORK_SERIAL_PORTS + con.in_port;
+
+    if (-1 == drop_route(network, out_slot, con.in_index, con.in_port, con.baud)) {
+        return -1;
+    }
+
+    return drop_route(network, in_slot, con.out_index, con.out_port, con.baud);
+}
+
+
+void free_network(ArduinoNetwork *network)
+{
+    if (network->image) {
+        /* Everything but the string arrays lives in the image, unless the routes outgrew it */
+        munmap(network->image, network->image_size);
+
+        if (0 != network->route_capacity) {
+            free(network->serial_routes);
+        }
+    }
+    else {
+        /* Free all of the paths and names */
+        for (int i = 0; i < network->num_arduinos; ++i) {
+            free(network->names[i]);
+            free(network->paths[i]);
+            free(network->eeproms[i]);
+            free(network->eeprom_seeds[i]);
+        }
+
+        free(network->schedule);
+        free(network->serial_ports);
+        free(network->pins);
+        free(network->wires);
+        free(network->devices);
+        free(network->registers);
+
+        for (size_t i = 0; i < network->num_stimuli; ++i) {
+            free(network->stimulus_paths[i]);
+        }
+
+        free(network->stimuli);
+        free(network->changes);
+
+        free(network->pin_fanout_start);
+        free(network->pin_fanout);
+        free(network->serial_route_start);
+        free(network->serial_routes);
+    }
+
+    /* Now free the arrays */
+    free(network->names);
+    free(network->paths);
+    free(network->eeproms);
+    free(network->eeprom_seeds);
+    free(network->stimulus_paths);
+    free(network->name_index);
+
+    network->names = NULL;
+    network->paths = NULL;
+    network->eeproms = NULL;
+    network->eeprom_seeds = NULL;
+    network->schedule = NULL;
+    network->serial_ports = NULL;
+    network->pins = NULL;
+    network->wires = NULL;
+    network->devices = NULL;
+    network->registers = NULL;
+    network->stimuli = NULL;
+    network->stimulus_paths = NULL;
+    network->changes = NULL;
+    network->name_index = NULL;
+
+    network->pin_fanout_start = NULL;
+    network->pin_fanout = NULL;
+    network->serial_route_start = NULL;
+    network->serial_routes = NULL;
+
+    network->image = NULL;
+    network->image_size = 0;
+
+    network->num_arduinos = 0;
+    network->name_index_size = 0;
+    network->num_named = 0;
+    network->num_serial = 0;
+    network->num_pins = 0;
+    network->num_wires = 0;
+    network->num_devices = 0;
+    network->num_registers = 0;
+    network->num_stimuli = 0;
+    network->num_changes = 0;
+    network->num_routes = 0;
+    network->route_capacity = 0;
+    network->free_routes = ROUTE_END;
+}
+
+
+void print_network(ArduinoNetwork *network)
+{
+    printf("%lu Arduinos:\n\n", network->num_arduinos);
+
+    for (int i = 0; i < network->num_arduinos; ++i) {
+        printf("%s - %s\n", network->names[i], network->paths[i]);
+
+        if (NULL != network->eeproms[i]) {
+            printf("    EEPROM in %s%s%s\n", network->eeproms[i],
+                   network->eeprom_seeds[i] ? ", from " : "", network->eeprom_seeds[i] ? network->eeprom_seeds[i] : "");
+        }
+    }
+
+    printf("\n");
+
+    for (int i = 0; i < network->num_pins; ++i) {
+        PinConnection con = network->pins[i];
+        printf("%s pin %d to %s pin %d", network->names[con.out_index], con.out_pin,
+               network->names[con.in_index], con.in_pin);
+
+        if (con.delay) {
+            printf(", %u us later", con.delay);
+        }
+
+        printf("\n");
+    }
+
+    printf("\n");
+
+    for (int i = 0; i < network->num_serial; ++i) {
+        SerialConnection con = network->serial_ports[i];
+        printf("%s serial %d to %s serial %d", network->names[con.out_index], con.out_port,
+               network->names[con.in_index], con.in_port);
+
+        if (SERIAL_BAUD_BEGIN == con.baud) {
+            printf(", at the Serial.begin() rate");
+        }
+        else if (con.baud) {
+            printf(", at %u baud", con.baud);
+        }
+
+        printf("\n");
+    }
+
+    printf("\n");
+
+    for (int i = 0; i < network->num_wires; ++i) {
+        printf("%s on I2C bus %u\n", network->names[network->wires[i].index], network->wires[i].bus);
+    }
+
+    for (int i = 0; i < network->num_devices; ++i) {
+        BusDevice device = network->devices[i];
+        const char *model = DEVICE_EEPROM == device.model ? "eeprom" : "sensor";
+
+        if (device.spi) {
+            printf("%s on %s's SPI, selected by pin %d\n", model, network->names[device.index], device.address);
+        }
+        else {
+            printf("%s on I2C bus %u at 0x%02X\n", model, device.bus, device.address);
+        }
+    }
+
+    if (network->num_wires || network->num_devices) {
+        printf("\n");
+    }
+
+    for (size_t i = 0; i < network->num_stimuli; ++i) {
+        AnalogStimulus stimulus = network->stimuli[i];
+        printf("%s pin %d plays %s", network->names[stimulus.index], stimulus.pin, network->stimulus_paths[i]);
+
+        if (stimulus.period) {
+            printf(", a sample every %u us", stimulus.period);
+        }
+
+        printf("\n");
+    }
+
+    if (network->num_stimuli) {
+        printf("\n");
+    }
+
+    for (size_t i = 0; i < network->num_changes; ++i) {
+        TopologyChange change = network->changes[i];
+        printf("At %llu us, ", (unsigned long long)change.time);
+
+        if (CHANGE_PIN == change.kind) {
+            printf("%s %s pin %d to %s pin %d", change.cut ? "cut" : "connect", network->names[change.pin.out_index],
+                   change.pin.out_pin, network->names[change.pin.in_index], change.pin.in_pin);
+        }
+        else if (CHANGE_SERIAL == change.kind) {
+            printf("%s %s serial %d to %s serial %d", change.cut ? "cut" : "connect", network->names[change.serial.out_index],
+                   change.serial.out_port, network->names[change.serial.in_index], change.serial.in_port);
+        }
+        else {
+            printf("%s %s", change.cut ? "stop" : "start", network->names[change.index]);
+        }
+
+        printf("\n");
+    }
+
+    if (network->num_changes) {
+        printf("\n");
+    }
 }
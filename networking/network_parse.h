@@ -30,36 +30,204 @@
 #include <stdlib.h>
 
 
+/*
+  A pin connection with a delay isn't a wire joining two nets: OUT's
+  drive reaches IN's net that many microseconds later.
+ */
 typedef struct PinConnection {
     size_t out_index;
     size_t in_index;
 
     uint8_t out_pin;
     uint8_t in_pin;
+
+    uint32_t delay;  /* Microseconds, 0 for a plain wire */
 } PinConnection;
 
 
+/* Baud rate for a serial connection paced by its sender's Serial.begin() */
+#define SERIAL_BAUD_BEGIN UINT32_MAX
+
+/*
+  A serial connection with a baud rate takes 10 bits' time to carry
+  each byte, one after another. Without one bytes arrive at once.
+ */
 typedef struct SerialConnection {
     size_t out_index;
     size_t in_index;
 
     int out_port;
     int in_port;
+
+    uint32_t baud;  /* 0 for no pacing, or SERIAL_BAUD_BEGIN */
 } SerialConnection;
 
 
+/* End of a chain of serial routes */
+#define ROUTE_END SIZE_MAX
+
+/* Where a byte written to a serial port ends up */
+typedef struct SerialRoute {
+    size_t index;
+    int port;
+    uint32_t baud;
+    size_t next;  /* Next route out of the same port, or ROUTE_END */
+} SerialRoute;
+
+
+/* What the server does when an Arduino's process dies */
+#define FAILURE_HALT 0     /* Stop the run */
+#define FAILURE_DEAD 1     /* Leave it dead, and carry on without it */
+#define FAILURE_RESPAWN 2  /* Start it again from scratch */
+
+/*
+  How the server schedules an Arduino. 0 in any field means the
+  default: the server's quantum, no rate limit, and halting if it dies.
+ */
+typedef struct NodeSchedule {
+    uint32_t quantum;  /* Commands per round */
+    uint32_t rate;     /* Commands per second */
+    uint32_t failure;  /* One of the FAILURE_ values */
+} NodeSchedule;
+
+
+/* Arduino `index` has its Wire on I2C bus `bus` */
+typedef struct WireConnection {
+    size_t index;
+    uint32_t bus;
+} WireConnection;
+
+
+/* Device models for bus devices */
+#define DEVICE_EEPROM 1
+#define DEVICE_SENSOR 2
+
+/*
+  A device model on a bus. I2C devices answer at `address` on I2C bus
+  `bus`. SPI devices hang off Arduino `index`'s SPI pins, and are
+  selected by driving its pin `address` LOW.
+ */
+typedef struct BusDevice {
+    size_t index;
+    uint32_t bus;
+    uint8_t spi;
+    uint8_t address;
+    uint8_t model;
+    uint32_t size;  /* Bytes of storage for an EEPROM */
+} BusDevice;
+
+
+/* The value one of device `device`'s registers starts at */
+typedef struct DeviceRegister {
+    size_t device;
+    uint8_t reg;
+    uint8_t value;
+} DeviceRegister;
+
+
+/*
+  Analog pin `pin` on Arduino `index` plays a recorded waveform (see
+  server/waveform.h) from the file in the network's stimulus_paths at
+  the same position: uint16_t samples every `period` microseconds, or
+  CSV if `period` is 0.
+ */
+typedef struct AnalogStimulus {
+    size_t index;
+    uint8_t pin;
+    uint32_t period;
+} AnalogStimulus;
+
+
+/* What a TopologyChange does */
+#define CHANGE_PIN 0      /* Connect `pin` */
+#define CHANGE_SERIAL 1   /* Connect `serial` */
+#define CHANGE_ARDUINO 2  /* Start Arduino `index` */
+
+/*
+  A change to the network partway through a run, `time` microseconds
+  in on the network's clock. With `cut` set it takes the connection
+  away, or stops the Arduino, instead.
+ */
+typedef struct TopologyChange {
+    uint64_t time;
+    uint8_t kind;
+    uint8_t cut;
+    size_t index;
+    PinConnection pin;
+    SerialConnection serial;
+} TopologyChange;
+
+
+/* Number of serial ports the routing index has room for per Arduino */
+#define NETWORK_SERIAL_PORTS 4
+
+/* Number of pins a connection can be made to, ArduinoMega::NUM_PINS */
+#define NETWORK_PINS 70
+
+
 /* Currently we do not include the actual Arduinos here -- there may
    be many different kinds of Arduinos */
 typedef struct ArduinoNetwork {
     char **names;  /* Names of the Arduinos corresponding to the given index */
     char **paths;  /* Path to the executable for an Arduino at a given index */
+    NodeSchedule *schedule;  /* Scheduling for the Arduino at a given index */
+    char **eeproms;  /* File the EEPROM of the Arduino at a given index lives in, or NULL */
+    char **eeprom_seeds;  /* File its EEPROM starts every run from, or NULL */
     size_t num_arduinos;
 
+    /*
+      Open-addressed table of indexes by name, for arduino_lookup(),
+      with -1 in empty slots. It catches up on the Arduinos declared
+      since it was last used, the first `num_named` being in it.
+     */
+    int *name_index;
+    size_t name_index_size;
+    size_t num_named;
+
     SerialConnection *serial_ports;
     size_t num_serial;
 
     PinConnection *pins;
     size_t num_pins;
+
+    WireConnection *wires;
+    size_t num_wires;
+
+    BusDevice *devices;
+    size_t num_devices;
+
+    DeviceRegister *registers;
+    size_t num_registers;
+
+    AnalogStimulus *stimuli;
+    char **stimulus_paths;
+    size_t num_stimuli;
+
+    /* The timeline of changes made while the network runs, in the order they were given */
+    TopologyChange *changes;
+    size_t num_changes;
+
+    /*
+      Indexes so the server never has to scan every connection. Pin
+      connections driven by Arduino i are
+      pins[pin_fanout[pin_fanout_start[i]]] up to (but not including)
+      pins[pin_fanout[pin_fanout_start[i + 1]]]. A byte written to
+      port p on Arduino i goes down the chain of serial_routes from
+      serial_route_start[i * NETWORK_SERIAL_PORTS + p], which are laid
+      out one after another until the routes change while running.
+     */
+    size_t *pin_fanout_start;
+    size_t *pin_fanout;
+
+    size_t *serial_route_start;
+    SerialRoute *serial_routes;
+    size_t num_routes;
+    size_t route_capacity;  /* Room in serial_routes, 0 while it's still in the image */
+    size_t free_routes;     /* Chain of routes taken out, for new ones to reuse */
+
+    /* Compiled image everything points into, or NULL if parsed */
+    void *image;
+    size_t image_size;
 } ArduinoNetwork;
 
 
@@ -68,4 +236,26 @@ ArduinoNetwork parse_network(FILE *ard_file);
 void free_network(ArduinoNetwork *network);
 void print_network(ArduinoNetwork *network);
 
+/* A network of one Arduino, with nothing connected to it */
+ArduinoNetwork single_network(const char *name, const char *path);
+
+/* Index of the Arduino with the given name, or -1 */
+int arduino_lookup(const char *name, ArduinoNetwork *network);
+
+/* Rebuild the fan-out and routing indexes (parse_network already does this) */
+void index_network(ArduinoNetwork *network);
+
+/*
+  Add a serial connection's two routes to the routing index of a
+  running network, and put where they went in `routes`, or take them
+  out again. The connection lists stay as they were loaded. Both
+  return -1 if the connection isn't valid, or isn't there to take out.
+ */
+int add_serial_routes(ArduinoNetwork *network, SerialConnection con, size_t *routes);
+int remove_serial_routes(ArduinoNetwork *network, SerialConnection con);
+
+/* Whether a connection is between declared Arduinos and real pins or ports */
+int valid_pin_connection(ArduinoNetwork *network, PinConnection con);
+int valid_serial_connection(ArduinoNetwork *network, SerialConnection con);
+
 #endif
@@ -0,0 +1,304 @@
+/* Copyright (C) 2013 Calvin Beck
+
+  Permission is hereby granted, free of charge, to any person
+  obtaining a copy of this software and associated documentation files
+  (the "Software"), to deal in the Software without restriction,
+  including without limitation the rights to use, copy, modify, merge,
+  publish, distribute, sublicense, and/or sell copies of the Software,
+  and to permit persons to whom the Software is furnished to do so,
+  subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be
+  included in all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+  EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+  MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+  NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+  BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+  ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+  CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+  SOFTWARE.
+
+*/
+
+#include "network_placement.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sched.h>
+
+
+/* Highest cache level to look for, under /sys/devices/system/cpu/cpuN/cache/indexK */
+#define CACHE_INDEXES 8
+
+
+/* Read the first number in a sysfs file, or return -1 */
+static long read_first(const char *path)
+{
+    FILE *file = fopen(path, "r");
+    long value = -1;
+
+    if (NULL == file) {
+        return -1;
+    }
+
+    if (1 != fscanf(file, "%ld", &value)) {
+        value = -1;
+    }
+
+    fclose(file);
+    return value;
+}
+
+
+/*
+  Which cache domain a CPU is in: the lowest numbered CPU sharing its
+  last level cache, or failing that its socket, or failing that 0.
+ */
+static long cache_domain(int cpu)
+{
+    char path[128];
+    long level = -1;
+    long domain = -1;
+
+    for (int k = 0; k < CACHE_INDEXES; ++k) {
+        snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d/cache/index%d/level", cpu, k);
+        long index_level = read_first(path);
+
+        if (index_level > level) {
+            snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d/cache/index%d/shared_cpu_list", cpu, k);
+            long shared = read_first(path);
+
+            if (-1 != shared) {
+                level = index_level;
+                domain = shared;
+            }
+        }
+    }
+
+    if (-1 != domain) {
+        return domain;
+    }
+
+    snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d/topology/physical_package_id", cpu);
+    domain = read_first(path);
+
+    return -1 == domain ? 0 : domain;
+}
+
+
+typedef struct PlacedCPU {
+    int cpu;
+    long domain;
+} PlacedCPU;
+
+
+static int compare_cpus(const void *a, const void *b)
+{
+    const PlacedCPU *x = (const PlacedCPU *)a;
+    const PlacedCPU *y = (const PlacedCPU *)b;
+
+    if (x->domain != y->domain) {
+        return x->domain < y->domain ? -1 : 1;
+    }
+
+    return x->cpu - y->cpu;
+}
+
+
+/* Arduinos on a Wire bus, sorted so each bus's are together */
+static int compare_wires(const void *a, const void *b)
+{
+    const WireConnection *x = (const WireConnection *)a;
+    const WireConnection *y = (const WireConnection *)b;
+
+    if (x->bus != y->bus) {
+        return x->bus < y->bus ? -1 : 1;
+    }
+
+    return x->index < y->index ? -1 : x->index > y->index;
+}
+
+
+/* Add an edge to the graph, or just count it if `neighbours` is NULL */
+static void add_edge(size_t *fill, size_t *neighbours, size_t a, size_t b)
+{
+    if (NULL == neighbours) {
+        ++fill[a];
+        ++fill[b];
+        return;
+    }
+
+    neighbours[fill[a]++] = b;
+    neighbours[fill[b]++] = a;
+}
+
+
+/*
+  Every connection as an edge, both ways. Arduinos on the same Wire bus
+  are chained together. `fill` counts edges when `neighbours` is NULL,
+  and places them when it isn't.
+ */
+static void add_edges(ArduinoNetwork *network, WireConnection *wires, size_t *fill, size_t *neighbours)
+{
+    for (size_t k = 0; k < network->num_pins; ++k) {
+        add_edge(fill, neighbours, network->pins[k].out_index, network->pins[k].in_index);
+    }
+
+    for (size_t k = 0; k < network->num_serial; ++k) {
+        add_edge(fill, neighbours, network->serial_ports[k].out_index, network->serial_ports[k].in_index);
+    }
+
+    for (size_t k = 1; k < network->num_wires; ++k) {
+        if (wires[k].bus == wires[k - 1].bus) {
+            add_edge(fill, neighbours, wires[k - 1].index, wires[k].index);
+        }
+    }
+}
+
+
+size_t *connection_order(ArduinoNetwork *network)
+{
+    size_t count = network->num_arduinos;
+
+    WireConnection *wires = (WireConnection *)malloc(sizeof(WireConnection) * (network->num_wires + 1));
+    memcpy(wires, network->wires, sizeof(WireConnection) * network->num_wires);
+    qsort(wires, network->num_wires, sizeof(WireConnection), compare_wires);
+
+    /* The neighbours of Arduino i are neighbours[start[i]] up to neighbours[start[i + 1]] */
+    size_t *start = (size_t *)calloc(count + 1, sizeof(size_t));
+    size_t *fill = (size_t *)calloc(count + 1, sizeof(size_t));
+
+    add_edges(network, wires, fill, NULL);
+
+    for (size_t i = 0; i < count; ++i) {
+        start[i + 1] = start[i] + fill[i];
+        fill[i] = start[i];
+    }
+
+    size_t *neighbours = (size_t *)malloc(sizeof(size_t) * (start[count] + 1));
+    add_edges(network, wires, fill, neighbours);
+
+    /* `fill` is done with, so it marks who has been visited */
+    size_t *order = (size_t *)malloc(sizeof(size_t) * (count + 1));
+    size_t placed = 0;
+
+    memset(fill, 0, sizeof(size_t) * (count + 1));
+
+    for (size_t root = 0; root < count; ++root) {
+        if (fill[root]) {
+            continue;
+        }
+
+        size_t head = placed;
+
+        fill[root] = 1;
+        order[placed++] = root;
+
+        while (head < placed) {
+            size_t i = order[head++];
+
+            for (size_t k = start[i]; k < start[i + 1]; ++k) {
+                if (!fill[neighbours[k]]) {
+                    fill[neighbours[k]] = 1;
+                    order[placed++] = neighbours[k];
+                }
+            }
+        }
+    }
+
+    free(wires);
+    free(start);
+    free(fill);
+    free(neighbours);
+
+    return order;
+}
+
+
+int place_arduinos(Placement *placement, ArduinoNetwork *network)
+{
+    size_t count = network->num_arduinos;
+    cpu_set_t allowed;
+
+    placement->server_cpu = -1;
+    placement->num_arduinos = count;
+    placement->cpus = (int *)malloc(sizeof(int) * (count + 1));
+
+    if (-1 == sched_getaffinity(0, sizeof(allowed), &allowed)) {
+        return -1;
+    }
+
+    PlacedCPU *cpus = (PlacedCPU *)malloc(sizeof(PlacedCPU) * (CPU_SETSIZE + 1));
+    size_t num_cpus = 0;
+
+    for (int cpu = 0; cpu < CPU_SETSIZE; ++cpu) {
+        if (CPU_ISSET(cpu, &allowed)) {
+            cpus[num_cpus].cpu = cpu;
+            cpus[num_cpus].domain = cache_domain(cpu);
+            ++num_cpus;
+        }
+    }
+
+    if (0 == num_cpus) {
+        free(cpus);
+        return -1;
+    }
+
+    /* The server only gets a CPU of its own if that leaves some for the Arduinos */
+    PlacedCPU *pool = cpus;
+
+    if (num_cpus > 1) {
+        placement->server_cpu = cpus[0].cpu;
+        ++pool;
+        --num_cpus;
+    }
+
+    qsort(pool, num_cpus, sizeof(PlacedCPU), compare_cpus);
+
+    /* Neighbours in the walk are neighbours on the CPUs, so they share caches */
+    size_t *order = connection_order(network);
+
+    for (size_t k = 0; k < count; ++k) {
+        placement->cpus[order[k]] = pool[k * num_cpus / count].cpu;
+    }
+
+    free(order);
+    free(cpus);
+
+    return 0;
+}
+
+
+void free_placement(Placement *placement)
+{
+    free(placement->cpus);
+}
+
+
+int pin_to_cpu(int cpu)
+{
+    cpu_set_t set;
+
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+
+    return sched_setaffinity(0, sizeof(set), &set);
+}
+
+
+void print_placement(Placement *placement, ArduinoNetwork *network)
+{
+    if (-1 == placement->server_cpu) {
+        printf("Server shares its CPUs with the Arduinos\n");
+    }
+    else {
+        printf("Server on CPU %d\n", placement->server_cpu);
+    }
+
+    for (size_t i = 0; i < placement->num_arduinos; ++i) {
+        printf("%s on CPU %d\n", network->names[i], placement->cpus[i]);
+    }
+}
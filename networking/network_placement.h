@@ -0,0 +1,67 @@
+/* Copyright (C) 2013 Calvin Beck
+
+  Permission is hereby granted, free of charge, to any person
+  obtaining a copy of this software and associated documentation files
+  (the "Software"), to deal in the Software without restriction,
+  including without limitation the rights to use, copy, modify, merge,
+  publish, distribute, sublicense, and/or sell copies of the Software,
+  and to permit persons to whom the Software is furnished to do so,
+  subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be
+  included in all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+  EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+  MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+  NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+  BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+  ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+  CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+  SOFTWARE.
+
+*/
+
+#ifndef NETWORK_PLACEMENT_H
+#define NETWORK_PLACEMENT_H
+
+#include "network_parse.h"
+
+
+/*
+  CPU placement for the server and the Arduino processes.
+
+  The server gets the first CPU it is allowed to run on to itself, so
+  the Arduinos never preempt it, as long as there's another CPU left
+  for them. The rest are grouped by the last level cache they share
+  (or their socket, if the cache isn't described), and the Arduinos
+  are handed out over them in the order a breadth-first walk of the
+  connection graph visits them. Each CPU gets a run of that order, so
+  Arduinos that talk to each other end up on the same CPU or on CPUs
+  sharing a cache, and the pipe wakeups between them stay local.
+ */
+
+typedef struct Placement {
+    int server_cpu;  /* -1 if the server shares its CPUs */
+    int *cpus;       /* CPU each Arduino is pinned to */
+    size_t num_arduinos;
+} Placement;
+
+
+/*
+  The Arduinos in the order a breadth-first walk of the connection
+  graph visits them, so connected ones are close together (malloc'd).
+ */
+size_t *connection_order(ArduinoNetwork *network);
+
+/* Work out where everything runs. Returns -1 if the CPUs couldn't be found. */
+int place_arduinos(Placement *placement, ArduinoNetwork *network);
+void free_placement(Placement *placement);
+
+/* Pin the calling process to a CPU. Returns -1 if it couldn't be. */
+int pin_to_cpu(int cpu);
+
+/* Report where the server and every Arduino run */
+void print_placement(Placement *placement, ArduinoNetwork *network);
+
+#endif
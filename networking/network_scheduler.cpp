@@ -0,0 +1,155 @@
+/* Copyright (C) 2013 Calvin Beck
+
+  Permission is hereby granted, free of charge, to any person
+  obtaining a copy of this software and associated documentation files
+  (the "Software"), to deal in the Software without restriction,
+  including without limitation the rights to use, copy, modify, merge,
+  publish, distribute, sublicense, and/or sell copies of the Software,
+  and to permit persons to whom the Software is furnished to do so,
+  subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be
+  included in all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+  EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+  MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+  NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+  BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+  ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+  CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+  SOFTWARE.
+
+*/
+
+#include "network_scheduler.h"
+
+#include <stdlib.h>
+#include <time.h>
+
+
+static double now()
+{
+    struct timespec time;
+    clock_gettime(CLOCK_MONOTONIC, &time);
+
+    return time.tv_sec + time.tv_nsec / 1e9;
+}
+
+
+void init_scheduler(Scheduler *scheduler, ArduinoNetwork *network, uint32_t quantum)
+{
+    size_t count = network->num_arduinos;
+
+    scheduler->num_arduinos = count;
+    scheduler->quanta = (uint32_t *)malloc(sizeof(uint32_t) * (count + 1));
+    scheduler->rates = (uint32_t *)malloc(sizeof(uint32_t) * (count + 1));
+    scheduler->deficits = (long *)calloc(count + 1, sizeof(long));
+    scheduler->tokens = (double *)malloc(sizeof(double) * (count + 1));
+
+    for (size_t i = 0; i < count; ++i) {
+        NodeSchedule schedule = network->schedule[i];
+
+        scheduler->quanta[i] = schedule.quantum ? schedule.quantum : quantum;
+        scheduler->rates[i] = schedule.rate;
+        scheduler->tokens[i] = scheduler->quanta[i];
+    }
+
+    scheduler->last_refill = now();
+    scheduler->next_start = 0;
+}
+
+
+void free_scheduler(Scheduler *scheduler)
+{
+    free(scheduler->quanta);
+    free(scheduler->rates);
+    free(scheduler->deficits);
+    free(scheduler->tokens);
+}
+
+
+size_t start_round(Scheduler *scheduler)
+{
+    double time = now();
+    double elapsed = time - scheduler->last_refill;
+
+    scheduler->last_refill = time;
+
+    for (size_t i = 0; i < scheduler->num_arduinos; ++i) {
+        if (scheduler->rates[i]) {
+            scheduler->tokens[i] += elapsed * scheduler->rates[i];
+
+            if (scheduler->tokens[i] > scheduler->quanta[i]) {
+                scheduler->tokens[i] = scheduler->quanta[i];
+            }
+        }
+    }
+
+    if (0 == scheduler->num_arduinos) {
+        return 0;
+    }
+
+    size_t start = scheduler->next_start;
+    scheduler->next_start = (start + 1) % scheduler->num_arduinos;
+
+    return start;
+}
+
+
+int throttled(Scheduler *scheduler, size_t index)
+{
+    return scheduler->rates[index] && scheduler->tokens[index] < 1;
+}
+
+
+long grant_commands(Scheduler *scheduler, size_t index)
+{
+    scheduler->deficits[index] += scheduler->quanta[index];
+
+    long budget = scheduler->deficits[index];
+
+    if (scheduler->rates[index] && budget > (long)scheduler->tokens[index]) {
+        budget = (long)scheduler->tokens[index];
+    }
+
+    return budget;
+}
+
+
+void charge_commands(Scheduler *scheduler, size_t index, long used, int emptied)
+{
+    if (scheduler->rates[index]) {
+        scheduler->tokens[index] -= used;
+    }
+
+    /* Nothing left to do means nothing to carry over */
+    if (emptied) {
+        scheduler->deficits[index] = 0;
+        return;
+    }
+
+    scheduler->deficits[index] -= used;
+
+    if (scheduler->deficits[index] > scheduler->quanta[index]) {
+        scheduler->deficits[index] = scheduler->quanta[index];
+    }
+}
+
+
+double throttle_wait(Scheduler *scheduler)
+{
+    double wait = -1;
+
+    for (size_t i = 0; i < scheduler->num_arduinos; ++i) {
+        if (throttled(scheduler, i)) {
+            double needed = (1 - scheduler->tokens[i]) / scheduler->rates[i];
+
+            if (wait < 0 || needed < wait) {
+                wait = needed;
+            }
+        }
+    }
+
+    return wait;
+}
@@ -0,0 +1,87 @@
+/* Copyright (C) 2013 Calvin Beck
+
+  Permission is hereby granted, free of charge, to any person
+  obtaining a copy of this software and associated documentation files
+  (the "Software"), to deal in the Software without restriction,
+  including without limitation the rights to use, copy, modify, merge,
+  publish, distribute, sublicense, and/or sell copies of the Software,
+  and to permit persons to whom the Software is furnished to do so,
+  subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be
+  included in all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+  EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+  MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+  NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+  BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+  ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+  CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+  SOFTWARE.
+
+*/
+
+#ifndef NETWORK_SCHEDULER_H
+#define NETWORK_SCHEDULER_H
+
+#include "network_parse.h"
+
+#include <stdint.h>
+
+
+/*
+  Scheduling for the network server's event loop.
+
+  Every pass of the loop is a round. Each Arduino with commands
+  waiting gets its quantum added to a deficit, and may run that many
+  commands before the server moves on (deficit round robin). Budget
+  it doesn't get to use because of its rate limit carries over to the
+  next round, up to one more quantum. Which Arduino goes first rotates
+  every round, so low indexes don't always win ties.
+
+  Rate limits are token buckets in commands per second of real time,
+  holding at most one quantum of tokens. An Arduino without tokens is
+  throttled, and sits out rounds until it has one again.
+ */
+
+/* Commands per round for Arduinos without their own quantum */
+#define SCHEDULER_QUANTUM 16
+
+typedef struct Scheduler {
+    size_t num_arduinos;
+
+    uint32_t *quanta;
+    uint32_t *rates;
+
+    long *deficits;
+    double *tokens;
+
+    double last_refill;
+    size_t next_start;
+} Scheduler;
+
+
+/* Set up scheduling for a network. `quantum` is the default quantum. */
+void init_scheduler(Scheduler *scheduler, ArduinoNetwork *network, uint32_t quantum);
+void free_scheduler(Scheduler *scheduler);
+
+/* Start a round: top up the rate limits, and return who goes first */
+size_t start_round(Scheduler *scheduler);
+
+/* Whether Arduino `index` has to sit this round out for its rate limit */
+int throttled(Scheduler *scheduler, size_t index);
+
+/* How many commands Arduino `index` may run this round */
+long grant_commands(Scheduler *scheduler, size_t index);
+
+/*
+  Account for the commands Arduino `index` ran. `emptied` is set if it
+  ran out of commands before it ran out of budget.
+ */
+void charge_commands(Scheduler *scheduler, size_t index, long used, int emptied);
+
+/* Seconds until a throttled Arduino can run again, or -1 if none are throttled */
+double throttle_wait(Scheduler *scheduler);
+
+#endif
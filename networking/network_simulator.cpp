@@ -0,0 +1,1515 @@
+/* Copyright (C) 2013 Calvin Beck
+
+  Permission is hereby granted, free of charge, to any person
+  obtaining a copy of this software and associated documentation files
+  (the "Software"), to deal in the Software without restriction,
+  including without limitation the rights to use, copy, modify, merge,
+  publish, distribute, sublicense, and/or sell copies of the Software,
+  and to permit persons to whom the Software is furnished to do so,
+  subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be
+  included in all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+  EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+  MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+  NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+  BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+  ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+  CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+  SOFTWARE.
+
+*/
+
+#include "network_simulator.h"
+#include "network_image.h"
+#include "network_utilities.h"
+#include "network_eeprom.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <limits.h>
+#include <errno.h>
+#include <sys/wait.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <pthread.h>
+
+
+/*
+  Held from making an Arduino's pipes until its ends of them are
+  closed here, so that an Arduino another thread launches in the
+  meantime can't inherit them and keep them open (see network_explore.h).
+ */
+static pthread_mutex_t launch_lock = PTHREAD_MUTEX_INITIALIZER;
+
+
+/* Start Arduino `name` with the pipes to talk to it, and return its pid */
+static pid_t launch_arduino(void (*sketch)(void), char *name, char *path, char *eeprom, int heap_fd, int cpu,
+                            int headless, int *in_pipe, int *out_pipe, int *event_pipe)
+{
+    pthread_mutex_lock(&launch_lock);
+
+    if (-1 == pipe(in_pipe)) {
+        perror("Could not create input pipe");
+        exit(EXIT_FAILURE);
+    }
+
+    if (-1 == pipe(out_pipe)) {
+        perror("Could not create output pipe");
+        exit(EXIT_FAILURE);
+    }
+
+    if (-1 == pipe(event_pipe)) {
+        perror("Could not create interrupt pipe");
+        exit(EXIT_FAILURE);
+    }
+
+    pid_t pid = fork();
+
+    if (pid == 0) {
+        /* Child process - run the Arduino stuff */
+
+        /*
+          No freopen here -- it would truncate our stdout if it's a
+          file, and the Arduino program switches its own pipes to
+          binary mode after the exec anyway.
+         */
+
+        /* Set up the STDIN pipe */
+        close(in_pipe[1]);  /* Close the write end */
+
+        /* Set STDIN to the read end */
+        if (-1 == dup2(in_pipe[0], STDIN_FILENO)) {
+            perror("Could not set up input pipe");
+            exit(EXIT_FAILURE);
+        }
+
+        /* Set up the STDOUT pipe */
+        close(out_pipe[0]);  /* Close the read end */
+
+        /* Set STDOUT to the write end */
+        if (-1 == dup2(out_pipe[1], STDOUT_FILENO)) {
+            perror("Could not set up output pipe");
+            exit(EXIT_FAILURE);
+        }
+
+        /* Interrupts are pushed down the event pipe */
+        close(event_pipe[1]);
+
+        char event_fd[16];
+        snprintf(event_fd, sizeof(event_fd), "%d", event_pipe[0]);
+        setenv("EMULARD_EVENT_FD", event_fd, 1);
+
+        /* A headless Arduino keeps its time with us */
+        if (headless) {
+            setenv("EMULARD_VIRTUAL_TIME", "1", 1);
+        }
+
+        /* The EEPROM is mapped straight from its file, if it has one */
+        if (NULL != eeprom) {
+            setenv("EMULARD_EEPROM", eeprom, 1);
+        }
+        else {
+            unsetenv("EMULARD_EEPROM");
+        }
+
+        /* The String heap keeps its figures where we can read them */
+        char heap_stats_fd[16];
+        snprintf(heap_stats_fd, sizeof(heap_stats_fd), "%d", heap_fd);
+        setenv("EMULARD_HEAP_FD", heap_stats_fd, 1);
+
+        /* The server ignores SIGPIPE, but a sketch whose server is gone should go too */
+        signal(SIGPIPE, SIG_DFL);
+
+        /* Stay on the CPU we were placed on, near whoever we talk to */
+        if (-1 != cpu && -1 == pin_to_cpu(cpu)) {
+            perror("Could not pin Arduino to its CPU");
+        }
+
+        /* Run the Arduino program, here or from its file */
+        if (NULL != sketch) {
+            sketch();
+            exit(EXIT_SUCCESS);
+        }
+
+        char child_option[] = "-c";
+        char *argv[] = {name, child_option, NULL};
+        execvp(path, argv);
+
+        fprintf(stderr, "Invalid Arduino program, \"%s\"\n", path);
+        exit(EXIT_FAILURE);
+    }
+
+    /* The child's ends are its own now */
+    close(in_pipe[0]);
+    close(out_pipe[1]);
+    close(event_pipe[0]);
+    close(heap_fd);
+
+    pthread_mutex_unlock(&launch_lock);
+
+    return pid;
+}
+
+
+/* Launch Arduino `index`'s process, and hand back the server's ends of its pipes */
+static void spawn_arduino(Simulator *simulator, size_t index, int *to, int *from, int *events)
+{
+    ArduinoNetwork *network = &simulator->network;
+
+    int arduino_in[2];  /* Arduino STDIN pipe */
+    int arduino_out[2];  /* Arduino STDOUT pipe */
+    int arduino_events[2];  /* Arduino interrupt pipe */
+
+    int heap_fd;
+    simulator->heap_stats[index] = share_heap_stats(&heap_fd);
+    int cpu = simulator->place ? simulator->placement.cpus[index] : -1;
+    simulator->pids[index] = launch_arduino(simulator->sketch, network->names[index], network->paths[index],
+                                            network->eeproms[index], heap_fd, cpu, simulator->headless,
+                                            arduino_in, arduino_out, arduino_events);
+
+    *to = arduino_in[1];
+    *from = arduino_out[0];
+    *events = arduino_events[1];
+}
+
+
+/*
+  Reap Arduino `index`'s process, stopping it first if it hasn't gone
+  already, close its pipes, and report its String heap. Returns its
+  wait status.
+ */
+static int close_arduino(Simulator *simulator, size_t index)
+{
+    ArduinoMega *arduino = simulator->arduinos[index];
+    const char *name = simulator->network.names[index];
+
+    /* It may have just closed its stdout, rather than exited */
+    int status;
+
+    if (0 == waitpid(simulator->pids[index], &status, WNOHANG)) {
+        status = stop_arduino(simulator->pids[index]);
+    }
+
+    simulator->pids[index] = -1;
+
+    arduino->let_go();
+
+    close(arduino->to_arduino);
+    close(arduino->from_arduino);
+    close(arduino->events);
+
+    arduino->to_arduino = -1;
+    arduino->from_arduino = -1;
+    arduino->events = -1;
+
+    /* Its String heap figures are as final as they'll get */
+    if (!simulator->quiet) {
+        print_heap_stats(name, simulator->heap_stats[index]);
+    }
+
+    munmap(simulator->heap_stats[index], sizeof(HeapStats));
+    simulator->heap_stats[index] = NULL;
+
+    return status;
+}
+
+
+/* Start a fresh process for Arduino `index`, which isn't running, at `now` on the network's clock */
+static void revive_arduino(Simulator *simulator, size_t index, unsigned long long now)
+{
+    ArduinoMega *arduino = simulator->arduinos[index];
+
+    int to, from, events;
+    spawn_arduino(simulator, index, &to, &from, &events);
+    arduino->restart(to, from, events);
+
+    /* A headless Arduino's time is its own, so it starts from the network's */
+    if (arduino->virtual_clock && arduino->virtual_micros < now) {
+        arduino->virtual_micros = now;
+    }
+}
+
+
+/* How many Arduinos this server runs are still alive */
+static size_t alive_arduinos(Simulator *simulator)
+{
+    size_t alive = 0;
+
+    for (size_t i = 0; i < simulator->network.num_arduinos; ++i) {
+        alive += !simulator->arduinos[i]->dead && (NULL == simulator->remote || !simulator->remote[i]);
+    }
+
+    return alive;
+}
+
+
+/*
+  Arduino `index` has closed its pipe. Reap it, say why it went, and
+  do what its 'f' entry says: stop the run, carry on without it, or
+  start it again.
+ */
+static void bury_arduino(Simulator *simulator, size_t index)
+{
+    ArduinoNetwork *network = &simulator->network;
+    const char *name = network->names[index];
+
+    int status = close_arduino(simulator, index);
+    char cause[128];
+
+    if (WIFSIGNALED(status)) {
+        snprintf(cause, sizeof(cause), "%s was killed by signal %d (%s)", name, WTERMSIG(status), strsignal(WTERMSIG(status)));
+    }
+    else {
+        snprintf(cause, sizeof(cause), "%s exited with status %d", name, WEXITSTATUS(status));
+    }
+
+    switch (network->schedule[index].failure) {
+    case FAILURE_RESPAWN: {
+        fprintf(stderr, "%s, restarting it\n", cause);
+
+        revive_arduino(simulator, index, simulator->wheel.now);
+
+        simulator->restarts[index].since = ArduinoMega::real_micros();
+        ++simulator->restarts[index].count;
+
+        break;
+    }
+    case FAILURE_DEAD: {
+        fprintf(stderr, "%s, carrying on without it\n", cause);
+
+        if (0 == alive_arduinos(simulator) && 0 == simulator->pending_changes) {
+            snprintf(simulator->stop.reason, sizeof(simulator->stop.reason), "every Arduino has died");
+            simulator->status = STOP_ERROR;
+        }
+
+        break;
+    }
+    default:
+        snprintf(simulator->stop.reason, sizeof(simulator->stop.reason), "%s", cause);
+        simulator->status = STOP_ERROR;
+        break;
+    }
+}
+
+
+/* A respawned Arduino has sent its first command, so it's back */
+static void note_restart(Restarts *restarts)
+{
+    unsigned long long took = ArduinoMega::real_micros() - restarts->since;
+
+    restarts->total += took;
+    restarts->since = 0;
+
+    if (restarts->longest < took) {
+        restarts->longest = took;
+    }
+}
+
+
+/*
+  How far the links have got. In a headless run that's as far as
+  every running Arduino has got, since none of them can send anything
+  earlier than that any more. One waiting on a Wire target doesn't
+  count, since it can't go anywhere until the target answers, and
+  nor does one that has reached `cutoff`, the time limit (0 for
+  none). If every Arduino is parked nothing is going to change, so
+  time skips ahead to when the first one is due.
+ */
+static unsigned long long link_time(ArduinoMega **arduinos, size_t count, int headless, unsigned long long cutoff)
+{
+    if (!headless) {
+        return ArduinoMega::real_micros();
+    }
+
+    unsigned long long now = ULLONG_MAX;
+    int running = 0;
+
+    for (size_t i = 0; i < count; ++i) {
+        if (arduinos[i]->dead) {
+            continue;
+        }
+
+        if (0 != cutoff && arduinos[i]->virtual_micros >= cutoff) {
+            continue;
+        }
+
+        if (!arduinos[i]->parked && !arduinos[i]->wire_waiting) {
+            running = 1;
+
+            if (now > arduinos[i]->virtual_micros) {
+                now = arduinos[i]->virtual_micros;
+            }
+        }
+    }
+
+    if (!running) {
+        for (size_t i = 0; i < count; ++i) {
+            if (arduinos[i]->parked && now > arduinos[i]->wake_deadline()) {
+                now = arduinos[i]->wake_deadline();
+            }
+        }
+    }
+
+    return now;
+}
+
+
+/*
+  How far the slowest Arduino with ISRs attached has got, of the ones
+  link_time() counts as running, or ULLONG_MAX if there are none.
+  Nobody gets ahead of it, so a pin change never runs its ISRs from
+  its future, and once its SYNC is answered every edge up to then has
+  come in. One that hasn't finished its first loop() counts as well,
+  since that's where sketches attach their ISRs, and an edge from
+  before it did would be lost.
+ */
+static unsigned long long listen_time(ArduinoMega **arduinos, size_t count, unsigned long long cutoff)
+{
+    unsigned long long now = ULLONG_MAX;
+
+    for (size_t i = 0; i < count; ++i) {
+        ArduinoMega *arduino = arduinos[i];
+
+        if (arduino->dead || arduino->parked || arduino->wire_waiting) {
+            continue;
+        }
+
+        if (0 != arduino->loops && !arduino->listening()) {
+            continue;
+        }
+
+        if (0 != cutoff && arduino->virtual_micros >= cutoff) {
+            continue;
+        }
+
+        if (now > arduino->virtual_micros) {
+            now = arduino->virtual_micros;
+        }
+    }
+
+    return now;
+}
+
+
+/*
+  Wake parked Arduinos whose inputs changed, or whose time is up, and
+  return how long poll can wait before the next one is due, or
+  `limit` comes (NULL if it can wait for as long as it likes).
+
+  In a headless run the network's time is `now` from link_time(), as
+  far as the slowest running Arduino has got, but never past `limit`:
+  an Arduino woken up mustn't land ahead of one that could still send
+  it something, or have missed anything on its way down a link.
+ */
+static struct timeval *wake_arduinos(ArduinoMega **arduinos, size_t count, int headless,
+                                     unsigned long long now, unsigned long long limit, struct timeval *timeout)
+{
+    if (headless) {
+        if (now > limit) {
+            now = limit;
+        }
+    }
+    else {
+        now = ArduinoMega::real_micros();
+    }
+
+    unsigned long long next = limit;
+
+    for (size_t i = 0; i < count; ++i) {
+        if (!arduinos[i]->wake(now) && arduinos[i]->parked && next > arduinos[i]->wake_deadline()) {
+            next = arduinos[i]->wake_deadline();
+        }
+    }
+
+    /* Virtual deadlines come from running Arduinos, not from waiting */
+    if (headless || ULLONG_MAX == next) {
+        return NULL;
+    }
+
+    unsigned long long wait = next > now ? next - now : 0;
+    timeout->tv_sec = wait / 1000000;
+    timeout->tv_usec = wait % 1000000;
+
+    return timeout;
+}
+
+
+/*
+  Answer the SYNCs of the Arduinos the network has caught up to: every
+  running Arduino has got as far as `slowest`, and the links have
+  nothing more due by then, so whatever interrupts they had for it
+  are in its event pipe.
+ */
+static void answer_syncs(Simulator *simulator, unsigned long long slowest)
+{
+    ArduinoMega **arduinos = simulator->arduinos;
+    unsigned long long due = wheel_due(&simulator->wheel);
+
+    for (size_t i = 0; i < simulator->network.num_arduinos; ++i) {
+        ArduinoMega *arduino = arduinos[i];
+
+        if (arduino->syncing && arduino->virtual_micros <= slowest && arduino->virtual_micros < due) {
+            arduino->answer_sync();
+        }
+    }
+}
+
+
+/* Whether an Arduino's clock has reached the time limit, so it mustn't run anything more */
+static int at_limit(Simulator *simulator, ArduinoMega *arduino)
+{
+    return 0 != simulator->stop.max_micros && arduino->virtual_micros >= simulator->stop.max_micros;
+}
+
+
+/*
+  Whether a headless Arduino has to leave its next command until the
+  others catch up: it has reached the time limit, it's more than the
+  horizon ahead of `slowest`, the link_time() of the round, or it's
+  ahead of `listening`, the listen_time(). Either way nothing it sends
+  can reach an Arduino that hasn't got as far. A Wire target with a
+  request to answer is never held back, since the requester can't go
+  anywhere until it does.
+ */
+static int held_back(Simulator *simulator, ArduinoMega *arduino, unsigned long long slowest,
+                     unsigned long long listening)
+{
+    if (!simulator->headless || NULL != arduino->wire_requester) {
+        return 0;
+    }
+
+    if (at_limit(simulator, arduino)) {
+        return 1;
+    }
+
+    if (arduino->virtual_micros > listening) {
+        return 1;
+    }
+
+    return ULLONG_MAX != slowest && arduino->virtual_micros > slowest + simulator->horizon;
+}
+
+
+/*
+  Wait until one of the descriptors set in the simulator's polls can
+  be read, or for `wait` (NULL for as long as it takes). poll rounds
+  the wait up to the millisecond.
+ */
+static void poll_arduinos(Simulator *simulator, struct timeval *wait)
+{
+    size_t count = 2 * simulator->network.num_arduinos;
+    int timeout = -1;
+
+    if (NULL != wait) {
+        long long milliseconds = wait->tv_sec * 1000LL + (wait->tv_usec + 999) / 1000;
+        timeout = milliseconds > INT_MAX ? INT_MAX : (int)milliseconds;
+    }
+
+    if (-1 == poll(simulator->polls, count, timeout)) {
+        if (EINTR != errno) {
+            perror("Could not wait on the Arduinos");
+            exit(EXIT_FAILURE);
+        }
+
+        /* Nothing can be read this time round */
+        for (size_t i = 0; i < count; ++i) {
+            simulator->polls[i].revents = 0;
+        }
+    }
+}
+
+
+/* Whether a descriptor poll_arduinos() waited on can be read, or has closed */
+static int polled(struct pollfd *entry)
+{
+    return 0 != (entry->revents & (POLLIN | POLLHUP | POLLERR));
+}
+
+
+/* Stop with `status` if it's already set, on a goal, or on a limit, otherwise -1 to keep going */
+static int stop_status(StopConditions *stop, ArduinoMega **arduinos, size_t count, int status)
+{
+    if (-1 != status) {
+        return status;
+    }
+
+    if (stop->check_pins(arduinos)) {
+        return STOP_GOAL;
+    }
+
+    if (stop->check_limits(arduinos, count)) {
+        return stop->limit_status();
+    }
+
+    return -1;
+}
+
+
+/* Top up an Arduino's Serial input from its file, as far as the buffer will take it */
+static void stream_serial_input(ArduinoMega *arduino, FILE *serial_input)
+{
+    while (NULL != serial_input) {
+        int input = fgetc(serial_input);
+
+        if (EOF == input) {
+            return;
+        }
+
+        if (-1 == arduino->serial_in[0]->append(input)) {
+            ungetc(input, serial_input);
+            return;
+        }
+    }
+}
+
+
+/* Make a change to the network as of `now`, or return -1 if it doesn't apply */
+static int apply_change(Simulator *simulator, TopologyChange *change, unsigned long long now)
+{
+    ArduinoNetwork *network = &simulator->network;
+    ArduinoMega **arduinos = simulator->arduinos;
+
+    if (CHANGE_PIN == change->kind) {
+        if (!valid_pin_connection(network, change->pin)) {
+            return -1;
+        }
+
+        if (change->cut) {
+            return cut_pins(&simulator->nets, arduinos, change->pin);
+        }
+
+        simulator->timed |= 0 != change->pin.delay;
+
+        return connect_pins(&simulator->nets, arduinos, change->pin, now);
+    }
+
+    if (CHANGE_SERIAL == change->kind) {
+        if (change->cut) {
+            return remove_serial_routes(network, change->serial);
+        }
+
+        size_t had = network->num_routes;
+        size_t routes[2];
+
+        if (-1 == add_serial_routes(network, change->serial, routes)) {
+            return -1;
+        }
+
+        if (network->num_routes > had) {
+            simulator->line_free = (unsigned long long *)realloc(simulator->line_free,
+                                                                 sizeof(unsigned long long) * (network->num_routes + 1));
+
+            if (NULL == simulator->line_free) {
+                perror("Could not add serial routes");
+                exit(EXIT_FAILURE);
+            }
+        }
+
+        /* The new routes' lines are free, even where old ones were taken out */
+        simulator->line_free[routes[0]] = 0;
+        simulator->line_free[routes[1]] = 0;
+        simulator->timed |= 0 != change->serial.baud;
+
+        return 0;
+    }
+
+    size_t index = change->index;
+
+    if (index >= network->num_arduinos || (NULL != simulator->remote && simulator->remote[index])) {
+        return -1;
+    }
+
+    ArduinoMega *arduino = arduinos[index];
+
+    if (change->cut) {
+        if (arduino->dead) {
+            return -1;
+        }
+
+        /* Its pins let go of their nets, but stay wired for when it comes back */
+        close_arduino(simulator, index);
+        arduino->dead = 1;
+        unplug_pins(&simulator->nets, arduinos, index, now);
+
+        fprintf(stderr, "%s has left the network\n", network->names[index]);
+
+        if (0 == alive_arduinos(simulator) && 0 == simulator->pending_changes) {
+            snprintf(simulator->stop.reason, sizeof(simulator->stop.reason), "every Arduino has left");
+            simulator->status = STOP_ERROR;
+        }
+
+        return 0;
+    }
+
+    if (!arduino->dead) {
+        return -1;
+    }
+
+    revive_arduino(simulator, index, now);
+    stream_serial_input(arduino, simulator->serial_inputs[index]);
+
+    fprintf(stderr, "%s has joined the network\n", network->names[index]);
+
+    return 0;
+}
+
+
+/* Everything the links have carried by `now` arrives, and the timeline's changes up to then are made */
+static void deliver_links(Simulator *simulator, unsigned long long now)
+{
+    ArduinoMega **arduinos = simulator->arduinos;
+    WheelEvent event;
+
+    while (next_event(&simulator->wheel, now, &event)) {
+        if (LINK_SERIAL == event.kind) {
+            arduinos[event.target]->serial_in[event.arg]->append(event.value);
+        }
+        else if (TOPOLOGY_CHANGE == event.kind) {
+            --simulator->pending_changes;
+
+            if (-1 == apply_change(simulator, &simulator->network.changes[event.target], event.time)) {
+                fprintf(stderr, "Change %u of the timeline doesn't apply, skipping it\n", event.target + 1);
+            }
+        }
+        else {
+            deliver_link(&simulator->nets, arduinos, &event);
+        }
+    }
+}
+
+
+/* A byte Arduino `index` wrote to Serial goes to its pty, its file, and whoever is watching */
+static void serial_output(Simulator *simulator, size_t index, char output)
+{
+    if (-1 != simulator->tty_masters[index]) {
+        write(simulator->tty_masters[index], &output, sizeof(output));
+    }
+
+    if (NULL != simulator->serial_outputs[index]) {
+        fputc(output, simulator->serial_outputs[index]);
+    }
+
+    if (NULL != simulator->serial_output) {
+        simulator->serial_output(simulator->serial_output_data, index, output);
+    }
+
+    if (simulator->stop.check_output(index, output)) {
+        simulator->status = STOP_GOAL;
+    }
+}
+
+
+/*
+  Run one lockstep step: every Arduino that isn't done with it runs
+  whatever commands it has, until they all are, and then the barrier
+  passes on what they did -- to the other servers as well, if this
+  one is part of a cluster.
+ */
+static int run_step(Simulator *simulator)
+{
+    ArduinoNetwork *network = &simulator->network;
+    ArduinoMega **arduinos = simulator->arduinos;
+    Lockstep *lockstep = &simulator->lockstep;
+    Cluster *cluster = simulator->cluster;
+
+    unsigned long long end = start_step(lockstep);
+
+    struct pollfd *polls = simulator->polls;
+    struct timeval timeout;
+
+    while (1) {
+        int waiting = 0;
+        int work_buffered = 0;
+
+        for (size_t i = 0; i < network->num_arduinos; ++i) {
+            polls[2 * i].fd = -1;
+            polls[2 * i + 1].fd = -1;
+
+            if (step_done(lockstep, arduinos, i)) {
+                continue;
+            }
+
+            if (arduinos[i]->buffered()) {
+                work_buffered = 1;
+            }
+
+            polls[2 * i].fd = arduinos[i]->from_arduino;
+            waiting = 1;
+        }
+
+        if (!waiting) {
+            break;
+        }
+
+        timeout.tv_sec = 0;
+        timeout.tv_usec = 0;
+        poll_arduinos(simulator, work_buffered ? &timeout : NULL);
+
+        for (size_t i = 0; i < network->num_arduinos; ++i) {
+            ArduinoMega *arduino = arduinos[i];
+
+            if (step_done(lockstep, arduinos, i) || (!arduino->buffered() && !polled(&polls[2 * i]))) {
+                continue;
+            }
+
+            while (!step_done(lockstep, arduinos, i)) {
+                arduino->run();
+
+                if (arduino->dead) {
+                    bury_arduino(simulator, i);
+                    break;
+                }
+
+                if (0 != simulator->restarts[i].since) {
+                    note_restart(&simulator->restarts[i]);
+                }
+
+                for (int port = 0; port < ArduinoMega::NUM_SERIAL; ++port) {
+                    if (arduino->serial_out[port]->available()) {
+                        char output = arduino->serial_out[port]->read();
+
+                        if (port == 0) {
+                            serial_output(simulator, i, output);
+                        }
+
+                        hold_serial(lockstep, i, port, output);
+                    }
+                }
+
+                stream_serial_input(arduino, simulator->serial_inputs[i]);
+
+                if (!arduino->buffered()) {
+                    break;
+                }
+            }
+        }
+    }
+
+    /* The barrier */
+    if (NULL != cluster) {
+        hold_boundary(cluster, arduinos, &simulator->nets);
+    }
+
+    deliver_links(simulator, end);
+    finish_step(lockstep, network, arduinos, &simulator->nets, &simulator->wheel, simulator->line_free);
+
+    /* The servers settle when to stop together, with what they knew before the wake-ups */
+    int status = simulator->status;
+
+    if (NULL != cluster) {
+        status = trade_boundary(cluster, arduinos, &simulator->nets, end, &simulator->stop, status);
+    }
+
+    for (size_t i = 0; i < network->num_arduinos; ++i) {
+        arduinos[i]->wake(end);
+    }
+
+    answer_syncs(simulator, end);
+
+    return NULL == cluster ? stop_status(&simulator->stop, arduinos, network->num_arduinos, status) : status;
+}
+
+
+/*
+  Run one of Arduino `index`'s commands, and pass on whatever it did.
+  Returns -1 if the Arduino died instead (it has been buried), 1 if
+  the command put something out on the network -- a Serial byte, a
+  pin its nets hear about, a SoftwareSerial bit -- and 0 if not.
+ */
+static int run_command(Simulator *simulator, size_t index)
+{
+    ArduinoNetwork *network = &simulator->network;
+    ArduinoMega **arduinos = simulator->arduinos;
+    ArduinoMega *arduino = arduinos[index];
+
+    arduino->run();
+
+    if (arduino->dead) {
+        bury_arduino(simulator, index);
+        return -1;
+    }
+
+    if (0 != simulator->restarts[index].since) {
+        note_restart(&simulator->restarts[index]);
+    }
+
+    /* When anything this command sends down a link leaves */
+    unsigned long long sent = simulator->headless ? arduino->virtual_micros
+                              : simulator->timed ? ArduinoMega::real_micros() : 0;
+    int seen = 0 != arduino->num_drive_changes;
+
+    for (int port = 0; port < ArduinoMega::NUM_SERIAL; ++port) {
+        if (arduino->serial_out[port]->available()) {
+            char output = arduino->serial_out[port]->read();
+            seen = 1;
+
+            if (port == 0) {
+                serial_output(simulator, index, output);
+            }
+
+            /* Send it down all of this port's serial connections */
+            route_serial(network, arduinos, index, port, output, &simulator->wheel, simulator->line_free, sent,
+                         simulator->headless);
+        }
+    }
+
+    /* Only this Arduino's pins can have changed */
+    update_nets(&simulator->nets, arduinos, index, sent);
+
+    /* A pin goal is met as soon as the pin gets there, not just if it's still there after the round */
+    if (simulator->stop.num_pin_goals && simulator->stop.check_pins(arduinos)) {
+        simulator->status = STOP_GOAL;
+    }
+
+    /* A SoftwareSerial byte waits for the network to pass it on */
+    if (-1 != arduino->soft_pending_port) {
+        route_soft_serial(&simulator->nets, arduinos, index, sent);
+        seen = 1;
+    }
+
+    stream_serial_input(arduino, simulator->serial_inputs[index]);
+
+    return seen;
+}
+
+
+/* One round of the event loop: wait for something to happen, then give everyone with work their turn */
+static int run_round(Simulator *simulator)
+{
+    ArduinoNetwork *network = &simulator->network;
+    ArduinoMega **arduinos = simulator->arduinos;
+    Scheduler *scheduler = &simulator->scheduler;
+    int headless = simulator->headless;
+
+    struct pollfd *polls = simulator->polls;
+    struct timeval timeout;
+
+    /* Headless Arduinos keep to within the horizon of the slowest one, and behind any with ISRs */
+    unsigned long long slowest = link_time(arduinos, network->num_arduinos, headless, simulator->stop.max_micros);
+    unsigned long long listening = listen_time(arduinos, network->num_arduinos, simulator->stop.max_micros);
+
+    /* Set up what to wait on */
+    int work_buffered = 0;
+
+    for (int i = 0; i < network->num_arduinos; ++i) {
+        polls[2 * i].fd = -1;
+        polls[2 * i + 1].fd = simulator->tty_masters[i];
+
+        /* Throttled and held back Arduinos can wait, there's no point waking up for them */
+        if (throttled(scheduler, i) || arduinos[i]->dead || held_back(simulator, arduinos[i], slowest, listening)) {
+            continue;
+        }
+
+        if (arduinos[i]->buffered()) {
+            work_buffered = 1;
+        }
+        else {
+            polls[2 * i].fd = arduinos[i]->from_arduino;
+        }
+    }
+
+    /* Don't wait at all if commands are already read, or wait until something is due */
+    unsigned long long now = slowest;
+    unsigned long long limit = wheel_due(&simulator->wheel);
+
+    if (limit <= now) {
+        /* Headless, one moment at a time, so whoever it wakes wakes then */
+        if (headless) {
+            now = limit;
+        }
+
+        deliver_links(simulator, now);
+        limit = headless ? now : wheel_due(&simulator->wheel);
+
+        /* It may have left nobody to wait on, with the rest held back */
+        work_buffered |= headless;
+    }
+
+    answer_syncs(simulator, slowest);
+
+    struct timeval *wait = wake_arduinos(arduinos, network->num_arduinos, headless, now, limit, &timeout);
+    double throttle = throttle_wait(scheduler);
+
+    if (work_buffered) {
+        timeout.tv_sec = 0;
+        timeout.tv_usec = 0;
+        wait = &timeout;
+    }
+    else if (throttle >= 0 && (NULL == wait || throttle < wait->tv_sec + wait->tv_usec / 1e6)) {
+        timeout.tv_sec = (long)throttle;
+        timeout.tv_usec = (long)((throttle - timeout.tv_sec) * 1e6) + 1;
+        wait = &timeout;
+    }
+
+    /* Wait until something happens */
+    poll_arduinos(simulator, wait);
+
+    /* TTY to Arduino */
+    for (int i = 0; i < network->num_arduinos; ++i) {
+        if (polled(&polls[2 * i + 1])) {
+            char input;
+            int bytes_read = read(simulator->tty_masters[i], &input, sizeof(input));
+
+            if (-1 == bytes_read) {
+                perror("Error reading from serial");
+                exit(EXIT_FAILURE);
+            }
+
+            arduinos[i]->serial_in[0]->append(input);
+        }
+    }
+
+    /*
+      Arduinos doing something, each for as long as its budget lasts.
+      The round ends as soon as the run stops, so a headless run that
+      meets a goal stops there, not wherever the commands already read
+      in happen to end.
+     */
+    size_t first = start_round(scheduler);
+
+    for (size_t k = 0; k < network->num_arduinos && -1 == simulator->status; ++k) {
+        size_t i = (first + k) % network->num_arduinos;
+        ArduinoMega *arduino = arduinos[i];
+
+        if (throttled(scheduler, i) || arduino->dead || held_back(simulator, arduino, slowest, listening)
+            || (!arduino->buffered() && !polled(&polls[2 * i]))) {
+            continue;
+        }
+
+        long budget = grant_commands(scheduler, i);
+        long used = 0;
+
+        /* Checked before each command, so none of them starts past the limit */
+        while (used < budget && !arduino->parked && !held_back(simulator, arduino, slowest, listening)
+               && -1 == simulator->status) {
+            ++used;
+
+            if (-1 == run_command(simulator, i)) {
+                break;
+            }
+
+            /* Anything more will need another read, so leave it for the next round */
+            if (!arduino->buffered()) {
+                break;
+            }
+        }
+
+        charge_commands(scheduler, i, used, !arduino->buffered());
+    }
+
+    return stop_status(&simulator->stop, arduinos, network->num_arduinos, simulator->status);
+}
+
+
+void init_simulator(Simulator *simulator, ArduinoNetwork *network)
+{
+    simulator->network = *network;
+
+    simulator->sketch = NULL;
+    simulator->headless = 0;
+    simulator->idle_reads = ArduinoMega::IDLE_READS;
+    simulator->quantum = SCHEDULER_QUANTUM;
+    simulator->step = 0;
+    simulator->horizon = HEADLESS_HORIZON;
+    simulator->place = 0;
+    simulator->quiet = 0;
+    simulator->cluster = NULL;
+    simulator->stop = StopConditions();
+
+    size_t count = network->num_arduinos + 1;
+    simulator->serial_inputs = (FILE **)calloc(count, sizeof(FILE *));
+    simulator->serial_outputs = (FILE **)calloc(count, sizeof(FILE *));
+
+    simulator->serial_output = NULL;
+    simulator->serial_output_data = NULL;
+
+    simulator->status = -1;
+
+    simulator->arduinos = (ArduinoMega **)calloc(count, sizeof(ArduinoMega *));
+    simulator->pids = (pid_t *)malloc(sizeof(pid_t) * count);
+    simulator->heap_stats = (HeapStats **)calloc(count, sizeof(HeapStats *));
+    simulator->restarts = (Restarts *)calloc(count, sizeof(Restarts));
+    simulator->tty_masters = (int *)malloc(sizeof(int) * count);
+    simulator->polls = (struct pollfd *)calloc(2 * count, sizeof(struct pollfd));
+    simulator->remote = NULL;
+    simulator->line_free = NULL;
+    simulator->timed = 0;
+    simulator->pending_changes = 0;
+
+    for (size_t i = 0; i < count; ++i) {
+        simulator->pids[i] = -1;
+        simulator->tty_masters[i] = -1;
+    }
+
+    for (size_t i = 0; i < 2 * count; ++i) {
+        simulator->polls[i].fd = -1;
+        simulator->polls[i].events = POLLIN;
+    }
+}
+
+
+int load_simulator(Simulator *simulator, const char *path)
+{
+    ArduinoNetwork network;
+
+    if (-1 == load_network(path, &network)) {
+        return -1;
+    }
+
+    init_simulator(simulator, &network);
+
+    return 0;
+}
+
+
+/* A pty for Arduino `index`'s Serial, named on stdout */
+static int open_tty(const char *name)
+{
+    int master = posix_openpt(O_RDWR);  /* Create the master pty fd */
+
+    if (-1 == master) {
+        perror("Could not create pty master");
+        exit(EXIT_FAILURE);
+    }
+
+    /* Set the mode and owner of the slave of our master pty */
+    if (-1 == grantpt(master)) {
+        perror("Could not set mode or ownership of pty");
+        exit(EXIT_FAILURE);
+    }
+
+    /* Unlock the slave pty */
+    if (-1 == unlockpt(master)) {
+        perror("Could not get slave pty");
+        exit(EXIT_FAILURE);
+    }
+
+    int flags = fcntl(master, F_GETFL);
+    fcntl(master, F_SETFL, flags | O_NONBLOCK);
+
+    /* Now we want to get the device name for the slave pty */
+    char *slave_name = ptsname(master);
+
+    if (NULL == slave_name) {
+        perror("Could not get name of slave device");
+        exit(EXIT_FAILURE);
+    }
+
+    printf("%s on: %s\n", name, slave_name);
+
+    return master;
+}
+
+
+void start_simulator(Simulator *simulator)
+{
+    ArduinoNetwork *network = &simulator->network;
+    ArduinoMega **arduinos = simulator->arduinos;
+    int headless = simulator->headless;
+
+    /* Where everything runs, if it matters */
+    if (simulator->place) {
+        if (-1 == place_arduinos(&simulator->placement, network)) {
+            perror("Could not find the CPUs to place Arduinos on");
+            exit(EXIT_FAILURE);
+        }
+
+        print_placement(&simulator->placement, network);
+    }
+
+    /* Only this server's share of a cluster runs here, the rest are ghosts */
+    if (NULL != simulator->cluster) {
+        simulator->remote = simulator->cluster->remote;
+        simulator->stop.remote = simulator->remote;
+    }
+
+    const uint8_t *remote = simulator->remote;
+
+    /* The other servers couldn't follow the nets changing under them */
+    if (NULL != simulator->cluster && 0 != network->num_changes) {
+        fprintf(stderr, "A network with a 't' timeline can't be split across servers\n");
+        exit(EXIT_FAILURE);
+    }
+
+    /* An Arduino whose first change is to start it waits until then */
+    uint8_t *late = (uint8_t *)calloc(network->num_arduinos + 1, sizeof(uint8_t));
+    uint64_t *first_change = (uint64_t *)malloc(sizeof(uint64_t) * (network->num_arduinos + 1));
+
+    if (NULL == late || NULL == first_change) {
+        perror("Could not allocate the timeline");
+        exit(EXIT_FAILURE);
+    }
+
+    for (size_t i = 0; i < network->num_arduinos; ++i) {
+        first_change[i] = UINT64_MAX;
+    }
+
+    for (size_t k = 0; k < network->num_changes; ++k) {
+        TopologyChange change = network->changes[k];
+
+        if (CHANGE_ARDUINO == change.kind && change.index < network->num_arduinos && change.time < first_change[change.index]) {
+            first_change[change.index] = change.time;
+            late[change.index] = !change.cut;
+        }
+    }
+
+    free(first_change);
+
+    /* A dead Arduino's pipes may be written to before we notice, which mustn't take us with it */
+    signal(SIGPIPE, SIG_IGN);
+
+    prepare_eeproms(network, remote);
+
+    for (int i = 0; i < network->num_arduinos; ++i) {
+        if (NULL != remote && remote[i]) {
+            /* A ghost, with no process behind it */
+            arduinos[i] = new ArduinoMega(-1, -1);
+            arduinos[i]->virtual_clock = headless;
+
+            continue;
+        }
+
+        if (late[i]) {
+            /* No process until it joins */
+            arduinos[i] = new ArduinoMega(-1, -1);
+            arduinos[i]->idle_reads = simulator->idle_reads;
+            arduinos[i]->virtual_clock = headless;
+            arduinos[i]->dead = 1;
+
+            continue;
+        }
+
+        /* Launch our fake Arduino processes */
+        int to, from, events;
+        spawn_arduino(simulator, i, &to, &from, &events);
+
+        /* Make an entry in the giant arduino array! */
+        arduinos[i] = new ArduinoMega(to, from, events);
+        arduinos[i]->idle_reads = simulator->idle_reads;
+        arduinos[i]->virtual_clock = headless;
+
+        stream_serial_input(arduinos[i], simulator->serial_inputs[i]);
+    }
+
+    free(late);
+
+    /* The Arduinos have their own CPUs, so now the server can take its one */
+    if (simulator->place && -1 != simulator->placement.server_cpu && -1 == pin_to_cpu(simulator->placement.server_cpu)) {
+        perror("Could not pin the server to its CPU");
+    }
+
+    /* Get a pseudo-tty for each Arduino, unless we're headless */
+    for (int i = 0; !headless && i < network->num_arduinos; ++i) {
+        simulator->tty_masters[i] = open_tty(network->names[i]);
+    }
+
+    init_scheduler(&simulator->scheduler, network, simulator->quantum);
+
+    /* Delayed pins and paced serial go through the wheel, on the network's clock */
+    init_wheel(&simulator->wheel, headless ? 0 : ArduinoMega::real_micros());
+
+    /* The timeline counts from now, and ties go in the order it was written */
+    for (size_t k = 0; k < network->num_changes; ++k) {
+        schedule_event(&simulator->wheel, simulator->wheel.now + network->changes[k].time, TOPOLOGY_CHANGE, 0, k, 0);
+    }
+
+    simulator->pending_changes = network->num_changes;
+
+    simulator->line_free = (unsigned long long *)calloc(network->num_routes + 1, sizeof(unsigned long long));
+
+    for (size_t i = 0; i < network->num_pins; ++i) {
+        simulator->timed |= 0 != network->pins[i].delay;
+    }
+
+    for (size_t i = 0; i < network->num_serial; ++i) {
+        simulator->timed |= 0 != network->serial_ports[i].baud;
+    }
+
+    init_nets(&simulator->nets, network, arduinos, &simulator->wheel);
+    init_buses(&simulator->buses, network, arduinos);
+    init_stimuli(&simulator->stimuli, network, arduinos, remote);
+
+    if (NULL != simulator->cluster) {
+        plan_boundary(simulator->cluster, &simulator->nets);
+        connect_cluster(simulator->cluster, network);
+    }
+
+    init_lockstep(&simulator->lockstep, network->num_arduinos, simulator->step);
+    simulator->lockstep.remote = remote;
+}
+
+
+int step_simulator(Simulator *simulator)
+{
+    if (-1 != simulator->status) {
+        return simulator->status;
+    }
+
+    simulator->status = 0 != simulator->step ? run_step(simulator) : run_round(simulator);
+
+    return simulator->status;
+}
+
+
+int run_simulator(Simulator *simulator, int (*until)(Simulator *simulator, void *data), void *data)
+{
+    while (-1 == step_simulator(simulator)) {
+        if (NULL != until && until(simulator, data)) {
+            return -1;
+        }
+    }
+
+    return simulator->status;
+}
+
+
+size_t ready_arduinos(Simulator *simulator, size_t *ready)
+{
+    ArduinoNetwork *network = &simulator->network;
+    ArduinoMega **arduinos = simulator->arduinos;
+    struct timeval timeout;
+
+    while (-1 == simulator->status) {
+        /* The network's time moves up as in a headless round, one moment at a time */
+        unsigned long long now = link_time(arduinos, network->num_arduinos, 1, simulator->stop.max_micros);
+        unsigned long long limit = wheel_due(&simulator->wheel);
+
+        if (limit <= now) {
+            now = limit;
+            deliver_links(simulator, now);
+        }
+
+        answer_syncs(simulator, now);
+        wake_arduinos(arduinos, network->num_arduinos, 1, now, limit, &timeout);
+
+        size_t count = 0;
+        int parked = 0;
+
+        for (size_t i = 0; i < network->num_arduinos; ++i) {
+            ArduinoMega *arduino = arduinos[i];
+
+            if (arduino->dead || (NULL != simulator->remote && simulator->remote[i])) {
+                continue;
+            }
+
+            parked |= arduino->parked;
+
+            /* One waiting on a Wire target or a SYNC can't send anything until it's answered */
+            if (!arduino->parked && !arduino->wire_waiting && !arduino->syncing && !at_limit(simulator, arduino)) {
+                ready[count++] = i;
+            }
+        }
+
+        /* Otherwise only time passing can let anyone go */
+        if (0 != count || (!parked && ULLONG_MAX == wheel_due(&simulator->wheel))) {
+            return count;
+        }
+    }
+
+    return 0;
+}
+
+
+int turn_simulator(Simulator *simulator, size_t index)
+{
+    ArduinoMega *arduino = simulator->arduinos[index];
+    unsigned long answers = arduino->answers;
+
+    for (int used = 0; used < TURN_COMMANDS && !arduino->parked && !arduino->syncing; ++used) {
+        if (0 != run_command(simulator, index) || answers != arduino->answers) {
+            break;
+        }
+    }
+
+    simulator->status = stop_status(&simulator->stop, simulator->arduinos, simulator->network.num_arduinos,
+                                    simulator->status);
+
+    return simulator->status;
+}
+
+
+/* Fold `length` bytes into an FNV-1a hash */
+static uint64_t fold_state(uint64_t hash, const void *data, size_t length)
+{
+    const uint8_t *bytes = (const uint8_t *)data;
+
+    for (size_t i = 0; i < length; ++i) {
+        hash ^= bytes[i];
+        hash *= 0x100000001B3ULL;
+    }
+
+    return hash;
+}
+
+
+uint64_t simulator_state(Simulator *simulator)
+{
+    uint64_t hash = 0xCBF29CE484222325ULL;
+
+    hash = fold_state(hash, &simulator->wheel.now, sizeof(simulator->wheel.now));
+
+    for (size_t i = 0; i < simulator->network.num_arduinos; ++i) {
+        ArduinoMega *arduino = simulator->arduinos[i];
+
+        hash = fold_state(hash, &arduino->told, sizeof(arduino->told));
+        hash = fold_state(hash, &arduino->virtual_micros, sizeof(arduino->virtual_micros));
+        hash = fold_state(hash, &arduino->dead, sizeof(arduino->dead));
+        hash = fold_state(hash, &arduino->parked, sizeof(arduino->parked));
+        hash = fold_state(hash, &arduino->syncing, sizeof(arduino->syncing));
+        hash = fold_state(hash, arduino->pins, sizeof(arduino->pins));
+
+        for (int port = 0; port < ArduinoMega::NUM_PORTS; ++port) {
+            hash = arduino->serial_in[port]->fold(hash);
+        }
+
+        size_t inbox = arduino->inbox_end - arduino->inbox_start;
+        hash = fold_state(hash, &inbox, sizeof(inbox));
+    }
+
+    return hash;
+}
+
+
+int simulator_pin(Simulator *simulator, size_t index, int pin)
+{
+    return simulator->arduinos[index]->pins[pin];
+}
+
+
+void drive_simulator_pin(Simulator *simulator, size_t index, int pin, int value)
+{
+    simulator->arduinos[index]->set_pin(pin, value);
+}
+
+
+int change_topology(Simulator *simulator, TopologyChange change)
+{
+    return apply_change(simulator, &change, simulator->wheel.now);
+}
+
+
+size_t inject_serial(Simulator *simulator, size_t index, const char *data, size_t length)
+{
+    size_t count = 0;
+
+    while (count < length && -1 != simulator->arduinos[index]->serial_in[0]->append(data[count])) {
+        ++count;
+    }
+
+    return count;
+}
+
+
+void finish_simulator(Simulator *simulator)
+{
+    ArduinoNetwork *network = &simulator->network;
+
+    free_scheduler(&simulator->scheduler);
+    free_lockstep(&simulator->lockstep);
+
+    if (simulator->place) {
+        free_placement(&simulator->placement);
+    }
+
+    free_nets(&simulator->nets);
+    free_buses(&simulator->buses);
+    free_stimuli(&simulator->stimuli);
+    free_wheel(&simulator->wheel);
+
+    if (!simulator->quiet) {
+        fprintf(stderr, "Stopped: %s\n", simulator->stop.reason);
+    }
+
+    /* Shut the Arduinos down, and make sure all of the output is out */
+    for (int i = 0; i < network->num_arduinos; ++i) {
+        if (-1 != simulator->pids[i]) {
+            stop_arduino(simulator->pids[i]);
+            simulator->pids[i] = -1;
+        }
+
+        if (NULL != simulator->serial_outputs[i]) {
+            fclose(simulator->serial_outputs[i]);
+            simulator->serial_outputs[i] = NULL;
+        }
+
+        if (NULL != simulator->serial_inputs[i]) {
+            fclose(simulator->serial_inputs[i]);
+            simulator->serial_inputs[i] = NULL;
+        }
+
+        if (-1 != simulator->tty_masters[i]) {
+            close(simulator->tty_masters[i]);
+            simulator->tty_masters[i] = -1;
+        }
+    }
+
+    /* The Arduinos are gone, so their EEPROMs are done with */
+    if (!simulator->quiet) {
+        print_eeprom_wear(network, simulator->remote);
+    }
+
+    for (int i = 0; i < network->num_arduinos; ++i) {
+        Restarts *restarts = &simulator->restarts[i];
+
+        /* One still under way at the end never came back, so it doesn't count towards the times */
+        unsigned long back = restarts->count - (0 != restarts->since);
+
+        if (!simulator->quiet && 0 != back) {
+            fprintf(stderr, "%s was restarted %lu times, %.3f ms on average to its first command (longest %.3f ms)\n",
+                    network->names[i], restarts->count, restarts->total / 1000.0 / back, restarts->longest / 1000.0);
+        }
+        else if (!simulator->quiet && 0 != restarts->count) {
+            fprintf(stderr, "%s was restarted %lu times, and never came back\n", network->names[i], restarts->count);
+        }
+
+        if (NULL == simulator->heap_stats[i]) {
+            continue;
+        }
+
+        if (!simulator->quiet) {
+            print_heap_stats(network->names[i], simulator->heap_stats[i]);
+        }
+
+        munmap(simulator->heap_stats[i], sizeof(HeapStats));
+        simulator->heap_stats[i] = NULL;
+    }
+}
+
+
+void free_simulator(Simulator *simulator)
+{
+    for (int i = 0; i < simulator->network.num_arduinos; ++i) {
+        if (NULL == simulator->arduinos[i]) {
+            continue;
+        }
+
+        /* Done with its pipes, and anything still going on with them */
+        close(simulator->arduinos[i]->to_arduino);
+        close(simulator->arduinos[i]->from_arduino);
+        close(simulator->arduinos[i]->events);
+        delete simulator->arduinos[i];
+    }
+
+    if (NULL != simulator->cluster) {
+        free_cluster(simulator->cluster);
+    }
+
+    free(simulator->line_free);
+    free(simulator->serial_inputs);
+    free(simulator->serial_outputs);
+    free(simulator->arduinos);
+    free(simulator->pids);
+    free(simulator->heap_stats);
+    free(simulator->restarts);
+    free(simulator->tty_masters);
+    free(simulator->polls);
+
+    free_network(&simulator->network);
+}
@@ -0,0 +1,228 @@
+/* Copyright (C) 2013 Calvin Beck
+
+  Permission is hereby granted, free of charge, to any person
+  obtaining a copy of this software and associated documentation files
+  (the "Software"), to deal in the Software without restriction,
+  including without limitation the rights to use, copy, modify, merge,
+  publish, distribute, sublicense, and/or sell copies of the Software,
+  and to permit persons to whom the Software is furnished to do so,
+  subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be
+  included in all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+  EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+  MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+  NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+  BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+  ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+  CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+  SOFTWARE.
+
+*/
+
+
+#ifndef NETWORK_SIMULATOR_H
+#define NETWORK_SIMULATOR_H
+
+#include "network_parse.h"
+#include "network_scheduler.h"
+#include "network_nets.h"
+#include "network_buses.h"
+#include "network_wheel.h"
+#include "network_lockstep.h"
+#include "network_placement.h"
+#include "network_cluster.h"
+#include "network_stimulus.h"
+#include <emulard/fakeduino.h>
+#include <emulard/stop_conditions.h>
+
+#include <stdio.h>
+#include <stdint.h>
+#include <poll.h>
+#include <sys/types.h>
+
+
+/*
+  The engine behind arduino_net and the single Arduino programs: it
+  starts a network's Arduinos, runs the server's side of them, and
+  stops them again. Anything else that wants to run a network, like a
+  test that runs one case after another, can drive it the same way:
+
+  - load_simulator() (or init_simulator() with a network already in
+    hand), then set the options, goals and serial files below,
+  - start_simulator() to launch the Arduinos,
+  - step_simulator() or run_simulator() until it's stopped, looking at
+    pins and serial with simulator_pin() and serial_output, poking
+    them with drive_simulator_pin() and inject_serial(), and rewiring
+    the network with change_topology(), or take the scheduling over
+    with ready_arduinos() and turn_simulator(),
+  - finish_simulator() to shut it down and report, and
+    free_simulator().
+ */
+
+/*
+  Every Arduino is a process of its own, talking to the server over
+  pipes on its stdin and stdout, with its interrupts on an event pipe.
+  It runs the network's path for it, as in arduino_net, unless
+  `sketch` is set: then each Arduino is a fork of this process that
+  calls it, for a program that has the sketch linked into it, so no
+  exec is needed. A single Arduino program runs itself this way, and
+  a test binary can start thousands of networks of its sketch. Running
+  a sketch inside the server's own process takes the direct build of
+  the library (see server/fuzz_main.cpp), which only has room for one.
+
+  So pipes are the only transport: there is no transport interface to
+  plug a shared memory or in-process one into. Both would need the
+  client library to speak something other than the pipe protocol, and
+  an in-process network would need a copy of a sketch's globals per
+  Arduino.
+ */
+
+/*
+  How far, in microseconds of virtual time, a headless Arduino may get
+  ahead of the slowest one still running before it has to wait.
+ */
+#define HEADLESS_HORIZON 1000
+
+/* The most commands a turn_simulator() turn runs, if none of them are seen */
+#define TURN_COMMANDS 64
+
+
+/*
+  How often an Arduino has been respawned, and how long it took each
+  time from its death to its first command, in real microseconds.
+ */
+typedef struct Restarts {
+    unsigned long count;
+    unsigned long long since;  /* When the one under way started, or 0 */
+    unsigned long long total;
+    unsigned long long longest;
+} Restarts;
+
+
+typedef struct Simulator {
+    ArduinoNetwork network;
+
+    /* Options, set between loading and starting */
+    void (*sketch)(void);        /* Forked in place of each program, or NULL; never returns */
+    int headless;                /* Virtual time, and no ptys */
+    int idle_reads;              /* Parking, see ArduinoMega */
+    int quantum;                 /* Commands per round, see network_scheduler.h */
+    unsigned long long step;     /* Lockstep step in microseconds, or 0 */
+    unsigned long long horizon;  /* Headless lead over the slowest Arduino, see HEADLESS_HORIZON */
+    int place;                   /* Pin everything to CPUs, see network_placement.h */
+    int quiet;                   /* finish_simulator() keeps its report to itself */
+    Cluster *cluster;            /* Partitioned with partition_cluster(), or NULL; freed with us */
+    StopConditions stop;
+
+    /* Serial files for Arduino i, or NULL; closed by finish_simulator() */
+    FILE **serial_inputs;
+    FILE **serial_outputs;
+
+    /* Called with every byte an Arduino writes to Serial, if set */
+    void (*serial_output)(void *data, size_t index, char output);
+    void *serial_output_data;
+
+    /* Exit status once a stop condition is met, -1 while running */
+    int status;
+
+    /* Running state */
+    ArduinoMega **arduinos;
+    pid_t *pids;
+    HeapStats **heap_stats;
+    Restarts *restarts;
+    int *tty_masters;
+    struct pollfd *polls;  /* Arduino i's commands at 2i, its pty at 2i + 1 */
+    const uint8_t *remote;
+
+    Placement placement;
+    Scheduler scheduler;
+    TimingWheel wheel;
+    unsigned long long *line_free;
+    int timed;
+    size_t pending_changes;  /* Changes in the timeline still to come */
+    PinNets nets;
+    NetworkBuses buses;
+    Stimuli stimuli;
+    Lockstep lockstep;
+} Simulator;
+
+
+/* Set up a simulator for `network`, which it takes over, with the default options */
+void init_simulator(Simulator *simulator, ArduinoNetwork *network);
+
+/* The same for the network in a .ard file or its image, or -1 if it can't be loaded */
+int load_simulator(Simulator *simulator, const char *path);
+
+/* Launch the Arduinos, and get everything between them ready */
+void start_simulator(Simulator *simulator);
+
+/*
+  Run one round: every Arduino with something to do gets its turn (or
+  in a lockstep run, everything runs one step). Returns the status to
+  stop with, or -1 to keep going.
+ */
+int step_simulator(Simulator *simulator);
+
+/*
+  Step until a stop condition is met, or `until` (if it isn't NULL)
+  returns non-zero after a round. Returns the stop status, or -1 if
+  it was `until` that stopped it.
+ */
+int run_simulator(Simulator *simulator, int (*until)(Simulator *simulator, void *data), void *data);
+
+/*
+  Taking the scheduling over, in a headless run that isn't lockstep:
+  instead of stepping, pick which Arduino goes next. ready_arduinos()
+  lets the network's time move on until someone can go, and fills
+  `ready` (one slot per Arduino) with who can: one that is parked, or
+  waiting on a Wire target or a SYNC, can't. Returns how many there
+  are, 0 if nobody ever will again (or the run has stopped).
+
+  turn_simulator() gives Arduino `index` (one of those) its turn: it
+  runs until one of its commands is answered or puts something out on
+  the network, until it waits on a SYNC, or for TURN_COMMANDS
+  commands. What happens in a turn depends only on what came before
+  it, so the same turns always make the same run. Returns the status
+  to stop with, or -1.
+ */
+size_t ready_arduinos(Simulator *simulator, size_t *ready);
+int turn_simulator(Simulator *simulator, size_t index);
+
+/*
+  A hash of where the run has got to: what each sketch has been told,
+  its time, pins and Serial input, and the network's time. Runs that
+  get to the same hash go the same way from there on.
+ */
+uint64_t simulator_state(Simulator *simulator);
+
+/* The level of a pin on Arduino `index` */
+int simulator_pin(Simulator *simulator, size_t index, int pin);
+
+/*
+  Drive a pin on Arduino `index` from outside, as a button or sensor
+  would, firing its interrupt if it has one. It holds until the sketch
+  or a net sets the pin again.
+ */
+void drive_simulator_pin(Simulator *simulator, size_t index, int pin, int value);
+
+/*
+  Change the network while it runs, as the 't' entries of a .ard file
+  do, as of how far the links have got: make or cut a pin or serial
+  connection, or start or stop an Arduino. Only what the change touches
+  is updated, and no other Arduino is restarted. Returns 0, or -1 if
+  the change doesn't apply: a connection that isn't valid or isn't
+  there to cut, or an Arduino that is already running or stopped.
+ */
+int change_topology(Simulator *simulator, TopologyChange change);
+
+/* Put bytes in Arduino `index`'s Serial input, and return how many fit */
+size_t inject_serial(Simulator *simulator, size_t index, const char *data, size_t length);
+
+/* Stop the Arduinos, and print what they wore out, used up, and how often they died */
+void finish_simulator(Simulator *simulator);
+void free_simulator(Simulator *simulator);
+
+#endif
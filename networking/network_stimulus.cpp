@@ -0,0 +1,128 @@
+/* Copyright (C) 2013 Calvin Beck
+
+  Permission is hereby granted, free of charge, to any person
+  obtaining a copy of this software and associated documentation files
+  (the "Software"), to deal in the Software without restriction,
+  including without limitation the rights to use, copy, modify, merge,
+  publish, distribute, sublicense, and/or sell copies of the Software,
+  and to permit persons to whom the Software is furnished to do so,
+  subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be
+  included in all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+  EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+  MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+  NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+  BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+  ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+  CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+  SOFTWARE.
+
+*/
+
+#include "network_stimulus.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+
+/* Map the file for stimulus `s`, or find it mapped for an earlier one */
+static const void *map_waveform(Stimuli *stimuli, ArduinoNetwork *network, size_t s, size_t *size)
+{
+    for (size_t k = 0; k < s; ++k) {
+        if (0 == strcmp(network->stimulus_paths[k], network->stimulus_paths[s]) && NULL != stimuli->maps[k]) {
+            *size = stimuli->map_sizes[k];
+            return stimuli->maps[k];
+        }
+    }
+
+    int fd = open(network->stimulus_paths[s], O_RDONLY);
+    struct stat info;
+
+    if (-1 == fd || -1 == fstat(fd, &info)) {
+        perror(network->stimulus_paths[s]);
+        exit(EXIT_FAILURE);
+    }
+
+    void *data = NULL;
+
+    /* An empty file plays 0, and can't be mapped */
+    if (info.st_size > 0) {
+        data = mmap(NULL, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+
+        if (MAP_FAILED == data) {
+            perror(network->stimulus_paths[s]);
+            exit(EXIT_FAILURE);
+        }
+
+        /* Played from start to end, so read ahead */
+        madvise(data, info.st_size, MADV_SEQUENTIAL);
+    }
+
+    close(fd);
+
+    stimuli->maps[s] = data;
+    stimuli->map_sizes[s] = info.st_size;
+
+    *size = info.st_size;
+
+    return data;
+}
+
+
+void init_stimuli(Stimuli *stimuli, ArduinoNetwork *network, ArduinoMega **arduinos, const uint8_t *remote)
+{
+    stimuli->waveforms = (Waveform **)calloc(network->num_stimuli + 1, sizeof(Waveform *));
+    stimuli->num_waveforms = network->num_stimuli;
+
+    stimuli->maps = (void **)calloc(network->num_stimuli + 1, sizeof(void *));
+    stimuli->map_sizes = (size_t *)calloc(network->num_stimuli + 1, sizeof(size_t));
+    stimuli->num_maps = network->num_stimuli;
+
+    if (NULL == stimuli->waveforms || NULL == stimuli->maps || NULL == stimuli->map_sizes) {
+        perror("Could not allocate waveforms");
+        exit(EXIT_FAILURE);
+    }
+
+    for (size_t s = 0; s < network->num_stimuli; ++s) {
+        AnalogStimulus stimulus = network->stimuli[s];
+
+        /* Another server plays its own Arduinos' waveforms */
+        if (stimulus.index >= network->num_arduinos || (NULL != remote && remote[stimulus.index])) {
+            continue;
+        }
+
+        size_t size;
+        const void *data = map_waveform(stimuli, network, s, &size);
+
+        /* The last entry for a pin wins */
+        stimuli->waveforms[s] = new Waveform(data, size, stimulus.period);
+        arduinos[stimulus.index]->waveforms[stimulus.pin - 54] = stimuli->waveforms[s];
+    }
+}
+
+
+void free_stimuli(Stimuli *stimuli)
+{
+    for (size_t s = 0; s < stimuli->num_waveforms; ++s) {
+        delete stimuli->waveforms[s];
+    }
+
+    /* Files shared between stimuli are only in maps once */
+    for (size_t k = 0; k < stimuli->num_maps; ++k) {
+        if (NULL != stimuli->maps[k]) {
+            munmap(stimuli->maps[k], stimuli->map_sizes[k]);
+        }
+    }
+
+    free(stimuli->waveforms);
+    free(stimuli->maps);
+    free(stimuli->map_sizes);
+}
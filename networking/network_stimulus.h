@@ -0,0 +1,52 @@
+/* Copyright (C) 2013 Calvin Beck
+
+  Permission is hereby granted, free of charge, to any person
+  obtaining a copy of this software and associated documentation files
+  (the "Software"), to deal in the Software without restriction,
+  including without limitation the rights to use, copy, modify, merge,
+  publish, distribute, sublicense, and/or sell copies of the Software,
+  and to permit persons to whom the Software is furnished to do so,
+  subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be
+  included in all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+  EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+  MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+  NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+  BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+  ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+  CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+  SOFTWARE.
+
+*/
+
+
+#ifndef NETWORK_STIMULUS_H
+#define NETWORK_STIMULUS_H
+
+#include "network_parse.h"
+#include <emulard/fakeduino.h>
+
+
+/*
+  The waveforms a network's 'a' entries play on analog pins. Each
+  file is mapped once, however many pins play it, and every pin gets
+  a Waveform of its own so it keeps its own place.
+ */
+typedef struct Stimuli {
+    Waveform **waveforms;
+    size_t num_waveforms;
+
+    void **maps;
+    size_t *map_sizes;
+    size_t num_maps;
+} Stimuli;
+
+
+/* Map the waveforms, and hand them to the Arduinos that aren't `remote` */
+void init_stimuli(Stimuli *stimuli, ArduinoNetwork *network, ArduinoMega **arduinos, const uint8_t *remote);
+void free_stimuli(Stimuli *stimuli);
+
+#endif
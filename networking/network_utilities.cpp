@@ -77,3 +77,31 @@ void write_graph(const char *path, const char *name, ArduinoNetwork *network, Ar
     fprintf(file, "\n}\n");
     fclose(file);
 }
+
+
+void route_serial(ArduinoNetwork *network, ArduinoMega **arduinos, size_t index, int port, uint8_t value,
+                  TimingWheel *wheel, unsigned long long *line_free, unsigned long long now, int wait)
+{
+    size_t slot = index * NETWORK_SERIAL_PORTS + port;
+
+    for (size_t k = network->serial_route_start[slot]; ROUTE_END != k; k = network->serial_routes[k].next) {
+        SerialRoute route = network->serial_routes[k];
+        unsigned long baud = SERIAL_BAUD_BEGIN == route.baud ? arduinos[index]->serial_baud[port] : route.baud;
+
+        if (0 == baud && wait) {
+            schedule_event(wheel, now, LINK_SERIAL, route.port, route.index, value);
+            continue;
+        }
+
+        if (0 == baud) {
+            arduinos[route.index]->serial_in[route.port]->append(value);
+            continue;
+        }
+
+        /* A start bit, 8 data bits, and a stop bit, after whatever is still going out */
+        unsigned long long start = line_free[k] > now ? line_free[k] : now;
+        line_free[k] = start + (10000000 + baud - 1) / baud;
+
+        schedule_event(wheel, line_free[k], LINK_SERIAL, route.port, route.index, value);
+    }
+}
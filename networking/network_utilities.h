@@ -26,6 +26,7 @@
 #define NETWORK_UTILITIES_H
 
 #include "network_parse.h"
+#include "network_wheel.h"
 #include <emulard/fakeduino.h>
 
 
@@ -48,4 +49,18 @@
 void write_graph(const char *path, const char *name, ArduinoNetwork *network, ArduinoMega **arduinos, void (*node_print)(FILE*, ArduinoNetwork*, ArduinoMega*, int));
 
 
+/*
+  Deliver a byte written to serial port `port` on Arduino `index` to
+  every port that it is connected to. Connections with a baud rate
+  put it on the timing wheel instead, to arrive once the byte has been
+  clocked out after everything sent before it. `line_free` has when
+  each route is next free, and `now` is when the byte was written.
+  With `wait` set the rest go on the wheel too, to arrive at `now`:
+  in a headless run the receiver may not have got that far yet.
+ */
+
+void route_serial(ArduinoNetwork *network, ArduinoMega **arduinos, size_t index, int port, uint8_t value,
+                  TimingWheel *wheel, unsigned long long *line_free, unsigned long long now, int wait);
+
+
 #endif
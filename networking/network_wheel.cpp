@@ -0,0 +1,240 @@
+/* Copyright (C) 2013 Calvin Beck
+
+  Permission is hereby granted, free of charge, to any person
+  obtaining a copy of this software and associated documentation files
+  (the "Software"), to deal in the Software without restriction,
+  including without limitation the rights to use, copy, modify, merge,
+  publish, distribute, sublicense, and/or sell copies of the Software,
+  and to permit persons to whom the Software is furnished to do so,
+  subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be
+  included in all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+  EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+  MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+  NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+  BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+  ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+  CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+  SOFTWARE.
+
+*/
+
+#include "network_wheel.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+
+
+void init_wheel(TimingWheel *wheel, unsigned long long now)
+{
+    wheel->now = now;
+
+    memset(wheel->occupied, 0, sizeof(wheel->occupied));
+    memset(wheel->slots, 0xFF, sizeof(wheel->slots));
+
+    wheel->due.head = WHEEL_NONE;
+    wheel->due.tail = WHEEL_NONE;
+
+    wheel->events = NULL;
+    wheel->num_events = 0;
+    wheel->free_events = WHEEL_NONE;
+}
+
+
+void free_wheel(TimingWheel *wheel)
+{
+    free(wheel->events);
+
+    wheel->events = NULL;
+    wheel->num_events = 0;
+    wheel->free_events = WHEEL_NONE;
+}
+
+
+static void append_event(TimingWheel *wheel, WheelSlot *slot, uint32_t event)
+{
+    wheel->events[event].next = WHEEL_NONE;
+
+    if (WHEEL_NONE == slot->tail) {
+        slot->head = event;
+    }
+    else {
+        wheel->events[slot->tail].next = event;
+    }
+
+    slot->tail = event;
+}
+
+
+/* Put an event on the lowest level where its time and now agree above the slot */
+static void place_event(TimingWheel *wheel, uint32_t event)
+{
+    unsigned long long difference = wheel->events[event].time ^ wheel->now;
+    int level = 0 == difference ? 0 : (63 - __builtin_clzll(difference)) / WHEEL_BITS;
+    int slot = (wheel->events[event].time >> (level * WHEEL_BITS)) & (WHEEL_SLOTS - 1);
+
+    append_event(wheel, &wheel->slots[level][slot], event);
+    wheel->occupied[level] |= 1ULL << slot;
+}
+
+
+void schedule_event(TimingWheel *wheel, unsigned long long time, uint8_t kind, uint8_t arg, uint32_t target, int value)
+{
+    if (WHEEL_NONE == wheel->free_events) {
+        /* Double the pool, and put the new events on the free list */
+        uint32_t count = wheel->num_events ? wheel->num_events * 2 : 256;
+        wheel->events = (WheelEvent *)realloc(wheel->events, sizeof(WheelEvent) * count);
+
+        if (NULL == wheel->events) {
+            perror("Could not allocate timing wheel events");
+            exit(EXIT_FAILURE);
+        }
+
+        for (uint32_t e = wheel->num_events; e < count; ++e) {
+            wheel->events[e].next = e + 1 < count ? e + 1 : WHEEL_NONE;
+        }
+
+        wheel->free_events = wheel->num_events;
+        wheel->num_events = count;
+    }
+
+    uint32_t event = wheel->free_events;
+    wheel->free_events = wheel->events[event].next;
+
+    wheel->events[event].time = time < wheel->now ? wheel->now : time;
+    wheel->events[event].kind = kind;
+    wheel->events[event].arg = arg;
+    wheel->events[event].target = target;
+    wheel->events[event].value = value;
+
+    place_event(wheel, event);
+}
+
+
+/*
+  The earliest time slot `slot` on `level` can hold. Everything on a
+  level is later than everything on the levels below it, and its
+  slots are in time order.
+ */
+static unsigned long long slot_start(TimingWheel *wheel, int level, int slot)
+{
+    int shift = level * WHEEL_BITS;
+    unsigned long long above = shift + WHEEL_BITS >= 64 ? 0 : wheel->now >> (shift + WHEEL_BITS) << (shift + WHEEL_BITS);
+
+    return above | (unsigned long long)slot << shift;
+}
+
+
+/*
+  Move the earliest events up to `until` onto the due list, cascading
+  higher slots down as now reaches them. Returns 0 if none are due.
+ */
+static int collect_events(TimingWheel *wheel, unsigned long long until)
+{
+    int level = 0;
+
+    while (level < WHEEL_LEVELS) {
+        if (!wheel->occupied[level]) {
+            ++level;
+            continue;
+        }
+
+        int slot = __builtin_ctzll(wheel->occupied[level]);
+        unsigned long long start = slot_start(wheel, level, slot);
+
+        if (start > until) {
+            if (until > wheel->now) {
+                wheel->now = until;
+            }
+
+            return 0;
+        }
+
+        WheelSlot events = wheel->slots[level][slot];
+
+        wheel->slots[level][slot].head = WHEEL_NONE;
+        wheel->slots[level][slot].tail = WHEEL_NONE;
+        wheel->occupied[level] &= ~(1ULL << slot);
+
+        if (start > wheel->now) {
+            wheel->now = start;
+        }
+
+        if (0 == level) {
+            /* A level 0 slot is a single microsecond, so they are all due */
+            wheel->due = events;
+            return 1;
+        }
+
+        for (uint32_t event = events.head; WHEEL_NONE != event;) {
+            uint32_t next = wheel->events[event].next;
+
+            place_event(wheel, event);
+            event = next;
+        }
+
+        level = 0;
+    }
+
+    /* Nothing scheduled at all */
+    if (until > wheel->now && ULLONG_MAX != until) {
+        wheel->now = until;
+    }
+
+    return 0;
+}
+
+
+int next_event(TimingWheel *wheel, unsigned long long until, WheelEvent *event)
+{
+    if (WHEEL_NONE == wheel->due.head && !collect_events(wheel, until)) {
+        return 0;
+    }
+
+    uint32_t taken = wheel->due.head;
+    *event = wheel->events[taken];
+
+    wheel->due.head = event->next;
+
+    if (WHEEL_NONE == wheel->due.head) {
+        wheel->due.tail = WHEEL_NONE;
+    }
+
+    wheel->events[taken].next = wheel->free_events;
+    wheel->free_events = taken;
+
+    return 1;
+}
+
+
+unsigned long long wheel_due(TimingWheel *wheel)
+{
+    if (WHEEL_NONE != wheel->due.head) {
+        return wheel->events[wheel->due.head].time;
+    }
+
+    for (int level = 0; level < WHEEL_LEVELS; ++level) {
+        if (!wheel->occupied[level]) {
+            continue;
+        }
+
+        /* Only the first slot of the first level in use can hold the earliest */
+        WheelSlot slot = wheel->slots[level][__builtin_ctzll(wheel->occupied[level])];
+        unsigned long long due = ULLONG_MAX;
+
+        for (uint32_t event = slot.head; WHEEL_NONE != event; event = wheel->events[event].next) {
+            if (due > wheel->events[event].time) {
+                due = wheel->events[event].time;
+            }
+        }
+
+        return due;
+    }
+
+    return ULLONG_MAX;
+}
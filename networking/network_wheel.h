@@ -0,0 +1,111 @@
+/* Copyright (C) 2013 Calvin Beck
+
+  Permission is hereby granted, free of charge, to any person
+  obtaining a copy of this software and associated documentation files
+  (the "Software"), to deal in the Software without restriction,
+  including without limitation the rights to use, copy, modify, merge,
+  publish, distribute, sublicense, and/or sell copies of the Software,
+  and to permit persons to whom the Software is furnished to do so,
+  subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be
+  included in all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+  EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+  MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+  NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+  BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+  ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+  CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+  SOFTWARE.
+
+*/
+
+#ifndef NETWORK_WHEEL_H
+#define NETWORK_WHEEL_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+
+/*
+  A hierarchical timing wheel, for things the network does later:
+  pin levels arriving at the far end of a slow wire, serial bytes
+  arriving once the baud rate has had time to clock them out, and the
+  network's own timeline of changes.
+
+  Times are microseconds on the network's clock, virtual or real.
+  Level 0 has a slot for each of the 64 microseconds around now, and
+  each level above has slots 64 times as wide, so any 64 bit time has
+  a place and scheduling is constant time. An event goes on the
+  lowest level where its time and now agree on everything above the
+  slot. When now reaches a higher slot, its events are spread out
+  over the levels below, so each event only moves a few times however
+  far off it was. Events due at the same time come out in the order
+  they were scheduled.
+ */
+
+#define WHEEL_BITS 6
+#define WHEEL_SLOTS (1 << WHEEL_BITS)
+#define WHEEL_LEVELS ((64 + WHEEL_BITS - 1) / WHEEL_BITS)
+
+/* No event, for the end of a list */
+#define WHEEL_NONE UINT32_MAX
+
+/* The kinds of events the network schedules */
+#define LINK_PIN 1          /* target is a NetLink, arg the drive */
+#define LINK_SOFT_SERIAL 2  /* target is the NetLink it crosses */
+#define LINK_SERIAL 3       /* target is the receiving Arduino, arg its port */
+#define TOPOLOGY_CHANGE 4   /* target is the change in the network's timeline */
+
+typedef struct WheelEvent {
+    unsigned long long time;
+    uint32_t next;  /* Next event in the same list */
+    uint32_t target;
+    int value;
+    uint8_t kind;
+    uint8_t arg;
+} WheelEvent;
+
+
+typedef struct WheelSlot {
+    uint32_t head;
+    uint32_t tail;
+} WheelSlot;
+
+
+typedef struct TimingWheel {
+    unsigned long long now;
+
+    /* Bit s of occupied[l] is set when slots[l][s] has events */
+    uint64_t occupied[WHEEL_LEVELS];
+    WheelSlot slots[WHEEL_LEVELS][WHEEL_SLOTS];
+
+    /* Events that are due, ready to be taken */
+    WheelSlot due;
+
+    /* Every event lives in here, and unused ones are on the free list */
+    WheelEvent *events;
+    uint32_t num_events;
+    uint32_t free_events;
+} TimingWheel;
+
+
+void init_wheel(TimingWheel *wheel, unsigned long long now);
+void free_wheel(TimingWheel *wheel);
+
+/* Schedule an event. Anything in the past is due now. */
+void schedule_event(TimingWheel *wheel, unsigned long long time, uint8_t kind, uint8_t arg, uint32_t target, int value);
+
+/*
+  Take the next event due no later than `until`, in time order.
+  Returns 0 once there are none, with the wheel's time moved up to
+  `until`: nothing may be scheduled before it from then on.
+ */
+int next_event(TimingWheel *wheel, unsigned long long until, WheelEvent *event);
+
+/* When the next event is due, or ULLONG_MAX if there are none */
+unsigned long long wheel_due(TimingWheel *wheel);
+
+#endif
@@ -0,0 +1,84 @@
+/* Copyright (C) 2013 Calvin Beck
+
+  Permission is hereby granted, free of charge, to any person
+  obtaining a copy of this software and associated documentation files
+  (the "Software"), to deal in the Software without restriction,
+  including without limitation the rights to use, copy, modify, merge,
+  publish, distribute, sublicense, and/or sell copies of the Software,
+  and to permit persons to whom the Software is furnished to do so,
+  subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be
+  included in all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+  EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+  MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+  NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+  BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+  ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+  CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+  SOFTWARE.
+
+*/
+
+/*
+  Leader election round a ring. Every node takes its number from its
+  name (arduino_net runs node3 as "node3"), and passes the smallest
+  number it has heard on over Serial1, which reaches both of its
+  neighbours. A node that hears nothing smaller than its own number
+  for a second says it's the leader, and drives pin 13 HIGH.
+ */
+
+#include <Arduino.h>
+#include <errno.h>
+#include <stdlib.h>
+
+uint8_t number;
+uint8_t smallest;
+unsigned long changed;
+int leading = 0;
+
+
+void setup() {
+    Serial.begin(9600);
+    Serial1.begin(9600);
+
+    pinMode(13, OUTPUT);
+    digitalWrite(13, LOW);
+
+    const char *digits = program_invocation_short_name;
+
+    while ('\0' != *digits && (*digits < '0' || *digits > '9')) {
+        ++digits;
+    }
+
+    number = atoi(digits);
+    smallest = number;
+    changed = millis();
+
+    Serial1.write(number);
+}
+
+
+void loop() {
+    while (Serial1.available()) {
+        uint8_t heard = Serial1.read();
+
+        if (heard < smallest) {
+            smallest = heard;
+            changed = millis();
+
+            Serial1.write(smallest);
+        }
+    }
+
+    if (!leading && smallest == number && millis() - changed > 1000) {
+        leading = 1;
+
+        Serial.println("leader");
+        digitalWrite(13, HIGH);
+    }
+
+    delay(10);
+}
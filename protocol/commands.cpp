@@ -25,51 +25,124 @@
 #include "commands.h"
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <unistd.h>
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
 
 
-char receive_char(int fd) {
-    char value = 0;
-    ssize_t bytes_read = 0;
+/*
+  Read exactly `length` bytes. The server closing its end means the
+  run is over, and an Arduino without a server has nothing left to do.
+ */
+static void receive_all(int fd, void *buffer, size_t length) {
+    size_t total_read = 0;
+    char *bytes = (char *) buffer;
 
-    while (bytes_read != 1) {
-        bytes_read = read(fd, &value, sizeof(value));
+    while (total_read < length) {
+        ssize_t bytes_read = read(fd, bytes + total_read, length - total_read);
+
+        if (bytes_read > 0) {
+            total_read += bytes_read;
+        }
+        else if (0 == bytes_read) {
+            exit(EXIT_SUCCESS);
+        }
+        else if (EINTR != errno) {
+            perror("Could not read from the server");
+            exit(EXIT_FAILURE);
+        }
     }
+}
+
+
+char receive_char(int fd) {
+    char value = 0;
+    receive_all(fd, &value, sizeof(value));
 
     return value;
 }
 
 int receive_int(int fd) {
-    int total_read = 0;
     int value = 0;
-    char *int_buff = (char *) &value;
-
-    while (total_read < sizeof(value)) {
-        ssize_t bytes_read = read(fd, int_buff, sizeof(value) - total_read);
-
-        if (bytes_read > 0) {
-            int_buff += bytes_read;
-            total_read += bytes_read;
-        }
-    }
+    receive_all(fd, &value, sizeof(value));
 
     return value;
 }
 
 
 long receive_long(int fd) {
-    int total_read = 0;
     long value = 0;
-    char *long_buff = (char *) &value;
+    receive_all(fd, &value, sizeof(value));
 
-    while (total_read < sizeof(value)) {
-        ssize_t bytes_read = read(fd, long_buff, sizeof(value) - total_read);
+    return value;
+}
 
-        if (bytes_read > 0) {
-            long_buff += bytes_read;
-            total_read += bytes_read;
+
+void receive_bytes(int fd, void *buffer, size_t length) {
+    receive_all(fd, buffer, length);
+}
+
+
+HeapStats *share_heap_stats(int *fd) {
+    FILE *file = tmpfile();
+
+    if (NULL == file) {
+        perror("Could not create the String heap figures");
+        exit(EXIT_FAILURE);
+    }
+
+    /* A dup doesn't inherit close on exec, and outlives the FILE */
+    *fd = dup(fileno(file));
+    fclose(file);
+
+    if (-1 == *fd || -1 == ftruncate(*fd, sizeof(HeapStats))) {
+        perror("Could not create the String heap figures");
+        exit(EXIT_FAILURE);
+    }
+
+    void *stats = mmap(NULL, sizeof(HeapStats), PROT_READ | PROT_WRITE, MAP_SHARED, *fd, 0);
+
+    if (MAP_FAILED == stats) {
+        perror("Could not map the String heap figures");
+        exit(EXIT_FAILURE);
+    }
+
+    return (HeapStats *)stats;
+}
+
+
+void print_heap_stats(const char *name, const HeapStats *stats) {
+    if (0 == stats->peak) {
+        return;
+    }
+
+    /* Fragmentation shows up as a largest block well short of the free space */
+    fprintf(stderr, "String heap for %s: peak %u of %u bytes, %u free in %u blocks at the end (largest %u), %u failed allocations\n",
+            name, stats->peak, stats->size, stats->size - stats->used, stats->free_blocks, stats->largest_free, stats->failures);
+}
+
+
+int stop_arduino(pid_t pid) {
+    int status = 0;
+    kill(pid, SIGTERM);
+
+    /* Give it a second, in steps of 1ms, since most are gone after the first */
+    struct timespec step = {0, 1000000};
+
+    for (int i = 0; i < 1000; ++i) {
+        if (0 != waitpid(pid, &status, WNOHANG)) {
+            return status;
         }
+
+        nanosleep(&step, NULL);
     }
 
-    return value;
+    kill(pid, SIGKILL);
+    waitpid(pid, &status, 0);
+
+    return status;
 }
@@ -27,6 +27,7 @@
 
 #include <stdio.h>
 #include <stdint.h>
+#include <sys/types.h>
 
 /*
   This file specifies some of the command codes for the EmulArd
@@ -46,18 +47,114 @@ static const uint8_t DIGITAL_READ = 7;
 static const uint8_t ANALOG_WRITE = 8;
 static const uint8_t ANALOG_READ = 9;
 static const uint8_t PIN_MODE = 10;
+static const uint8_t LOOP = 11;
+static const uint8_t DELAY = 12;
+static const uint8_t MICROS = 13;
+static const uint8_t ATTACH_INTERRUPT = 14;
+static const uint8_t DETACH_INTERRUPT = 15;
+static const uint8_t WIRE_BEGIN = 16;
+static const uint8_t WIRE_TRANSMIT = 17;
+static const uint8_t WIRE_REQUEST = 18;
+static const uint8_t WIRE_TAKE = 19;
+static const uint8_t WIRE_RESPOND = 20;
+static const uint8_t SPI_TRANSFER = 21;
+static const uint8_t SOFT_SERIAL_BEGIN = 22;
+static const uint8_t SOFT_SERIAL_LISTEN = 23;
+static const uint8_t SOFT_SERIAL_WRITE = 24;
+static const uint8_t REGISTER_READ = 25;
+static const uint8_t REGISTER_WRITE = 26;
+static const uint8_t SERIAL_READ_BYTES = 27;
+static const uint8_t SYNC = 28;
+
+/* Interrupt modes, the same values as Arduino.h's CHANGE, FALLING and RISING */
+static const uint8_t INTERRUPT_CHANGE = 1;
+static const uint8_t INTERRUPT_FALLING = 2;
+static const uint8_t INTERRUPT_RISING = 3;
+
+/* Events after the pin numbers on the event pipe, for Wire targets */
+static const uint8_t EVENT_WIRE_RECEIVE = 0xFE;
+static const uint8_t EVENT_WIRE_REQUEST = 0xFF;
+
+/* Wire transmission statuses, the same as endTransmission's */
+static const uint8_t WIRE_SUCCESS = 0;
+static const uint8_t WIRE_NACK_ADDRESS = 2;
+static const uint8_t WIRE_NACK_DATA = 3;
+
+/* Port registers, for REGISTER_READ and REGISTER_WRITE */
+static const uint8_t REGISTER_PIN = 0;
+static const uint8_t REGISTER_DDR = 1;
+static const uint8_t REGISTER_PORT = 2;
+
+/* Pin modes, the same values as Arduino.h's INPUT, OUTPUT and INPUT_PULLUP */
+static const uint8_t MODE_INPUT = 0;
+static const uint8_t MODE_OUTPUT = 1;
+static const uint8_t MODE_INPUT_PULLUP = 2;
+
+/*
+  EEPROM files, shared by the sketch and the network: EEPROM_SIZE
+  bytes, and a uint32_t count of the writes to each byte in the file
+  of the same name with EEPROM_WEAR_SUFFIX on the end.
+ */
+static const size_t EEPROM_SIZE = 4096;
+static const char EEPROM_WEAR_SUFFIX[] = ".wear";
+
+/*
+  The sketch's String heap figures. The launcher maps one of these from
+  a file it passes down as EMULARD_HEAP_FD, and the sketch keeps it up
+  to date, so it can be reported after the sketch is killed.
+ */
+typedef struct HeapStats {
+    uint32_t size;
+    uint32_t used;
+    uint32_t peak;
+    uint32_t free_blocks;
+    uint32_t largest_free;
+    uint32_t failures;
+} HeapStats;
 
 /*
   Macros for commands and sending variables over. Need the `::`
   because of the Serial.write() functions that also use these.
+  ARDUINO_SEND_BYTES always sends a whole command, starting with its
+  identifier.
  */
+#ifdef EMULARD_DIRECT
+
+/*
+  Direct builds run the sketch and its server in the same process
+  (server/fuzz_main.cpp), so commands and answers are handed over in
+  memory instead of going through pipes. A command is run once the
+  next one starts, or once the sketch waits on an answer.
+ */
+void direct_command(const void *buffer, size_t length);
+void direct_send(const void *buffer, size_t length);
+void direct_receive(void *buffer, size_t length);
+ssize_t direct_answer(int fd, const void *buffer, size_t length);
+
+#define ARDUINO_COMMAND(var) direct_command(&var, sizeof(var))
+#define ARDUINO_SEND(var) direct_send(&var, sizeof(var))
+#define ARDUINO_SEND_BYTES(buffer, length) direct_command(buffer, length)
+#define ARDUINO_RECEIVE(var) direct_receive(&var, sizeof(var))
+#define ARDUINO_RECEIVE_BYTES(buffer, length) direct_receive(buffer, length)
+#define FD_SEND(fd, var) direct_answer(fd, &var, sizeof(var))
+#define FD_SEND_BYTES(fd, buffer, length) direct_answer(fd, buffer, length)
+
+#else
+
 #define ARDUINO_COMMAND(var) ::write(STDOUT_FILENO, &var, sizeof(var))
 #define ARDUINO_SEND(var) ::write(STDOUT_FILENO, &var, sizeof(var))
+#define ARDUINO_SEND_BYTES(buffer, length) ::write(STDOUT_FILENO, buffer, length)
+#define ARDUINO_RECEIVE(var) receive_bytes(STDIN_FILENO, &var, sizeof(var))
+#define ARDUINO_RECEIVE_BYTES(buffer, length) receive_bytes(STDIN_FILENO, buffer, length)
 #define FD_SEND(fd, var) ::write(fd, &var, sizeof(var))
+#define FD_SEND_BYTES(fd, buffer, length) ::write(fd, buffer, length)
+
+#endif
 
 
 /*
-  Function to read a character from a file descriptor.
+  Function to read a character from a file descriptor. These all exit
+  if the other end has been closed.
  */
 
 char receive_char(int fd);
@@ -74,4 +171,32 @@ int receive_int(int fd);
 
 long receive_long(int fd);
 
+/*
+  Function to read `length` bytes from a file descriptor.
+*/
+
+void receive_bytes(int fd, void *buffer, size_t length);
+
+/*
+  Function to make a zeroed HeapStats that a child can share through
+  the file descriptor stored in `fd`, which stays open across exec.
+*/
+
+HeapStats *share_heap_stats(int *fd);
+
+/*
+  Function to print a child's String heap figures to stderr, if it
+  used the heap at all.
+*/
+
+void print_heap_stats(const char *name, const HeapStats *stats);
+
+/*
+  Function to stop a child and reap it. It gets SIGTERM and a moment
+  to finish up (profiling builds write their report), then SIGKILL.
+  Returns its wait status.
+*/
+
+int stop_arduino(pid_t pid);
+
 #endif
@@ -0,0 +1,313 @@
+/* Copyright (C) 2013 Calvin Beck
+
+  Permission is hereby granted, free of charge, to any person
+  obtaining a copy of this software and associated documentation files
+  (the "Software"), to deal in the Software without restriction,
+  including without limitation the rights to use, copy, modify, merge,
+  publish, distribute, sublicense, and/or sell copies of the Software,
+  and to permit persons to whom the Software is furnished to do so,
+  subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be
+  included in all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+  EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+  MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+  NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+  BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+  ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+  CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+  SOFTWARE.
+
+*/
+
+#ifndef BUSES_H
+#define BUSES_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+
+/*
+  Device models for the Wire (I2C) and SPI buses. Arduinos send whole
+  transactions to the server, so a model only ever sees complete
+  writes, reads, and transfers, never the bits on the wire.
+ */
+class DeviceModel {
+ public:
+    virtual ~DeviceModel() {}
+
+    /* I2C: the master wrote `length` bytes. Returns 0, or 3 to NACK the data. */
+    virtual int receive(const uint8_t *data, size_t length) {
+        return 0;
+    }
+
+    /* I2C: the master asked for `length` bytes. Returns how many it gets. */
+    virtual size_t request(uint8_t *data, size_t length) {
+        return 0;
+    }
+
+    /* SPI: `data` is shifted out, and replaced with what comes back */
+    virtual void transfer(uint8_t *data, size_t length) {
+        memset(data, 0xFF, length);
+    }
+
+    /* SPI: chip select went HIGH, which ends the transaction */
+    virtual void deselect() {
+    }
+};
+
+
+/*
+  A serial EEPROM, like a 24LC256 on I2C or a 25LC256 on SPI. Memory
+  starts erased (0xFF), and is addressed with two bytes, or one for
+  parts of 256 bytes or less. Reads and writes both carry on from
+  where the last one left off, wrapping at the end of memory.
+ */
+class EepromModel : public DeviceModel {
+ private:
+    /* SPI instructions */
+    static const uint8_t WRITE = 0x02;
+    static const uint8_t READ = 0x03;
+    static const uint8_t WRDI = 0x04;
+    static const uint8_t RDSR = 0x05;
+    static const uint8_t WREN = 0x06;
+
+    uint8_t *memory;
+    size_t size;
+    size_t pointer;
+    int address_bytes;
+
+    /* SPI transaction state */
+    uint8_t instruction;
+    int address_left;
+    int write_enabled;
+    int wrote;
+
+ public:
+    EepromModel(size_t size) {
+        this->size = size;
+        memory = (uint8_t *)malloc(size);
+
+        if (NULL == memory) {
+            perror("Could not allocate EEPROM");
+            exit(EXIT_FAILURE);
+        }
+
+        memset(memory, 0xFF, size);
+        pointer = 0;
+        address_bytes = size > 256 ? 2 : 1;
+
+        instruction = 0;
+        address_left = 0;
+        write_enabled = 0;
+        wrote = 0;
+    }
+
+    ~EepromModel() {
+        free(memory);
+    }
+
+    int receive(const uint8_t *data, size_t length) {
+        size_t k = 0;
+
+        if (length > 0) {
+            pointer = 0;
+        }
+
+        for (; k < length && k < (size_t)address_bytes; ++k) {
+            pointer = (pointer << 8) | data[k];
+        }
+
+        pointer %= size;
+
+        for (; k < length; ++k) {
+            memory[pointer] = data[k];
+            pointer = (pointer + 1) % size;
+        }
+
+        return 0;
+    }
+
+    size_t request(uint8_t *data, size_t length) {
+        for (size_t k = 0; k < length; ++k) {
+            data[k] = memory[pointer];
+            pointer = (pointer + 1) % size;
+        }
+
+        return length;
+    }
+
+    void transfer(uint8_t *data, size_t length) {
+        for (size_t k = 0; k < length; ++k) {
+            uint8_t in = data[k];
+            data[k] = 0xFF;
+
+            if (0 == instruction) {
+                instruction = in;
+                address_left = address_bytes;
+                pointer = 0;
+
+                if (WREN == instruction) {
+                    write_enabled = 1;
+                }
+                else if (WRDI == instruction) {
+                    write_enabled = 0;
+                }
+            }
+            else if ((READ == instruction || WRITE == instruction) && address_left > 0) {
+                pointer = ((pointer << 8) | in) % size;
+                --address_left;
+            }
+            else if (READ == instruction) {
+                data[k] = memory[pointer];
+                pointer = (pointer + 1) % size;
+            }
+            else if (WRITE == instruction && write_enabled) {
+                memory[pointer] = in;
+                pointer = (pointer + 1) % size;
+                wrote = 1;
+            }
+            else if (RDSR == instruction) {
+                data[k] = write_enabled ? 0x02 : 0x00;
+            }
+        }
+    }
+
+    void deselect() {
+        /* Like the real thing, finishing a write clears the write enable latch */
+        if (wrote) {
+            write_enabled = 0;
+        }
+
+        instruction = 0;
+        wrote = 0;
+    }
+};
+
+
+/*
+  A register-mapped sensor: 256 byte registers, with a register
+  pointer that moves along as they are read or written. On I2C the
+  first byte written sets the pointer. On SPI the first byte is the
+  register, with the top bit set for a read.
+ */
+class SensorModel : public DeviceModel {
+ private:
+    uint8_t pointer;
+
+    /* SPI transaction state */
+    int started;
+    int reading;
+
+ public:
+    uint8_t registers[256];
+
+    SensorModel() {
+        memset(registers, 0, sizeof(registers));
+        pointer = 0;
+        started = 0;
+        reading = 0;
+    }
+
+    int receive(const uint8_t *data, size_t length) {
+        if (length > 0) {
+            pointer = data[0];
+        }
+
+        for (size_t k = 1; k < length; ++k) {
+            registers[pointer++] = data[k];
+        }
+
+        return 0;
+    }
+
+    size_t request(uint8_t *data, size_t length) {
+        for (size_t k = 0; k < length; ++k) {
+            data[k] = registers[pointer++];
+        }
+
+        return length;
+    }
+
+    void transfer(uint8_t *data, size_t length) {
+        for (size_t k = 0; k < length; ++k) {
+            uint8_t in = data[k];
+            data[k] = 0xFF;
+
+            if (!started) {
+                started = 1;
+                reading = in & 0x80;
+                pointer = in & 0x7F;
+            }
+            else if (reading) {
+                data[k] = registers[pointer++];
+            }
+            else {
+                registers[pointer++] = in;
+            }
+        }
+    }
+
+    void deselect() {
+        started = 0;
+    }
+};
+
+
+class ArduinoMega;
+
+/* An I2C bus: whatever answers at each address */
+class I2CBus {
+ public:
+    static const int NUM_ADDRESSES = 128;
+
+    DeviceModel *devices[NUM_ADDRESSES];
+    ArduinoMega *targets[NUM_ADDRESSES];  /* Arduinos that called Wire.begin(address) */
+
+    I2CBus() {
+        for (int address = 0; address < NUM_ADDRESSES; ++address) {
+            devices[address] = NULL;
+            targets[address] = NULL;
+        }
+    }
+};
+
+
+/* The devices on one Arduino's SPI pins, and the pins that select them */
+class SPIBus {
+ public:
+    DeviceModel **devices;
+    uint8_t *select_pins;
+    int num_devices;
+
+    SPIBus() {
+        devices = NULL;
+        select_pins = NULL;
+        num_devices = 0;
+    }
+
+    ~SPIBus() {
+        free(devices);
+        free(select_pins);
+    }
+
+    void add(DeviceModel *device, uint8_t select_pin) {
+        devices = (DeviceModel **)realloc(devices, sizeof(devices[0]) * (num_devices + 1));
+        select_pins = (uint8_t *)realloc(select_pins, sizeof(select_pins[0]) * (num_devices + 1));
+
+        if (NULL == devices || NULL == select_pins) {
+            perror("Could not add SPI device");
+            exit(EXIT_FAILURE);
+        }
+
+        devices[num_devices] = device;
+        select_pins[num_devices] = select_pin;
+        ++num_devices;
+    }
+};
+
+#endif
@@ -28,9 +28,40 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <time.h>
+#include <string.h>
+#include <errno.h>
 
 #include <emulard/protocol/commands.h>
 
+#include "buses.h"
+#include "waveform.h"
+
+
+/*
+  The Mega's pins on each I/O port, A to L (there's no port I), from
+  bit 0 up. NO_PIN is a bit without a pin.
+ */
+static const uint8_t NO_PIN = 0xFF;
+static const int NUM_IO_PORTS = 12;
+
+static const uint8_t IO_PORT_PINS[NUM_IO_PORTS][8] = {
+    {22, 23, 24, 25, 26, 27, 28, 29},                           /* A */
+    {53, 52, 51, 50, 10, 11, 12, 13},                           /* B */
+    {37, 36, 35, 34, 33, 32, 31, 30},                           /* C */
+    {21, 20, 19, 18, NO_PIN, NO_PIN, NO_PIN, 38},               /* D */
+    {0, 1, NO_PIN, 5, 2, 3, NO_PIN, NO_PIN},                    /* E */
+    {54, 55, 56, 57, 58, 59, 60, 61},                           /* F */
+    {41, 40, 39, NO_PIN, NO_PIN, 4, NO_PIN, NO_PIN},            /* G */
+    {17, 16, NO_PIN, 6, 7, 8, 9, NO_PIN},                       /* H */
+    {NO_PIN, NO_PIN, NO_PIN, NO_PIN, NO_PIN, NO_PIN, NO_PIN, NO_PIN},  /* I */
+    {15, 14, NO_PIN, NO_PIN, NO_PIN, NO_PIN, NO_PIN, NO_PIN},   /* J */
+    {62, 63, 64, 65, 66, 67, 68, 69},                           /* K */
+    {49, 48, 47, 46, 45, 44, 43, 42}                            /* L */
+};
+
 
 /*
   Need a circular buffer for the serial ports.
@@ -41,21 +72,29 @@ class SerialBuffer {
 
     size_t start;
     size_t end;
+    size_t count;
 
  public:
+    /* Total number of bytes ever appended */
+    unsigned long appended;
+
     SerialBuffer() {
         start = 0;
         end = 0;
+        count = 0;
+        appended = 0;
     }
 
     int available() {
-        return abs(start - end);
+        return count;
     }
 
     int append(uint8_t value) {
-        if (this->available() < sizeof(serial_buffer)) {
+        if (count < sizeof(serial_buffer)) {
             serial_buffer[end] = value;
             end = (end + 1) % sizeof(serial_buffer);
+            ++count;
+            ++appended;
 
             return 0;
         }
@@ -79,9 +118,23 @@ class SerialBuffer {
 
         uint8_t value = serial_buffer[start];
         start = (start + 1) % sizeof(serial_buffer);
+        --count;
 
         return value;
     }
+
+    /* Fold what's waiting to be read into an FNV-1a hash */
+    uint64_t fold(uint64_t hash) {
+        for (size_t i = 0; i < count; ++i) {
+            hash ^= serial_buffer[(start + i) % sizeof(serial_buffer)];
+            hash *= 0x100000001B3ULL;
+        }
+
+        hash ^= count;
+        hash *= 0x100000001B3ULL;
+
+        return hash;
+    }
 };
 
 
@@ -94,33 +147,414 @@ class SerialBuffer {
 
 class ArduinoMega {
  public:
+    static const int NUM_PINS = 70;
+    static const int NUM_SERIAL = 4;
+    static const int NUM_SOFT_SERIAL = 4;
+    static const int NUM_PORTS = NUM_SERIAL + NUM_SOFT_SERIAL;
+
     /* Pins - analog and digital are in the same array */
-    int pins[70];
-    uint8_t pin_modes[70];
+    int pins[NUM_PINS];
+    uint8_t pin_modes[NUM_PINS];
+
+    /*
+      What the sketch has written to each pin (the PORT register on
+      the real thing). A pin's level in `pins` comes from this and its
+      mode: an OUTPUT drives it, anything else with a HIGH written to
+      it is pulled up, and the rest float LOW.
+     */
+    int outputs[NUM_PINS];
+
+    /* What a pin puts on the wire */
+    static const int DRIVE_NONE = 0;
+    static const int DRIVE_PULLUP = 1;
+    static const int DRIVE_LOW = 2;
+    static const int DRIVE_HIGH = 3;
+
+    /*
+      Pins wired to other Arduinos are in a net, and their levels are
+      set by the network instead. When one of their drives changes the
+      pin is queued in drive_changes for the network to look at.
+     */
+    uint8_t netted[NUM_PINS];
+    uint8_t drive_queued[NUM_PINS];
+    uint8_t drive_changes[NUM_PINS];
+    int num_drive_changes;
+
+    /* What analog pin i (pin 54 + i) plays when it's read, or NULL to read its level */
+    Waveform *waveforms[16];
 
     /* Serial buffers for the different ports */
-    SerialBuffer *serial_out[4];
-    SerialBuffer *serial_in[4];
-    unsigned long serial_baud[4];
+    SerialBuffer *serial_out[NUM_SERIAL];
+    SerialBuffer *serial_in[NUM_PORTS];  /* The hardware ports, then the SoftwareSerial ones */
+    unsigned long serial_baud[NUM_SERIAL];
+
+    /*
+      SoftwareSerial ports. Port k is serial port NUM_SERIAL + k to the
+      read commands, and receives on pin soft_rx[k] and sends on pin
+      soft_tx[k]. Like the real thing only one of them (soft_listening,
+      or -1) takes in bytes. A byte written on a TX pin that is in a
+      net waits in soft_pending_port (-1 if there isn't one) for the
+      network to pass it along and answer the write.
+     */
+    uint8_t soft_rx[NUM_SOFT_SERIAL];
+    uint8_t soft_tx[NUM_SOFT_SERIAL];
+    int num_soft_serial;
+    int soft_listening;
+    int soft_pending_port;
+    uint8_t soft_pending_value;
 
     /* Pipes for talking to the Arduino process */
     int to_arduino;
     int from_arduino;
 
-    ArduinoMega(int to, int from) {
+    /*
+      Pipe for pushing interrupts to the Arduino process (or -1). Each
+      event is the number of the pin that triggered it.
+     */
+    int events;
+
+    /* Interrupt mode for each pin, 0 if there is no interrupt attached */
+    uint8_t interrupt_modes[NUM_PINS];
+    int num_interrupts;
+
+    /* Pins the sketch has read, itself or through a PIN register */
+    uint8_t pins_read[NUM_PINS];
+
+    /*
+      Virtual time. Every command costs COMMAND_MICROS (about what a
+      digitalRead takes on the real thing), and delays add their
+      length, so sketches that spin on millis() still see time move.
+     */
+    static const unsigned long long COMMAND_MICROS = 4;
+    unsigned long long virtual_micros;
+
+    /* Number of times loop() has finished */
+    unsigned long loops;
+
+    /* Set when virtual_micros is the only clock (headless runs) */
+    int virtual_clock;
+
+    /*
+      Set while the sketch waits on a SYNC. It's answered once the rest
+      of the network has caught up to virtual_micros, so that every
+      interrupt up to then is already in the event pipe.
+     */
+    int syncing;
+
+    /*
+      Everything the sketch has been told since it started: an FNV-1a
+      hash of its answers and events, and how many answers there were.
+      A sketch only learns anything through these, so two runs that
+      have told it the same things have it in the same state.
+     */
+    uint64_t told;
+    unsigned long answers;
+
+    /*
+      Idle detection. An Arduino that has made more than idle_reads
+      reads in a row, all returning what they did last time, with no
+      writes in between, is spinning. The next read that would return
+      the same thing again isn't answered: the Arduino is parked, and
+      only gets its answer from wake() once one of its inputs changes
+      or IDLE_TIMEOUT microseconds go by.
+     */
+    static const int IDLE_READS = 100;
+    static const unsigned long long IDLE_TIMEOUT = 1000;
+    static const int READ_SLOTS = NUM_PINS + 16 + 3 * NUM_PORTS + NUM_IO_PORTS;
+
+    int idle_reads;  /* 0 never parks */
+    int read_streak;
+    int read_cache[READ_SLOTS];
+
+    int parked;
+    uint8_t parked_command;
+    unsigned int parked_argument;
+    unsigned long parked_inputs;
+    unsigned long long parked_at;
+    int parked_at_set;
+
+    /* Number of times a pin has been changed by set_pin */
+    unsigned long pin_changes;
+
+    /*
+      Buses. wire_bus is the I2C bus this Arduino's Wire is on, and
+      spi_bus is the devices on its SPI pins (either may be NULL). An
+      Arduino that has called Wire.begin(address) is a target:
+      transmissions to it wait in wire_inbox (each one a length byte
+      and then the data) until it takes them, and a request from
+      another Arduino waits in wire_requester until it responds, with
+      the requester's wire_waiting set.
+     */
+    I2CBus *wire_bus;
+    SPIBus *spi_bus;
+    int wire_address;
+
+    uint8_t *wire_inbox;
+    size_t inbox_start;
+    size_t inbox_end;
+    size_t inbox_size;
+
+    ArduinoMega *wire_requester;
+    uint8_t wire_quantity;
+    int wire_waiting;
+
+    /* Number of bus events pushed to this Arduino */
+    unsigned long bus_events;
+
+    /*
+      Commands are read from the Arduino in bulk, so a burst of them
+      costs one read instead of one per field.
+     */
+    static const size_t INPUT_BUFFER = 4096;
+    uint8_t input[INPUT_BUFFER];
+    size_t input_start;
+    size_t input_end;
+
+    ArduinoMega(int to, int from, int events = -1) {
         this->to_arduino = to;
         this->from_arduino = from;
+        this->events = events;
+
+        /* Never wait on an Arduino that isn't taking its interrupts */
+        if (-1 != events) {
+            fcntl(events, F_SETFL, fcntl(events, F_GETFL) | O_NONBLOCK);
+        }
+
+        virtual_micros = 0;
+        loops = 0;
+        virtual_clock = 0;
+        syncing = 0;
+
+        told = 0xCBF29CE484222325ULL;
+        answers = 0;
+
+        input_start = 0;
+        input_end = 0;
+        dead = 0;
 
-        for (int port = 0; port < 4; ++port) {
+        idle_reads = IDLE_READS;
+        read_streak = 0;
+        parked = 0;
+        pin_changes = 0;
+        num_drive_changes = 0;
+
+        wire_bus = NULL;
+        spi_bus = NULL;
+        wire_address = -1;
+
+        wire_inbox = NULL;
+        inbox_start = 0;
+        inbox_end = 0;
+        inbox_size = 0;
+
+        wire_requester = NULL;
+        wire_quantity = 0;
+        wire_waiting = 0;
+        bus_events = 0;
+
+        num_soft_serial = 0;
+        soft_listening = -1;
+        soft_pending_port = -1;
+
+        for (int slot = 0; slot < READ_SLOTS; ++slot) {
+            read_cache[slot] = INT_MIN;
+        }
+
+        num_interrupts = 0;
+
+        for (int pin = 0; pin < NUM_PINS; ++pin) {
+            pins[pin] = 0;
+            pin_modes[pin] = MODE_INPUT;
+            outputs[pin] = 0;
+            netted[pin] = 0;
+            drive_queued[pin] = 0;
+            interrupt_modes[pin] = 0;
+            pins_read[pin] = 0;
+        }
+
+        for (int channel = 0; channel < 16; ++channel) {
+            waveforms[channel] = NULL;
+        }
+
+        for (int port = 0; port < NUM_SERIAL; ++port) {
             serial_out[port] = new SerialBuffer();
+            serial_baud[port] = 0;
+        }
+
+        for (int port = 0; port < NUM_PORTS; ++port) {
             serial_in[port] = new SerialBuffer();
         }
     }
 
+    ~ArduinoMega() {
+        for (int port = 0; port < NUM_SERIAL; ++port) {
+            delete serial_out[port];
+        }
+
+        for (int port = 0; port < NUM_PORTS; ++port) {
+            delete serial_in[port];
+        }
+
+        free(wire_inbox);
+    }
+
+    /*
+      Let go of everything the rest of the network could be waiting on
+      this Arduino for, once it's dead: an Arduino that asked it for
+      Wire bytes gets none, and it's no longer a Wire target.
+     */
+    void let_go() {
+        if (NULL != wire_requester) {
+            wire_requester->wire_reply(NULL, 0);
+            wire_requester->wire_waiting = 0;
+            wire_requester = NULL;
+        }
+
+        for (int address = 0; NULL != wire_bus && address < I2CBus::NUM_ADDRESSES; ++address) {
+            ArduinoMega *target = wire_bus->targets[address];
+
+            if (this == target) {
+                wire_bus->targets[address] = NULL;
+            }
+            else if (NULL != target && this == target->wire_requester) {
+                target->wire_requester = NULL;
+            }
+        }
+
+        wire_address = -1;
+        wire_waiting = 0;
+        soft_pending_port = -1;
+        parked = 0;
+        syncing = 0;
+    }
+
+    /*
+      Start over on new pipes to a new process, as if the board had
+      been reset: whatever the sketch set up is gone, and only its time
+      and loop count carry on.
+     */
+    void restart(int to, int from, int events) {
+        let_go();
+
+        this->to_arduino = to;
+        this->from_arduino = from;
+        this->events = events;
+
+        if (-1 != events) {
+            fcntl(events, F_SETFL, fcntl(events, F_GETFL) | O_NONBLOCK);
+        }
+
+        input_start = 0;
+        input_end = 0;
+        dead = 0;
+        read_streak = 0;
+
+        told = 0xCBF29CE484222325ULL;
+        answers = 0;
+
+        inbox_start = 0;
+        inbox_end = 0;
+
+        num_soft_serial = 0;
+        soft_listening = -1;
+
+        for (int slot = 0; slot < READ_SLOTS; ++slot) {
+            read_cache[slot] = INT_MIN;
+        }
+
+        for (int port = 0; port < NUM_SERIAL; ++port) {
+            *serial_out[port] = SerialBuffer();
+            serial_baud[port] = 0;
+        }
+
+        for (int port = 0; port < NUM_PORTS; ++port) {
+            *serial_in[port] = SerialBuffer();
+        }
+
+        num_interrupts = 0;
+
+        /* Every pin floats again, and its net hears about it */
+        for (int pin = 0; pin < NUM_PINS; ++pin) {
+            pin_modes[pin] = MODE_INPUT;
+            outputs[pin] = 0;
+            interrupt_modes[pin] = 0;
+            pins_read[pin] = 0;
+
+            drive_changed(pin);
+        }
+    }
+
+    /*
+      Set once the Arduino's end of its pipe has closed -- it exited or
+      crashed -- so nothing more will come from it. Whatever it was in
+      the middle of reads as zeroes.
+     */
+    int dead;
+
+    /* Commands that have been read but not run yet */
+    int buffered() {
+        return input_end > input_start;
+    }
+
+    /* Block until at least `length` bytes are buffered. Returns 0 if the Arduino is dead. */
+    int fill_input(size_t length) {
+        if (input_start + length > INPUT_BUFFER) {
+            memmove(input, input + input_start, input_end - input_start);
+            input_end -= input_start;
+            input_start = 0;
+        }
+
+        while (input_end - input_start < length) {
+            ssize_t bytes_read = dead ? 0 : ::read(from_arduino, input + input_end, INPUT_BUFFER - input_end);
+
+            if (bytes_read > 0) {
+                input_end += bytes_read;
+            }
+            else if (0 == bytes_read || EINTR != errno) {
+                dead = 1;
+                input_start = input_end;
+                return 0;
+            }
+        }
+
+        return 1;
+    }
+
+    void take(void *value, size_t length) {
+        if (!fill_input(length)) {
+            memset(value, 0, length);
+            return;
+        }
+
+        memcpy(value, input + input_start, length);
+        input_start += length;
+    }
+
+    char take_char() {
+        char value;
+        take(&value, sizeof(value));
+
+        return value;
+    }
+
+    int take_int() {
+        int value;
+        take(&value, sizeof(value));
+
+        return value;
+    }
+
+    long take_long() {
+        long value;
+        take(&value, sizeof(value));
+
+        return value;
+    }
+
     /* May be none-blocking */
     uint8_t run() {
         /* Read command for dispatching */
-        uint8_t command = receive_char(from_arduino);
+        uint8_t command = take_char();
 
         if (command) {
             /* Perform the appropriate action for the command */
@@ -155,7 +589,81 @@ class ArduinoMega {
             case PIN_MODE:
                 this->pin_mode();
                 break;
+            case LOOP:
+                ++loops;
+                break;
+            case DELAY:
+                this->delay();
+                break;
+            case MICROS:
+                this->micros();
+                break;
+            case ATTACH_INTERRUPT:
+                this->attach_interrupt();
+                break;
+            case DETACH_INTERRUPT:
+                this->detach_interrupt();
+                break;
+            case WIRE_BEGIN:
+                this->wire_begin();
+                break;
+            case WIRE_TRANSMIT:
+                this->wire_transmit();
+                break;
+            case WIRE_REQUEST:
+                this->wire_request();
+                break;
+            case WIRE_TAKE:
+                this->wire_take();
+                break;
+            case WIRE_RESPOND:
+                this->wire_respond();
+                break;
+            case SPI_TRANSFER:
+                this->spi_transfer();
+                break;
+            case SOFT_SERIAL_BEGIN:
+                this->soft_serial_begin();
+                break;
+            case SOFT_SERIAL_LISTEN:
+                this->soft_serial_listen();
+                break;
+            case SOFT_SERIAL_WRITE:
+                this->soft_serial_write();
+                break;
+            case REGISTER_READ:
+                this->register_read();
+                break;
+            case REGISTER_WRITE:
+                this->register_write();
+                break;
+            case SERIAL_READ_BYTES:
+                this->serial_read_bytes();
+                break;
+            case SYNC:
+                this->sync();
+                break;
+            default:
+                break;
+            }
+
+            virtual_micros += COMMAND_MICROS;
+
+            /* Anything but a read or waiting around breaks a streak */
+            switch (command) {
+            case SERIAL_READ:
+            case SERIAL_PEEK:
+            case SERIAL_AVAILABLE:
+            case DIGITAL_READ:
+            case ANALOG_READ:
+            case REGISTER_READ:
+            case SERIAL_READ_BYTES:
+            case LOOP:
+            case DELAY:
+            case SYNC:
+                break;
             default:
+                read_streak = 0;
                 break;
             }
         }
@@ -163,99 +671,770 @@ class ArduinoMega {
         return command;
     }
 
+    /* Changes to pins and serial input, for noticing that an input changed */
+    unsigned long input_changes() {
+        unsigned long changes = pin_changes + bus_events;
+
+        for (int port = 0; port < NUM_PORTS; ++port) {
+            changes += serial_in[port]->appended;
+        }
+
+        return changes;
+    }
+
+    /* What a read would return right now. Serial reads take the byte. */
+    int read_value(uint8_t command, unsigned int argument) {
+        switch (command) {
+        case SERIAL_READ:
+            return argument < NUM_PORTS ? serial_in[argument]->read() : -1;
+        case SERIAL_PEEK:
+            return argument < NUM_PORTS ? serial_in[argument]->peek() : -1;
+        case SERIAL_AVAILABLE:
+            return argument < NUM_PORTS ? serial_in[argument]->available() : -1;
+        case DIGITAL_READ:
+            if (argument >= NUM_PINS) {
+                return 0;
+            }
+
+            pins_read[argument] = 1;
+            return pins[argument] ? 1 : 0;
+        case ANALOG_READ:
+            if (argument >= 16) {
+                return 0;
+            }
+
+            pins_read[argument + 54] = 1;
+
+            /* A waveform is only worked out when it's read, and then the pin shows it */
+            if (NULL != waveforms[argument]) {
+                pins[argument + 54] = waveforms[argument]->sample(virtual_micros);
+            }
+
+            return pins[argument + 54];
+        case REGISTER_READ:
+            if (REGISTER_PIN == argument >> 8 && (argument & 0xFF) < NUM_IO_PORTS) {
+                for (int bit = 0; bit < 8; ++bit) {
+                    uint8_t pin = IO_PORT_PINS[argument & 0xFF][bit];
+
+                    if (NO_PIN != pin) {
+                        pins_read[pin] = 1;
+                    }
+                }
+            }
+
+            return read_register(argument >> 8, argument & 0xFF);
+        default:
+            return 0;
+        }
+    }
+
+    int read_slot(uint8_t command, unsigned int argument) {
+        switch (command) {
+        case DIGITAL_READ:
+            return argument < NUM_PINS ? argument : -1;
+        case ANALOG_READ:
+            /* A waveform changes by itself, so spinning on one isn't idle */
+            return argument < 16 && NULL == waveforms[argument] ? NUM_PINS + argument : -1;
+        case SERIAL_AVAILABLE:
+            return argument < NUM_PORTS ? NUM_PINS + 16 + argument : -1;
+        case SERIAL_PEEK:
+            return argument < NUM_PORTS ? NUM_PINS + 16 + NUM_PORTS + argument : -1;
+        case SERIAL_READ:
+            return argument < NUM_PORTS ? NUM_PINS + 16 + 2 * NUM_PORTS + argument : -1;
+        case REGISTER_READ:
+            /* Only PIN registers are inputs, DDR and PORT only change when the sketch says */
+            if (REGISTER_PIN == argument >> 8 && (argument & 0xFF) < NUM_IO_PORTS) {
+                return NUM_PINS + 16 + 3 * NUM_PORTS + (argument & 0xFF);
+            }
+
+            return -1;
+        default:
+            return -1;
+        }
+    }
+
+    /* Answer a read, or park the Arduino if it's just spinning */
+    void answer_read(uint8_t command, unsigned int argument) {
+        int value = read_value(command, argument);
+        int slot = read_slot(command, argument);
+
+        /* A serial read that got a byte changed something */
+        if (-1 == slot || (SERIAL_READ == command && -1 != value)) {
+            read_streak = 0;
+        }
+        else if (value != read_cache[slot]) {
+            read_cache[slot] = value;
+            read_streak = 0;
+        }
+        else if (idle_reads && ++read_streak > idle_reads) {
+            parked = 1;
+            parked_command = command;
+            parked_argument = argument;
+            parked_inputs = input_changes();
+
+            /* A virtual clock knows when this is, a real one finds out in wake() */
+            parked_at = virtual_micros;
+            parked_at_set = virtual_clock;
+
+            return;
+        }
+
+        answer(&value, sizeof(value));
+    }
+
+    /*
+      Give a parked Arduino its answer if its inputs changed, or it
+      has been parked for IDLE_TIMEOUT. `now` is in microseconds on
+      whatever clock the caller keeps -- the time of the first call
+      counts as when the Arduino was parked. With a virtual clock the
+      Arduino's time catches up to `now`, since it would have spent
+      that time spinning. Returns 1 if it woke up.
+     */
+    int wake(unsigned long long now) {
+        if (!parked) {
+            return 0;
+        }
+
+        if (!parked_at_set) {
+            parked_at = now;
+            parked_at_set = 1;
+        }
+
+        int changed = parked_inputs != input_changes();
+
+        if (!changed && now < parked_at + IDLE_TIMEOUT) {
+            return 0;
+        }
+
+        if (virtual_clock && virtual_micros < now) {
+            virtual_micros = now;
+        }
+
+        /* Still spinning if nothing changed, so the next same read parks again */
+        parked = 0;
+        read_streak = changed ? 0 : idle_reads;
+
+        int value = read_value(parked_command, parked_argument);
+        answer(&value, sizeof(value));
+
+        return 1;
+    }
+
+    /* When a parked Arduino is due to wake up, if nothing changes */
+    unsigned long long wake_deadline() {
+        return parked_at + IDLE_TIMEOUT;
+    }
+
+    /* Microseconds on the real clock, for wake() when time isn't virtual */
+    static unsigned long long real_micros() {
+        struct timespec time;
+        clock_gettime(CLOCK_MONOTONIC, &time);
+
+        return time.tv_sec * 1000000ULL + time.tv_nsec / 1000;
+    }
+
     void serial_begin() {
-        unsigned int port = receive_int(from_arduino);
-        unsigned long baud_rate = receive_long(from_arduino);
+        unsigned int port = take_int();
+        unsigned long baud_rate = take_long();
 
+#ifndef EMULARD_DIRECT
+        /* A direct build runs setup() for every input, and would say this every time */
         printf("Port: %u  --  Baud: %lu\n", port, baud_rate);
+#endif
 
-        serial_baud[port] = baud_rate;
+        if (port < NUM_SERIAL) {
+            serial_baud[port] = baud_rate;
+        }
     }
 
     void serial_write() {
-        unsigned int port = receive_int(from_arduino);
-        char value = receive_char(from_arduino);
+        unsigned int port = take_int();
+        char value = take_char();
 
-        serial_out[port]->append(value);
+        if (port < NUM_SERIAL) {
+            serial_out[port]->append(value);
+        }
     }
 
     void serial_read() {
-        unsigned int port = receive_int(from_arduino);
-        int value = -1;
+        unsigned int port = take_int();
 
-        value = serial_in[port]->read();
-        FD_SEND(to_arduino, value);
+        answer_read(SERIAL_READ, port);
     }
 
     void serial_peek() {
-        unsigned int port = receive_int(from_arduino);
-        int value = -1;
+        unsigned int port = take_int();
 
-        value = serial_in[port]->peek();
-        FD_SEND(to_arduino, value);
+        answer_read(SERIAL_PEEK, port);
     }
 
     void serial_available() {
-        unsigned int port = receive_int(from_arduino);
-        int available = -1;
+        unsigned int port = take_int();
 
-        available = serial_in[port]->available();
-        FD_SEND(to_arduino, available);
+        answer_read(SERIAL_AVAILABLE, port);
+    }
+
+    /* Up to `length` bytes that are there now, stopping after `terminator` */
+    void serial_read_bytes() {
+        unsigned int port = take_int();
+        uint8_t length = take_char();
+        int terminator = take_int();
+
+        uint8_t reply[1 + UINT8_MAX];
+        uint8_t count = 0;
+
+        while (port < NUM_PORTS && count < length && serial_in[port]->available()) {
+            int value = serial_in[port]->read();
+            reply[1 + count++] = value;
+
+            if (value == terminator) {
+                break;
+            }
+        }
+
+        if (count) {
+            read_streak = 0;
+        }
+
+        reply[0] = count;
+        answer(reply, 1 + count);
     }
 
     void digital_write() {
-        uint8_t pin = receive_char(from_arduino);
-        uint8_t value = receive_char(from_arduino);
+        uint8_t pin = take_char();
+        uint8_t value = take_char();
 
         if (pin >= sizeof(pins) / sizeof(pins[0])) {
             return;
         }
 
-        if (pin >= 54) {
-            pins[pin] = value ? 1023 : 0;
+        outputs[pin] = value ? high_level(pin) : 0;
+        drive_changed(pin);
+    }
+
+    void digital_read() {
+        uint8_t pin = take_char();
+
+        answer_read(DIGITAL_READ, pin);
+    }
+
+    void analog_write() {
+        uint8_t pin = take_char();
+        int value = take_int();
+
+        /* Like the real analogWrite, this makes the pin an OUTPUT */
+        if (pin < NUM_PINS) {
+            outputs[pin] = value;
+            pin_modes[pin] = MODE_OUTPUT;
+            drive_changed(pin);
+        }
+    }
+
+    void analog_read() {
+        uint8_t pin = take_char();
+
+        answer_read(ANALOG_READ, pin);
+    }
+
+    void delay() {
+        unsigned long length = take_long();
+
+        virtual_micros += length;
+    }
+
+    void micros() {
+        unsigned long value = virtual_micros;
+
+        answer(&value, sizeof(value));
+    }
+
+    /* A real clock has nobody to wait for, so only a virtual one holds the answer back */
+    void sync() {
+        if (virtual_clock) {
+            syncing = 1;
         }
         else {
-            pins[pin] = value ? 1 : 0;
+            answer_sync();
         }
     }
 
-    void digital_read() {
-        uint8_t pin = receive_char(from_arduino);
-        int value = 0;
+    void answer_sync() {
+        uint8_t done = 1;
+
+        syncing = 0;
+        answer(&done, sizeof(done));
+    }
 
-        if (pin < sizeof(pins) / sizeof(pins[0])) {
-            value = pins[pin] ? 1 : 0;
+    void attach_interrupt() {
+        uint8_t pin = take_char();
+        uint8_t mode = take_char();
+
+        if (pin < NUM_PINS) {
+            num_interrupts += (0 != mode) - (0 != interrupt_modes[pin]);
+            interrupt_modes[pin] = mode;
         }
+    }
+
+    void detach_interrupt() {
+        uint8_t pin = take_char();
 
-        FD_SEND(to_arduino, value);
+        if (pin < NUM_PINS) {
+            num_interrupts -= 0 != interrupt_modes[pin];
+            interrupt_modes[pin] = 0;
+        }
     }
 
-    void analog_write() {
-        uint8_t pin = receive_char(from_arduino);
-        int value = receive_int(from_arduino);
+    /* Whether a pin change can run one of the sketch's ISRs */
+    int listening() {
+        return 0 != num_interrupts && -1 != events;
+    }
 
+    /*
+      Change a pin's value from outside of the Arduino (or from a
+      write), and push an interrupt if one is attached and the edge
+      matches. Like the real thing, an interrupt that is already
+      pending isn't queued again: if the pipe is full it's dropped.
+     */
+    void set_pin(int pin, int value) {
+        int old_value = pins[pin];
         pins[pin] = value;
-    }
 
-    void analog_read() {
-        uint8_t pin = receive_char(from_arduino);
-        int value = 0;
+        if (old_value != value) {
+            ++pin_changes;
+        }
 
-        if (pin >= 0 && pin < 16) {
-            value = pins[pin + 54];
+        uint8_t mode = interrupt_modes[pin];
+
+        if (!mode || -1 == events || (0 != old_value) == (0 != value)) {
+            return;
         }
 
-        FD_SEND(to_arduino, value);
+        if (INTERRUPT_CHANGE == mode
+            || (INTERRUPT_RISING == mode && value)
+            || (INTERRUPT_FALLING == mode && !value)) {
+            uint8_t event = pin;
+            tell(&event, sizeof(event));
+            FD_SEND(events, event);
+        }
     }
 
     void pin_mode() {
-        uint8_t pin = receive_char(from_arduino);
-        uint8_t mode = receive_char(from_arduino);
+        uint8_t pin = take_char();
+        uint8_t mode = take_char();
+
+        if (pin >= NUM_PINS) {
+            return;
+        }
+
+        /* INPUT and INPUT_PULLUP set the pull-up, OUTPUT keeps it as the level */
+        pin_modes[pin] = mode;
+
+        if (MODE_INPUT == mode) {
+            outputs[pin] = 0;
+        }
+        else if (MODE_INPUT_PULLUP == mode) {
+            outputs[pin] = high_level(pin);
+        }
+
+        drive_changed(pin);
+    }
+
+    /* A port register's value, from the pins on the port */
+    uint8_t read_register(uint8_t reg, uint8_t port) {
+        uint8_t value = 0;
+
+        if (port >= NUM_IO_PORTS) {
+            return 0;
+        }
+
+        for (int bit = 0; bit < 8; ++bit) {
+            uint8_t pin = IO_PORT_PINS[port][bit];
+
+            if (NO_PIN == pin) {
+                continue;
+            }
+
+            int set = 0;
+
+            switch (reg) {
+            case REGISTER_PIN:
+                set = 0 != pins[pin];
+                break;
+            case REGISTER_DDR:
+                set = MODE_OUTPUT == pin_modes[pin];
+                break;
+            case REGISTER_PORT:
+                set = 0 != outputs[pin];
+                break;
+            }
+
+            value |= set << bit;
+        }
+
+        return value;
+    }
+
+    void register_read() {
+        uint8_t reg = take_char();
+        uint8_t port = take_char();
+
+        answer_read(REGISTER_READ, reg << 8 | port);
+    }
+
+    /*
+      A write to a port register is a read-modify-write done here: the
+      register becomes (register & and_mask) ^ xor_mask, which covers
+      =, |=, &=, and ^=. Only the pins that change are touched, and
+      like the real thing writing a PIN register toggles PORT bits.
+     */
+    void register_write() {
+        uint8_t reg = take_char();
+        uint8_t port = take_char();
+        uint8_t and_mask = take_char();
+        uint8_t xor_mask = take_char();
+
+        if (port >= NUM_IO_PORTS || reg > REGISTER_PORT) {
+            return;
+        }
+
+        uint8_t old_value = read_register(reg, port);
+        uint8_t value = (old_value & and_mask) ^ xor_mask;
+
+        if (REGISTER_PIN == reg) {
+            reg = REGISTER_PORT;
+            old_value = read_register(REGISTER_PORT, port);
+            value ^= old_value;
+        }
+
+        for (int bit = 0; bit < 8; ++bit) {
+            uint8_t pin = IO_PORT_PINS[port][bit];
+            int set = (value >> bit) & 1;
+
+            if (NO_PIN == pin || set == ((old_value >> bit) & 1)) {
+                continue;
+            }
+
+            /* DDR doesn't touch the pull-up, unlike pinMode */
+            if (REGISTER_DDR == reg) {
+                pin_modes[pin] = set ? MODE_OUTPUT : MODE_INPUT;
+            }
+            else {
+                outputs[pin] = set ? high_level(pin) : 0;
+            }
+
+            drive_changed(pin);
+        }
+    }
+
+    /* The HIGH level of a pin, analog pins read as full scale */
+    static int high_level(int pin) {
+        return pin >= 54 ? 1023 : 1;
+    }
+
+    /* What `pin` is putting on the wire, one of the DRIVE_ values */
+    int drive(int pin) {
+        if (MODE_OUTPUT == pin_modes[pin]) {
+            return outputs[pin] ? DRIVE_HIGH : DRIVE_LOW;
+        }
+
+        return outputs[pin] ? DRIVE_PULLUP : DRIVE_NONE;
+    }
+
+    /*
+      A pin's output or mode changed. A pin on its own just takes its
+      own level, a pin in a net is queued up for the network.
+     */
+    void drive_changed(int pin) {
+        if (NULL != spi_bus) {
+            spi_select_changed(pin);
+        }
+
+        if (netted[pin]) {
+            if (!drive_queued[pin]) {
+                drive_queued[pin] = 1;
+                drive_changes[num_drive_changes++] = pin;
+            }
+
+            return;
+        }
+
+        switch (drive(pin)) {
+        case DRIVE_HIGH:
+            set_pin(pin, outputs[pin]);
+            break;
+        case DRIVE_PULLUP:
+            set_pin(pin, high_level(pin));
+            break;
+        default:
+            set_pin(pin, 0);
+            break;
+        }
+    }
+
+    /* Note something the sketch is told in `told` */
+    void tell(const void *data, size_t length) {
+        const uint8_t *bytes = (const uint8_t *)data;
 
-        if (pin < sizeof(pin_modes) / sizeof(pin_modes[0])) {
-            pin_modes[pin] = mode;
+        for (size_t i = 0; i < length; ++i) {
+            told ^= bytes[i];
+            told *= 0x100000001B3ULL;
         }
     }
+
+    /* Send the sketch the answer to the command it's waiting on */
+    void answer(const void *data, size_t length) {
+        tell(data, length);
+        ++answers;
+
+        FD_SEND_BYTES(to_arduino, data, length);
+    }
+
+    /* Push a bus event down the event pipe. Returns 0 if it couldn't be sent. */
+    int push_event(uint8_t event) {
+        if (-1 == events || sizeof(event) != FD_SEND(events, event)) {
+            return 0;
+        }
+
+        tell(&event, sizeof(event));
+        ++bus_events;
+        return 1;
+    }
+
+    void wire_begin() {
+        uint8_t address = take_char();
+
+        if (NULL == wire_bus || address >= I2CBus::NUM_ADDRESSES) {
+            return;
+        }
+
+        if (-1 != wire_address && this == wire_bus->targets[wire_address]) {
+            wire_bus->targets[wire_address] = NULL;
+        }
+
+        wire_address = address;
+        wire_bus->targets[address] = this;
+    }
+
+    /* Answer a WIRE_REQUEST or WIRE_TAKE: a count, and then the bytes */
+    void wire_reply(const uint8_t *data, uint8_t count) {
+        answer(&count, sizeof(count));
+
+        if (count) {
+            answer(data, count);
+        }
+    }
+
+    /* Queue up a transmission for this Arduino's onReceive */
+    void wire_deliver(const uint8_t *data, uint8_t length) {
+        if (inbox_end + length + 1 > inbox_size) {
+            /* Move what's left to the front, and grow if that isn't enough */
+            memmove(wire_inbox, wire_inbox + inbox_start, inbox_end - inbox_start);
+            inbox_end -= inbox_start;
+            inbox_start = 0;
+
+            if (inbox_end + length + 1 > inbox_size) {
+                inbox_size = 2 * (inbox_end + length + 1);
+                wire_inbox = (uint8_t *)realloc(wire_inbox, inbox_size);
+
+                if (NULL == wire_inbox) {
+                    perror("Could not grow Wire inbox");
+                    exit(EXIT_FAILURE);
+                }
+            }
+        }
+
+        wire_inbox[inbox_end++] = length;
+        memcpy(wire_inbox + inbox_end, data, length);
+        inbox_end += length;
+
+        push_event(EVENT_WIRE_RECEIVE);
+    }
+
+    void wire_transmit() {
+        uint8_t address = take_char();
+        uint8_t length = take_char();
+        uint8_t data[UINT8_MAX];
+
+        take(data, length);
+
+        uint8_t status = WIRE_NACK_ADDRESS;
+
+        if (NULL != wire_bus && address < I2CBus::NUM_ADDRESSES) {
+            ArduinoMega *target = wire_bus->targets[address];
+
+            if (NULL != wire_bus->devices[address]) {
+                status = wire_bus->devices[address]->receive(data, length);
+            }
+            else if (NULL != target && this != target) {
+                target->wire_deliver(data, length);
+                status = WIRE_SUCCESS;
+            }
+        }
+
+        answer(&status, sizeof(status));
+    }
+
+    /*
+      A request to a device is answered straight away. A request to
+      another Arduino is passed on as an event, and this Arduino waits
+      for its answer until the target responds.
+     */
+    void wire_request() {
+        uint8_t address = take_char();
+        uint8_t quantity = take_char();
+        uint8_t data[UINT8_MAX];
+
+        if (NULL == wire_bus || address >= I2CBus::NUM_ADDRESSES) {
+            wire_reply(data, 0);
+            return;
+        }
+
+        ArduinoMega *target = wire_bus->targets[address];
+
+        if (NULL != wire_bus->devices[address]) {
+            wire_reply(data, wire_bus->devices[address]->request(data, quantity));
+        }
+        else if (NULL != target && this != target && NULL == target->wire_requester
+                 && target->push_event(EVENT_WIRE_REQUEST)) {
+            target->wire_requester = this;
+            target->wire_quantity = quantity;
+            wire_waiting = 1;
+        }
+        else {
+            wire_reply(data, 0);
+        }
+    }
+
+    void wire_take() {
+        if (inbox_start == inbox_end) {
+            wire_reply(NULL, 0);
+            return;
+        }
+
+        uint8_t length = wire_inbox[inbox_start];
+
+        wire_reply(wire_inbox + inbox_start + 1, length);
+        inbox_start += length + 1;
+    }
+
+    void wire_respond() {
+        uint8_t length = take_char();
+        uint8_t data[UINT8_MAX];
+
+        take(data, length);
+
+        if (NULL != wire_requester) {
+            wire_requester->wire_reply(data, length < wire_quantity ? length : wire_quantity);
+            wire_requester->wire_waiting = 0;
+            wire_requester = NULL;
+        }
+    }
+
+    /* Whether the SPI device selected by `pin` is selected */
+    int spi_selected(int pin) {
+        return MODE_OUTPUT == pin_modes[pin] && 0 == outputs[pin];
+    }
+
+    void spi_select_changed(int pin) {
+        for (int k = 0; k < spi_bus->num_devices; ++k) {
+            if (pin == spi_bus->select_pins[k] && !spi_selected(pin)) {
+                spi_bus->devices[k]->deselect();
+            }
+        }
+    }
+
+    /* Shift bytes through whichever device is selected, MISO floats HIGH if none is */
+    void spi_transfer() {
+        uint8_t length = take_char();
+        uint8_t data[UINT8_MAX];
+
+        take(data, length);
+
+        DeviceModel *device = NULL;
+
+        for (int k = 0; NULL != spi_bus && k < spi_bus->num_devices; ++k) {
+            if (spi_selected(spi_bus->select_pins[k])) {
+                device = spi_bus->devices[k];
+                break;
+            }
+        }
+
+        if (NULL != device) {
+            device->transfer(data, length);
+        }
+        else {
+            memset(data, 0xFF, length);
+        }
+
+        answer(data, length);
+    }
+
+    /* Set up a SoftwareSerial port, and answer with its serial port number (or -1) */
+    void soft_serial_begin() {
+        uint8_t rx = take_char();
+        uint8_t tx = take_char();
+        int port = -1;
+
+        for (int k = 0; k < num_soft_serial; ++k) {
+            if (rx == soft_rx[k] && tx == soft_tx[k]) {
+                port = NUM_SERIAL + k;
+            }
+        }
+
+        if (-1 == port && num_soft_serial < NUM_SOFT_SERIAL && rx < NUM_PINS && tx < NUM_PINS) {
+            soft_rx[num_soft_serial] = rx;
+            soft_tx[num_soft_serial] = tx;
+            port = NUM_SERIAL + num_soft_serial++;
+        }
+
+        answer(&port, sizeof(port));
+    }
+
+    void soft_serial_listen() {
+        unsigned int port = take_int();
+
+        if (port >= NUM_SERIAL && port < (unsigned int)(NUM_SERIAL + num_soft_serial)) {
+            soft_listening = port - NUM_SERIAL;
+        }
+        else {
+            soft_listening = -1;
+        }
+    }
+
+    /*
+      A byte written on a TX pin that isn't wired to anything goes
+      nowhere, and doesn't need its bits sent. Otherwise it's left for
+      the network.
+     */
+    void soft_serial_write() {
+        unsigned int port = take_int();
+        uint8_t value = take_char();
+
+        if (port < NUM_SERIAL || port >= (unsigned int)(NUM_SERIAL + num_soft_serial) || !netted[soft_tx[port - NUM_SERIAL]]) {
+            soft_serial_reply(0);
+            return;
+        }
+
+        soft_pending_port = port - NUM_SERIAL;
+        soft_pending_value = value;
+    }
+
+    /* Answer a SoftwareSerial write, `bits` is set if the bits have to go out on the pin */
+    void soft_serial_reply(uint8_t bits) {
+        answer(&bits, sizeof(bits));
+        soft_pending_port = -1;
+    }
+
+    /* Whether `pin` receives for one of the SoftwareSerial ports */
+    int soft_endpoint(int pin) {
+        for (int k = 0; k < num_soft_serial; ++k) {
+            if (pin == soft_rx[k]) {
+                return 1;
+            }
+        }
+
+        return 0;
+    }
 };
 
 #endif
@@ -0,0 +1,527 @@
+/* Copyright (C) 2013 Calvin Beck
+
+  Permission is hereby granted, free of charge, to any person
+  obtaining a copy of this software and associated documentation files
+  (the "Software"), to deal in the Software without restriction,
+  including without limitation the rights to use, copy, modify, merge,
+  publish, distribute, sublicense, and/or sell copies of the Software,
+  and to permit persons to whom the Software is furnished to do so,
+  subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be
+  included in all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+  EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+  MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+  NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+  BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+  ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+  CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+  SOFTWARE.
+
+*/
+
+
+#include <Arduino.h>
+#include "fakeduino.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <setjmp.h>
+
+
+void setup();
+void loop();
+
+/*
+  libFuzzer harness for a sketch. The sketch is linked against
+  libemulard_direct.a, and its server is an ArduinoMega in this same
+  process, so a command is a couple of function calls rather than a
+  trip through a pipe to another process.
+
+  Each input is a run from setup(), on a virtual clock. The input is a
+  list of records, each starting with a byte whose low 2 bits say what
+  it is:
+
+  - 0: the next (byte >> 2) + 1 bytes arrive on Serial.
+  - 1: the next byte is a pin, and the one after that its level: for
+    digital pins anything but 0 is HIGH, analog pins read 4 times the
+    byte. Pins the sketch has made OUTPUT keep their own level.
+  - 2: (byte >> 2) + 1 milliseconds go by.
+  - 3: the next (byte >> 4) + 1 bytes arrive on serial port
+    (byte >> 2) & 3.
+
+  A record is taken whenever loop() returns, and whenever the sketch
+  is parked spinning on reads that don't change. Serial input goes in
+  as the port has room for it, and anything left over when the next
+  record is taken is lost, like an overrun. The run is over once every
+  record is used up and the sketch is parked, or it returns from
+  loop() with no serial input waiting, or its clock is
+  EMULARD_FUZZ_MICROS (one second by default) past the last record.
+
+  Crashes and failed assertions are the fuzzer's to catch. Text in
+  EMULARD_FUZZ_FAIL showing up on any serial port counts as a failure
+  too, and aborts.
+ */
+
+
+/* The sketch's end of the pipe, which is only ever written to */
+static const int DIRECT_FD = INT_MAX;
+
+static const uint8_t RECORD_SERIAL = 0;
+static const uint8_t RECORD_PIN = 1;
+static const uint8_t RECORD_WAIT = 2;
+static const uint8_t RECORD_PORT = 3;
+
+static ArduinoMega *arduino = NULL;
+
+/* What's left of the input, and the serial input of the record being fed in */
+static const uint8_t *input;
+static size_t input_left;
+
+static const uint8_t *feed;
+static size_t feed_left;
+static int feed_port;
+static int fed;
+
+/* Set once the records are used up, when the sketch has until `deadline` */
+static int used_up;
+static unsigned long long deadline;
+static unsigned long long grace = 1000000;
+
+/* Answers the sketch hasn't taken yet */
+static uint8_t answers[1024];
+static size_t answers_start;
+static size_t answers_end;
+
+static jmp_buf run_end;
+
+/* The failure text, and the serial output that could be the start of it */
+static const char *fail_text = NULL;
+static size_t fail_length = 0;
+static char *recent = NULL;
+static size_t recent_length = 0;
+
+/* Replaying inputs prints the sketch's serial output */
+static int echo_output = 0;
+
+
+/*
+  The globals of the sketch and of libemulard_direct.a are moved into
+  these sections when they're built, so that they can be put back the
+  way they were after static initialisation before every run.
+ */
+extern char __start_emulard_data[] __attribute__((weak));
+extern char __stop_emulard_data[] __attribute__((weak));
+extern char __start_emulard_bss[] __attribute__((weak));
+extern char __stop_emulard_bss[] __attribute__((weak));
+
+static char *data_snapshot = NULL;
+static char *bss_snapshot = NULL;
+static int snapshot_taken = 0;
+
+
+/*
+  Copied a word at a time by hand: a sanitizer's memcpy would complain
+  about the redzones it keeps between globals.
+ */
+static void copy_globals(volatile char *to, const volatile char *from, size_t length)
+{
+    size_t words = length / sizeof(uint64_t);
+
+    for (size_t k = 0; k < words; ++k) {
+        ((volatile uint64_t *)to)[k] = ((const volatile uint64_t *)from)[k];
+    }
+
+    for (size_t k = words * sizeof(uint64_t); k < length; ++k) {
+        to[k] = from[k];
+    }
+}
+
+
+static char *take_snapshot(char *start, char *stop)
+{
+    if (NULL == start || stop <= start) {
+        return NULL;
+    }
+
+    char *snapshot = (char *)malloc(stop - start);
+
+    if (NULL == snapshot) {
+        perror("Could not snapshot the sketch's globals");
+        exit(EXIT_FAILURE);
+    }
+
+    copy_globals(snapshot, start, stop - start);
+
+    return snapshot;
+}
+
+
+static void restore_globals()
+{
+    if (!snapshot_taken) {
+        data_snapshot = take_snapshot(__start_emulard_data, __stop_emulard_data);
+        bss_snapshot = take_snapshot(__start_emulard_bss, __stop_emulard_bss);
+        snapshot_taken = 1;
+
+        return;
+    }
+
+    if (NULL != data_snapshot) {
+        copy_globals(__start_emulard_data, data_snapshot, __stop_emulard_data - __start_emulard_data);
+    }
+
+    if (NULL != bss_snapshot) {
+        copy_globals(__start_emulard_bss, bss_snapshot, __stop_emulard_bss - __start_emulard_bss);
+    }
+}
+
+
+static void end_run()
+{
+    longjmp(run_end, 1);
+}
+
+
+/* A byte the sketch wrote to one of its serial ports */
+static void output_byte(uint8_t value)
+{
+    if (echo_output) {
+        putchar(value);
+    }
+
+    if (0 == fail_length) {
+        return;
+    }
+
+    if (recent_length == fail_length) {
+        memmove(recent, recent + 1, --recent_length);
+    }
+
+    recent[recent_length++] = value;
+
+    if (recent_length == fail_length && 0 == memcmp(recent, fail_text, fail_length)) {
+        fflush(stdout);
+        fprintf(stderr, "The sketch printed \"%s\" at %llu us\n", fail_text, arduino->virtual_micros);
+        abort();
+    }
+}
+
+
+/* Serial input from the current record, as far as the port has room for it */
+static void feed_serial()
+{
+    while (feed_left && -1 != arduino->serial_in[feed_port]->append(*feed)) {
+        ++feed;
+        --feed_left;
+        fed = 1;
+    }
+}
+
+
+/* Run the commands the sketch has sent so far */
+static void run_commands()
+{
+    while (arduino->buffered()) {
+        arduino->run();
+    }
+
+    arduino->input_start = 0;
+    arduino->input_end = 0;
+
+    for (int port = 0; port < ArduinoMega::NUM_SERIAL; ++port) {
+        while (arduino->serial_out[port]->available()) {
+            output_byte(arduino->serial_out[port]->read());
+        }
+    }
+
+    feed_serial();
+
+    if (used_up && arduino->virtual_micros > deadline) {
+        end_run();
+    }
+}
+
+
+static uint8_t take_input()
+{
+    if (0 == input_left) {
+        return 0;
+    }
+
+    --input_left;
+    return *input++;
+}
+
+
+/* Start on the next record. Returns 0 if they are used up. */
+static int next_record()
+{
+    /* Whatever didn't fit is lost */
+    feed_left = 0;
+
+    if (0 == input_left) {
+        if (!used_up) {
+            used_up = 1;
+            deadline = arduino->virtual_micros + grace;
+        }
+
+        return 0;
+    }
+
+    uint8_t header = take_input();
+    size_t length = 0;
+
+    switch (header & 3) {
+    case RECORD_SERIAL:
+        feed_port = 0;
+        length = (header >> 2) + 1;
+        break;
+    case RECORD_PIN: {
+        int pin = take_input() % ArduinoMega::NUM_PINS;
+        uint8_t level = take_input();
+
+        if (MODE_OUTPUT != arduino->pin_modes[pin]) {
+            arduino->set_pin(pin, pin >= 54 ? 4 * level : 0 != level);
+        }
+
+        break;
+    }
+    case RECORD_WAIT:
+        arduino->virtual_micros += ((header >> 2) + 1) * 1000ULL;
+        break;
+    case RECORD_PORT:
+        feed_port = (header >> 2) & 3;
+        length = (header >> 4) + 1;
+        break;
+    }
+
+    feed = input;
+    feed_left = length < input_left ? length : input_left;
+
+    input += feed_left;
+    input_left -= feed_left;
+
+    feed_serial();
+
+    return 1;
+}
+
+
+void direct_command(const void *buffer, size_t length)
+{
+    /* Nowhere to go before the first run, from a global's constructor */
+    if (NULL == arduino) {
+        return;
+    }
+
+    /* Whatever was sent before is a whole command */
+    run_commands();
+    direct_send(buffer, length);
+}
+
+
+void direct_send(const void *buffer, size_t length)
+{
+    if (NULL == arduino) {
+        return;
+    }
+
+    if (arduino->input_end + length > ArduinoMega::INPUT_BUFFER) {
+        fprintf(stderr, "Command too long for a direct build\n");
+        abort();
+    }
+
+    memcpy(arduino->input + arduino->input_end, buffer, length);
+    arduino->input_end += length;
+}
+
+
+ssize_t direct_answer(int fd, const void *buffer, size_t length)
+{
+    if (DIRECT_FD != fd) {
+        return -1;
+    }
+
+    if (answers_end + length > sizeof(answers)) {
+        fprintf(stderr, "Answer too long for a direct build\n");
+        abort();
+    }
+
+    memcpy(answers + answers_end, buffer, length);
+    answers_end += length;
+
+    return length;
+}
+
+
+void direct_receive(void *buffer, size_t length)
+{
+    if (NULL == arduino) {
+        memset(buffer, 0, length);
+        return;
+    }
+
+    run_commands();
+
+    /* No answer yet means the sketch is parked, so it's time for more input */
+    while (answers_end - answers_start < length) {
+        if (!arduino->parked) {
+            fprintf(stderr, "The sketch is waiting on an answer that isn't coming\n");
+            abort();
+        }
+
+        feed_serial();
+
+        if (!arduino->wake(arduino->virtual_micros) && !next_record()) {
+            end_run();
+        }
+    }
+
+    memcpy(buffer, answers + answers_start, length);
+    answers_start += length;
+
+    if (answers_start == answers_end) {
+        answers_start = 0;
+        answers_end = 0;
+    }
+}
+
+
+/* Between calls to loop(), move on to the next record, or end the run */
+static void next_loop()
+{
+    run_commands();
+
+    /* Serial input that's still going in gets another loop(), as long as the sketch is taking it */
+    if (feed_left && fed) {
+        fed = 0;
+        return;
+    }
+
+    if (next_record()) {
+        return;
+    }
+
+    for (int port = 0; port < ArduinoMega::NUM_PORTS; ++port) {
+        if (arduino->serial_in[port]->available()) {
+            return;
+        }
+    }
+
+    end_run();
+}
+
+
+extern "C" int LLVMFuzzerInitialize(int *argc, char ***argv)
+{
+    const char *micros = getenv("EMULARD_FUZZ_MICROS");
+
+    if (NULL != micros) {
+        grace = strtoull(micros, NULL, 10);
+    }
+
+    fail_text = getenv("EMULARD_FUZZ_FAIL");
+
+    if (NULL != fail_text) {
+        fail_length = strlen(fail_text);
+        recent = (char *)malloc(fail_length + 1);
+
+        if (NULL == recent) {
+            perror("Could not allocate the failure text");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    return 0;
+}
+
+
+extern "C" int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size)
+{
+    restore_globals();
+
+    arduino = new ArduinoMega(DIRECT_FD, -1);
+    arduino->virtual_clock = 1;
+
+    input = data;
+    input_left = size;
+    feed_left = 0;
+    fed = 0;
+    used_up = 0;
+
+    answers_start = 0;
+    answers_end = 0;
+    recent_length = 0;
+
+    if (0 == setjmp(run_end)) {
+        setup();
+
+        while (1) {
+            loop();
+            finish_loop();
+            next_loop();
+        }
+    }
+
+    delete arduino;
+    arduino = NULL;
+
+    return 0;
+}
+
+
+#ifdef EMULARD_FUZZ_REPLAY
+/* Without libFuzzer: run each file given as an input, printing what the sketch writes */
+int main(int argc, char *argv[])
+{
+    LLVMFuzzerInitialize(&argc, &argv);
+    echo_output = 1;
+
+    if (argc < 2) {
+        fprintf(stderr, "Usage: %s <input>...\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    for (int i = 1; i < argc; ++i) {
+        FILE *file = fopen(argv[i], "rb");
+
+        if (NULL == file) {
+            fprintf(stderr, "No such file: \"%s\"\n", argv[i]);
+            return EXIT_FAILURE;
+        }
+
+        uint8_t *data = NULL;
+        size_t size = 0;
+        size_t capacity = 0;
+        size_t count;
+
+        do {
+            if (size == capacity) {
+                capacity = 2 * capacity + 4096;
+                data = (uint8_t *)realloc(data, capacity);
+
+                if (NULL == data) {
+                    perror("Could not read an input");
+                    exit(EXIT_FAILURE);
+                }
+            }
+
+            count = fread(data + size, 1, capacity - size, file);
+            size += count;
+        } while (count);
+
+        fclose(file);
+
+        LLVMFuzzerTestOneInput(data, size);
+        free(data);
+    }
+
+    fflush(stdout);
+    return EXIT_SUCCESS;
+}
+#endif
@@ -23,162 +23,132 @@
 */
 
 #include <Arduino.h>
-#include "fakeduino.h"
+#include "network_simulator.h"
 
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
-#include <fcntl.h>
-#include <sys/select.h>
+#include <unistd.h>
 
 
 void setup();
 void loop();
 
 /*
-  Main to act as a server for a single arduino.
+  Main to act as a server for a single arduino. The server is the
+  network simulator, with a network of one, and the Arduino is this
+  program again, forked into running the sketch.
  */
 
 
-int main(int argc, char *argv[]) {
-    int client_mode = 0;
-
-    if (argc > 1 && 0 == strcmp(argv[1], "-c")) {
-        /* Run in client mode */
-        client_mode = 1;
-    }
-
-    int arduino_in[2];  /* Arduino STDIN pipe */
-    int arduino_out[2];  /* Arduino STDOUT pipe */
+void usage(char *program_name) {
+    fprintf(stderr, "Usage: %s [-k <reads>]\n", program_name);
+    fprintf(stderr, "       %s -H [-i <serial input>] [-o <serial output>] [-t <ms>] [-l <loops>] [-p <pin>=<value>] [-m <text>]\n", program_name);
+}
 
-    if (!client_mode) {
-        if (-1 == pipe(arduino_in)) {
-            perror("Could not create input pipe");
-            exit(EXIT_FAILURE);
-        }
 
-        if (-1 == pipe(arduino_out)) {
-            perror("Could not create output pipe");
-            exit(EXIT_FAILURE);
-        }
-    }
+/* Run the sketch, talking to a server on stdin and stdout */
+void run_sketch() {
+    /* Can't have buffered stdout, it ruins stuff! */
+    setvbuf(stdout, NULL, _IONBF, 0);
 
+    /* Need binary mode badly! */
+    freopen(NULL, "wb", stdout);
+    freopen(NULL, "rb", stdin);
 
-    pid_t pid = 0;
+    setup();
 
-    if (0 == client_mode) {
-        pid = fork();
+    while (1) {
+        loop();
+        finish_loop();
     }
+}
 
-    if (pid == 0) {
-        /* Child process - run the Arduino stuff */
-
-        /* Can't have buffered stdout, it ruins stuff! */
-        setvbuf(stdout, NULL, _IONBF, 0);
-    
-        /* Need binary mode badly! */
-        freopen(NULL, "wb", stdout);
-        freopen(NULL, "rb", stdin);
-
-        if (!client_mode) {
-            /* Set up the STDIN pipe */
-            close(arduino_in[1]);  /* Close the write end */
-
-            /* Set STDIN to the read end */
-            if (-1 == dup2(arduino_in[0], STDIN_FILENO)) {
-                perror("Could not set up input pipe");
-                exit(EXIT_FAILURE);
-            }
-
-            /* Set up the STDOUT pipe */
-            close(arduino_out[0]);  /* Close the read end */
-
-            /* Set STDOUT to the write end */
-            if (-1 == dup2(arduino_out[1], STDOUT_FILENO)) {
-                perror("Could not set up output pipe");
-                exit(EXIT_FAILURE);
-            }
-        }
-
-        /* Run the Arduino stuff */
-        setup();
 
-        while (1) {
-            loop();
-        }
+int main(int argc, char *argv[]) {
+    if (argc > 1 && 0 == strcmp(argv[1], "-c")) {
+        /* Run in client mode, for arduino_net */
+        run_sketch();
     }
 
     /* Can't have buffered stdout, it ruins stuff! */
     setvbuf(stdout, NULL, _IONBF, 0);
 
-    /* Parent process - set up Arduino server */
-    ArduinoMega mega(arduino_in[1], arduino_out[0]);
-
-    /* Set up a PTTY so we can connect to our Arduino! */
-    int master = posix_openpt(O_RDWR);  /* Create the master pty fd */
-
-    if (-1 == master) {
-        perror("Could not create pty master");
-        exit(EXIT_FAILURE);
-    }
+    const char *name = strrchr(argv[0], '/');
+    ArduinoNetwork network = single_network(NULL == name ? argv[0] : name + 1, argv[0]);
 
-    /* Set the mode and owner of the slave of our master pty */
-    if (-1 == grantpt(master)) {
-        perror("Could not set mode or ownership of pty");
-        exit(EXIT_FAILURE);
-    }
-    
-    /* Unlock the slave pty */
-    if (-1 == unlockpt(master)) {
-        perror("Could not get slave pty");
-        exit(EXIT_FAILURE);
+    /* No .ard file to give the EEPROM a file, so it can come from the environment */
+    if (NULL != getenv("EMULARD_EEPROM")) {
+        network.eeproms[0] = strdup(getenv("EMULARD_EEPROM"));
     }
 
-    /* Now we want to get the device name for the slave pty */
-    char *slave_name = ptsname(master);
+    Simulator simulator;
+    init_simulator(&simulator, &network);
 
-    if (NULL == slave_name) {
-        perror("Could not get name of slave device");
-        exit(EXIT_FAILURE);
-    }
+    simulator.sketch = run_sketch;
 
-    printf("Arduino on: %s\n", slave_name);
+    /* Headless options */
+    StopConditions *stop = &simulator.stop;
+    int option;
 
-    fd_set read_set;
-    int max_read = 1 + (master > mega.from_arduino ? master : mega.from_arduino);
+    while (-1 != (option = getopt(argc, argv, "k:Hi:o:t:l:p:m:"))) {
+        int pin;
+        int value;
 
-    while (1) {
-        /* Set up the read set */
-        FD_ZERO(&read_set);
+        switch (option) {
+        case 'k':
+            simulator.idle_reads = atoi(optarg);
+            break;
+        case 'H':
+            simulator.headless = 1;
+            break;
+        case 'i':
+            simulator.serial_inputs[0] = fopen(optarg, "rb");
 
-        FD_SET(master, &read_set);
-        FD_SET(mega.from_arduino, &read_set);
+            if (NULL == simulator.serial_inputs[0]) {
+                fprintf(stderr, "No such file: \"%s\"\n", optarg);
+                return STOP_ERROR;
+            }
 
-        /* Wait until something happens */
-        select(max_read, &read_set, NULL, NULL, NULL);
+            break;
+        case 'o':
+            simulator.serial_outputs[0] = fopen(optarg, "wb");
 
-        if (FD_ISSET(master, &read_set)) {
-            char input;
-            int bytes_read = read(master, &input, sizeof(input));
+            if (NULL == simulator.serial_outputs[0]) {
+                fprintf(stderr, "Could not open \"%s\"\n", optarg);
+                return STOP_ERROR;
+            }
 
-            if (-1 == bytes_read) {
-                perror("Error reading from serial");
-                exit(EXIT_FAILURE);
+            break;
+        case 't':
+            stop->max_micros = strtoull(optarg, NULL, 10) * 1000;
+            break;
+        case 'l':
+            stop->max_loops = strtoul(optarg, NULL, 10);
+            break;
+        case 'p':
+            if (2 != sscanf(optarg, "%d=%d", &pin, &value) || pin < 0 || pin >= ArduinoMega::NUM_PINS) {
+                fprintf(stderr, "Bad pin goal \"%s\", expected <pin>=<value>\n", optarg);
+                return STOP_ERROR;
             }
 
-            mega.serial_in[0]->append(input);
+            stop->add_pin_goal(0, pin, value);
+            break;
+        case 'm':
+            stop->add_output_goal(0, optarg);
+            break;
+        default:
+            usage(argv[0]);
+            return STOP_ERROR;
         }
+    }
 
-        if (FD_ISSET(mega.from_arduino, &read_set)) {
-            mega.run();
+    /* Without -H this goes on until we're killed */
+    start_simulator(&simulator);
+    int status = run_simulator(&simulator, NULL, NULL);
 
-            if (mega.serial_out[0]->available()) {
-                char output = mega.serial_out[0]->read();
-                write(master, &output, sizeof(output));
-            }
-        }
-    }
+    finish_simulator(&simulator);
+    free_simulator(&simulator);
 
-    return 0;
+    return status;
 }
-    
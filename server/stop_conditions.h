@@ -0,0 +1,220 @@
+/* Copyright (C) 2013 Calvin Beck
+
+  Permission is hereby granted, free of charge, to any person
+  obtaining a copy of this software and associated documentation files
+  (the "Software"), to deal in the Software without restriction,
+  including without limitation the rights to use, copy, modify, merge,
+  publish, distribute, sublicense, and/or sell copies of the Software,
+  and to permit persons to whom the Software is furnished to do so,
+  subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be
+  included in all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+  EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+  MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+  NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+  BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+  ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+  CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+  SOFTWARE.
+
+*/
+
+#ifndef STOP_CONDITIONS_H
+#define STOP_CONDITIONS_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#include "fakeduino.h"
+
+
+/*
+  Conditions that end a headless run.
+
+  Limits (virtual time, loop count) end the run when every Arduino
+  still alive has reached them. Goals (a pin reaching a value, some text showing up on
+  an Arduino's serial port) end the run as soon as any one of them is
+  met.
+ */
+
+/* Exit statuses for a headless run */
+static const int STOP_GOAL = 0;   /* A goal was met, or a limit was hit and there were no goals */
+static const int STOP_ERROR = 1;  /* Bad arguments, or something broke */
+static const int STOP_LIMIT = 2;  /* A limit was hit before any of the goals were met */
+
+
+typedef struct PinGoal {
+    size_t index;
+    uint8_t pin;
+    int value;
+} PinGoal;
+
+
+typedef struct OutputGoal {
+    size_t index;
+
+    char *text;
+    size_t length;
+
+    /* The last `length` characters written, as a circular buffer */
+    char *window;
+    size_t filled;
+    size_t next;
+} OutputGoal;
+
+
+class StopConditions {
+ public:
+    unsigned long long max_micros;  /* 0 for no limit */
+    unsigned long max_loops;        /* 0 for no limit */
+
+    PinGoal *pin_goals;
+    size_t num_pin_goals;
+
+    OutputGoal *output_goals;
+    size_t num_output_goals;
+
+    /* Why we stopped, for the log */
+    char reason[256];
+
+    /*
+      Set for Arduinos another server runs (or NULL). Their goals and
+      limits are that server's to check.
+     */
+    const uint8_t *remote;
+
+    StopConditions() {
+        max_micros = 0;
+        max_loops = 0;
+
+        pin_goals = NULL;
+        num_pin_goals = 0;
+
+        output_goals = NULL;
+        num_output_goals = 0;
+
+        reason[0] = '\0';
+        remote = NULL;
+    }
+
+    int has_goals() {
+        return num_pin_goals || num_output_goals;
+    }
+
+    void add_pin_goal(size_t index, uint8_t pin, int value) {
+        pin_goals = (PinGoal *)realloc(pin_goals, sizeof(pin_goals[0]) * (num_pin_goals + 1));
+
+        PinGoal goal = {index, pin, value};
+        pin_goals[num_pin_goals++] = goal;
+    }
+
+    void add_output_goal(size_t index, const char *text) {
+        output_goals = (OutputGoal *)realloc(output_goals, sizeof(output_goals[0]) * (num_output_goals + 1));
+
+        OutputGoal goal;
+        goal.index = index;
+        goal.text = strdup(text);
+        goal.length = strlen(text);
+        goal.window = (char *)malloc(goal.length + 1);
+        goal.filled = 0;
+        goal.next = 0;
+
+        output_goals[num_output_goals++] = goal;
+    }
+
+    /* Returns 1 if every Arduino has hit the time or loop limit */
+    int check_limits(ArduinoMega **arduinos, size_t count) {
+        if (0 == max_micros && 0 == max_loops) {
+            return 0;
+        }
+
+        int micros_reached = 0 != max_micros;
+        int loops_reached = 0 != max_loops;
+
+        for (size_t i = 0; i < count; ++i) {
+            /* Dead Arduinos have stopped where they are */
+            if ((NULL != remote && remote[i]) || arduinos[i]->dead) {
+                continue;
+            }
+
+            micros_reached = micros_reached && arduinos[i]->virtual_micros >= max_micros;
+            loops_reached = loops_reached && arduinos[i]->loops >= max_loops;
+        }
+
+        if (micros_reached) {
+            snprintf(reason, sizeof(reason), "virtual time limit of %llu ms", max_micros / 1000);
+        }
+        else if (loops_reached) {
+            snprintf(reason, sizeof(reason), "limit of %lu loops", max_loops);
+        }
+
+        return micros_reached || loops_reached;
+    }
+
+    /* Returns 1 if any pin goal is met */
+    int check_pins(ArduinoMega **arduinos) {
+        for (size_t i = 0; i < num_pin_goals; ++i) {
+            PinGoal goal = pin_goals[i];
+
+            if (NULL != remote && remote[goal.index]) {
+                continue;
+            }
+
+            if (arduinos[goal.index]->pins[goal.pin] == goal.value) {
+                snprintf(reason, sizeof(reason), "pin %d on Arduino %lu reached %d",
+                         goal.pin, (unsigned long)goal.index, goal.value);
+                return 1;
+            }
+        }
+
+        return 0;
+    }
+
+    /* Feed a byte written to serial port 0. Returns 1 if it completes an output goal. */
+    int check_output(size_t index, char value) {
+        for (size_t i = 0; i < num_output_goals; ++i) {
+            OutputGoal *goal = &output_goals[i];
+
+            if (goal->index != index || 0 == goal->length) {
+                continue;
+            }
+
+            goal->window[goal->next] = value;
+            goal->next = (goal->next + 1) % goal->length;
+
+            if (goal->filled < goal->length) {
+                ++goal->filled;
+            }
+
+            if (goal->filled < goal->length) {
+                continue;
+            }
+
+            /* The window starts at `next`, since that's the oldest character */
+            size_t matched = 0;
+
+            while (matched < goal->length && goal->window[(goal->next + matched) % goal->length] == goal->text[matched]) {
+                ++matched;
+            }
+
+            if (matched == goal->length) {
+                snprintf(reason, sizeof(reason), "\"%s\" on Arduino %lu", goal->text, (unsigned long)index);
+                return 1;
+            }
+        }
+
+        return 0;
+    }
+
+    /* Exit status once a limit was hit */
+    int limit_status() {
+        return has_goals() ? STOP_LIMIT : STOP_GOAL;
+    }
+};
+
+#endif
@@ -0,0 +1,215 @@
+/* Copyright (C) 2013 Calvin Beck
+
+  Permission is hereby granted, free of charge, to any person
+  obtaining a copy of this software and associated documentation files
+  (the "Software"), to deal in the Software without restriction,
+  including without limitation the rights to use, copy, modify, merge,
+  publish, distribute, sublicense, and/or sell copies of the Software,
+  and to permit persons to whom the Software is furnished to do so,
+  subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be
+  included in all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+  EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+  MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+  NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+  BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+  ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+  CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+  SOFTWARE.
+
+*/
+
+
+#ifndef WAVEFORM_H
+#define WAVEFORM_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+
+/*
+  A recorded signal for an analog pin. The file is mapped, not read,
+  and a sample is only worked out when the sketch reads the pin, so
+  hours of data cost nothing until they're played.
+
+  With a period the file is raw uint16_t samples, one every `period`
+  microseconds from time 0. Without one it's CSV, a line of
+  <MICROS>,<VALUE> for each sample in order of time. Lines that don't
+  start with a digit, like a header, are skipped. Between samples the
+  value is interpolated, and before the first or after the last it
+  holds.
+ */
+class Waveform {
+ private:
+    const char *data;
+    size_t size;
+    uint32_t period;
+
+    /*
+      CSV: the samples either side of the last time asked for, and
+      where the line after them starts. Time only goes forward, so
+      this is as far as anyone has to look.
+     */
+    unsigned long long before_time;
+    long before_value;
+    unsigned long long after_time;
+    long after_value;
+    size_t next;
+    int ended;
+    int moved;  /* Past the first two samples */
+
+    /* Parse "<MICROS>,<VALUE>" from data[start] up to data[end]. Returns 0 if it isn't a sample. */
+    int parse_line(size_t start, size_t end, unsigned long long *time, long *value) {
+        size_t at = start;
+
+        if (at == end || data[at] < '0' || data[at] > '9') {
+            return 0;
+        }
+
+        *time = 0;
+
+        while (at < end && data[at] >= '0' && data[at] <= '9') {
+            *time = *time * 10 + (data[at++] - '0');
+        }
+
+        while (at < end && (' ' == data[at] || '\t' == data[at])) {
+            ++at;
+        }
+
+        if (at == end || ',' != data[at++]) {
+            return 0;
+        }
+
+        while (at < end && (' ' == data[at] || '\t' == data[at])) {
+            ++at;
+        }
+
+        int negative = at < end && '-' == data[at];
+        at += negative;
+
+        if (at == end || data[at] < '0' || data[at] > '9') {
+            return 0;
+        }
+
+        *value = 0;
+
+        while (at < end && data[at] >= '0' && data[at] <= '9') {
+            *value = *value * 10 + (data[at++] - '0');
+        }
+
+        if (negative) {
+            *value = -*value;
+        }
+
+        return 1;
+    }
+
+    /* The next sample in the file after `next`. Returns 0 at the end. */
+    int next_sample(unsigned long long *time, long *value) {
+        while (next < size) {
+            size_t start = next;
+            const char *newline = (const char *)memchr(data + start, '\n', size - start);
+            size_t end = NULL == newline ? size : newline - data;
+
+            next = end + 1;
+
+            if (parse_line(start, end, time, value)) {
+                return 1;
+            }
+        }
+
+        return 0;
+    }
+
+    /* Back to the first two samples */
+    void rewind() {
+        next = 0;
+        ended = 0;
+        moved = 0;
+        before_time = 0;
+        before_value = 0;
+
+        if (!next_sample(&before_time, &before_value)) {
+            ended = 1;
+        }
+
+        after_time = before_time;
+        after_value = before_value;
+
+        if (!ended && !next_sample(&after_time, &after_value)) {
+            ended = 1;
+        }
+    }
+
+    long sample_csv(unsigned long long now) {
+        if (now < before_time && moved) {
+            rewind();
+        }
+
+        while (now >= after_time && !ended) {
+            before_time = after_time;
+            before_value = after_value;
+            moved = 1;
+
+            if (!next_sample(&after_time, &after_value)) {
+                after_time = before_time;
+                after_value = before_value;
+                ended = 1;
+            }
+        }
+
+        if (now <= before_time || after_time == before_time) {
+            return before_value;
+        }
+
+        if (now >= after_time) {
+            return after_value;
+        }
+
+        return before_value + (after_value - before_value) * (long long)(now - before_time) / (long long)(after_time - before_time);
+    }
+
+    long sample_binary(unsigned long long now) {
+        const uint16_t *samples = (const uint16_t *)data;
+        size_t count = size / sizeof(uint16_t);
+
+        if (0 == count) {
+            return 0;
+        }
+
+        unsigned long long index = now / period;
+
+        if (index >= count - 1) {
+            return samples[count - 1];
+        }
+
+        long first = samples[index];
+        long second = samples[index + 1];
+
+        return first + (second - first) * (long long)(now % period) / (long long)period;
+    }
+
+ public:
+    /* `period` is 0 for CSV. The data has to stay mapped for as long as the waveform is used. */
+    Waveform(const void *data, size_t size, uint32_t period) {
+        this->data = (const char *)data;
+        this->size = size;
+        this->period = period;
+
+        if (0 == period) {
+            rewind();
+        }
+    }
+
+    /* The signal at `now` microseconds */
+    int sample(unsigned long long now) {
+        return 0 == period ? sample_csv(now) : sample_binary(now);
+    }
+};
+
+#endif
@@ -0,0 +1,92 @@
+/* Copyright (C) 2013 Calvin Beck
+
+  Permission is hereby granted, free of charge, to any person
+  obtaining a copy of this software and associated documentation files
+  (the "Software"), to deal in the Software without restriction,
+  including without limitation the rights to use, copy, modify, merge,
+  publish, distribute, sublicense, and/or sell copies of the Software,
+  and to permit persons to whom the Software is furnished to do so,
+  subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be
+  included in all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+  EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+  MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+  NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+  BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+  ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+  CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+  SOFTWARE.
+
+*/
+
+/*
+  Reads a sensor on I2C and one on SPI, writes a byte to an I2C EEPROM
+  and reads it back, and asks the responder Arduino for two bytes.
+ */
+
+#include <Arduino.h>
+#include <Wire.h>
+#include <SPI.h>
+
+
+void setup() {
+    Serial.begin(9600);
+    Wire.begin();
+    SPI.begin();
+
+    pinMode(53, OUTPUT);
+    digitalWrite(53, HIGH);
+
+    /* I2C sensor register 0x0F */
+    Wire.beginTransmission(0x48);
+    Wire.write(0x0F);
+    Wire.endTransmission();
+    Wire.requestFrom(0x48, 1);
+
+    Serial.print("i2c sensor ");
+    Serial.println(Wire.read(), HEX);
+
+    /* SPI sensor register 0x0F, top bit set to read */
+    digitalWrite(53, LOW);
+    SPI.transfer(0x8F);
+    uint8_t value = SPI.transfer(0);
+    digitalWrite(53, HIGH);
+
+    Serial.print("spi sensor ");
+    Serial.println(value, HEX);
+
+    /* I2C EEPROM byte 0x10, one address byte for 256 bytes */
+    Wire.beginTransmission(0x50);
+    Wire.write(0x10);
+    Wire.write(0x5A);
+    Wire.endTransmission();
+
+    Wire.beginTransmission(0x50);
+    Wire.write(0x10);
+    Wire.endTransmission();
+    Wire.requestFrom(0x50, 1);
+
+    Serial.print("i2c eeprom ");
+    Serial.println(Wire.read(), HEX);
+
+    /* Another Arduino on the bus, at address 8, once it has had time to call Wire.begin(8) */
+    delay(5);
+    Wire.requestFrom(8, 2);
+
+    Serial.print("responder");
+
+    while (Wire.available()) {
+        Serial.print(' ');
+        Serial.print((char)Wire.read());
+    }
+
+    Serial.println();
+}
+
+
+void loop() {
+    delay(10);
+}
@@ -0,0 +1,104 @@
+#!/bin/sh
+# Headless checks. Each one runs a network, and compares arduino_net's
+# exit status, and every Arduino's Serial output, with what's expected:
+# expected/<CHECK>/<NAME>.serial for each Arduino in it.
+
+NET=../../networking/arduino_net
+failed=0
+
+# check <CHECK> <STATUS> <ARDUINO_NET OPTIONS...>
+check() {
+    name=$1
+    status=$2
+    shift 2
+
+    $NET "$@" -o out/$name > out/$name.log 2>&1
+    got=$?
+
+    if [ $got -ne $status ]; then
+        echo "$name: FAILED, exit status $got instead of $status (see out/$name.log)"
+        failed=1
+    elif ! diff -r expected/$name out/$name; then
+        echo "$name: FAILED, Serial output differs"
+        failed=1
+    else
+        echo "$name: ok"
+    fi
+}
+
+rm -rf out
+mkdir out
+
+# Stop reasons and exit codes: 0 for a goal met, or a limit with no goals; 2 for a limit before any goal; 1 for a crash
+check stop_output 0 -H -t 10000 -m counter:done counter.ard
+check stop_pin 0 -H -t 10000 -p counter:13=1 counter.ard
+check stop_time 0 -H -t 250 counter.ard
+check stop_loops 0 -H -l 3 counter.ard
+check stop_limit 2 -H -t 250 -m counter:never counter.ard
+check stop_crash 1 -H -t 1000 crash.ard
+check stop_dead 0 -H -t 350 dead.ard
+
+# Interrupts: the count goes up with every pulse from the other Arduino, however far ahead the horizon lets it get
+check interrupts 0 -H -t 500 isr.ard
+check interrupts_far 0 -H -t 500 -W 100000 isr.ard
+
+# Pin nets, digital and analog
+check nets 0 -H -t 60 net.ard
+
+# Wire and SPI devices, and an Arduino as a Wire target
+check buses 0 -H -t 20 bus.ard
+
+# SoftwareSerial, a byte at a time between two ports on a pin connection
+check soft_serial 0 -H -t 100 soft.ard
+
+# EEPROM persistence: the kept one counts up from run to run, the seeded one starts from the seed every time
+printf '\005' > out/seed.bin
+check eeprom_first 0 -H -t 20 eeprom.ard
+check eeprom_again 0 -H -t 20 eeprom.ard
+
+# Port registers: a byte written to PORTA on one Arduino reads back whole from PINC on another
+check ports 0 -H -t 60 ports.ard
+
+# String heap: short Strings stay out of it, and a String that can't grow in 1K is left as it was
+export EMULARD_HEAP=1024
+check strings 0 -H -t 10 strings.ard
+unset EMULARD_HEAP
+
+# Link timing: what's sent at 10 ms arrives at once on a wire, 5 ms later on a link, and a byte per ms at 9600 baud
+check links 0 -H -t 20 links.ard
+
+# Lockstep: a byte takes a step to arrive, so each echo comes back two steps after it was sent
+check lockstep 0 -H -L 1000 -t 10 echo.ard
+check lockstep_wide 0 -H -L 2000 -t 20 echo.ard
+
+# Analog stimulus: a CSV waveform, interpolated between its samples and held after the last
+check waveform 0 -H -t 300 wave.ard
+
+# Timeline: the wire is only there from 30 ms to 70 ms, and the counter's clock starts when it joins at 50 ms
+check timeline 0 -H -t 160 timeline.ard
+
+# Schedule replay: the one exploring finds, and one kept with the tests
+if $NET -x 10 -m s:early -w out/early.schedule race.ard > out/explore.log 2>&1; then
+    check replay_found 0 -r out/early.schedule -m s:early race.ard
+else
+    echo "replay_found: FAILED, exploring found no schedule (see out/explore.log)"
+    failed=1
+fi
+
+check replay_kept 0 -r late.schedule -m s:late race.ard
+
+# Generators: a generated line passes the counter's pin along, one relay after another
+check generators 0 -H -t 1000 -m n2:high gen.ard
+
+# Compiled images: one whose .ard has changed since it was compiled is rebuilt, so the Arduino added since runs too
+printf 'd counter:./counter\n' > out/stale.ard
+
+if $NET compile out/stale.ard > out/compile.log 2>&1; then
+    printf 'd second:./counter\n' >> out/stale.ard
+    check stale_image 0 -H -t 250 out/stale.ardc
+else
+    echo "stale_image: FAILED, compiling didn't work (see out/compile.log)"
+    failed=1
+fi
+
+exit $failed
@@ -0,0 +1,62 @@
+/* Copyright (C) 2013 Calvin Beck
+
+  Permission is hereby granted, free of charge, to any person
+  obtaining a copy of this software and associated documentation files
+  (the "Software"), to deal in the Software without restriction,
+  including without limitation the rights to use, copy, modify, merge,
+  publish, distribute, sublicense, and/or sell copies of the Software,
+  and to permit persons to whom the Software is furnished to do so,
+  subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be
+  included in all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+  EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+  MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+  NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+  BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+  ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+  CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+  SOFTWARE.
+
+*/
+
+/* Prints the millisecond that pins 2 and 3 go high, and that each byte comes in on Serial1 */
+
+#include <Arduino.h>
+
+int wire_seen = 0;
+int link_seen = 0;
+
+
+void setup() {
+    Serial.begin(9600);
+    Serial1.begin(9600);
+    pinMode(2, INPUT);
+    pinMode(3, INPUT);
+}
+
+
+void loop() {
+    if (!wire_seen && digitalRead(3)) {
+        Serial.print("wire high at ");
+        Serial.println(millis());
+        wire_seen = 1;
+    }
+
+    if (!link_seen && digitalRead(2)) {
+        Serial.print("link high at ");
+        Serial.println(millis());
+        link_seen = 1;
+    }
+
+    while (Serial1.available()) {
+        Serial.print("byte ");
+        Serial.write(Serial1.read());
+        Serial.print(" at ");
+        Serial.println(millis());
+    }
+
+    delayMicroseconds(100);
+}
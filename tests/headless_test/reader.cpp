@@ -0,0 +1,54 @@
+/* Copyright (C) 2013 Calvin Beck
+
+  Permission is hereby granted, free of charge, to any person
+  obtaining a copy of this software and associated documentation files
+  (the "Software"), to deal in the Software without restriction,
+  including without limitation the rights to use, copy, modify, merge,
+  publish, distribute, sublicense, and/or sell copies of the Software,
+  and to permit persons to whom the Software is furnished to do so,
+  subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be
+  included in all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+  EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+  MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+  NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+  BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+  ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+  CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+  SOFTWARE.
+
+*/
+
+/*
+  Prints pin 2 every 10 ms, halfway between the driver's toggles, and
+  the level of analog pin 0 (pin 54) on the first loop.
+ */
+
+#include <Arduino.h>
+
+int first = 1;
+
+
+void setup() {
+    Serial.begin(9600);
+    pinMode(2, INPUT);
+
+    delay(5);
+}
+
+
+void loop() {
+    if (first) {
+        Serial.print("analog ");
+        Serial.println(analogRead(0));
+        first = 0;
+    }
+
+    Serial.print("pin ");
+    Serial.println(digitalRead(2));
+
+    delay(10);
+}
@@ -0,0 +1,77 @@
+/* Copyright (C) 2013 Calvin Beck
+
+  Permission is hereby granted, free of charge, to any person
+  obtaining a copy of this software and associated documentation files
+  (the "Software"), to deal in the Software without restriction,
+  including without limitation the rights to use, copy, modify, merge,
+  publish, distribute, sublicense, and/or sell copies of the Software,
+  and to permit persons to whom the Software is furnished to do so,
+  subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be
+  included in all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+  EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+  MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+  NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+  BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+  ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+  CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+  SOFTWARE.
+
+*/
+
+/*
+  Grows a String in the arena until it runs out, and prints what the
+  heap says along the way. Run with EMULARD_HEAP=1024.
+ */
+
+#include <Arduino.h>
+
+
+void print_heap(const char *when) {
+    StringHeapStats stats;
+    stringHeapStats(&stats);
+
+    Serial.print(when);
+    Serial.print(": ");
+    Serial.print(stats.used);
+    Serial.print(" of ");
+    Serial.print(stats.size);
+    Serial.print(" bytes used, ");
+    Serial.print(stats.failures);
+    Serial.println(" failed");
+}
+
+
+void setup() {
+    Serial.begin(9600);
+
+    {
+        String small = "fits inline";
+        Serial.println(small);
+        print_heap("short string");
+    }
+
+    {
+        String grown;
+
+        while (grown.concat("0123456789")) {
+        }
+
+        Serial.print("grew to ");
+        Serial.println(grown.length());
+        print_heap("out of room");
+
+        /* The String that couldn't grow is left as it was */
+        Serial.println(grown.endsWith("0123456789") ? "intact" : "damaged");
+    }
+
+    print_heap("freed");
+}
+
+
+void loop() {
+    delay(1000);
+}